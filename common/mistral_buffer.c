@@ -0,0 +1,201 @@
+/*
+ * mistral_buffer
+ *
+ * Growable character buffer used by plug-ins to build request bodies. Repeatedly formatting the
+ * whole body with asprintf copies everything seen so far for every record added which is O(n^2)
+ * in the size of the data block, appending to this buffer only copies the new data.
+ */
+#include <stdarg.h>             /* va_start, va_list, va_end */
+#include <stdio.h>              /* vsnprintf */
+#include <stdlib.h>             /* realloc, free */
+#include <string.h>             /* memcpy */
+
+#include "mistral_buffer.h"
+
+/* Size of the first allocation made for a buffer */
+#define MISTRAL_BUFFER_MIN_SIZE 4096
+
+/*
+ * mistral_buffer_reserve
+ *
+ * Ensure there is space for at least extra more bytes plus a null terminator in the buffer,
+ * doubling the allocation until it is large enough.
+ *
+ * Parameters:
+ *   buffer - Pointer to the buffer
+ *   extra  - Number of bytes that are about to be appended
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated, the buffer is left unchanged
+ */
+bool mistral_buffer_reserve(mistral_buffer *buffer, size_t extra)
+{
+    size_t needed = buffer->len + extra + 1;
+
+    if (needed < extra) {
+        return false;
+    }
+
+    if (needed <= buffer->size) {
+        return true;
+    }
+
+    size_t size = buffer->size ? buffer->size : MISTRAL_BUFFER_MIN_SIZE;
+    while (size < needed) {
+        if (size > (size_t)-1 / 2) {
+            size = needed;
+            break;
+        }
+        size *= 2;
+    }
+
+    char *data = realloc(buffer->data, size);
+    if (!data) {
+        return false;
+    }
+
+    if (!buffer->data) {
+        data[0] = '\0';
+    }
+    buffer->data = data;
+    buffer->size = size;
+    return true;
+}
+
+/*
+ * mistral_buffer_append
+ *
+ * Append len bytes of data to the buffer and keep the contents null terminated.
+ *
+ * Parameters:
+ *   buffer - Pointer to the buffer
+ *   data   - Pointer to the data to append
+ *   len    - Number of bytes to append
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated, the buffer is left unchanged
+ */
+bool mistral_buffer_append(mistral_buffer *buffer, const char *data, size_t len)
+{
+    if (!mistral_buffer_reserve(buffer, len)) {
+        return false;
+    }
+
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+    buffer->data[buffer->len] = '\0';
+    return true;
+}
+
+/*
+ * mistral_buffer_printf
+ *
+ * Append a printf style formatted string to the buffer. The string is formatted directly into the
+ * free space at the end of the buffer, only if it does not fit is the buffer grown and the string
+ * formatted a second time.
+ *
+ * Parameters:
+ *   buffer - Pointer to the buffer
+ *   format - A standard printf style format string
+ *   ...    - Any parameters required by the format string
+ *
+ * Returns:
+ *   true on success
+ *   false otherwise, the contents of the buffer are left unchanged
+ */
+bool mistral_buffer_printf(mistral_buffer *buffer, const char *format, ...)
+{
+    va_list ap;
+    int len;
+
+    if (!mistral_buffer_reserve(buffer, 0)) {
+        return false;
+    }
+
+    va_start(ap, format);
+    len = vsnprintf(buffer->data + buffer->len, buffer->size - buffer->len, format, ap);
+    va_end(ap);
+
+    if (len < 0) {
+        buffer->data[buffer->len] = '\0';
+        return false;
+    }
+
+    if ((size_t)len >= buffer->size - buffer->len) {
+        if (!mistral_buffer_reserve(buffer, (size_t)len)) {
+            buffer->data[buffer->len] = '\0';
+            return false;
+        }
+
+        va_start(ap, format);
+        len = vsnprintf(buffer->data + buffer->len, buffer->size - buffer->len, format, ap);
+        va_end(ap);
+
+        if (len < 0) {
+            buffer->data[buffer->len] = '\0';
+            return false;
+        }
+    }
+
+    buffer->len += (size_t)len;
+    return true;
+}
+
+/*
+ * mistral_buffer_release
+ *
+ * Take ownership of the contents of the buffer, which must later be released with free, and
+ * reset the buffer to its initial empty state.
+ *
+ * Parameters:
+ *   buffer - Pointer to the buffer
+ *
+ * Returns:
+ *   A pointer to the null terminated contents, or NULL if nothing was ever written
+ */
+char *mistral_buffer_release(mistral_buffer *buffer)
+{
+    char *data = buffer->data;
+
+    buffer->data = NULL;
+    buffer->len = 0;
+    buffer->size = 0;
+    return data;
+}
+
+/*
+ * mistral_buffer_reset
+ *
+ * Empty the buffer while keeping its allocation for reuse.
+ *
+ * Parameters:
+ *   buffer - Pointer to the buffer
+ *
+ * Returns:
+ *   void
+ */
+void mistral_buffer_reset(mistral_buffer *buffer)
+{
+    buffer->len = 0;
+    if (buffer->data) {
+        buffer->data[0] = '\0';
+    }
+}
+
+/*
+ * mistral_buffer_free
+ *
+ * Release the memory used by the buffer and reset it to its initial empty state.
+ *
+ * Parameters:
+ *   buffer - Pointer to the buffer
+ *
+ * Returns:
+ *   void
+ */
+void mistral_buffer_free(mistral_buffer *buffer)
+{
+    free(mistral_buffer_release(buffer));
+}
@@ -0,0 +1,27 @@
+/* Growable character buffer used by plug-ins to build request bodies in linear time. Appending
+ * only copies the new data, the buffer is grown geometrically when it is full.
+ */
+
+#ifndef MISTRAL_BUFFER_H
+#define MISTRAL_BUFFER_H
+
+#include <stdbool.h>            /* bool */
+#include <stddef.h>             /* size_t */
+
+typedef struct mistral_buffer {
+    char *data;                 /* Null terminated contents, NULL until first written */
+    size_t len;                 /* Length of the contents excluding the terminator */
+    size_t size;                /* Bytes allocated */
+} mistral_buffer;
+
+#define MISTRAL_BUFFER_INITIALIZER {NULL, 0, 0}
+
+bool mistral_buffer_reserve(mistral_buffer *buffer, size_t extra);
+bool mistral_buffer_append(mistral_buffer *buffer, const char *data, size_t len);
+__attribute__((__format__(printf, 2, 3)))
+bool mistral_buffer_printf(mistral_buffer *buffer, const char *format, ...);
+char *mistral_buffer_release(mistral_buffer *buffer);
+void mistral_buffer_reset(mistral_buffer *buffer);
+void mistral_buffer_free(mistral_buffer *buffer);
+
+#endif
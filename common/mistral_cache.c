@@ -0,0 +1,132 @@
+/*
+ * mistral_cache
+ *
+ * Cache of text rendered from the fields of a record. Plug-ins split the output for a record into
+ * parts that depend on a few fields each, such as the rule or the job, and look each part up here
+ * so it is only formatted, and escaped, the first time those values are seen. Entries are
+ * identified by a 64-bit FNV-1a hash of the raw field values and the full key is compared to
+ * confirm a match. When the table becomes too full it is simply emptied and refilled as records
+ * arrive. A cache must only be used by one thread.
+ */
+#include <stdlib.h>             /* calloc, malloc, free */
+#include <string.h>             /* memcmp, memcpy */
+
+#include "mistral_cache.h"
+
+/* The table is emptied once it is three quarters full so probe sequences stay short */
+#define MISTRAL_CACHE_MAX_USED(slots) ((slots) * 3 / 4)
+
+/*
+ * mistral_cache_clear
+ *
+ * Remove every entry from a cache.
+ *
+ * Parameters:
+ *   cache - The cache to empty
+ *
+ * Returns:
+ *   void
+ */
+void mistral_cache_clear(mistral_cache *cache)
+{
+    if (cache->entry) {
+        for (size_t i = 0; i < cache->slots; i++) {
+            free(cache->entry[i].key);
+            cache->entry[i].key = NULL;
+        }
+    }
+    cache->used = 0;
+}
+
+/*
+ * mistral_cache_free
+ *
+ * Remove every entry from a cache and free the table and scratch space. The cache can still be
+ * used afterwards, the table is allocated again when it is needed.
+ *
+ * Parameters:
+ *   cache - The cache to free
+ *
+ * Returns:
+ *   void
+ */
+void mistral_cache_free(mistral_cache *cache)
+{
+    mistral_cache_clear(cache);
+    free(cache->entry);
+    cache->entry = NULL;
+    mistral_buffer_free(&cache->key);
+    mistral_buffer_free(&cache->text);
+}
+
+/*
+ * mistral_cache_get
+ *
+ * Find the text rendered for an item, rendering and caching it with the render callback if the
+ * values returned by the identify callback have not been seen before.
+ *
+ * Parameters:
+ *   cache - The cache to look in
+ *   item  - The item, passed to the identify and render callbacks
+ *
+ * Returns:
+ *   A pointer to the cache entry, valid until the next call for the same cache, or NULL if memory
+ *   could not be allocated
+ */
+const mistral_cache_entry *mistral_cache_get(mistral_cache *cache, const void *item)
+{
+    if (!cache->entry) {
+        cache->entry = calloc(cache->slots, sizeof(mistral_cache_entry));
+        if (!cache->entry) {
+            return NULL;
+        }
+    }
+
+    mistral_buffer_reset(&cache->key);
+    if (!cache->identify(&cache->key, item)) {
+        return NULL;
+    }
+
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < cache->key.len; i++) {
+        hash = (hash ^ (unsigned char)cache->key.data[i]) * 1099511628211ULL;
+    }
+
+    size_t slot = hash & (cache->slots - 1);
+    while (cache->entry[slot].key) {
+        mistral_cache_entry *entry = &cache->entry[slot];
+        if (entry->hash == hash && entry->key_len == cache->key.len &&
+            memcmp(entry->key, cache->key.data, cache->key.len) == 0)
+        {
+            return entry;
+        }
+        slot = (slot + 1) & (cache->slots - 1);
+    }
+
+    mistral_buffer_reset(&cache->text);
+    if (!cache->render(&cache->text, item)) {
+        return NULL;
+    }
+
+    if (cache->used >= MISTRAL_CACHE_MAX_USED(cache->slots)) {
+        mistral_cache_clear(cache);
+        slot = hash & (cache->slots - 1);
+    }
+
+    char *data = malloc(cache->key.len + cache->text.len);
+    if (!data) {
+        return NULL;
+    }
+    memcpy(data, cache->key.data, cache->key.len);
+    memcpy(data + cache->key.len, cache->text.data, cache->text.len);
+
+    mistral_cache_entry *entry = &cache->entry[slot];
+    entry->hash = hash;
+    entry->key = data;
+    entry->key_len = cache->key.len;
+    entry->text = data + cache->key.len;
+    entry->text_len = cache->text.len;
+    cache->used++;
+
+    return entry;
+}
@@ -0,0 +1,46 @@
+/* Cache of text rendered from the fields of a record, used by plug-ins to avoid formatting the
+ * same values again for every record. Entries are found in an open addressed hash table by the
+ * raw field values they were rendered from.
+ */
+
+#ifndef MISTRAL_CACHE_H
+#define MISTRAL_CACHE_H
+
+#include <stdbool.h>            /* bool */
+#include <stddef.h>             /* size_t */
+#include <stdint.h>             /* uint64_t */
+
+#include "mistral_buffer.h"     /* mistral_buffer */
+
+/* Callback that appends the raw field values identifying an item, or the text rendered for it, to
+ * a buffer. Returns false if memory could not be allocated.
+ */
+typedef bool (*mistral_cache_fn)(mistral_buffer *buffer, const void *item);
+
+/* Rendered text together with the raw values it was rendered from */
+typedef struct mistral_cache_entry {
+    uint64_t hash;
+    char *key;                  /* Allocated with space for the rendered text after it */
+    size_t key_len;
+    const char *text;
+    size_t text_len;
+} mistral_cache_entry;
+
+typedef struct mistral_cache {
+    mistral_cache_entry *entry;
+    size_t slots;               /* Size of the table, a power of two */
+    size_t used;
+    mistral_cache_fn identify;
+    mistral_cache_fn render;
+    mistral_buffer key;         /* Scratch space for the key and text of the item being looked up */
+    mistral_buffer text;
+} mistral_cache;
+
+#define MISTRAL_CACHE_INITIALIZER(slots, identify, render) \
+    {NULL, (slots), 0, (identify), (render), MISTRAL_BUFFER_INITIALIZER, MISTRAL_BUFFER_INITIALIZER}
+
+const mistral_cache_entry *mistral_cache_get(mistral_cache *cache, const void *item);
+void mistral_cache_clear(mistral_cache *cache);
+void mistral_cache_free(mistral_cache *cache);
+
+#endif
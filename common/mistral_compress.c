@@ -0,0 +1,51 @@
+/*
+ * mistral_compress
+ *
+ * gzip compression of request bodies for plug-ins that send data over HTTP. Each connection keeps
+ * its own deflate stream, initialised by the plug-in with the gzip header enabled, which is reset
+ * rather than reallocated for every request.
+ */
+#include "mistral_compress.h"
+#include "mistral_plugin.h"     /* mistral_err */
+
+/*
+ * mistral_compress
+ *
+ * Compress a request body with gzip into a buffer kept with the connection.
+ *
+ * Parameters:
+ *   zstream    - The deflate stream of the connection
+ *   compressed - The buffer to replace with the compressed body
+ *   data       - The uncompressed request body
+ *   len        - The length of the uncompressed request body
+ *
+ * Returns:
+ *   true on success
+ *   false otherwise
+ */
+bool mistral_compress(z_stream *zstream, mistral_buffer *compressed, const char *data, size_t len)
+{
+    uLong bound = deflateBound(zstream, len);
+
+    mistral_buffer_reset(compressed);
+    if (deflateReset(zstream) != Z_OK || !mistral_buffer_reserve(compressed, bound)) {
+        mistral_err("Could not prepare compressed request body\n");
+        return false;
+    }
+
+    /* The output buffer is large enough for the whole request so a single call to deflate will
+     * complete the stream.
+     */
+    zstream->next_in = (Bytef *)data;
+    zstream->avail_in = len;
+    zstream->next_out = (Bytef *)compressed->data;
+    zstream->avail_out = bound;
+
+    if (deflate(zstream, Z_FINISH) != Z_STREAM_END) {
+        mistral_err("Could not compress request body: %s\n",
+                    zstream->msg ? zstream->msg : "unknown error");
+        return false;
+    }
+    compressed->len = zstream->total_out;
+    return true;
+}
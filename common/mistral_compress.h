@@ -0,0 +1,16 @@
+/* gzip compression of request bodies for plug-ins that send data over HTTP. The compressed body is
+ * written to a buffer that is kept and reused for every request sent over a connection.
+ */
+
+#ifndef MISTRAL_COMPRESS_H
+#define MISTRAL_COMPRESS_H
+
+#include <stdbool.h>            /* bool */
+#include <stddef.h>             /* size_t */
+#include <zlib.h>               /* z_stream */
+
+#include "mistral_buffer.h"     /* mistral_buffer */
+
+bool mistral_compress(z_stream *zstream, mistral_buffer *compressed, const char *data, size_t len);
+
+#endif
@@ -0,0 +1,152 @@
+/*
+ * mistral_json
+ *
+ * JSON string escaping for plug-ins that produce JSON documents. Plug-ins previously escaped each
+ * field into a worst case sized heap allocation that was then copied into the document and freed,
+ * several times per record. These functions append the escaped string directly to the output
+ * buffer instead. Most strings seen by the plug-ins need no escaping at all so runs of characters
+ * that can be copied unchanged are found 16 bytes at a time where SSE2 is available.
+ */
+#include <stdint.h>             /* uint8_t */
+#include <string.h>             /* memcpy, strlen */
+#ifdef __SSE2__
+#include <emmintrin.h>          /* _mm_* SSE2 intrinsics */
+#endif
+
+#include "mistral_json.h"
+
+/* The escape sequence needed by each byte value. Zero means the byte is copied unchanged, 'u'
+ * means it is written as a \u00XX sequence and any other value is the character written after a
+ * backslash.
+ */
+static const char json_escape_class[256] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    ['"'] = '"',
+    ['\\'] = '\\',
+};
+
+static const char json_hex_digit[16] = "0123456789abcdef";
+
+/*
+ * json_clean_run
+ *
+ * Find the length of the run of characters at the start of a string that can be copied to JSON
+ * output without escaping.
+ *
+ * Parameters:
+ *   string - The string to scan
+ *   len    - The length of the string
+ *
+ * Returns:
+ *   The offset of the first character that must be escaped, or len if there is none
+ */
+static size_t json_clean_run(const char *string, size_t len)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1f);
+
+    for (; i + sizeof(__m128i) <= len; i += sizeof(__m128i)) {
+        __m128i chars = _mm_loadu_si128((const __m128i *)(const void *)(string + i));
+        /* Unsigned minimum with 0x1f is only unchanged for control characters */
+        __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chars, quote),
+                                                    _mm_cmpeq_epi8(chars, backslash)),
+                                       _mm_cmpeq_epi8(_mm_min_epu8(chars, control), chars));
+        int mask = _mm_movemask_epi8(special);
+        if (mask) {
+            return i + (size_t)__builtin_ctz((unsigned int)mask);
+        }
+    }
+#endif
+
+    while (i < len && !json_escape_class[(uint8_t)string[i]]) {
+        i++;
+    }
+    return i;
+}
+
+/*
+ * mistral_json_escape_len
+ *
+ * Append a string of known length to a buffer, escaping it so it can be used as the contents of a
+ * JSON string. Quotes, backslashes and the common control characters are escaped with a single
+ * backslash, any other control characters are written as \u00XX sequences.
+ *
+ * Parameters:
+ *   buffer - Pointer to the buffer
+ *   string - The string to escape
+ *   len    - The length of the string
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated, the contents of the buffer are left unchanged
+ */
+bool mistral_json_escape_len(mistral_buffer *buffer, const char *string, size_t len)
+{
+    size_t start = buffer->len;
+    size_t i = 0;
+
+    /* Space for the common case where nothing needs to be escaped */
+    if (!mistral_buffer_reserve(buffer, len)) {
+        return false;
+    }
+
+    while (true) {
+        size_t run = json_clean_run(string + i, len - i);
+        memcpy(buffer->data + buffer->len, string + i, run);
+        buffer->len += run;
+        i += run;
+
+        if (i == len) {
+            break;
+        }
+
+        uint8_t c = (uint8_t)string[i++];
+
+        /* Make room for the longest escape sequence plus the rest of the string */
+        if (!mistral_buffer_reserve(buffer, sizeof("\\u00XX") - 1 + len - i)) {
+            buffer->len = start;
+            buffer->data[buffer->len] = '\0';
+            return false;
+        }
+
+        char *q = buffer->data + buffer->len;
+        *q++ = '\\';
+        if (json_escape_class[c] == 'u') {
+            *q++ = 'u';
+            *q++ = '0';
+            *q++ = '0';
+            *q++ = json_hex_digit[c >> 4];
+            *q++ = json_hex_digit[c & 0xf];
+        } else {
+            *q++ = json_escape_class[c];
+        }
+        buffer->len = q - buffer->data;
+    }
+
+    buffer->data[buffer->len] = '\0';
+    return true;
+}
+
+/*
+ * mistral_json_escape
+ *
+ * Append a null terminated string to a buffer, escaping it so it can be used as the contents of a
+ * JSON string. A NULL string is treated as empty.
+ *
+ * Parameters:
+ *   buffer - Pointer to the buffer
+ *   string - The string to escape
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated, the contents of the buffer are left unchanged
+ */
+bool mistral_json_escape(mistral_buffer *buffer, const char *string)
+{
+    return mistral_json_escape_len(buffer, string ? string : "", string ? strlen(string) : 0);
+}
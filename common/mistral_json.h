@@ -0,0 +1,16 @@
+/* JSON string escaping used by plug-ins that produce JSON documents. Escaped text is written
+ * straight into the caller's output buffer rather than a separately allocated copy.
+ */
+
+#ifndef MISTRAL_JSON_H
+#define MISTRAL_JSON_H
+
+#include <stdbool.h>            /* bool */
+#include <stddef.h>             /* size_t */
+
+#include "mistral_buffer.h"     /* mistral_buffer */
+
+bool mistral_json_escape_len(mistral_buffer *buffer, const char *string, size_t len);
+bool mistral_json_escape(mistral_buffer *buffer, const char *string);
+
+#endif
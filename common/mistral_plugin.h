@@ -219,6 +219,62 @@ typedef struct mistral_log {
     int64_t sequence;
 } mistral_log;
 
+/* Compact record layout, an alternative to mistral_log for new plug-ins.
+ *
+ * The fields most plug-ins use for every record are packed into the first
+ * 64 byte cache line. Derived values such as the local time broken down into
+ * a struct tm are calculated on demand using mistral_record_localtime and the
+ * call types are only available as a bitmask. Strings, including the raw text
+ * of the rate and size range fields, are held out of line in a single block
+ * allocated with the record and released by mistral_destroy_record.
+ */
+typedef struct mistral_record_strings {
+    const char *label;
+    const char *path;
+    const char *fstype;
+    const char *fsname;
+    const char *fshost;
+    const char *size_range;
+    const char *threshold_str;
+    const char *measured_str;
+    const char *command;
+    const char *file;
+    const char *job_group_id;
+    const char *job_id;
+    const char *hostname;
+    const char *full_hostname;
+} mistral_record_strings;
+
+typedef struct mistral_record {
+    /* First cache line */
+    struct mistral_record *next;
+    time_t epoch;
+    uint64_t measured;
+    uint64_t threshold;
+    uint64_t timeframe;
+    int64_t size_min;
+    int64_t size_max;
+    uint32_t microseconds;
+    uint32_t call_type_mask;
+    /* Less frequently used values */
+    uint64_t measured_time;
+    int64_t pid;
+    int64_t sequence;
+    uint32_t cpu;
+    int32_t mpi_rank;
+    enum mistral_contract contract_type;
+    enum mistral_scope scope;
+    enum mistral_measurement measurement;
+    enum mistral_unit size_min_unit;
+    enum mistral_unit size_max_unit;
+    enum mistral_unit threshold_unit;
+    enum mistral_unit timeframe_unit;
+    enum mistral_unit measured_unit;
+    enum mistral_unit measured_time_unit;
+    const char *call_type_names;
+    const mistral_record_strings *strings;
+} mistral_record;
+
 typedef struct mistral_header {
     uint32_t contract_version;
     enum mistral_contract contract_type;
@@ -252,6 +308,9 @@ extern const int64_t mistral_max_size;    /* Holds max value of ssize_t as
                                            */
 
 extern void mistral_destroy_log_entry(mistral_log *log_entry);
+extern void mistral_destroy_record(mistral_record *record);
+extern struct tm *mistral_record_localtime(const mistral_record *record,
+                                           struct tm *result);
 __attribute__((__format__(printf, 1, 2)))
 extern int mistral_err(const char *format, ...);
 extern void mistral_shutdown(void); /* Function that, if called, will cause
@@ -259,6 +318,14 @@ extern void mistral_shutdown(void); /* Function that, if called, will cause
                                      * the next line of input.
                                      */
 extern const char *mistral_get_call_type_name(uint32_t mask);
+extern bool mistral_parse_count(const char *name, const char *string,
+                                unsigned long long min, unsigned long long max,
+                                unsigned long long *value);
+extern bool mistral_sink_submit(void *block); /* Hand a serialised block
+                                               * to mistral_sink_deliver,
+                                               * on the sink worker thread
+                                               * if it is running.
+                                               */
 
 #define UNUSED(param) ((void)(param))
 
@@ -267,9 +334,13 @@ void mistral_startup(mistral_plugin *plugin, int argc, char *argv[]);
 void mistral_received_interval(mistral_plugin *plugin) __attribute__((weak));
 void mistral_received_data_start(uint64_t block_num, bool block_error) __attribute__((weak));
 void mistral_received_data_end(uint64_t block_num, bool block_error) __attribute__((weak));
+void mistral_flush(uint64_t block_num) __attribute__((weak));
 void mistral_received_shutdown(void) __attribute__((weak));
 void mistral_received_log(mistral_log *log_entry) __attribute__((weak));
+void mistral_received_record(mistral_record *record) __attribute__((weak));
 void mistral_received_bad_log(const char *log_line) __attribute__((weak));
+void mistral_sink_deliver(void *block) __attribute__((weak));
+void mistral_sink_discard(void *block) __attribute__((weak));
 void mistral_exit(void) __attribute__((weak));
 
 #endif
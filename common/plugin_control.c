@@ -6,21 +6,27 @@
  * plug-ins. This alias, combined with our naming convention produces nice function names for the
  * external interface.
  */
+#include <ctype.h>              /* isspace */
 #include <errno.h>              /* errno */
+#include <fnmatch.h>            /* fnmatch */
 #include <inttypes.h>           /* uint32_t, uint64_t */
 #include <limits.h>             /* SSIZE_MAX */
 #include <pthread.h>            /* pthread_t, pthread_create, etc */
 #include <search.h>             /* insque, remque */
+#include <sched.h>              /* sched_setscheduler, sched_getscheduler, CPU_SET, etc */
 #include <semaphore.h>          /* sem_init, sem_wait, sem_post, sem_destroy */
 #include <signal.h>             /* sigaction, sigemptyset, etc */
 #include <stdarg.h>             /* va_start, va_list, va_end */
 #include <stdbool.h>            /* bool */
+#include <stddef.h>             /* offsetof */
 #include <stdint.h>             /* uint64_t, UINT64_MAX */
 #include <stdio.h>              /* fprintf, asprintf, vfprintf, setvbuf */
-#include <stdlib.h>             /* calloc, free */
+#include <stdlib.h>             /* calloc, free, posix_memalign */
 #include <string.h>             /* strerror_r, strdup, strncmp, strcmp, etc. */
+#include <sys/resource.h>       /* setpriority, getpriority */
+#include <sys/syscall.h>        /* SYS_gettid */
 #include <sys/time.h>           /* gettimeofday, localtime, strftime */
-#include <unistd.h>             /* STDOUT_FILENO, STDIN_FILENO, setsid, gethostname */
+#include <unistd.h>             /* STDOUT_FILENO, STDIN_FILENO, setsid, gethostname, syscall */
 
 #include "plugin_control.h"
 
@@ -38,6 +44,25 @@ typedef struct mask_names_map {             /* Structure used to map a call type
     char *call_types;                       /* A normalised string representation of the mask */
 } mask_names_map;
 
+typedef struct filter_op {                  /* A single step of a compiled record filter */
+    enum filter_opcode opcode;              /* Operation to perform */
+    enum filter_field field;                /* Raw log field tested by a FILTER_OP_MATCH step */
+    bool glob;                              /* True, if pattern contains wildcard characters */
+    uint32_t call_type_mask;                /* Call types that must all be present in the record */
+    char *pattern;                          /* Value or shell wildcard pattern to test against */
+} filter_op;
+
+typedef struct filter_parser {              /* State used while compiling a record filter */
+    const char *expr;                       /* Start of the filter expression */
+    const char *p;                          /* Current parse position */
+    filter_op *ops;                         /* Compiled operations */
+    size_t len;                             /* Number of compiled operations */
+    size_t size;                            /* Number of operations allocated */
+} filter_parser;
+
+_Static_assert(offsetof(mistral_record, measured_time) <= RECORD_ALIGNMENT,
+               "mistral_record hot fields must fit in one cache line");
+
 /* Globals only used by the communication thread */
 static unsigned ver = MISTRAL_API_VERSION;  /* Supported version */
 static uint64_t data_count = 0;             /* Number of data blocks received */
@@ -55,6 +80,38 @@ static message_details *messages_head = NULL;   /* First element of the messages
 static message_details *messages_tail = NULL;   /* Last element of the messages linked list */
 static void *mask_root = NULL;              /* Root node of tsearch call type mask map */
 
+/* Globals set up before the processing thread starts and only read by it afterwards */
+static filter_op *filter_ops = NULL;        /* Compiled record filter in postfix order */
+static size_t filter_len = 0;               /* Number of operations in the compiled filter */
+static bool *filter_stack = NULL;           /* Evaluation stack for the compiled filter */
+static uint64_t flush_interval = 0;         /* Seconds between mid-block flushes, 0 to disable */
+static uint64_t flush_records = 0;          /* Records that trigger a mid-block flush, 0 to disable */
+static uint64_t flush_bytes = 0;            /* Raw bytes that trigger a mid-block flush, 0 to disable */
+static uint64_t sink_blocks = PLUGIN_SINK_BLOCKS_DEFAULT;   /* Maximum blocks in flight, 0 to disable */
+static bool sink_running = false;           /* True, while the sink worker thread is running */
+static bool placement_set = false;          /* True, if any thread placement option was specified */
+static bool placement_cpus_set = false;     /* True, if a CPU list was specified */
+static cpu_set_t placement_cpus;            /* CPUs the framework threads may run on */
+static ssize_t placement_policy = -1;       /* Scheduling policy to use, -1 to leave unchanged */
+static bool placement_nice_set = false;     /* True, if a nice level was specified */
+static int placement_nice = 0;              /* Nice level to use for the framework threads */
+
+/* Globals used by both the processing and sink worker threads */
+static sem_t sink_free;                     /* Counts free slots in the sink queue */
+static sem_t sink_used;                     /* Counts blocks waiting in the sink queue */
+static void **sink_queue = NULL;            /* Ring buffer of blocks waiting to be delivered */
+static pthread_t sink_thread_id = 0;        /* Sink worker thread */
+static bool sink_failed = false;            /* True, if delivery set the shutdown flag */
+
+/* Globals only used by the processing thread */
+static uint64_t pending_records = 0;        /* Records passed to the plug-in since the last flush */
+static uint64_t pending_bytes = 0;          /* Raw size of the records counted in pending_records */
+static struct timespec last_flush;          /* Time of the last flush or data block boundary */
+static size_t sink_head = 0;                /* Next sink queue slot to fill */
+
+/* Globals only used by the sink worker thread */
+static size_t sink_tail = 0;                /* Next sink queue slot to deliver */
+
 /* Global variables available to plug-in developers */
 
 /* Define this value here in case the machine used to compile the plug-in functionality module uses
@@ -318,6 +375,37 @@ const char *mistral_get_call_type_name(uint32_t mask)
     return (const char *)(*found)->call_types;
 }
 
+/*
+ * mistral_parse_count
+ *
+ * Parse the value of a plug-in command line option that must be a decimal integer within a given
+ * range.
+ *
+ * Parameters:
+ *   name   - The long name of the option, used in error messages
+ *   string - The option value to parse
+ *   min    - The smallest value allowed
+ *   max    - The largest value allowed
+ *   value  - Set to the parsed value on success
+ *
+ * Returns:
+ *   true on success
+ *   false otherwise
+ */
+bool mistral_parse_count(const char *name, const char *string, unsigned long long min,
+                         unsigned long long max, unsigned long long *value)
+{
+    char *end = NULL;
+    errno = 0;
+    unsigned long long tmp = strtoull(string, &end, 10);
+    if (errno || !end || *end || string[0] == '\0' || string[0] == '-' || tmp < min || tmp > max) {
+        mistral_err("Invalid value for --%s specified %s\n", name, string);
+        return false;
+    }
+    *value = tmp;
+    return true;
+}
+
 /*
  * send_string_to_mistral
  *
@@ -752,850 +840,2056 @@ fail_rate_split:
 }
 
 /*
- * parse_log_entry
+ * filter_emit
  *
- * Parse the line received. The line structure is <scope>#<type>#log_message
+ * Append an operation to the record filter being compiled, growing the operation array as needed.
  *
- * scope will be one of "global" or "local"
+ * Parameters:
+ *   parser  - The filter parser state
+ *   opcode  - The operation to append
  *
- * type will be one of "monitor" or "throttle"
+ * Returns:
+ *   A pointer to the new operation if successful
+ *   NULL otherwise
+ */
+static filter_op *filter_emit(filter_parser *parser, enum filter_opcode opcode)
+{
+    if (parser->len == parser->size) {
+        size_t new_size = (parser->size) ? parser->size * 2 : 8;
+        filter_op *new_ops = realloc(parser->ops, new_size * sizeof(filter_op));
+        if (!new_ops) {
+            mistral_err("Unable to allocate memory for record filter\n");
+            return NULL;
+        }
+        parser->ops = new_ops;
+        parser->size = new_size;
+    }
+    filter_op *op = &parser->ops[parser->len++];
+    memset(op, 0, sizeof(filter_op));
+    op->opcode = opcode;
+    return op;
+}
+
+/*
+ * filter_skip_space
  *
- * log_message is the mistral log message as it would have been written to disk. This is a comma
- * separated format but it is possible that the command or file name may contain a comma.
+ * Advance the parse position past any white space.
  *
  * Parameters:
- *   line       - Standard null terminated string containing the line to be parsed
+ *   parser  - The filter parser state
  *
  * Returns:
- *   true on success
- *   false otherwise
+ *   The first character that is not white space
  */
-static bool parse_log_entry(const char *line)
+static char filter_skip_space(filter_parser *parser)
 {
-    size_t field_count;
-    mistral_log *log_entry = NULL;
-
-    char **comma_split = line_split_and_unescape(line, &field_count);
-    size_t log_field_count = field_count;
-    if (!comma_split) {
-        mistral_err("Unable to allocate memory for split log line: %s\n", line);
-        goto fail_split_commas;
+    while (isspace((unsigned char)*parser->p)) {
+        parser->p++;
     }
+    return *parser->p;
+}
 
-    /* As there might be commas in the command and/or filename we cannot just check the raw count */
-    if (log_field_count < FIELD_MAX) {
-        mistral_err("Invalid log message: %s (%zd/%d max fields)\n", line, log_field_count,
-                    FIELD_MAX);
-        goto fail_split_comma_fields;
-    }
+/*
+ * filter_parse_value
+ *
+ * Parse the value of a comparison. A value is either a double quoted string, in which a backslash
+ * escapes the following character, or a run of characters ending at white space or one of the
+ * characters "()&|".
+ *
+ * Parameters:
+ *   parser  - The filter parser state
+ *
+ * Returns:
+ *   A pointer to newly allocated memory containing the value if successful
+ *   NULL otherwise
+ */
+static char *filter_parse_value(filter_parser *parser)
+{
+    const char *start = parser->p;
+    char *value = NULL;
 
-    char **hash_split = str_split(comma_split[FIELD_TIMESTAMP], '#', &field_count);
-    if (!hash_split) {
-        mistral_err("Unable to allocate memory for mistral timestamp fields: %s\n",
-                    comma_split[FIELD_TIMESTAMP]);
-        goto fail_split_hashes;
+    if (*start == '"') {
+        value = calloc(1, strlen(start));
+        if (!value) {
+            mistral_err("Unable to allocate memory for record filter value\n");
+            return NULL;
+        }
+        char *q = value;
+        for (parser->p++; *parser->p && *parser->p != '"'; parser->p++) {
+            if (*parser->p == '\\' && parser->p[1] != '\0') {
+                parser->p++;
+            }
+            *q++ = *parser->p;
+        }
+        if (*parser->p != '"') {
+            mistral_err("Unterminated string in record filter at offset %td: %s\n",
+                        start - parser->expr, parser->expr);
+            free(value);
+            return NULL;
+        }
+        parser->p++;
+    } else {
+        size_t len = strcspn(start, " \t\n()&|");
+        if (len == 0) {
+            mistral_err("Missing value in record filter at offset %td: %s\n",
+                        start - parser->expr, parser->expr);
+            return NULL;
+        }
+        value = strndup(start, len);
+        if (!value) {
+            mistral_err("Unable to allocate memory for record filter value\n");
+            return NULL;
+        }
+        parser->p += len;
     }
+    return value;
+}
 
-    if (field_count != PLUGIN_MESSAGE_FIELDS) {
-        mistral_err("Invalid log message: %s (%zd/%d timestamp fields)\n", line, field_count,
-                    PLUGIN_MESSAGE_FIELDS);
-        goto fail_split_hash_fields;
-    }
+static bool filter_parse_or(filter_parser *parser);
 
-    /* Allocate memory for the log entry */
-    log_entry = calloc(1, sizeof(mistral_log));
-    if (log_entry == NULL) {
-        mistral_err("Unable to allocate memory for log message: %s\n", line);
-        goto fail_log_alloc;
+/*
+ * filter_parse_comparison
+ *
+ * Parse a comparison of the form <field>=<value> or <field>!=<value>. Values for fields with a
+ * fixed set of valid names are checked here so a typing error is reported at start up rather than
+ * silently discarding every record. Other values may contain shell wildcard characters.
+ *
+ * Parameters:
+ *   parser  - The filter parser state
+ *
+ * Returns:
+ *   true if the comparison was compiled successfully
+ *   false otherwise
+ */
+static bool filter_parse_comparison(filter_parser *parser)
+{
+    const char *start = parser->p;
+    size_t len = strspn(start, "abcdefghijklmnopqrstuvwxyz_");
+    char name[len + 1];
+
+    memcpy(name, start, len);
+    name[len] = '\0';
+    ssize_t field = find_in_array(name, filter_field_name);
+    if (*start == '\0') {
+        mistral_err("Unexpected end of record filter at offset %td: %s\n", start - parser->expr,
+                    parser->expr);
+        return false;
+    } else if (len == 0) {
+        mistral_err("Expected field name in record filter at offset %td: %s\n",
+                    start - parser->expr, parser->expr);
+        return false;
+    } else if (field == -1) {
+        mistral_err("Unknown field in record filter at offset %td: %s\n", start - parser->expr,
+                    parser->expr);
+        return false;
     }
+    parser->p += len;
 
-    /* Record the contract scope */
-    ssize_t scope = find_in_array(hash_split[0], mistral_scope_name);
-    if (scope == -1) {
-        mistral_err("Invalid scope in log message: %s\n", hash_split[0]);
-        goto fail_log_scope;
+    bool negate = false;
+    filter_skip_space(parser);
+    if (parser->p[0] == '!' && parser->p[1] == '=') {
+        negate = true;
+        parser->p += 2;
+    } else if (parser->p[0] == '=') {
+        parser->p++;
     } else {
-        log_entry->scope = scope;
+        mistral_err("Expected '=' or '!=' in record filter at offset %td: %s\n",
+                    parser->p - parser->expr, parser->expr);
+        return false;
     }
 
-    /* Record the contract type */
-    ssize_t contract = find_in_array(hash_split[1], mistral_contract_name);
-    if (contract == -1) {
-        mistral_err("Invalid contract type in log message: %s\n", hash_split[1]);
-        goto fail_log_contract;
-    } else {
-        log_entry->contract_type = contract;
+    filter_skip_space(parser);
+    char *value = filter_parse_value(parser);
+    if (!value) {
+        return false;
     }
 
-    /* Record the log event time */
-    char *p = strptime(hash_split[2], "%FT%T", &log_entry->time);
-    log_entry->microseconds = 0;
+    bool glob = (strpbrk(value, "*?[") != NULL);
+    uint32_t mask = 0;
+    const char * const *names = NULL;
 
-    if (p && *p == '.') {
-        if (sscanf(++p, "%6" SCNu32, &log_entry->microseconds) == EOF) {
-            log_entry->microseconds = 0;
+    switch (field) {
+    case FILTER_FIELD_SCOPE:
+        names = mistral_scope_name;
+        break;
+    case FILTER_FIELD_CONTRACT:
+        names = mistral_contract_name;
+        break;
+    case FILTER_FIELD_MEASUREMENT:
+        names = mistral_measurement_name;
+        break;
+    case FILTER_FIELD_CALL_TYPE: {
+        /* Call types are matched by bitmask so the order they are listed in is not important */
+        size_t count;
+        char **call_types = str_split(value, '+', &count);
+        if (!call_types) {
+            mistral_err("Unable to allocate memory for record filter call types\n");
+            free(value);
+            return false;
         }
-    } else if (p == NULL || *p != '\0') {
-        mistral_err("Unable to parse date and time in log message: %s\n", hash_split[2]);
-        goto fail_log_strptime;
-    }
-
-    /* Record the log event time as seconds since epoch mktime will normalise to UTC.
-     *
-     * Set the daylight savings time value to -1 as log messages will arrive delayed by the update
-     * interval so we may have since transitioned between states which will force mktime to use a
-     * "best guess".
-     */
-    log_entry->time.tm_isdst = -1;
-    log_entry->epoch.tv_sec = mktime(&log_entry->time);
-
-    if (log_entry->epoch.tv_sec < 0) {
-        mistral_err("Unable to convert date and time in log message: %s\n", line);
-        goto fail_log_mktime;
+        for (size_t i = 0; i < count; i++) {
+            ssize_t type = find_in_array(call_types[i], mistral_call_type_name);
+            if (type == -1) {
+                mistral_err("Invalid call type '%s' in record filter: %s\n", call_types[i],
+                            parser->expr);
+                free(call_types);
+                free(value);
+                return false;
+            }
+            mask |= mistral_call_type_mask[type];
+        }
+        free(call_types);
+        glob = false;
+        break;
     }
-
-    /* Oddly, having parsed this data this way round the timezone information is not accurate in the
-     * tm structure. To work around this simply re-populate the structure from the calculated epoch.
-     */
-    if (localtime_r(&log_entry->epoch.tv_sec, &log_entry->time) == NULL) {
-        mistral_err("Unable to calculate timezone in log message: %s\n", hash_split[2]);
-        goto fail_log_localtime;
+    default:
+        break;
     }
 
-    /* Record the rule label */
-    if ((log_entry->label = strdup(comma_split[FIELD_LABEL])) == NULL) {
-        mistral_err("Unable to allocate memory for label: %s\n", comma_split[FIELD_LABEL]);
-        goto fail_log_label;
+    if (names && !glob && find_in_array(value, names) == -1) {
+        mistral_err("Invalid %s '%s' in record filter: %s\n", name, value, parser->expr);
+        free(value);
+        return false;
     }
 
-    /* Record the rule path */
-    if ((log_entry->path = strdup(comma_split[FIELD_PATH])) == NULL) {
-        mistral_err("Unable to allocate memory for path: %s\n", comma_split[FIELD_PATH]);
-        goto fail_log_path;
+    filter_op *op = filter_emit(parser, FILTER_OP_MATCH);
+    if (!op) {
+        free(value);
+        return false;
     }
+    op->field = field;
+    op->glob = glob;
+    op->call_type_mask = mask;
+    op->pattern = value;
 
-    /* Record the filesystem type */
-    if ((log_entry->fstype = strdup(comma_split[FIELD_FSTYPE])) == NULL) {
-        mistral_err("Unable to allocate memory for filesystem type: %s\n",
-                    comma_split[FIELD_FSTYPE]);
-        goto fail_log_fstype;
+    if (negate && !filter_emit(parser, FILTER_OP_NOT)) {
+        return false;
     }
+    return true;
+}
 
-    /* Record the filesystem name */
-    if ((log_entry->fsname = strdup(comma_split[FIELD_FSNAME])) == NULL) {
-        mistral_err("Unable to allocate memory for filesystem name: %s\n",
-                    comma_split[FIELD_FSNAME]);
-        goto fail_log_fsname;
+/*
+ * filter_parse_unary
+ *
+ * Parse a negated term, a parenthesised expression or a single comparison.
+ *
+ * Parameters:
+ *   parser  - The filter parser state
+ *
+ * Returns:
+ *   true if the term was compiled successfully
+ *   false otherwise
+ */
+static bool filter_parse_unary(filter_parser *parser)
+{
+    char c = filter_skip_space(parser);
+
+    if (c == '!') {
+        parser->p++;
+        return filter_parse_unary(parser) && filter_emit(parser, FILTER_OP_NOT);
+    } else if (c == '(') {
+        parser->p++;
+        if (!filter_parse_or(parser)) {
+            return false;
+        }
+        if (filter_skip_space(parser) != ')') {
+            mistral_err("Expected ')' in record filter at offset %td: %s\n",
+                        parser->p - parser->expr, parser->expr);
+            return false;
+        }
+        parser->p++;
+        return true;
     }
+    return filter_parse_comparison(parser);
+}
 
-    /* Record the filesystem host */
-    if ((log_entry->fshost = strdup(comma_split[FIELD_FSHOST])) == NULL) {
-        mistral_err("Unable to allocate memory for filesystem host: %s\n",
-                    comma_split[FIELD_FSHOST]);
-        goto fail_log_fshost;
+/*
+ * filter_parse_and
+ *
+ * Parse one or more terms joined by "&&".
+ *
+ * Parameters:
+ *   parser  - The filter parser state
+ *
+ * Returns:
+ *   true if the expression was compiled successfully
+ *   false otherwise
+ */
+static bool filter_parse_and(filter_parser *parser)
+{
+    if (!filter_parse_unary(parser)) {
+        return false;
     }
-
-    /* Record the rule call types */
-    char **call_type_split = str_split(comma_split[FIELD_CALL_TYPE], '+', &field_count);
-    if (!call_type_split) {
-        mistral_err("Unable to allocate memory for call types: %s\n", comma_split[FIELD_CALL_TYPE]);
-        goto fail_log_call_types_split;
+    while (filter_skip_space(parser) == '&' && parser->p[1] == '&') {
+        parser->p += 2;
+        if (!filter_parse_unary(parser) || !filter_emit(parser, FILTER_OP_AND)) {
+            return false;
+        }
     }
+    return true;
+}
 
-    if (!call_type_split[0]) {
-        mistral_err("Unable to find call type: %s\n", comma_split[FIELD_CALL_TYPE]);
-        goto fail_log_call_types;
+/*
+ * filter_parse_or
+ *
+ * Parse one or more sub-expressions joined by "||". This has a lower precedence than "&&".
+ *
+ * Parameters:
+ *   parser  - The filter parser state
+ *
+ * Returns:
+ *   true if the expression was compiled successfully
+ *   false otherwise
+ */
+static bool filter_parse_or(filter_parser *parser)
+{
+    if (!filter_parse_and(parser)) {
+        return false;
     }
-
-    for (char **call_type = call_type_split; call_type && *call_type; ++call_type) {
-        ssize_t type = find_in_array(*call_type, mistral_call_type_name);
-        if (type == -1) {
-            mistral_err("Invalid call type: %s\n", *call_type);
-            goto fail_log_call_type;
-        } else {
-            log_entry->call_type_mask = log_entry->call_type_mask | mistral_call_type_mask[type];
-            log_entry->call_types[type] = true;
+    while (filter_skip_space(parser) == '|' && parser->p[1] == '|') {
+        parser->p += 2;
+        if (!filter_parse_and(parser) || !filter_emit(parser, FILTER_OP_OR)) {
+            return false;
         }
     }
+    return true;
+}
 
-    /* Initialise the standardised version of the call type string */
-    log_entry->call_type_names = mistral_get_call_type_name(log_entry->call_type_mask);
-    if (!log_entry->call_type_names) {
-        mistral_err("Unable to normalise call type names: %s\n", comma_split[FIELD_CALL_TYPE]);
-        goto fail_log_call_type_names;
-    }
+/*
+ * filter_destroy
+ *
+ * Free all memory associated with the compiled record filter.
+ *
+ * Parameters:
+ *   void
+ *
+ * Returns:
+ *   void
+ */
+static void filter_destroy(void)
+{
+    for (size_t i = 0; i < filter_len; i++) {
+        free(filter_ops[i].pattern);
+    }
+    free(filter_ops);
+    free(filter_stack);
+    filter_ops = NULL;
+    filter_stack = NULL;
+    filter_len = 0;
+}
 
-    /* Record the rule size range, default/missing values are 0 for min, SSIZE_MAX for max */
-    char **size_range_split = str_split(comma_split[FIELD_SIZE_RANGE], '-', &field_count);
-    if (!size_range_split) {
-        mistral_err("Unable to allocate memory for size range: %s\n",
-                    comma_split[FIELD_SIZE_RANGE]);
-        goto fail_log_size_range_split;
-    }
+/*
+ * filter_compile
+ *
+ * Compile the record filter expression, if any, passed in the MISTRAL_PLUGIN_FILTER environment
+ * variable. The expression is compiled into a list of operations in postfix order so testing a
+ * record needs no further parsing or memory allocation.
+ *
+ * An expression is made up of comparisons of the form <field>=<value> or <field>!=<value> that can
+ * be combined using "!", "&&", "||" and parentheses, e.g.
+ *
+ *   contract=throttle && (label=io_* || measurement=bandwidth)
+ *
+ * Parameters:
+ *   void
+ *
+ * Returns:
+ *   true if no filter was specified or the filter was compiled successfully
+ *   false otherwise
+ */
+static bool filter_compile(void)
+{
+    const char *expr = getenv(PLUGIN_FILTER_ENV);
 
-    /* set defaults for both min and max */
-    log_entry->size_min = 0;
-    log_entry->size_max = SSIZE_MAX;
-    log_entry->size_min_unit = UNIT_BYTES;
-    log_entry->size_max_unit = UNIT_BYTES;
+    if (!expr) {
+        return true;
+    }
 
-    if (field_count == 2) {
-        uint64_t range;
-        /* size range contained a '-' so parse each string that is present (blank => min/max) */
-        if (strcmp(size_range_split[0], "")) {
-            if (!parse_size(size_range_split[0], &range, &log_entry->size_min_unit)) {
-                mistral_err("Unable to parse size range minimum: %s\n",
-                            comma_split[FIELD_SIZE_RANGE]);
-                goto fail_log_size_range;
-            }
-            log_entry->size_min = (ssize_t)range;
-            if (log_entry->size_min == 0) {
-                log_entry->size_min_unit = UNIT_BYTES;
-            }
-            if (mistral_unit_type[log_entry->size_min_unit] != UNIT_CLASS_SIZE) {
-                mistral_err("Unexpected unit for size range: %s\n", size_range_split[0]);
-                goto fail_log_size_range;
-            }
-        }
-        if (strcmp(size_range_split[1], "")) {
-            if (!parse_size(size_range_split[1], &range, &log_entry->size_max_unit)) {
-                mistral_err("Unable to parse size range maximum: %s\n",
-                            comma_split[FIELD_SIZE_RANGE]);
-                goto fail_log_size_range;
-            }
-            log_entry->size_max = (ssize_t)range;
+    filter_parser parser = {
+        .expr = expr,
+        .p = expr,
+    };
 
-            if (mistral_unit_type[log_entry->size_max_unit] != UNIT_CLASS_SIZE) {
-                mistral_err("Unexpected unit for size range: %s\n", size_range_split[1]);
-                goto fail_log_size_range;
-            }
-        }
-    } else if (strcmp(size_range_split[0], "all") || field_count > 1) {
-        /* Size range was not "all" which is the only other valid value */
-        mistral_err("Unable to parse size range: %s\n", comma_split[FIELD_SIZE_RANGE]);
-        goto fail_log_size_range;
+    if (filter_skip_space(&parser) == '\0') {
+        /* An empty filter accepts everything */
+        return true;
     }
 
-    /* Finally simply store the raw string */
-    if ((log_entry->size_range = strdup(comma_split[FIELD_SIZE_RANGE])) == NULL) {
-        mistral_err("Unable to allocate memory for size range: %s\n",
-                    comma_split[FIELD_SIZE_RANGE]);
-        goto fail_log_size_range;
+    if (!filter_parse_or(&parser)) {
+        goto fail_parse;
     }
 
-    /* Record the measurement type */
-    ssize_t measurement = find_in_array(comma_split[FIELD_MEASUREMENT], mistral_measurement_name);
-    if (measurement == -1) {
-        mistral_err("Invalid measurement in log message: %s\n", comma_split[FIELD_MEASUREMENT]);
-        goto fail_log_measurement;
-    } else {
-        log_entry->measurement = measurement;
+    if (filter_skip_space(&parser) != '\0') {
+        mistral_err("Unexpected data in record filter at offset %td: %s\n", parser.p - expr, expr);
+        goto fail_parse;
     }
 
-    /* Record the allowed rate */
-    if ((log_entry->threshold_str = strdup(comma_split[FIELD_THRESHOLD])) == NULL) {
-        mistral_err("Unable to allocate memory for allowed: %s\n", comma_split[FIELD_THRESHOLD]);
-        goto fail_log_threshold_str;
+    /* The evaluation stack can never be deeper than the number of operations */
+    filter_stack = calloc(parser.len, sizeof(bool));
+    if (!filter_stack) {
+        mistral_err("Unable to allocate memory for record filter\n");
+        goto fail_parse;
     }
 
-    /* And also store its constituent parts */
-    if (!parse_rate(comma_split[FIELD_THRESHOLD], &log_entry->threshold, &log_entry->threshold_unit,
-                    &log_entry->timeframe, &log_entry->timeframe_unit))
-    {
-        goto fail_log_allowed;
-    }
-
-    /* Record the observed rate */
-    if ((log_entry->measured_str = strdup(comma_split[FIELD_MEASURED])) == NULL) {
-        mistral_err("Unable to allocate memory for allowed: %s\n", comma_split[FIELD_MEASURED]);
-        goto fail_log_measured_str;
-    }
+    filter_ops = parser.ops;
+    filter_len = parser.len;
+    return true;
 
-    /* And also store its constituent parts */
-    if (!parse_rate(comma_split[FIELD_MEASURED], &log_entry->measured, &log_entry->measured_unit,
-                    &log_entry->measured_time, &log_entry->measured_time_unit))
-    {
-        goto fail_log_observed;
+fail_parse:
+    for (size_t i = 0; i < parser.len; i++) {
+        free(parser.ops[i].pattern);
     }
+    free(parser.ops);
+    return false;
+}
 
-    /* Record the hostname */
-    if ((log_entry->full_hostname = strdup(comma_split[FIELD_HOSTNAME])) == NULL) {
-        mistral_err("Unable to allocate memory for full hostname: %s\n",
-                    comma_split[FIELD_HOSTNAME]);
-        goto fail_log_fullhost;
+/*
+ * filter_string_match
+ *
+ * Test a raw field value against the value or wildcard pattern of a compiled comparison.
+ *
+ * Parameters:
+ *   op     - The compiled comparison
+ *   value  - Standard null terminated string containing the raw field value
+ *
+ * Returns:
+ *   true if the value matches
+ *   false otherwise
+ */
+static bool filter_string_match(const filter_op *op, const char *value)
+{
+    if (op->glob) {
+        return fnmatch(op->pattern, value, 0) == 0;
     }
+    return strcmp(op->pattern, value) == 0;
+}
 
-    /* Now we've stored the full hostname save a version truncated at the first '.' */
-    char *dot;
-    if ((dot = strchr(comma_split[FIELD_HOSTNAME], '.'))) {
-        *dot = '\0';
+/*
+ * filter_test
+ *
+ * Test the raw fields of a log message against a single compiled comparison.
+ *
+ * Parameters:
+ *   op          - The compiled comparison
+ *   fields      - The comma separated log message fields
+ *   hash_fields - The '#' separated scope, contract and timestamp fields
+ *
+ * Returns:
+ *   true if the log message matches the comparison
+ *   false otherwise
+ */
+static bool filter_test(const filter_op *op, char * const *fields, char * const *hash_fields)
+{
+    switch (op->field) {
+    case FILTER_FIELD_SCOPE:
+        return filter_string_match(op, hash_fields[0]);
+    case FILTER_FIELD_CONTRACT:
+        return filter_string_match(op, hash_fields[1]);
+    case FILTER_FIELD_LABEL:
+        return filter_string_match(op, fields[FIELD_LABEL]);
+    case FILTER_FIELD_MEASUREMENT:
+        return filter_string_match(op, fields[FIELD_MEASUREMENT]);
+    case FILTER_FIELD_JOB_GROUP_ID:
+        return filter_string_match(op, fields[FIELD_JOB_GROUP_ID]);
+    case FILTER_FIELD_JOB_ID:
+        return filter_string_match(op, fields[FIELD_JOB_ID]);
+    case FILTER_FIELD_CALL_TYPE: {
+        /* Build the mask without copying the field, unknown call types are left for the full
+         * parse to report.
+         */
+        uint32_t mask = 0;
+        for (const char *type = fields[FIELD_CALL_TYPE]; *type;) {
+            size_t len = strcspn(type, "+");
+            for (size_t j = 0; j < CALL_TYPE_MAX; j++) {
+                if (len == mistral_call_type_len[j] &&
+                    strncmp(type, mistral_call_type_name[j], len) == 0)
+                {
+                    mask |= BITMASK(j);
+                    break;
+                }
+            }
+            type += len;
+            if (*type) {
+                type++;
+            }
+        }
+        return (mask & op->call_type_mask) == op->call_type_mask;
     }
-
-    if ((log_entry->hostname = strdup(comma_split[FIELD_HOSTNAME])) == NULL) {
-        mistral_err("Unable to allocate memory for hostname: %s\n", comma_split[FIELD_HOSTNAME]);
-        goto fail_log_host;
+    case FILTER_FIELD_HOST: {
+        /* Match either the full hostname or the name truncated at the first '.' */
+        const char *host = fields[FIELD_HOSTNAME];
+        if (filter_string_match(op, host)) {
+            return true;
+        }
+        size_t len = strcspn(host, ".");
+        if (host[len] == '\0') {
+            return false;
+        }
+        char short_host[len + 1];
+        memcpy(short_host, host, len);
+        short_host[len] = '\0';
+        return filter_string_match(op, short_host);
     }
-
-    /* Record the pid - because pid_t varies from machine to machine use an int64_t to be safe */
-    char *end = NULL;
-    errno = 0;
-    log_entry->pid = (int64_t)strtoll(comma_split[FIELD_PID], &end, 10);
-
-    if (!end || *end != '\0' || end == comma_split[FIELD_PID] || errno) {
-        mistral_err("Invalid PID seen: [%s].\n", comma_split[FIELD_PID]);
-        goto fail_log_pid;
+    default:
+        return false;
     }
+}
 
-    /* Record the CPU ID - this is unlikely to be large but use a uint32_t to future proof */
-    end = NULL;
-    errno = 0;
-    log_entry->cpu = (uint32_t)strtoul(comma_split[FIELD_CPU], &end, 10);
-
-    if (!end || *end != '\0' || end == comma_split[FIELD_CPU] || errno) {
-        mistral_err("Invalid CPU ID seen: [%s].\n", comma_split[FIELD_CPU]);
-        goto fail_log_cpu;
-    }
+/*
+ * filter_accept
+ *
+ * Evaluate the compiled record filter against the raw fields of a log message.
+ *
+ * Parameters:
+ *   fields      - The comma separated log message fields
+ *   hash_fields - The '#' separated scope, contract and timestamp fields
+ *
+ * Returns:
+ *   true if the log message should be passed to the plug-in
+ *   false otherwise
+ */
+static bool filter_accept(char * const *fields, char * const *hash_fields)
+{
+    size_t depth = 0;
 
-    /* Record the command */
-    if ((log_entry->command = strdup(comma_split[FIELD_COMMAND])) == NULL) {
-        mistral_err("Unable to store command: %s\n", line);
-        goto fail_log_command;
+    for (size_t i = 0; i < filter_len; i++) {
+        const filter_op *op = &filter_ops[i];
+        switch (op->opcode) {
+        case FILTER_OP_MATCH:
+            filter_stack[depth++] = filter_test(op, fields, hash_fields);
+            break;
+        case FILTER_OP_NOT:
+            filter_stack[depth - 1] = !filter_stack[depth - 1];
+            break;
+        case FILTER_OP_AND:
+            depth--;
+            filter_stack[depth - 1] = filter_stack[depth - 1] && filter_stack[depth];
+            break;
+        case FILTER_OP_OR:
+            depth--;
+            filter_stack[depth - 1] = filter_stack[depth - 1] || filter_stack[depth];
+            break;
+        }
     }
+    return (depth == 0) || filter_stack[0];
+}
 
-    /* Record the file name */
-    if ((log_entry->file = strdup(comma_split[FIELD_FILENAME])) == NULL) {
-        mistral_err("Unable to store filename: %s\n", line);
-        goto fail_log_filename;
-    }
+/*
+ * record_alloc
+ *
+ * Allocate a single cache line aligned block holding a mistral_record, its out of line string
+ * table and a copy of every string field in the split log message. The hostname truncated at the
+ * first '.' is stored alongside the full hostname.
+ *
+ * Parameters:
+ *   fields - The unescaped comma separated fields of the log message
+ *
+ * Returns:
+ *   A pointer to the zero initialised record with its strings populated on success
+ *   NULL otherwise
+ */
+static mistral_record *record_alloc(char * const *fields)
+{
+    static const enum mistral_log_fields string_fields[] = {
+        FIELD_LABEL, FIELD_PATH, FIELD_FSTYPE, FIELD_FSNAME, FIELD_FSHOST, FIELD_SIZE_RANGE,
+        FIELD_THRESHOLD, FIELD_MEASURED, FIELD_COMMAND, FIELD_FILENAME, FIELD_JOB_GROUP_ID,
+        FIELD_JOB_ID,
+    };
+    size_t len[ARRAY_LENGTH(string_fields)];
+    size_t host_len = strlen(fields[FIELD_HOSTNAME]);
+    size_t short_len = strcspn(fields[FIELD_HOSTNAME], ".");
+    size_t size = sizeof(mistral_record) + sizeof(mistral_record_strings) + host_len + 1 +
+                  short_len + 1;
 
-    /* Record the job group id */
-    if ((log_entry->job_group_id = strdup(comma_split[FIELD_JOB_GROUP_ID])) == NULL) {
-        mistral_err("Unable to allocate memory for job group id: %s\n",
-                    comma_split[FIELD_JOB_GROUP_ID]);
-        goto fail_log_group;
+    for (size_t i = 0; i < ARRAY_LENGTH(string_fields); i++) {
+        len[i] = strlen(fields[string_fields[i]]);
+        size += len[i] + 1;
     }
 
-    /* Record the job id */
-    if ((log_entry->job_id = strdup(comma_split[FIELD_JOB_ID])) == NULL) {
-        mistral_err("Unable to allocate memory for job id: %s\n", comma_split[FIELD_JOB_ID]);
-        goto fail_log_job;
+    void *block = NULL;
+    if (posix_memalign(&block, RECORD_ALIGNMENT, size)) {
+        return NULL;
     }
 
-    /* Record the MPI Rank */
-    end = NULL;
-    errno = 0;
-    log_entry->mpi_rank = (int32_t)strtol(comma_split[FIELD_MPI_RANK], &end, 10);
-
-    if (!end || *end != '\0' || errno) {
-        mistral_err("Invalid MPI rank seen: [%s].\n", comma_split[FIELD_MPI_RANK]);
-        goto fail_log_mpi_rank;
-    }
+    mistral_record *record = block;
+    mistral_record_strings *strings = (mistral_record_strings *)(record + 1);
+    char *copy = (char *)(strings + 1);
+    const char **dest[ARRAY_LENGTH(string_fields)] = {
+        &strings->label, &strings->path, &strings->fstype, &strings->fsname, &strings->fshost,
+        &strings->size_range, &strings->threshold_str, &strings->measured_str, &strings->command,
+        &strings->file, &strings->job_group_id, &strings->job_id,
+    };
 
-    end = NULL;
-    errno = 0;
-    log_entry->sequence = (int64_t)strtoll(comma_split[FIELD_SEQUENCE], &end, 10);
+    memset(record, 0, sizeof(*record));
+    record->strings = strings;
 
-    if (!end || *end != '\0' || end == comma_split[FIELD_SEQUENCE] || errno) {
-        mistral_err("Invalid sequence seen: [%s].\n", comma_split[FIELD_SEQUENCE]);
-        goto fail_log_sequence;
+    for (size_t i = 0; i < ARRAY_LENGTH(string_fields); i++) {
+        *dest[i] = memcpy(copy, fields[string_fields[i]], len[i] + 1);
+        copy += len[i] + 1;
     }
 
-    CALL_IF_DEFINED(mistral_received_log, log_entry);
-
-    free(size_range_split);
-    free(call_type_split);
-    free(hash_split);
-    free(comma_split);
-    return true;
-
-fail_log_sequence:
-fail_log_mpi_rank:
-    free((void *)log_entry->job_id);
-fail_log_job:
-    free((void *)log_entry->job_group_id);
-fail_log_group:
-    free((void *)log_entry->file);
-fail_log_filename:
-    free((void *)log_entry->command);
-fail_log_command:
-fail_log_cpu:
-fail_log_pid:
-    free((void *)log_entry->hostname);
-fail_log_host:
-    free((void *)log_entry->full_hostname);
-fail_log_fullhost:
-fail_log_observed:
-    free((void *)log_entry->measured_str);
-fail_log_measured_str:
-fail_log_allowed:
-    free((void *)log_entry->threshold_str);
-fail_log_threshold_str:
-fail_log_measurement:
-    free((void *)log_entry->size_range);
-fail_log_size_range:
-    free(size_range_split);
-fail_log_size_range_split:
-fail_log_call_type_names:
-fail_log_call_type:
-fail_log_call_types:
-    free(call_type_split);
-fail_log_call_types_split:
-    free((void *)log_entry->fshost);
-fail_log_fshost:
-    free((void *)log_entry->fsname);
-fail_log_fsname:
-    free((void *)log_entry->fstype);
-fail_log_fstype:
-    free((void *)log_entry->path);
-fail_log_path:
-    free((void *)log_entry->label);
-fail_log_label:
-fail_log_localtime:
-fail_log_mktime:
-fail_log_strptime:
-fail_log_contract:
-fail_log_scope:
-    free(log_entry);
-fail_log_alloc:
-fail_split_hash_fields:
-    free(hash_split);
-fail_split_hashes:
-fail_split_comma_fields:
-    free(comma_split);
-fail_split_commas:
-
-    CALL_IF_DEFINED(mistral_received_bad_log, line);
+    strings->full_hostname = memcpy(copy, fields[FIELD_HOSTNAME], host_len + 1);
+    copy += host_len + 1;
+    memcpy(copy, fields[FIELD_HOSTNAME], short_len);
+    copy[short_len] = '\0';
+    strings->hostname = copy;
 
-    return false;
+    return record;
 }
 
 /*
- * destroy_message_details
+ * log_entry_create
  *
- * Used to clean up a message details structure created by parse_message.
+ * Create a log entry in the layout used by plug-ins that define mistral_received_log. The parsed
+ * values are taken from a record and the strings are copied directly from the split log message so
+ * no intermediate record needs to be allocated.
  *
  * Parameters:
- *   log_entry - a pointer to the log entry to destroy
+ *   parsed - A record holding the parsed values of the log message, its strings are not used
+ *   fields - The unescaped comma separated fields of the log message
  *
  * Returns:
- *   void
+ *   A pointer to the new log entry on success
+ *   NULL otherwise
  */
-static void destroy_message_details(message_details *message)
+static mistral_log *log_entry_create(const mistral_record *parsed, char * const *fields)
 {
-    if (message) {
-        free(message->data);
-        free(message);
+    mistral_log *log_entry = calloc(1, sizeof(mistral_log));
+    if (!log_entry) {
+        return NULL;
+    }
+
+    log_entry->contract_type = parsed->contract_type;
+    log_entry->scope = parsed->scope;
+    log_entry->epoch.tv_sec = parsed->epoch;
+    log_entry->microseconds = parsed->microseconds;
+    log_entry->call_type_mask = parsed->call_type_mask;
+    for (size_t i = 0; i < CALL_TYPE_MAX; i++) {
+        log_entry->call_types[i] = (parsed->call_type_mask & mistral_call_type_mask[i]) != 0;
+    }
+    log_entry->call_type_names = parsed->call_type_names;
+    log_entry->size_min = parsed->size_min;
+    log_entry->size_min_unit = parsed->size_min_unit;
+    log_entry->size_max = parsed->size_max;
+    log_entry->size_max_unit = parsed->size_max_unit;
+    log_entry->measurement = parsed->measurement;
+    log_entry->threshold = parsed->threshold;
+    log_entry->threshold_unit = parsed->threshold_unit;
+    log_entry->timeframe = parsed->timeframe;
+    log_entry->timeframe_unit = parsed->timeframe_unit;
+    log_entry->measured = parsed->measured;
+    log_entry->measured_unit = parsed->measured_unit;
+    log_entry->measured_time = parsed->measured_time;
+    log_entry->measured_time_unit = parsed->measured_time_unit;
+    log_entry->pid = parsed->pid;
+    log_entry->cpu = parsed->cpu;
+    log_entry->mpi_rank = parsed->mpi_rank;
+    log_entry->sequence = parsed->sequence;
+
+    log_entry->label = strdup(fields[FIELD_LABEL]);
+    log_entry->path = strdup(fields[FIELD_PATH]);
+    log_entry->fstype = strdup(fields[FIELD_FSTYPE]);
+    log_entry->fsname = strdup(fields[FIELD_FSNAME]);
+    log_entry->fshost = strdup(fields[FIELD_FSHOST]);
+    log_entry->size_range = strdup(fields[FIELD_SIZE_RANGE]);
+    log_entry->threshold_str = strdup(fields[FIELD_THRESHOLD]);
+    log_entry->measured_str = strdup(fields[FIELD_MEASURED]);
+    log_entry->command = strdup(fields[FIELD_COMMAND]);
+    log_entry->file = strdup(fields[FIELD_FILENAME]);
+    log_entry->job_group_id = strdup(fields[FIELD_JOB_GROUP_ID]);
+    log_entry->job_id = strdup(fields[FIELD_JOB_ID]);
+    log_entry->full_hostname = strdup(fields[FIELD_HOSTNAME]);
+    /* Also save a version of the hostname truncated at the first '.' */
+    log_entry->hostname = strndup(fields[FIELD_HOSTNAME], strcspn(fields[FIELD_HOSTNAME], "."));
+
+    if (!log_entry->label || !log_entry->path || !log_entry->fstype || !log_entry->fsname ||
+        !log_entry->fshost || !log_entry->size_range || !log_entry->threshold_str ||
+        !log_entry->measured_str || !log_entry->command || !log_entry->file ||
+        !log_entry->job_group_id || !log_entry->job_id || !log_entry->hostname ||
+        !log_entry->full_hostname ||
+        localtime_r(&log_entry->epoch.tv_sec, &log_entry->time) == NULL)
+    {
+        mistral_destroy_log_entry(log_entry);
+        return NULL;
     }
+
+    return log_entry;
 }
 
 /*
- * mistral_destroy_log_entry
+ * parse_log_entry
  *
- * Used to clean up a log entry structure created by parse_log_entry.
+ * Parse the line received. The line structure is <scope>#<type>#log_message
  *
- * Parameters:
- *   log_entry - a pointer to the log entry to destroy
+ * scope will be one of "global" or "local"
  *
- * Returns:
- *   void
- */
-void mistral_destroy_log_entry(mistral_log *log_entry)
-{
-    if (log_entry) {
-        free((void *)log_entry->label);
-        free((void *)log_entry->path);
-        free((void *)log_entry->fstype);
-        free((void *)log_entry->fsname);
-        free((void *)log_entry->fshost);
-        free((void *)log_entry->size_range);
-        free((void *)log_entry->threshold_str);
-        free((void *)log_entry->measured_str);
-        free((void *)log_entry->command);
-        free((void *)log_entry->file);
-        free((void *)log_entry->job_group_id);
-        free((void *)log_entry->job_id);
-        free((void *)log_entry->hostname);
-        free((void *)log_entry->full_hostname);
-        free((void *)log_entry);
-    }
-}
-
-/*
- * parse_message
+ * type will be one of "monitor" or "throttle"
  *
- * Parse the message type, and then validate control messages. Messages that require immediate
- * response are acted on. All valid messages are then added to a linked list for further processing
- * by the processing thread.
+ * log_message is the mistral log message as it would have been written to disk. This is a comma
+ * separated format but it is possible that the command or file name may contain a comma.
  *
  * Parameters:
- *   line           - Standard null terminated string containing the line to be checked
+ *   line       - Standard null terminated string containing the line to be parsed
  *
  * Returns:
- *   PLUGIN_DATA_ERR  - If a control message was recognised but contained invalid data
- *   PLUGIN_FATAL_ERR - If this plug-in does not use a supported API version or was unable to send
- *                      the API version to use to Mistral. An attempt to allocate memory failed.
- *   value of message - The PLUGIN_MESSAGE_ enum message type seen
+ *   true on success
+ *   false otherwise
  */
-static enum mistral_message parse_message(char *line)
+static bool parse_log_entry(const char *line)
 {
-    /* number of data blocks received */
-    uint64_t block_count;
-    enum mistral_message message = PLUGIN_MESSAGE_DATA_LINE;
-    size_t line_len = strlen(line);
+    size_t field_count;
+    mistral_record parsed = {0};
 
-    if (line_len > 0 && line[line_len - 1] == '\n') {
-        line[line_len - 1] = '\0';
+    char **comma_split = line_split_and_unescape(line, &field_count);
+    size_t log_field_count = field_count;
+    if (!comma_split) {
+        mistral_err("Unable to allocate memory for split log line: %s\n", line);
+        goto fail_split_commas;
     }
-    #define X(P, V)                               \
-        if (strncmp(line, V, sizeof(V) - 1) == 0) \
-        {                                         \
-            message = PLUGIN_MESSAGE_ ## P;       \
-        } else
-    PLUGIN_MESSAGE(X)
-    #undef X
-    {
-        /* Final else - do nothing */
+
+    /* As there might be commas in the command and/or filename we cannot just check the raw count */
+    if (log_field_count < FIELD_MAX) {
+        mistral_err("Invalid log message: %s (%zd/%d max fields)\n", line, log_field_count,
+                    FIELD_MAX);
+        goto fail_split_comma_fields;
     }
 
-    /* Do some generic error checking before we handle the message */
-    if (!supported_version && message != PLUGIN_MESSAGE_SUP_VERSION &&
-        message != PLUGIN_MESSAGE_SHUTDOWN)
-    {
-        mistral_err("Message seen before supported versions received [%s].\n", line);
-        return PLUGIN_DATA_ERR;
-    } else if (in_data) {       /* We are currently processing a data block */
-        switch (message) {
-        case PLUGIN_MESSAGE_INTERVAL:
-        case PLUGIN_MESSAGE_SUP_VERSION:
-        case PLUGIN_MESSAGE_DATA_START:
-            /* Invalid messages */
-            mistral_err("Data block incomplete, log data might be corrupted [%s].\n", line);
-            return PLUGIN_DATA_ERR;
-        default:
-            break;
-        }
-    } else {
-        /* Not in a data block so only control messages are valid */
-        if (message == PLUGIN_MESSAGE_DATA_LINE && *line != '\0') {
-            mistral_err("Invalid data: [%s]. Expected a control message.\n", line);
-            return PLUGIN_DATA_ERR;
-        }
+    char **hash_split = str_split(comma_split[FIELD_TIMESTAMP], '#', &field_count);
+    if (!hash_split) {
+        mistral_err("Unable to allocate memory for mistral timestamp fields: %s\n",
+                    comma_split[FIELD_TIMESTAMP]);
+        goto fail_split_hashes;
     }
 
-    /* If we have a valid control message it should end with PLUGIN_MESSAGE_END */
-    if (message != PLUGIN_MESSAGE_DATA_LINE &&
-        strcmp(PLUGIN_MESSAGE_END, &line[line_len - sizeof(PLUGIN_MESSAGE_END)]))
-    {
-        mistral_err("Invalid data: [%s]. Expected control message.\n", line);
-        return PLUGIN_DATA_ERR;
+    if (field_count != PLUGIN_MESSAGE_FIELDS) {
+        mistral_err("Invalid log message: %s (%zd/%d timestamp fields)\n", line, field_count,
+                    PLUGIN_MESSAGE_FIELDS);
+        goto fail_split_hash_fields;
     }
 
-    /* The message is one we want to process so create a message_details entry */
-    message_details *this_message = calloc(1, sizeof(message_details));
-    if (this_message == NULL) {
-        mistral_err("Unable to allocate memory for message details: %s\n", line);
-        return PLUGIN_FATAL_ERR;
+    /* Discard records rejected by the record filter before doing any more work on them */
+    if (filter_ops && !filter_accept(comma_split, hash_split)) {
+        free(hash_split);
+        free(comma_split);
+        return true;
     }
-    this_message->message = message;
 
-    switch (message) {
-    case PLUGIN_MESSAGE_USED_VERSION:
-        /* We should only send, never receive this message */
-        free(this_message);
-        mistral_err("Invalid data: [%s]. Don't expect to receive this message.\n", line);
-        return PLUGIN_DATA_ERR;
-    case PLUGIN_MESSAGE_INTERVAL: {
-        /* Only seen in update plug-ins
-         * Store the update interval
+    /* The values are parsed into a record on the stack. The record passed to the plug-in is only
+     * allocated, in whichever form the plug-in accepts, once the whole message is known to be valid.
+     */
+    /* Record the contract scope */
+    ssize_t scope = find_in_array(hash_split[0], mistral_scope_name);
+    if (scope == -1) {
+        mistral_err("Invalid scope in log message: %s\n", hash_split[0]);
+        goto fail_record_scope;
+    } else {
+        parsed.scope = scope;
+    }
+
+    /* Record the contract type */
+    ssize_t contract = find_in_array(hash_split[1], mistral_contract_name);
+    if (contract == -1) {
+        mistral_err("Invalid contract type in log message: %s\n", hash_split[1]);
+        goto fail_record_contract;
+    } else {
+        parsed.contract_type = contract;
+    }
+
+    /* Record the log event time */
+    struct tm event_time = {0};
+    char *p = strptime(hash_split[2], "%FT%T", &event_time);
+    parsed.microseconds = 0;
+
+    if (p && *p == '.') {
+        if (sscanf(++p, "%6" SCNu32, &parsed.microseconds) == EOF) {
+            parsed.microseconds = 0;
+        }
+    } else if (p == NULL || *p != '\0') {
+        mistral_err("Unable to parse date and time in log message: %s\n", hash_split[2]);
+        goto fail_record_strptime;
+    }
+
+    /* Record the log event time as seconds since epoch mktime will normalise to UTC.
+     *
+     * Set the daylight savings time value to -1 as log messages will arrive delayed by the update
+     * interval so we may have since transitioned between states which will force mktime to use a
+     * "best guess".
+     */
+    event_time.tm_isdst = -1;
+    parsed.epoch = mktime(&event_time);
+
+    if (parsed.epoch < 0) {
+        mistral_err("Unable to convert date and time in log message: %s\n", line);
+        goto fail_record_mktime;
+    }
+
+    /* Record the rule call types */
+    char **call_type_split = str_split(comma_split[FIELD_CALL_TYPE], '+', &field_count);
+    if (!call_type_split) {
+        mistral_err("Unable to allocate memory for call types: %s\n", comma_split[FIELD_CALL_TYPE]);
+        goto fail_record_call_types_split;
+    }
+
+    if (!call_type_split[0]) {
+        mistral_err("Unable to find call type: %s\n", comma_split[FIELD_CALL_TYPE]);
+        goto fail_record_call_types;
+    }
+
+    for (char **call_type = call_type_split; call_type && *call_type; ++call_type) {
+        ssize_t type = find_in_array(*call_type, mistral_call_type_name);
+        if (type == -1) {
+            mistral_err("Invalid call type: %s\n", *call_type);
+            goto fail_record_call_type;
+        } else {
+            parsed.call_type_mask = parsed.call_type_mask | mistral_call_type_mask[type];
+        }
+    }
+
+    /* Initialise the standardised version of the call type string */
+    parsed.call_type_names = mistral_get_call_type_name(parsed.call_type_mask);
+    if (!parsed.call_type_names) {
+        mistral_err("Unable to normalise call type names: %s\n", comma_split[FIELD_CALL_TYPE]);
+        goto fail_record_call_type_names;
+    }
+
+    /* Record the rule size range, default/missing values are 0 for min, SSIZE_MAX for max */
+    char **size_range_split = str_split(comma_split[FIELD_SIZE_RANGE], '-', &field_count);
+    if (!size_range_split) {
+        mistral_err("Unable to allocate memory for size range: %s\n",
+                    comma_split[FIELD_SIZE_RANGE]);
+        goto fail_record_size_range_split;
+    }
+
+    /* set defaults for both min and max */
+    parsed.size_min = 0;
+    parsed.size_max = SSIZE_MAX;
+    parsed.size_min_unit = UNIT_BYTES;
+    parsed.size_max_unit = UNIT_BYTES;
+
+    if (field_count == 2) {
+        uint64_t range;
+        /* size range contained a '-' so parse each string that is present (blank => min/max) */
+        if (strcmp(size_range_split[0], "")) {
+            if (!parse_size(size_range_split[0], &range, &parsed.size_min_unit)) {
+                mistral_err("Unable to parse size range minimum: %s\n",
+                            comma_split[FIELD_SIZE_RANGE]);
+                goto fail_record_size_range;
+            }
+            parsed.size_min = (ssize_t)range;
+            if (parsed.size_min == 0) {
+                parsed.size_min_unit = UNIT_BYTES;
+            }
+            if (mistral_unit_type[parsed.size_min_unit] != UNIT_CLASS_SIZE) {
+                mistral_err("Unexpected unit for size range: %s\n", size_range_split[0]);
+                goto fail_record_size_range;
+            }
+        }
+        if (strcmp(size_range_split[1], "")) {
+            if (!parse_size(size_range_split[1], &range, &parsed.size_max_unit)) {
+                mistral_err("Unable to parse size range maximum: %s\n",
+                            comma_split[FIELD_SIZE_RANGE]);
+                goto fail_record_size_range;
+            }
+            parsed.size_max = (ssize_t)range;
+
+            if (mistral_unit_type[parsed.size_max_unit] != UNIT_CLASS_SIZE) {
+                mistral_err("Unexpected unit for size range: %s\n", size_range_split[1]);
+                goto fail_record_size_range;
+            }
+        }
+    } else if (strcmp(size_range_split[0], "all") || field_count > 1) {
+        /* Size range was not "all" which is the only other valid value */
+        mistral_err("Unable to parse size range: %s\n", comma_split[FIELD_SIZE_RANGE]);
+        goto fail_record_size_range;
+    }
+
+    /* Record the measurement type */
+    ssize_t measurement = find_in_array(comma_split[FIELD_MEASUREMENT], mistral_measurement_name);
+    if (measurement == -1) {
+        mistral_err("Invalid measurement in log message: %s\n", comma_split[FIELD_MEASUREMENT]);
+        goto fail_record_measurement;
+    } else {
+        parsed.measurement = measurement;
+    }
+
+    /* Record the constituent parts of the allowed rate */
+    if (!parse_rate(comma_split[FIELD_THRESHOLD], &parsed.threshold, &parsed.threshold_unit,
+                    &parsed.timeframe, &parsed.timeframe_unit))
+    {
+        goto fail_record_allowed;
+    }
+
+    /* Record the constituent parts of the observed rate */
+    if (!parse_rate(comma_split[FIELD_MEASURED], &parsed.measured, &parsed.measured_unit,
+                    &parsed.measured_time, &parsed.measured_time_unit))
+    {
+        goto fail_record_observed;
+    }
+
+    /* Record the pid - because pid_t varies from machine to machine use an int64_t to be safe */
+    char *end = NULL;
+    errno = 0;
+    parsed.pid = (int64_t)strtoll(comma_split[FIELD_PID], &end, 10);
+
+    if (!end || *end != '\0' || end == comma_split[FIELD_PID] || errno) {
+        mistral_err("Invalid PID seen: [%s].\n", comma_split[FIELD_PID]);
+        goto fail_record_pid;
+    }
+
+    /* Record the CPU ID - this is unlikely to be large but use a uint32_t to future proof */
+    end = NULL;
+    errno = 0;
+    parsed.cpu = (uint32_t)strtoul(comma_split[FIELD_CPU], &end, 10);
+
+    if (!end || *end != '\0' || end == comma_split[FIELD_CPU] || errno) {
+        mistral_err("Invalid CPU ID seen: [%s].\n", comma_split[FIELD_CPU]);
+        goto fail_record_cpu;
+    }
+
+    /* Record the MPI Rank */
+    end = NULL;
+    errno = 0;
+    parsed.mpi_rank = (int32_t)strtol(comma_split[FIELD_MPI_RANK], &end, 10);
+
+    if (!end || *end != '\0' || errno) {
+        mistral_err("Invalid MPI rank seen: [%s].\n", comma_split[FIELD_MPI_RANK]);
+        goto fail_record_mpi_rank;
+    }
+
+    end = NULL;
+    errno = 0;
+    parsed.sequence = (int64_t)strtoll(comma_split[FIELD_SEQUENCE], &end, 10);
+
+    if (!end || *end != '\0' || end == comma_split[FIELD_SEQUENCE] || errno) {
+        mistral_err("Invalid sequence seen: [%s].\n", comma_split[FIELD_SEQUENCE]);
+        goto fail_record_sequence;
+    }
+
+    free(size_range_split);
+    free(call_type_split);
+
+    /* Pass the record on in whichever form the plug-in accepts */
+    if (mistral_received_record) {
+        /* Allocate the record, its string table and the strings themselves in one block */
+        mistral_record *record = record_alloc(comma_split);
+        if (!record) {
+            mistral_err("Unable to allocate memory for log message: %s\n", line);
+            goto fail_record_alloc;
+        }
+        parsed.strings = record->strings;
+        *record = parsed;
+        mistral_received_record(record);
+    } else if (mistral_received_log) {
+        mistral_log *log_entry = log_entry_create(&parsed, comma_split);
+        if (!log_entry) {
+            mistral_err("Unable to allocate memory for log message: %s\n", line);
+            goto fail_log_alloc;
+        }
+        mistral_received_log(log_entry);
+    }
+    free(hash_split);
+    free(comma_split);
+
+    pending_records++;
+    pending_bytes += strlen(line);
+
+    return true;
+
+fail_record_sequence:
+fail_record_mpi_rank:
+fail_record_cpu:
+fail_record_pid:
+fail_record_observed:
+fail_record_allowed:
+fail_record_measurement:
+fail_record_size_range:
+    free(size_range_split);
+fail_record_size_range_split:
+fail_record_call_type_names:
+fail_record_call_type:
+fail_record_call_types:
+    free(call_type_split);
+fail_record_call_types_split:
+fail_record_mktime:
+fail_record_strptime:
+fail_record_contract:
+fail_record_scope:
+fail_record_alloc:
+fail_log_alloc:
+fail_split_hash_fields:
+    free(hash_split);
+fail_split_hashes:
+fail_split_comma_fields:
+    free(comma_split);
+fail_split_commas:
+
+    CALL_IF_DEFINED(mistral_received_bad_log, line);
+
+    return false;
+}
+
+/*
+ * destroy_message_details
+ *
+ * Used to clean up a message details structure created by parse_message.
+ *
+ * Parameters:
+ *   log_entry - a pointer to the log entry to destroy
+ *
+ * Returns:
+ *   void
+ */
+static void destroy_message_details(message_details *message)
+{
+    if (message) {
+        free(message->data);
+        free(message);
+    }
+}
+
+/*
+ * mistral_destroy_log_entry
+ *
+ * Used to clean up a log entry structure created by parse_log_entry.
+ *
+ * Parameters:
+ *   log_entry - a pointer to the log entry to destroy
+ *
+ * Returns:
+ *   void
+ */
+void mistral_destroy_log_entry(mistral_log *log_entry)
+{
+    if (log_entry) {
+        free((void *)log_entry->label);
+        free((void *)log_entry->path);
+        free((void *)log_entry->fstype);
+        free((void *)log_entry->fsname);
+        free((void *)log_entry->fshost);
+        free((void *)log_entry->size_range);
+        free((void *)log_entry->threshold_str);
+        free((void *)log_entry->measured_str);
+        free((void *)log_entry->command);
+        free((void *)log_entry->file);
+        free((void *)log_entry->job_group_id);
+        free((void *)log_entry->job_id);
+        free((void *)log_entry->hostname);
+        free((void *)log_entry->full_hostname);
+        free((void *)log_entry);
+    }
+}
+
+/*
+ * mistral_destroy_record
+ *
+ * Used to clean up a record created by parse_log_entry. The record and its strings are held in a
+ * single allocation.
+ *
+ * Parameters:
+ *   record - a pointer to the record to destroy
+ *
+ * Returns:
+ *   void
+ */
+void mistral_destroy_record(mistral_record *record)
+{
+    free(record);
+}
+
+/*
+ * mistral_record_localtime
+ *
+ * Break down the time a record was generated into local time. This is calculated on demand rather
+ * than stored in the record as few plug-ins need it.
+ *
+ * Parameters:
+ *   record - a pointer to the record
+ *   result - a pointer to the structure to populate
+ *
+ * Returns:
+ *   result on success
+ *   NULL otherwise
+ */
+struct tm *mistral_record_localtime(const mistral_record *record, struct tm *result)
+{
+    return localtime_r(&record->epoch, result);
+}
+
+/*
+ * parse_message
+ *
+ * Parse the message type, and then validate control messages. Messages that require immediate
+ * response are acted on. All valid messages are then added to a linked list for further processing
+ * by the processing thread.
+ *
+ * Parameters:
+ *   line           - Standard null terminated string containing the line to be checked
+ *
+ * Returns:
+ *   PLUGIN_DATA_ERR  - If a control message was recognised but contained invalid data
+ *   PLUGIN_FATAL_ERR - If this plug-in does not use a supported API version or was unable to send
+ *                      the API version to use to Mistral. An attempt to allocate memory failed.
+ *   value of message - The PLUGIN_MESSAGE_ enum message type seen
+ */
+static enum mistral_message parse_message(char *line)
+{
+    /* number of data blocks received */
+    uint64_t block_count;
+    enum mistral_message message = PLUGIN_MESSAGE_DATA_LINE;
+    size_t line_len = strlen(line);
+
+    if (line_len > 0 && line[line_len - 1] == '\n') {
+        line[line_len - 1] = '\0';
+    }
+    #define X(P, V)                               \
+        if (strncmp(line, V, sizeof(V) - 1) == 0) \
+        {                                         \
+            message = PLUGIN_MESSAGE_ ## P;       \
+        } else
+    PLUGIN_MESSAGE(X)
+    #undef X
+    {
+        /* Final else - do nothing */
+    }
+
+    /* Do some generic error checking before we handle the message */
+    if (!supported_version && message != PLUGIN_MESSAGE_SUP_VERSION &&
+        message != PLUGIN_MESSAGE_SHUTDOWN)
+    {
+        mistral_err("Message seen before supported versions received [%s].\n", line);
+        return PLUGIN_DATA_ERR;
+    } else if (in_data) {       /* We are currently processing a data block */
+        switch (message) {
+        case PLUGIN_MESSAGE_INTERVAL:
+        case PLUGIN_MESSAGE_SUP_VERSION:
+        case PLUGIN_MESSAGE_DATA_START:
+            /* Invalid messages */
+            mistral_err("Data block incomplete, log data might be corrupted [%s].\n", line);
+            return PLUGIN_DATA_ERR;
+        default:
+            break;
+        }
+    } else {
+        /* Not in a data block so only control messages are valid */
+        if (message == PLUGIN_MESSAGE_DATA_LINE && *line != '\0') {
+            mistral_err("Invalid data: [%s]. Expected a control message.\n", line);
+            return PLUGIN_DATA_ERR;
+        }
+    }
+
+    /* If we have a valid control message it should end with PLUGIN_MESSAGE_END */
+    if (message != PLUGIN_MESSAGE_DATA_LINE &&
+        strcmp(PLUGIN_MESSAGE_END, &line[line_len - sizeof(PLUGIN_MESSAGE_END)]))
+    {
+        mistral_err("Invalid data: [%s]. Expected control message.\n", line);
+        return PLUGIN_DATA_ERR;
+    }
+
+    /* The message is one we want to process so create a message_details entry */
+    message_details *this_message = calloc(1, sizeof(message_details));
+    if (this_message == NULL) {
+        mistral_err("Unable to allocate memory for message details: %s\n", line);
+        return PLUGIN_FATAL_ERR;
+    }
+    this_message->message = message;
+
+    switch (message) {
+    case PLUGIN_MESSAGE_USED_VERSION:
+        /* We should only send, never receive this message */
+        free(this_message);
+        mistral_err("Invalid data: [%s]. Don't expect to receive this message.\n", line);
+        return PLUGIN_DATA_ERR;
+    case PLUGIN_MESSAGE_INTERVAL: {
+        /* Only seen in update plug-ins
+         * Store the update interval
+         */
+        char *p = NULL;
+        char *end = NULL;
+
+        p = line + mistral_log_msg_len[PLUGIN_MESSAGE_INTERVAL];
+
+        errno = 0;
+        interval = (uint64_t)strtoull(p, &end, 10);
+
+        if (interval == 0 || !end || *end != PLUGIN_MESSAGE_SEP_C || errno) {
+            free(this_message);
+            mistral_err("Invalid interval seen: [%s].\n", line);
+            return PLUGIN_DATA_ERR;
+        }
+
+        if (sem_wait(&mistral_plugin_info.lock) == 0) {
+            mistral_plugin_info.interval = interval;
+            if (sem_post(&mistral_plugin_info.lock) != 0) {
+                /* We didn't free the semaphore - this is going to go very wrong exit immediately */
+                char buf[256];
+                fprintf(stderr, "Error releasing semaphore after saving interval, exiting: %s\n",
+                        strerror_r(errno, buf, sizeof buf));
+                /* Try to send a shutdown message outside of the robust message sending routines
+                 * which may try to call mistral_err that relies on this semaphore.
+                 */
+                fprintf(stdout, "%s\n", mistral_log_message[PLUGIN_MESSAGE_SHUTDOWN]);
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            char buf[256];
+            /* The mistral_err function will also try to claim this semaphore but will fall back to
+             * using stderr on error.
+             */
+            mistral_err("Error claiming semaphore saving interval, exiting: %s\n",
+                        strerror_r(errno, buf, sizeof buf));
+            mistral_shutdown();
+        }
+        break;
+    }
+    case PLUGIN_MESSAGE_SUP_VERSION: {
+        /* Extract minimum and current version supported */
+        unsigned min_ver = 0;
+        unsigned cur_ver = 0;
+
+        /* Due to compiler warnings about string literals etc it is much simpler to hard code this
+         * message.
          */
+        if (sscanf(line, ":PGNSUPVRSN:%u:%u:\n", &min_ver, &cur_ver) != 2) {
+            free(this_message);
+            mistral_err("Invalid supported versions format received: [%s].\n", line);
+            return PLUGIN_DATA_ERR;
+        }
+
+        if (min_ver == 0 || cur_ver == 0 || min_ver > cur_ver) {
+            free(this_message);
+            mistral_err("Invalid supported version numbers received: [%s].\n", line);
+            return PLUGIN_DATA_ERR;
+        }
+
+        if (ver < min_ver || ver > cur_ver) {
+            free(this_message);
+            mistral_err("API version used [%u] is not supported [%s].\n", ver, line);
+            return PLUGIN_FATAL_ERR;
+        } else {
+            supported_version = true;
+            if (!send_message_to_mistral(PLUGIN_MESSAGE_USED_VERSION)) {
+                free(this_message);
+                return PLUGIN_FATAL_ERR;
+            }
+        }
+        break;
+    }
+    case PLUGIN_MESSAGE_DATA_START: {
+        /* Check if the data block number is one higher than the last version seen */
+        char *p = NULL;
+        char *end = NULL;
+        bool error_seen = false;
+
+        p = line + mistral_log_msg_len[PLUGIN_MESSAGE_DATA_START];
+
+        errno = 0;
+        block_count = (uint64_t)strtoull(p, &end, 10);
+
+        if (block_count == 0 || !end || *end != PLUGIN_MESSAGE_SEP_C || errno) {
+            mistral_err("Invalid data block number seen: [%s].\n", line);
+            error_seen = true;
+        }
+
+        if (block_count != data_count + 1) {
+            mistral_err("Unexpected data block number %" PRIu64 " seen (expected %" PRIu64 ").\n",
+                        block_count, data_count + 1);
+            error_seen = true;
+        }
+
+        this_message->block_num = block_count;
+        this_message->error = error_seen;
+
+        in_data = true;
+        data_count = block_count;
+        if (error_seen) {
+            message = PLUGIN_DATA_ERR;
+        }
+        break;
+    }
+    case PLUGIN_MESSAGE_DATA_END: {
+        /* Check if the data block number matches the last value seen */
+        uint64_t end_block_count = 0;
         char *p = NULL;
         char *end = NULL;
+        bool error_seen = false;
+
+        p = line + mistral_log_msg_len[PLUGIN_MESSAGE_DATA_END];
+
+        errno = 0;
+        end_block_count = (uint64_t)strtoull(p, &end, 10);
+
+        if (end_block_count == 0 || !end || *end != PLUGIN_MESSAGE_SEP_C || errno) {
+            mistral_err("Invalid data block number seen: [%s].\n", line);
+            error_seen = true;
+        }
+
+        if (data_count != end_block_count) {
+            mistral_err("Unexpected data block number %" PRIu64 " seen (expected %" PRIu64
+                        "), data may be corrupt.\n", end_block_count, data_count);
+            error_seen = true;
+        }
+        in_data = false;
+
+        this_message->block_num = end_block_count;
+        this_message->error = error_seen;
+
+        if (error_seen) {
+            message = PLUGIN_DATA_ERR;
+        }
+        break;
+    }
+    case PLUGIN_MESSAGE_SHUTDOWN:
+        /* Handle a clean shut down */
+        shutdown_message = true;
+        /* Once we've been told to shutdown Mistral will not read any message we send so simply
+         * detach the process. This will prevent blocking Mistral from exiting while we finish
+         * processing any stored messages.
+         */
+        if (setsid() < 0) {
+            /* This is non-fatal, it just means Mistral will wait for the plug-in to finish
+             * processing data before exiting. Log an error for information. This will always appear
+             * if the plug-in is run directly.
+             */
+            mistral_err("Unable to detach plug-in process on shutdown\n");
+        }
+
+        break;
+    case PLUGIN_MESSAGE_DATA_LINE:
+        this_message->block_num = data_count;
+        this_message->data = strdup(line);
+        /* Used by the Fluent Bit plug-in to calculate the running time of a job.
+         * This is a temporary implementation. To be removed for the next version of
+         * Mistral.
+         */
+        if (!timerisset(&mistral_plugin_end)) {
+            gettimeofday(&mistral_plugin_end, NULL);
+        }
+        break;
+    default:
+        mistral_err("Unknown message type [%d]\n", message);
+        break;
+    } /* End of message types */
+
+    /* Add the message to the linked list */
+    if (sem_wait(&message_list) == 0) {
+        if (!messages_head) {
+            /* Initialise linked list */
+            messages_head = this_message;
+            messages_tail = this_message;
+            insque(this_message, NULL);
+        } else {
+            insque(this_message, messages_tail);
+            messages_tail = this_message;
+        }
+
+        if (sem_post(&message_list) != 0) {
+            /* We didn't free the semaphore - this is going to go very wrong exit immediately */
+            char buf[256];
+            /* Although mistral_err uses a semaphore it is not this semaphore, so let's try to do
+             * things properly.
+             */
+            mistral_err("Error releasing semaphore after saving message, exiting: %s\n",
+                        strerror_r(errno, buf, sizeof buf));
+            send_message_to_mistral(PLUGIN_MESSAGE_SHUTDOWN);
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        char buf[256];
+        mistral_err("Error claiming semaphore saving message, exiting: %s\n",
+                    strerror_r(errno, buf, sizeof buf));
+        mistral_shutdown();
+    }
+
+    return message;
+}
+
+/*
+ * read_data_from_mistral
+ *
+ * Function that reads from STDIN_FILENO file descriptor.
+ * Calls parse_message() to parse the received message.
+ *
+ * Parameters:
+ *   None
+ *
+ * Returns:
+ *  true on success
+ *  false otherwise
+ */
+static bool read_data_from_mistral(void)
+{
+    int result;
+    /* waiting time set to 10 seconds, this is used to wait for the first message to be seen */
+    struct timeval timeout = {
+        .tv_sec = 10,
+        .tv_usec = 0,
+    };
+
+    fd_set read_set;
+
+    /* check stdin to see when it has input. */
+    FD_ZERO(&read_set);
+    FD_SET(STDIN_FILENO, &read_set);
+    char *line = NULL;
+    size_t line_length = 0;
+
+    bool retval = true;
+
+    /* If we knew the update interval we could alter this section to check stdin before every call
+     * to getline however currently only update plug-ins are sent this information.
+     */
+    do {
+        result = select(1 + STDIN_FILENO, &read_set, NULL, NULL, &timeout);
+    } while (result == -1 && errno == EINTR);   /* retry if interrupted */
+
+    if (result < 0) {
+        char buf[256];
+        mistral_err("Error in select() while reading from mistral: %s.\n",
+                    strerror_r(errno, buf, sizeof buf));
+        goto read_fail_select;
+    }
+
+    if (FD_ISSET(STDIN_FILENO, &read_set)) {
+        /* Data is available now. */
+        ssize_t gl_res = 0;
+        while (!__atomic_load_n(&shutdown, __ATOMIC_RELAXED) &&
+               (gl_res = getline(&line, &line_length, stdin)) > 0)
+        {
+            if (line != NULL) {
+                enum mistral_message message = parse_message(line);
+
+                if (message == PLUGIN_MESSAGE_SHUTDOWN) {
+                    /* Stop processing */
+                    goto read_shutdown;
+                } else if (message == PLUGIN_DATA_ERR) {
+                    /* Ignore bad data */
+                    continue;
+                } else if (message == PLUGIN_FATAL_ERR) {
+                    /* But do not continue if a serious error was seen. */
+                    retval = false;
+                    goto read_error;
+                }
+            }
+        }
+        /* If we've got here one of the while conditions failed, if we are shutting down an error
+         * should already have been output but we need to handle a getline call error.
+         */
+        if (gl_res < 0) {
+            char buf[256];
+            mistral_err("Error while reading from mistral: %s.\n",
+                        strerror_r(errno, buf, sizeof buf));
+        }
+    }
+
+read_error:
+read_shutdown:
+    free(line);
+
+read_fail_select:
+    /* In error cases we will not have seen a shutdown message so set a flag to tell the processing
+     * thread that no more messages are going to be seen.
+     */
+    __atomic_store_n(&complete, true, __ATOMIC_RELAXED);
+    return retval;
+}
 
-        p = line + mistral_log_msg_len[PLUGIN_MESSAGE_INTERVAL];
+/*
+ * read_env_uint64
+ *
+ * Read an unsigned integer value from an environment variable. The value passed in is left
+ * unchanged if the environment variable is not set.
+ *
+ * Parameters:
+ *   name   - Standard null terminated string containing the environment variable name
+ *   value  - Pointer to the variable to be updated with the value read
+ *
+ * Returns:
+ *   true if the environment variable is not set or contains a valid value
+ *   false otherwise
+ */
+static bool read_env_uint64(const char *name, uint64_t *value)
+{
+    const char *env = getenv(name);
+
+    if (!env || *env == '\0') {
+        return true;
+    }
+
+    char *end = NULL;
+    errno = 0;
+    unsigned long long tmp = strtoull(env, &end, 10);
+    if (errno || !end || *end || strchr(env, '-')) {
+        mistral_err("Invalid value '%s' specified in %s\n", env, name);
+        return false;
+    }
+    *value = (uint64_t)tmp;
+    return true;
+}
+
+/*
+ * flush_reset
+ *
+ * Restart the count of records and bytes seen and the flush timer. Called at data block boundaries
+ * and after every call to mistral_flush.
+ *
+ * Parameters:
+ *   void
+ *
+ * Returns:
+ *   void
+ */
+static void flush_reset(void)
+{
+    pending_records = 0;
+    pending_bytes = 0;
+    clock_gettime(CLOCK_MONOTONIC, &last_flush);
+}
+
+/*
+ * flush_configure
+ *
+ * Read the mid-block flush settings from the environment. These are only used if the plug-in
+ * defines mistral_flush.
+ *
+ * Parameters:
+ *   void
+ *
+ * Returns:
+ *   true on success
+ *   false if an invalid value was specified
+ */
+static bool flush_configure(void)
+{
+    if (!mistral_flush) {
+        return true;
+    }
+
+    if (!read_env_uint64(PLUGIN_FLUSH_INTERVAL_ENV, &flush_interval) ||
+        !read_env_uint64(PLUGIN_FLUSH_RECORDS_ENV, &flush_records) ||
+        !read_env_uint64(PLUGIN_FLUSH_BYTES_ENV, &flush_bytes))
+    {
+        return false;
+    }
+    flush_reset();
+    return true;
+}
+
+/*
+ * flush_if_due
+ *
+ * Call mistral_flush if records have been passed to the plug-in since the last flush and either
+ * the flush interval has elapsed or the record or byte threshold has been reached.
+ *
+ * Parameters:
+ *   block_num  - The number of the data block currently being received
+ *
+ * Returns:
+ *   true if mistral_flush was called
+ *   false otherwise
+ */
+static bool flush_if_due(uint64_t block_num)
+{
+    if (!mistral_flush || pending_records == 0) {
+        return false;
+    }
+
+    bool due = (flush_records && pending_records >= flush_records) ||
+               (flush_bytes && pending_bytes >= flush_bytes);
+
+    if (!due && flush_interval) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        due = ((uint64_t)(now.tv_sec - last_flush.tv_sec) >= flush_interval);
+    }
 
+    if (due) {
+        mistral_flush(block_num);
+        flush_reset();
+    }
+    return due;
+}
+
+/*
+ * placement_parse_cpus
+ *
+ * Parse a CPU list of the form used by taskset(1) and in /proc/<pid>/status, e.g. "0-3,8,10-11".
+ *
+ * Parameters:
+ *   list   - Standard null terminated string containing the CPU list
+ *   cpus   - Pointer to the CPU set to populate
+ *
+ * Returns:
+ *   true if the CPU list is valid
+ *   false otherwise
+ */
+static bool placement_parse_cpus(const char *list, cpu_set_t *cpus)
+{
+    const char *p = list;
+
+    CPU_ZERO(cpus);
+    do {
+        char *end = NULL;
         errno = 0;
-        interval = (uint64_t)strtoull(p, &end, 10);
+        unsigned long first = strtoul(p, &end, 10);
+        unsigned long last = first;
 
-        if (interval == 0 || !end || *end != PLUGIN_MESSAGE_SEP_C || errno) {
-            free(this_message);
-            mistral_err("Invalid interval seen: [%s].\n", line);
-            return PLUGIN_DATA_ERR;
+        if (errno || end == p || !isdigit((unsigned char)*p)) {
+            return false;
         }
-
-        if (sem_wait(&mistral_plugin_info.lock) == 0) {
-            mistral_plugin_info.interval = interval;
-            if (sem_post(&mistral_plugin_info.lock) != 0) {
-                /* We didn't free the semaphore - this is going to go very wrong exit immediately */
-                char buf[256];
-                fprintf(stderr, "Error releasing semaphore after saving interval, exiting: %s\n",
-                        strerror_r(errno, buf, sizeof buf));
-                /* Try to send a shutdown message outside of the robust message sending routines
-                 * which may try to call mistral_err that relies on this semaphore.
-                 */
-                fprintf(stdout, "%s\n", mistral_log_message[PLUGIN_MESSAGE_SHUTDOWN]);
-                exit(EXIT_FAILURE);
+        p = end;
+        if (*p == '-') {
+            ++p;
+            errno = 0;
+            last = strtoul(p, &end, 10);
+            if (errno || end == p || !isdigit((unsigned char)*p) || last < first) {
+                return false;
             }
-        } else {
-            char buf[256];
-            /* The mistral_err function will also try to claim this semaphore but will fall back to
-             * using stderr on error.
-             */
-            mistral_err("Error claiming semaphore saving interval, exiting: %s\n",
-                        strerror_r(errno, buf, sizeof buf));
-            mistral_shutdown();
+            p = end;
         }
-        break;
-    }
-    case PLUGIN_MESSAGE_SUP_VERSION: {
-        /* Extract minimum and current version supported */
-        unsigned min_ver = 0;
-        unsigned cur_ver = 0;
+        if (last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (unsigned long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, cpus);
+        }
+    } while (*p++ == ',');
 
-        /* Due to compiler warnings about string literals etc it is much simpler to hard code this
-         * message.
-         */
-        if (sscanf(line, ":PGNSUPVRSN:%u:%u:\n", &min_ver, &cur_ver) != 2) {
-            free(this_message);
-            mistral_err("Invalid supported versions format received: [%s].\n", line);
-            return PLUGIN_DATA_ERR;
+    return (*(p - 1) == '\0');
+}
+
+/*
+ * placement_format_cpus
+ *
+ * Write a CPU set as a compact CPU list, e.g. "0-3,8", into the buffer provided.
+ *
+ * Parameters:
+ *   cpus   - Pointer to the CPU set to format
+ *   buf    - Buffer to write the CPU list into
+ *   size   - Size of the buffer
+ *
+ * Returns:
+ *   buf
+ */
+static char *placement_format_cpus(const cpu_set_t *cpus, char *buf, size_t size)
+{
+    size_t len = 0;
+
+    buf[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE && len < size; cpu++) {
+        if (!CPU_ISSET(cpu, cpus)) {
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, cpus)) {
+            last++;
+        }
+        int res = (last == cpu) ? snprintf(buf + len, size - len, "%s%d", len ? "," : "", cpu) :
+                  snprintf(buf + len, size - len, "%s%d-%d", len ? "," : "", cpu, last);
+        if (res < 0) {
+            break;
         }
+        len += (size_t)res;
+        cpu = last;
+    }
+    return buf;
+}
 
-        if (min_ver == 0 || cur_ver == 0 || min_ver > cur_ver) {
-            free(this_message);
-            mistral_err("Invalid supported version numbers received: [%s].\n", line);
-            return PLUGIN_DATA_ERR;
+/*
+ * placement_configure
+ *
+ * Read the CPU affinity, scheduling policy and nice level to use for the plug-in framework
+ * threads from the environment.
+ *
+ * Parameters:
+ *   void
+ *
+ * Returns:
+ *   true on success
+ *   false if an invalid value was specified
+ */
+static bool placement_configure(void)
+{
+    const char *env = getenv(PLUGIN_CPUS_ENV);
+    if (env && *env) {
+        if (!placement_parse_cpus(env, &placement_cpus)) {
+            mistral_err("Invalid CPU list '%s' specified in %s\n", env, PLUGIN_CPUS_ENV);
+            return false;
         }
+        placement_cpus_set = true;
+    }
 
-        if (ver < min_ver || ver > cur_ver) {
-            free(this_message);
-            mistral_err("API version used [%u] is not supported [%s].\n", ver, line);
-            return PLUGIN_FATAL_ERR;
-        } else {
-            supported_version = true;
-            if (!send_message_to_mistral(PLUGIN_MESSAGE_USED_VERSION)) {
-                free(this_message);
-                return PLUGIN_FATAL_ERR;
-            }
+    env = getenv(PLUGIN_SCHED_ENV);
+    if (env && *env) {
+        placement_policy = find_in_array(env, placement_policy_name);
+        if (placement_policy == -1) {
+            mistral_err("Invalid scheduling policy '%s' specified in %s\n", env, PLUGIN_SCHED_ENV);
+            return false;
         }
-        break;
     }
-    case PLUGIN_MESSAGE_DATA_START: {
-        /* Check if the data block number is one higher than the last version seen */
-        char *p = NULL;
+
+    env = getenv(PLUGIN_NICE_ENV);
+    if (env && *env) {
         char *end = NULL;
-        bool error_seen = false;
+        errno = 0;
+        long nice_level = strtol(env, &end, 10);
+        if (errno || !end || *end || nice_level < -20 || nice_level > 19) {
+            mistral_err("Invalid nice level '%s' specified in %s\n", env, PLUGIN_NICE_ENV);
+            return false;
+        }
+        placement_nice = (int)nice_level;
+        placement_nice_set = true;
+    }
 
-        p = line + mistral_log_msg_len[PLUGIN_MESSAGE_DATA_START];
+    placement_set = placement_cpus_set || placement_policy != -1 || placement_nice_set;
+    return true;
+}
 
-        errno = 0;
-        block_count = (uint64_t)strtoull(p, &end, 10);
+/*
+ * placement_apply
+ *
+ * Apply the configured CPU affinity, scheduling policy and nice level to the calling thread then
+ * report the placement the thread actually ended up with in the error log. Failures are reported
+ * but are not fatal as the plug-in can still run correctly, if less politely.
+ *
+ * Parameters:
+ *   thread - Standard null terminated string containing the name of the calling thread
+ *
+ * Returns:
+ *   void
+ */
+static void placement_apply(const char *thread)
+{
+    if (!placement_set) {
+        return;
+    }
 
-        if (block_count == 0 || !end || *end != PLUGIN_MESSAGE_SEP_C || errno) {
-            mistral_err("Invalid data block number seen: [%s].\n", line);
-            error_seen = true;
+    char buf[256];
+    pid_t tid = (pid_t)syscall(SYS_gettid);
+
+    if (placement_cpus_set) {
+        int res = pthread_setaffinity_np(pthread_self(), sizeof(placement_cpus), &placement_cpus);
+        if (res) {
+            mistral_err("Unable to set CPU affinity of %s thread: %s\n", thread,
+                        strerror_r(res, buf, sizeof buf));
         }
+    }
 
-        if (block_count != data_count + 1) {
-            mistral_err("Unexpected data block number %" PRIu64 " seen (expected %" PRIu64 ").\n",
-                        block_count, data_count + 1);
-            error_seen = true;
+    if (placement_policy != -1) {
+        struct sched_param param = {0};
+        if (sched_setscheduler(0, placement_policy_value[placement_policy], &param) == -1) {
+            mistral_err("Unable to set scheduling policy of %s thread: %s\n", thread,
+                        strerror_r(errno, buf, sizeof buf));
         }
+    }
 
-        this_message->block_num = block_count;
-        this_message->error = error_seen;
+    if (placement_nice_set && setpriority(PRIO_PROCESS, (id_t)tid, placement_nice) == -1) {
+        mistral_err("Unable to set nice level of %s thread: %s\n", thread,
+                    strerror_r(errno, buf, sizeof buf));
+    }
 
-        in_data = true;
-        data_count = block_count;
-        if (error_seen) {
-            message = PLUGIN_DATA_ERR;
+    /* Report the effective placement rather than the requested one */
+    cpu_set_t cpus;
+    char cpu_list[256] = "unknown";
+    if (pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0) {
+        placement_format_cpus(&cpus, cpu_list, sizeof(cpu_list));
+    }
+
+    const char *policy_name = "unknown";
+    int policy = sched_getscheduler(0);
+    for (size_t i = 0; i < PLACEMENT_POLICY_MAX; i++) {
+        if (placement_policy_value[i] == policy) {
+            policy_name = placement_policy_name[i];
         }
-        break;
     }
-    case PLUGIN_MESSAGE_DATA_END: {
-        /* Check if the data block number matches the last value seen */
-        uint64_t end_block_count = 0;
-        char *p = NULL;
-        char *end = NULL;
-        bool error_seen = false;
 
-        p = line + mistral_log_msg_len[PLUGIN_MESSAGE_DATA_END];
+    errno = 0;
+    int nice_level = getpriority(PRIO_PROCESS, (id_t)tid);
+    if (errno) {
+        nice_level = 0;
+    }
+
+    mistral_err("Plug-in %s thread [%d] placement: CPUs %s, scheduling policy %s, nice %d\n",
+                thread, (int)tid, cpu_list, policy_name, nice_level);
+}
+
+/*
+ * sink_wait
+ *
+ * Wait on one of the sink queue semaphores, retrying if the wait is interrupted.
+ *
+ * Parameters:
+ *   sem  - The semaphore to wait on
+ *
+ * Returns:
+ *   true on success
+ *   false otherwise
+ */
+static bool sink_wait(sem_t *sem)
+{
+    while (sem_wait(sem) != 0) {
+        if (errno != EINTR) {
+            char buf[256];
+            mistral_err("Error claiming sink queue semaphore: %s\n",
+                        strerror_r(errno, buf, sizeof buf));
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * sink_enqueue
+ *
+ * Add a block to the sink queue, waiting for the sink worker thread to finish delivering a block
+ * if the maximum number of blocks are already in flight. A NULL block tells the sink worker thread
+ * to exit.
+ *
+ * Parameters:
+ *   block  - Pointer to the plug-in defined block to be delivered
+ *
+ * Returns:
+ *   true on success
+ *   false otherwise
+ */
+static bool sink_enqueue(void *block)
+{
+    if (!sink_wait(&sink_free)) {
+        return false;
+    }
 
-        errno = 0;
-        end_block_count = (uint64_t)strtoull(p, &end, 10);
+    sink_queue[sink_head] = block;
+    sink_head = (sink_head + 1) % sink_blocks;
 
-        if (end_block_count == 0 || !end || *end != PLUGIN_MESSAGE_SEP_C || errno) {
-            mistral_err("Invalid data block number seen: [%s].\n", line);
-            error_seen = true;
-        }
+    if (sem_post(&sink_used) != 0) {
+        char buf[256];
+        mistral_err("Error releasing sink queue semaphore: %s\n",
+                    strerror_r(errno, buf, sizeof buf));
+        return false;
+    }
+    return true;
+}
 
-        if (data_count != end_block_count) {
-            mistral_err("Unexpected data block number %" PRIu64 " seen (expected %" PRIu64
-                        "), data may be corrupt.\n", end_block_count, data_count);
-            error_seen = true;
-        }
-        in_data = false;
+/*
+ * sink_thread
+ *
+ * Main loop of the sink worker thread. Blocks are taken from the sink queue in the order they were
+ * submitted and passed to mistral_sink_deliver so that slow network or database operations do not
+ * prevent the processing thread from parsing the next data block.
+ *
+ * Once the shutdown flag is set, whether by a failed delivery or by the processing thread, the
+ * blocks still queued are passed to mistral_sink_discard, if defined, rather than being delivered.
+ * The plug-in would have stopped before building them had they been delivered as submitted.
+ *
+ * Parameters:
+ *   arg  - Unused
+ *
+ * Returns:
+ *   NULL
+ */
+static void *sink_thread(void *arg)
+{
+    UNUSED(arg);
 
-        this_message->block_num = end_block_count;
-        this_message->error = error_seen;
+    placement_apply("sink worker");
 
-        if (error_seen) {
-            message = PLUGIN_DATA_ERR;
-        }
-        break;
-    }
-    case PLUGIN_MESSAGE_SHUTDOWN:
-        /* Handle a clean shut down */
-        shutdown_message = true;
-        /* Once we've been told to shutdown Mistral will not read any message we send so simply
-         * detach the process. This will prevent blocking Mistral from exiting while we finish
-         * processing any stored messages.
-         */
-        if (setsid() < 0) {
-            /* This is non-fatal, it just means Mistral will wait for the plug-in to finish
-             * processing data before exiting. Log an error for information. This will always appear
-             * if the plug-in is run directly.
-             */
-            mistral_err("Unable to detach plug-in process on shutdown\n");
-        }
+    while (sink_wait(&sink_used)) {
+        void *block = sink_queue[sink_tail];
+        sink_tail = (sink_tail + 1) % sink_blocks;
 
-        break;
-    case PLUGIN_MESSAGE_DATA_LINE:
-        this_message->block_num = data_count;
-        this_message->data = strdup(line);
-        /* Used by the Fluent Bit plug-in to calculate the running time of a job.
-         * This is a temporary implementation. To be removed for the next version of
-         * Mistral.
-         */
-        if (!timerisset(&mistral_plugin_end)) {
-            gettimeofday(&mistral_plugin_end, NULL);
+        if (!block) {
+            break;
         }
-        break;
-    default:
-        mistral_err("Unknown message type [%d]\n", message);
-        break;
-    } /* End of message types */
 
-    /* Add the message to the linked list */
-    if (sem_wait(&message_list) == 0) {
-        if (!messages_head) {
-            /* Initialise linked list */
-            messages_head = this_message;
-            messages_tail = this_message;
-            insque(this_message, NULL);
+        if (__atomic_load_n(&shutdown, __ATOMIC_RELAXED)) {
+            CALL_IF_DEFINED(mistral_sink_discard, block);
         } else {
-            insque(this_message, messages_tail);
-            messages_tail = this_message;
+            mistral_sink_deliver(block);
+            if (__atomic_load_n(&shutdown, __ATOMIC_RELAXED)) {
+                __atomic_store_n(&sink_failed, true, __ATOMIC_RELAXED);
+            }
         }
 
-        if (sem_post(&message_list) != 0) {
-            /* We didn't free the semaphore - this is going to go very wrong exit immediately */
+        if (sem_post(&sink_free) != 0) {
             char buf[256];
-            /* Although mistral_err uses a semaphore it is not this semaphore, so let's try to do
-             * things properly.
-             */
-            mistral_err("Error releasing semaphore after saving message, exiting: %s\n",
+            mistral_err("Error releasing sink queue semaphore: %s\n",
                         strerror_r(errno, buf, sizeof buf));
-            send_message_to_mistral(PLUGIN_MESSAGE_SHUTDOWN);
-            exit(EXIT_FAILURE);
+            mistral_shutdown();
+            break;
         }
-    } else {
-        char buf[256];
-        mistral_err("Error claiming semaphore saving message, exiting: %s\n",
-                    strerror_r(errno, buf, sizeof buf));
-        mistral_shutdown();
     }
-
-    return message;
+    return NULL;
 }
 
 /*
- * read_data_from_mistral
+ * sink_start
  *
- * Function that reads from STDIN_FILENO file descriptor.
- * Calls parse_message() to parse the received message.
+ * Read the maximum number of blocks that may be in flight from the environment and, if the plug-in
+ * defines mistral_sink_deliver, start the sink worker thread. Setting the maximum to zero disables
+ * the worker thread and blocks are delivered synchronously.
  *
  * Parameters:
- *   None
+ *   void
  *
  * Returns:
- *  true on success
- *  false otherwise
+ *   true on success
+ *   false otherwise
  */
-static bool read_data_from_mistral(void)
+static bool sink_start(void)
 {
-    int result;
-    /* waiting time set to 10 seconds, this is used to wait for the first message to be seen */
-    struct timeval timeout = {
-        .tv_sec = 10,
-        .tv_usec = 0,
-    };
+    if (!mistral_sink_deliver) {
+        return true;
+    }
 
-    fd_set read_set;
+    if (!read_env_uint64(PLUGIN_SINK_BLOCKS_ENV, &sink_blocks)) {
+        return false;
+    }
 
-    /* check stdin to see when it has input. */
-    FD_ZERO(&read_set);
-    FD_SET(STDIN_FILENO, &read_set);
-    char *line = NULL;
-    size_t line_length = 0;
+    if (sink_blocks == 0) {
+        return true;
+    }
 
-    bool retval = true;
+    if (sink_blocks > SEM_VALUE_MAX) {
+        mistral_err("Value specified in %s must not exceed %d\n", PLUGIN_SINK_BLOCKS_ENV,
+                    SEM_VALUE_MAX);
+        return false;
+    }
 
-    /* If we knew the update interval we could alter this section to check stdin before every call
-     * to getline however currently only update plug-ins are sent this information.
-     */
-    do {
-        result = select(1 + STDIN_FILENO, &read_set, NULL, NULL, &timeout);
-    } while (result == -1 && errno == EINTR);   /* retry if interrupted */
+    sink_queue = calloc(sink_blocks, sizeof(*sink_queue));
+    if (!sink_queue) {
+        mistral_err("Unable to allocate memory for sink queue\n");
+        return false;
+    }
 
-    if (result < 0) {
+    if (sem_init(&sink_free, 0, (unsigned)sink_blocks)) {
         char buf[256];
-        mistral_err("Error in select() while reading from mistral: %s.\n",
+        mistral_err("Error initialising sink queue semaphore: (%s)\n",
                     strerror_r(errno, buf, sizeof buf));
-        goto read_fail_select;
+        goto fail_sem_free;
     }
 
-    if (FD_ISSET(STDIN_FILENO, &read_set)) {
-        /* Data is available now. */
-        ssize_t gl_res = 0;
-        while (!__atomic_load_n(&shutdown, __ATOMIC_RELAXED) &&
-               (gl_res = getline(&line, &line_length, stdin)) > 0)
-        {
-            if (line != NULL) {
-                enum mistral_message message = parse_message(line);
+    if (sem_init(&sink_used, 0, 0)) {
+        char buf[256];
+        mistral_err("Error initialising sink queue semaphore: (%s)\n",
+                    strerror_r(errno, buf, sizeof buf));
+        goto fail_sem_used;
+    }
 
-                if (message == PLUGIN_MESSAGE_SHUTDOWN) {
-                    /* Stop processing */
-                    goto read_shutdown;
-                } else if (message == PLUGIN_DATA_ERR) {
-                    /* Ignore bad data */
-                    continue;
-                } else if (message == PLUGIN_FATAL_ERR) {
-                    /* But do not continue if a serious error was seen. */
-                    retval = false;
-                    goto read_error;
-                }
-            }
-        }
-        /* If we've got here one of the while conditions failed, if we are shutting down an error
-         * should already have been output but we need to handle a getline call error.
-         */
-        if (gl_res < 0) {
-            char buf[256];
-            mistral_err("Error while reading from mistral: %s.\n",
-                        strerror_r(errno, buf, sizeof buf));
-        }
+    int res = pthread_create(&sink_thread_id, NULL, sink_thread, NULL);
+    if (res) {
+        char buf[256];
+        mistral_err("Unable to start sink worker thread: (%s)\n",
+                    strerror_r(res, buf, sizeof buf));
+        goto fail_thread;
     }
 
-read_error:
-read_shutdown:
-    free(line);
+    sink_running = true;
+    return true;
 
-read_fail_select:
-    /* In error cases we will not have seen a shutdown message so set a flag to tell the processing
-     * thread that no more messages are going to be seen.
-     */
-    __atomic_store_n(&complete, true, __ATOMIC_RELAXED);
-    return retval;
+fail_thread:
+    sem_destroy(&sink_used);
+fail_sem_used:
+    sem_destroy(&sink_free);
+fail_sem_free:
+    free(sink_queue);
+    sink_queue = NULL;
+    return false;
+}
+
+/*
+ * sink_stop
+ *
+ * Wait for the sink worker thread to deliver every block still in the sink queue then stop it.
+ * Any blocks submitted after this point are delivered synchronously.
+ *
+ * Parameters:
+ *   void
+ *
+ * Returns:
+ *   void
+ */
+static void sink_stop(void)
+{
+    if (!sink_running) {
+        return;
+    }
+
+    if (sink_enqueue(NULL)) {
+        pthread_join(sink_thread_id, NULL);
+    } else {
+        pthread_cancel(sink_thread_id);
+        pthread_join(sink_thread_id, NULL);
+    }
+    sink_running = false;
+
+    sem_destroy(&sink_used);
+    sem_destroy(&sink_free);
+    free(sink_queue);
+    sink_queue = NULL;
+}
+
+/*
+ * mistral_sink_submit
+ *
+ * Function called by a plug-in, normally from mistral_received_data_end, to hand over a block of
+ * serialised data for delivery. If the sink worker thread is running the block is queued and
+ * mistral_sink_deliver is called on that thread, allowing parsing of the next data block to
+ * continue while this one is sent. If the maximum number of blocks are already in flight this
+ * function waits for one to be delivered. Otherwise mistral_sink_deliver is called immediately.
+ *
+ * Blocks are refused once the shutdown flag has been set, for example because an earlier block
+ * could not be delivered. Ownership of the block passes to mistral_sink_deliver on success.
+ *
+ * Parameters:
+ *   block  - Pointer to the plug-in defined block to be delivered
+ *
+ * Returns:
+ *   true if the block was queued or delivered
+ *   false otherwise, in which case the caller still owns the block
+ */
+bool mistral_sink_submit(void *block)
+{
+    if (!block) {
+        mistral_err("Unable to submit an empty block to the sink\n");
+        return false;
+    }
+
+    if (!mistral_sink_deliver) {
+        mistral_err("Plug-in does not define mistral_sink_deliver\n");
+        return false;
+    }
+
+    if (__atomic_load_n(&shutdown, __ATOMIC_RELAXED)) {
+        return false;
+    }
+
+    if (!sink_running) {
+        mistral_sink_deliver(block);
+        return true;
+    }
+
+    return sink_enqueue(block);
+}
+
+/*
+ * sink_failure_reported
+ *
+ * Report that the shutdown flag was set while the sink worker thread was delivering data, rather
+ * than by the message or flush the processing thread has just handled.
+ *
+ * Parameters:
+ *   void
+ *
+ * Returns:
+ *   true if the failure came from the sink worker thread and has been reported
+ *   false otherwise
+ */
+static bool sink_failure_reported(void)
+{
+    if (!__atomic_load_n(&sink_failed, __ATOMIC_RELAXED)) {
+        return false;
+    }
+    mistral_err("Error while delivering data on the sink worker thread\n");
+    return true;
 }
 
 /*
@@ -1619,8 +2913,11 @@ static void *processing_thread(void *arg)
     int ret = EXIT_SUCCESS;
     int res = -1;
     bool shutdown_seen = false;
+    uint64_t block_num = 0;
     sigset_t *set = arg;
 
+    placement_apply("processing");
+
     /* Restore the signals blocked in the main thread */
     res = pthread_sigmask(SIG_UNBLOCK, set, NULL);
     if (res) {
@@ -1674,10 +2971,13 @@ static void *processing_thread(void *arg)
                 CALL_IF_DEFINED(mistral_received_interval, &mistral_plugin_info);
                 break;
             case PLUGIN_MESSAGE_DATA_START:
+                block_num = message->block_num;
+                flush_reset();
                 CALL_IF_DEFINED(mistral_received_data_start, message->block_num, message->error);
                 break;
             case PLUGIN_MESSAGE_DATA_END:
                 CALL_IF_DEFINED(mistral_received_data_end, message->block_num, message->error);
+                flush_reset();
                 break;
             case PLUGIN_MESSAGE_SHUTDOWN:
                 shutdown_seen = true;
@@ -1695,16 +2995,34 @@ static void *processing_thread(void *arg)
                 break;
             } /* End of message types */
 
-            /* If the global shutdown flag is now set something went wrong in the called function */
+            /* If the global shutdown flag is now set something went wrong in the called function
+             * or on the sink worker thread
+             */
             if (__atomic_load_n(&shutdown, __ATOMIC_RELAXED)) {
-                mistral_err("Error while processing message [%s]\n",
-                            mistral_log_message[message->message]);
+                if (!sink_failure_reported()) {
+                    mistral_err("Error while processing message [%s]\n",
+                                mistral_log_message[message->message]);
+                }
                 ret = EXIT_FAILURE;
             }
             destroy_message_details(message);
+        } else if (__atomic_load_n(&shutdown, __ATOMIC_RELAXED)) {
+            /* Delivery can fail on the sink worker thread while no messages are waiting */
+            sink_failure_reported();
+            ret = EXIT_FAILURE;
         } else {
             sleep(1);
         }
+
+        /* Check if records held by the plug-in should be flushed part way through a data block */
+        if (ret == EXIT_SUCCESS && flush_if_due(block_num) &&
+            __atomic_load_n(&shutdown, __ATOMIC_RELAXED))
+        {
+            if (!sink_failure_reported()) {
+                mistral_err("Error while flushing data block [%" PRIu64 "]\n", block_num);
+            }
+            ret = EXIT_FAILURE;
+        }
     }
     pthread_exit(&ret);
 }
@@ -1759,6 +3077,25 @@ int main(int argc, char **argv)
     mistral_startup(&mistral_plugin_info, argc, argv);
 
     if (mistral_plugin_info.type != MAX_PLUGIN) {
+        /* Compile any record filter now so errors are written to the plug-in's error log */
+        if (!filter_compile()) {
+            mistral_err("Invalid record filter specified in %s\n", PLUGIN_FILTER_ENV);
+            send_message_to_mistral(PLUGIN_MESSAGE_SHUTDOWN);
+            return EXIT_FAILURE;
+        }
+
+        if (!flush_configure()) {
+            send_message_to_mistral(PLUGIN_MESSAGE_SHUTDOWN);
+            return EXIT_FAILURE;
+        }
+
+        /* Threads created below inherit the placement of this thread but each reports its own */
+        if (!placement_configure()) {
+            send_message_to_mistral(PLUGIN_MESSAGE_SHUTDOWN);
+            return EXIT_FAILURE;
+        }
+        placement_apply("communication");
+
         /*
          * Block all signals in the main thread which will handle communication with Mistral.
          * They will be re-enabled in the processing thread which will process the data received.
@@ -1773,6 +3110,12 @@ int main(int argc, char **argv)
             return EXIT_FAILURE;
         }
 
+        /* Start the sink worker thread, if used, with all signals blocked */
+        if (!sink_start()) {
+            send_message_to_mistral(PLUGIN_MESSAGE_SHUTDOWN);
+            return EXIT_FAILURE;
+        }
+
         /* Create the processing thread */
         res = pthread_create(&thread_id, NULL, processing_thread, &set);
         if (res == 0) {
@@ -1781,6 +3124,7 @@ int main(int argc, char **argv)
             char buf[256];
             mistral_err("Unable to start processing thread: (%s)\n",
                         strerror_r(res, buf, sizeof buf));
+            sink_stop();
             send_message_to_mistral(PLUGIN_MESSAGE_SHUTDOWN);
             return EXIT_FAILURE;
         }
@@ -1791,6 +3135,9 @@ int main(int argc, char **argv)
         pthread_join(thread_id, NULL);
     }
 
+    /* Wait for any blocks still in flight to be delivered */
+    sink_stop();
+
     /* Even though the processing thread returns a success state we don't actually need to examine
      * it as we just need to know whether or not to inform Mistral that we are shutting down.
      */
@@ -1815,6 +3162,7 @@ int main(int argc, char **argv)
     sem_destroy(&mistral_plugin_info.lock);
     tdestroy(mask_root, mask_destroy);
     mask_root = NULL;
+    filter_destroy();
     CALL_IF_DEFINED(mistral_exit);
     return EXIT_SUCCESS;
 }
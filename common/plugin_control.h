@@ -9,6 +9,7 @@
 #include <stdint.h>             /* uint32_t */
 #include <stdio.h>              /* FILE */
 #include <fcntl.h>              /* open */
+#include <sched.h>              /* SCHED_OTHER, SCHED_BATCH, SCHED_IDLE */
 #include <sys/time.h>           /* struct timeval */
 #include <sys/stat.h>           /* open, umask */
 #include <sys/types.h>          /* open, umask */
@@ -97,6 +98,85 @@ enum mistral_log_fields {
     FIELD_MAX
 };
 
+/* Records are aligned so the hot fields at the start of a mistral_record share one cache line */
+#define RECORD_ALIGNMENT 64
+
+/* Environment variable used to pass a record filter expression to the plug-in framework */
+#define PLUGIN_FILTER_ENV "MISTRAL_PLUGIN_FILTER"
+
+/* Environment variables used to configure calls to mistral_flush part way through a data block */
+#define PLUGIN_FLUSH_INTERVAL_ENV "MISTRAL_PLUGIN_FLUSH_INTERVAL"
+#define PLUGIN_FLUSH_RECORDS_ENV "MISTRAL_PLUGIN_FLUSH_RECORDS"
+#define PLUGIN_FLUSH_BYTES_ENV "MISTRAL_PLUGIN_FLUSH_BYTES"
+
+/* Environment variable used to set the maximum number of blocks queued for the sink worker thread */
+#define PLUGIN_SINK_BLOCKS_ENV "MISTRAL_PLUGIN_SINK_BLOCKS"
+#define PLUGIN_SINK_BLOCKS_DEFAULT 2
+
+/* Environment variables used to control where and how the plug-in framework threads run */
+#define PLUGIN_CPUS_ENV "MISTRAL_PLUGIN_CPUS"
+#define PLUGIN_SCHED_ENV "MISTRAL_PLUGIN_SCHED"
+#define PLUGIN_NICE_ENV "MISTRAL_PLUGIN_NICE"
+
+/* Define the scheduling policies that can be selected for the plug-in framework threads */
+#define PLACEMENT_POLICY(X)        \
+    X(OTHER, "other", SCHED_OTHER) \
+    X(BATCH, "batch", SCHED_BATCH) \
+    X(IDLE,  "idle",  SCHED_IDLE)
+
+enum placement_policy {
+    #define X(name, str, policy) PLACEMENT_POLICY_ ## name,
+    PLACEMENT_POLICY(X)
+    #undef X
+    PLACEMENT_POLICY_MAX
+};
+
+const char * const placement_policy_name[] = {
+    #define X(name, str, policy) str,
+    PLACEMENT_POLICY(X)
+    #undef X
+    NULL
+};
+
+const int placement_policy_value[] = {
+    #define X(name, str, policy) policy,
+    PLACEMENT_POLICY(X)
+    #undef X
+};
+
+/* Define the raw log fields that can be tested by a record filter expression */
+#define FILTER_FIELD(X)                 \
+    X(SCOPE,        "scope")            \
+    X(CONTRACT,     "contract")         \
+    X(LABEL,        "label")            \
+    X(MEASUREMENT,  "measurement")      \
+    X(CALL_TYPE,    "calltype")         \
+    X(HOST,         "host")             \
+    X(JOB_GROUP_ID, "jobgroup")         \
+    X(JOB_ID,       "jobid")
+
+enum filter_field {
+    #define X(name, str) FILTER_FIELD_ ## name,
+    FILTER_FIELD(X)
+    #undef X
+    FILTER_FIELD_MAX
+};
+
+const char * const filter_field_name[] = {
+    #define X(name, str) str,
+    FILTER_FIELD(X)
+    #undef X
+    NULL
+};
+
+/* Operations used by a compiled record filter, these are evaluated in postfix order */
+enum filter_opcode {
+    FILTER_OP_MATCH,
+    FILTER_OP_NOT,
+    FILTER_OP_AND,
+    FILTER_OP_OR
+};
+
 /* Create various string arrays based off of the mistral_plugin.h header */
 const char * const mistral_contract_name[] = {
     #define X(name, str, header) str,
@@ -10,7 +10,13 @@
 #include <string.h>             /* strerror_r */
 #include <sys/stat.h>           /* open, umask */
 #include <sys/types.h>          /* open, umask */
+#include <time.h>               /* nanosleep */
+#include <zlib.h>               /* deflate */
 
+#include "mistral_buffer.h"
+#include "mistral_cache.h"
+#include "mistral_compress.h"
+#include "mistral_json.h"
 #include "mistral_plugin.h"
 
 #define VALID_NAME_CHARS "1234567890abcdefghijklmnopqrstvuwxyzABCDEFGHIJKLMNOPQRSTVUWXYZ-_"
@@ -27,50 +33,116 @@ static const char *es_index = "mistral";
 static char *custom_variables = NULL;
 static unsigned long es_version = 7;
 static bool index_use_date_format = false;
+static bool data_stream = false;
 
-struct saved_resp {
-    size_t size;
-    char *body;
-};
+/* Limits used to split a data block into separate _bulk requests */
+#define BULK_MAX_BYTES_DEFAULT (10 * 1024 * 1024)
+#define BULK_MAX_DOCS_DEFAULT 0
+#define CONNECTIONS_DEFAULT 4
+#define CONNECTIONS_MAX 64
 
-static struct curl_slist *headers = NULL;
-/*
- * write_callback
- *
- * Function to be called by CURL to save the response from a request. All this
- * function does is save the response for later processing. If a memory
- * allocation error occurs, the entire response is discarded.
+/* Documents rejected because Elasticsearch is overloaded are resent after an
+ * increasing delay, in milliseconds, up to a maximum number of attempts.
+ */
+#define RETRIES_DEFAULT 5
+#define RETRIES_MAX 100
+#define RETRY_DELAY_INITIAL 100
+#define RETRY_DELAY_MAX 10000
+
+static size_t bulk_max_bytes = BULK_MAX_BYTES_DEFAULT;
+static size_t bulk_max_docs = BULK_MAX_DOCS_DEFAULT;
+static unsigned long connections = CONNECTIONS_DEFAULT;
+static unsigned long max_retries = RETRIES_DEFAULT;
+static FILE *dead_letter = NULL;
+static uint64_t failed_total = 0;
+static uint64_t dead_letter_total = 0;
+static int compress_level = 0;
+static uint64_t compress_in_total = 0;
+static uint64_t compress_out_total = 0;
+static bool stream = false;
+static mistral_buffer doc_buffer = MISTRAL_BUFFER_INITIALIZER;
+
+/* A serialised data block, the bulk request body plus the offset at which the
+ * action line of each document starts. The extra final offset marks the end of
+ * the body so the length of document n is always offset[n + 1] - offset[n].
  *
- * Parameters:
- *   data   - A pointer to the returned data
- *   size   - Size of a data element
- *   nmemb  - Number of elements to "write"
- *   saved  - A pointer to the full response, this is our custom structure
+ * When streaming, the log entries themselves are kept instead and each one is
+ * only serialised as it is sent.
  *
- * Returns:
- *   Number of bytes successfully processed
+ * While the block is being sent the outcome of each document is tracked so
+ * that rejected documents can be sent again.
  */
-static size_t write_callback(void *data, size_t size, size_t nmemb, void *saved)
-{
-    size_t data_len = size * nmemb;
-    struct saved_resp *response = (struct saved_resp *)saved;
-
-    char *new_body = realloc(response->body, response->size + data_len + 1);
-    if (new_body == NULL) {
-        free(response->body);
-        response->body = NULL;
-        response->size = 0;
-        mistral_err("Could not allocate memory for response body\n");
-        return 0;
-    }
-
-    response->body = new_body;
-    memcpy(response->body + response->size, data, data_len);
-    response->size += data_len;
-    *(response->body + response->size) = '\0';
+typedef struct es_block {
+    mistral_buffer body;
+    size_t *offset;
+    size_t offset_size;
+    mistral_log **records;
+    size_t records_size;
+    size_t docs;
+    size_t next_doc;
+    bool *retry;
+    size_t retries;
+    size_t dead;
+    size_t failed;
+} es_block;
+
+/* Limits on how much of a _bulk response is kept while it is parsed */
+#define PARSER_MAX_DEPTH 8
+#define PARSER_KEY_LEN 16
+#define PARSER_TYPE_LEN 64
+#define PARSER_VALUE_LEN 256
+
+/* State of the incremental parser used to read a _bulk response. The response
+ * is processed as it is received so only the outcome of the current item
+ * needs to be kept, however large the response is.
+ */
+typedef struct bulk_parser {
+    unsigned int depth;                             /* Number of open objects and arrays */
+    char container[PARSER_MAX_DEPTH + 1];           /* '{' or '[' for each open level */
+    char key[PARSER_MAX_DEPTH + 1][PARSER_KEY_LEN]; /* Latest key seen at each level */
+    char value[PARSER_VALUE_LEN];                   /* String or literal being read */
+    size_t value_len;
+    bool in_string;
+    bool in_literal;
+    bool escape;
+    bool after_colon;
+    bool in_items;
+    bool done;                                      /* "errors":false, skip the rest */
+    size_t items;
+    long status;
+    char type[PARSER_TYPE_LEN];
+    char reason[PARSER_VALUE_LEN];
+} bulk_parser;
+
+/* A connection used to send one _bulk request (chunk) at a time. The request
+ * records which documents of the block it contains, in order, so that the items
+ * in the response can be matched to them.
+ */
+typedef struct es_request {
+    CURL *handle;
+    char error[CURL_ERROR_SIZE];
+    es_block *block;
+    size_t *doc;
+    size_t docs;
+    size_t doc_size;
+    size_t bytes;
+    bool busy;
+    bulk_parser parser;
+    z_stream zstream;
+    bool zstream_init;
+    mistral_buffer compressed;
+    mistral_buffer staging;     /* Document being streamed */
+    size_t staging_pos;
+    size_t replay;              /* Documents resent after a rewind */
+    bool eof;                   /* No more documents to add */
+    bool finished;              /* Compressed stream complete */
+    bool abort;
+} es_request;
+
+static CURLM *multihandle = NULL;
+static es_request *requests = NULL;
 
-    return data_len;
-}
+static struct curl_slist *headers = NULL;
 
 /*
  * set_curl_option
@@ -119,7 +191,10 @@ static void usage(const char *name)
      */
     mistral_err("Usage:\n"
                 "  %s [-i index] [-h host] [-P port] [-e file] [-m octal-mode] [-u user] [-p password] [-s] [-v var-name ...]\n"
-                     "[-k] [-c certificate_path] [--cert-dir=certificate_directory]\n", name);
+                     "[-k] [-c certificate_path] [--cert-dir=certificate_directory]\n"
+                     "[--bulk-bytes=bytes] [--bulk-docs=count] [--connections=count]\n"
+                     "[--compress[=level]] [--dead-letter=file] [--retries=count] [--stream]\n"
+                     "[--data-stream]\n", name);
     mistral_err("\n"
                 "  --cert-path=certificate_path\n"
                 "  -c certificate_path\n"
@@ -127,17 +202,44 @@ static void usage(const char *name)
                 "     of the ElasticSearch server. See ``man openssl verify`` for\n"
                 "     details of the ``CAfile`` option.\n"
                 "\n"
+                "  --bulk-bytes=bytes\n"
+                "     The maximum size of a single _bulk request. Larger data blocks are\n"
+                "     split into several requests. A document larger than this limit is\n"
+                "     sent in a request of its own. Defaults to 10485760 (10MiB).\n"
+                "\n"
+                "  --bulk-docs=count\n"
+                "     The maximum number of documents sent in a single _bulk request. If\n"
+                "     not specified or set to 0 only the --bulk-bytes limit applies.\n"
+                "\n"
                 "  --cert-dir=certificate_directory \n"
                 "     The directory that contains the CA certificate(s) used to sign the\n"
                 "     certificate of the ElasticSearch server.  Certificates in this\n"
                 "     directory should be named after the hashed certificate subject\n"
                 "     name, see ``man openssl verify`` for details of the ``CApath`` option.\n"
                  "\n"
+                "  --compress[=level]\n"
+                "     Compress each _bulk request with gzip. The optional level runs from\n"
+                "     1, the fastest and the default, to 9, the smallest.\n"
+                "\n"
+                "  --connections=count\n"
+                "     The maximum number of _bulk requests that will be sent to the\n"
+                "     Elasticsearch server concurrently. Defaults to 4.\n"
+                "\n"
+                "  --data-stream\n"
+                "     Write to the data stream named by --index using create actions\n"
+                "     rather than indexing into daily or rollover indexes. Requires\n"
+                "     Elasticsearch 7.9 or later and a data stream index template.\n"
+                "\n"
                 "  --date \n"
                 "  -d\n"
                 "     Use date based index names e.g. ``<idx_name>-yyyy-MM-dd`` rather than the default\n"
                 "     of numeric indexes ``<idx_name>-0000N``.\n"
                 "\n"
+                "  --dead-letter=file\n"
+                "     Append documents that Elasticsearch can never index, usually due to a\n"
+                "     mapping error, to this file rather than counting them as failures.\n"
+                "     The file can be sent to the _bulk API once the problem is fixed.\n"
+                "\n"
                 "  --error=file\n"
                 "  -e file\n"
                 "     Specify location for error log. If not specified all errors will\n"
@@ -168,6 +270,16 @@ static void usage(const char *name)
                 "     Specifies the port to connect to on the Elasticsearch server host.\n"
                 "     If not specified the plug-in will default to \"9200\".\n"
                 "\n"
+                "  --retries=count\n"
+                "     The number of times documents rejected because Elasticsearch is\n"
+                "     overloaded will be sent again, with an increasing delay, before they\n"
+                "     are counted as failures. Defaults to 5.\n"
+                "\n"
+                "  --stream\n"
+                "     Serialise each document as it is sent rather than building the whole\n"
+                "     _bulk request in memory first. Requests are sent using chunked\n"
+                "     transfer encoding.\n"
+                "\n"
                 "  --ssl\n"
                 "  -s\n"
                 "     Connect to the Elasticsearch server via secure HTTP.\n"
@@ -193,79 +305,1096 @@ static void usage(const char *name)
 }
 
 /*
- * elasticsearch_escape
+ * es_block_destroy
+ *
+ * Free a serialised data block and everything it contains.
+ *
+ * Parameters:
+ *   block - The data block to free, may be NULL
+ *
+ * Returns:
+ *   void
+ */
+static void es_block_destroy(es_block *block)
+{
+    if (block) {
+        mistral_buffer_free(&block->body);
+        free(block->offset);
+        if (block->records) {
+            for (size_t i = 0; i < block->docs; i++) {
+                if (block->records[i]) {
+                    mistral_destroy_log_entry(block->records[i]);
+                }
+            }
+            free(block->records);
+        }
+        free(block->retry);
+        free(block);
+    }
+}
+
+/*
+ * es_block_mark
+ *
+ * Record the current end of the bulk request body as the start of a new
+ * document, or as the end of the body once all documents have been added.
  *
- * Elasticsearch uses JSON output which uses double quotes to delimit strings.
- * There are several special characters that must be escaped using a single
- * backslash character inside these strings.
+ * Parameters:
+ *   block - The data block being built
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated
+ */
+static bool es_block_mark(es_block *block)
+{
+    if (block->docs + 1 >= block->offset_size) {
+        size_t new_size = block->offset_size ? block->offset_size * 2 : 256;
+        size_t *new_offset = realloc(block->offset, new_size * sizeof(size_t));
+        if (!new_offset) {
+            return false;
+        }
+        block->offset = new_offset;
+        block->offset_size = new_size;
+    }
+    block->offset[block->docs] = block->body.len;
+    return true;
+}
+
+/* Pre-rendered JSON fragments are cached. Each cache is only used by one
+ * thread, the processing thread normally or the sink worker thread when
+ * streaming.
+ */
+#define FRAGMENT_CACHE_SLOTS 1024
+
+/*
+ * key_string
  *
- * This function allocates twice as much memory as is required to copy the
- * passed string and then copies the string character by character escaping
- * the common characters that need special treatment as they are encountered.
- * Once the copy is complete the memory is reallocated to reduce wastage.
+ * Add a string field to a fragment cache key. The terminating null character
+ * is included so that adjacent fields cannot run together.
  *
  * Parameters:
- *   string - The string whose content needs to be escaped
+ *   key    - The key being built
+ *   string - The field value, may be NULL
  *
  * Returns:
- *   A pointer to newly allocated memory containing the escaped string or
- *   NULL on error
+ *   true on success
+ *   false if memory could not be allocated
  */
-static char *elasticsearch_escape(const char *string)
+static bool key_string(mistral_buffer *key, const char *string)
 {
     if (!string) {
-        return NULL;
+        return mistral_buffer_append(key, "\x01", 2);
+    }
+    return mistral_buffer_append(key, string, strlen(string) + 1);
+}
+
+/*
+ * key_value
+ *
+ * Add the raw bytes of a fixed size field to a fragment cache key.
+ *
+ * Parameters:
+ *   key   - The key being built
+ *   value - A pointer to the field value
+ *   size  - The size of the field
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated
+ */
+static bool key_value(mistral_buffer *key, const void *value, size_t size)
+{
+    return mistral_buffer_append(key, value, size);
+}
+
+/*
+ * rule_key
+ *
+ * Build the fragment cache key identifying the rule that generated a log
+ * entry. Every field that appears in the rule object is part of the key.
+ *
+ * Parameters:
+ *   key       - The buffer to build the key in
+ *   item      - The log entry
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated
+ */
+static bool rule_key(mistral_buffer *key, const void *item)
+{
+    const mistral_log *log_entry = item;
+    return key_value(key, &log_entry->scope, sizeof(log_entry->scope)) &&
+           key_value(key, &log_entry->contract_type, sizeof(log_entry->contract_type)) &&
+           key_value(key, &log_entry->measurement, sizeof(log_entry->measurement)) &&
+           key_value(key, &log_entry->threshold, sizeof(log_entry->threshold)) &&
+           key_value(key, &log_entry->timeframe, sizeof(log_entry->timeframe)) &&
+           key_value(key, &log_entry->size_min, sizeof(log_entry->size_min)) &&
+           key_value(key, &log_entry->size_max, sizeof(log_entry->size_max)) &&
+           key_string(key, log_entry->label) &&
+           key_string(key, log_entry->call_type_names) &&
+           key_string(key, log_entry->path) &&
+           key_string(key, log_entry->fstype) &&
+           key_string(key, log_entry->fsname) &&
+           key_string(key, log_entry->fshost);
+}
+
+/*
+ * rule_render
+ *
+ * Render the rule object of a document, including the trailing comma.
+ *
+ * Parameters:
+ *   text      - The buffer to render the fragment in
+ *   item      - The log entry
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated
+ */
+static bool rule_render(mistral_buffer *text, const void *item)
+{
+    const mistral_log *log_entry = item;
+    /* Several fields must be JSON escaped, these are escaped straight into the fragment */
+    return mistral_buffer_printf(text,
+                                 "\"rule\":{"
+                                 "\"scope\":\"%s\","
+                                 "\"type\":\"%s\","
+                                 "\"label\":\"%s\","
+                                 "\"measurement\":\"%s\","
+                                 "\"calltype\":\"%s\","
+                                 "\"path\":\"",
+                                 mistral_scope_name[log_entry->scope],
+                                 mistral_contract_name[log_entry->contract_type],
+                                 log_entry->label,
+                                 mistral_measurement_name[log_entry->measurement],
+                                 log_entry->call_type_names) &&
+           mistral_json_escape(text, log_entry->path) &&
+           mistral_buffer_printf(text, "\",\"fstype\":\"") &&
+           mistral_json_escape(text, log_entry->fstype) &&
+           mistral_buffer_printf(text, "\",\"fsname\":\"") &&
+           mistral_json_escape(text, log_entry->fsname) &&
+           mistral_buffer_printf(text, "\",\"fshost\":\"") &&
+           mistral_json_escape(text, log_entry->fshost) &&
+           mistral_buffer_printf(text,
+                                 "\","
+                                 "\"threshold\":%" PRIu64 ","
+                                 "\"timeframe\":%" PRIu64 ","
+                                 "\"size-min\":%" PRIu64 ","
+                                 "\"size-max\":%" PRIu64
+                                 "},",
+                                 log_entry->threshold,
+                                 log_entry->timeframe,
+                                 log_entry->size_min,
+                                 log_entry->size_max);
+}
+
+/*
+ * job_key
+ *
+ * Build the fragment cache key identifying the job that generated a log
+ * entry.
+ *
+ * Parameters:
+ *   key       - The buffer to build the key in
+ *   item      - The log entry
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated
+ */
+static bool job_key(mistral_buffer *key, const void *item)
+{
+    const mistral_log *log_entry = item;
+    return key_string(key, log_entry->hostname) &&
+           key_string(key, log_entry->job_group_id) &&
+           key_string(key, log_entry->job_id);
+}
+
+/*
+ * job_render
+ *
+ * Render the job object of a document, including the trailing comma.
+ *
+ * Parameters:
+ *   text      - The buffer to render the fragment in
+ *   item      - The log entry
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated
+ */
+static bool job_render(mistral_buffer *text, const void *item)
+{
+    const mistral_log *log_entry = item;
+    const char *job_gid = (log_entry->job_group_id[0] == 0) ? "N/A" : log_entry->job_group_id;
+    const char *job_id = (log_entry->job_id[0] == 0) ? "N/A" : log_entry->job_id;
+
+    return mistral_buffer_printf(text,
+                                 "\"job\":{"
+                                 "\"host\":\"%s\","
+                                 "\"job-group-id\":\"%s\","
+                                 "\"job-id\":\"%s\""
+                                 "},",
+                                 log_entry->hostname,
+                                 job_gid,
+                                 job_id);
+}
+
+/*
+ * process_key
+ *
+ * Build the fragment cache key identifying the process and file of a log
+ * entry.
+ *
+ * Parameters:
+ *   key       - The buffer to build the key in
+ *   item      - The log entry
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated
+ */
+static bool process_key(mistral_buffer *key, const void *item)
+{
+    const mistral_log *log_entry = item;
+    return key_value(key, &log_entry->pid, sizeof(log_entry->pid)) &&
+           key_string(key, log_entry->command) &&
+           key_string(key, log_entry->file);
+}
+
+/*
+ * process_render
+ *
+ * Render the start of the process object of a document, up to the fields that
+ * vary between records from the same process.
+ *
+ * Parameters:
+ *   text      - The buffer to render the fragment in
+ *   item      - The log entry
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated
+ */
+static bool process_render(mistral_buffer *text, const void *item)
+{
+    const mistral_log *log_entry = item;
+    return mistral_buffer_printf(text,
+                                 "\"process\":{"
+                                 "\"pid\":%" PRId64 ","
+                                 "\"command\":\"",
+                                 log_entry->pid) &&
+           mistral_json_escape(text, log_entry->command) &&
+           mistral_buffer_printf(text, "\",\"file\":\"") &&
+           mistral_json_escape(text, log_entry->file) &&
+           mistral_buffer_printf(text, "\",");
+}
+
+static mistral_cache rule_cache = MISTRAL_CACHE_INITIALIZER(FRAGMENT_CACHE_SLOTS, rule_key,
+                                                            rule_render);
+static mistral_cache job_cache = MISTRAL_CACHE_INITIALIZER(FRAGMENT_CACHE_SLOTS, job_key,
+                                                           job_render);
+static mistral_cache process_cache = MISTRAL_CACHE_INITIALIZER(FRAGMENT_CACHE_SLOTS, process_key,
+                                                               process_render);
+
+/* Consecutive records are usually logged in the same second and always share
+ * the same action line for a day so both are cached. Like the fragment caches
+ * these are only used by one thread.
+ */
+#define SECONDS_PER_DAY 86400
+
+static bool timestamp_valid = false;
+static time_t timestamp_second;
+static char timestamp_text[sizeof("YYYY-MM-DDTHH:MI:SS")];
+static bool action_valid = false;
+static int64_t action_day;
+static mistral_buffer action_line[CONTRACT_MAX];
+
+/*
+ * put_digits
+ *
+ * Write a non-negative number as a fixed number of decimal digits, padded
+ * with leading zeros.
+ *
+ * Parameters:
+ *   dest   - Where to write the digits
+ *   value  - The number to write
+ *   digits - The number of digits to write
+ *
+ * Returns:
+ *   void
+ */
+static void put_digits(char *dest, unsigned int value, unsigned int digits)
+{
+    while (digits--) {
+        dest[digits] = '0' + value % 10;
+        value /= 10;
     }
-    size_t len = strlen(string);
-
-    char *escaped = calloc(1, (2 * len + 1) * sizeof(char));
-    char *p, *q;
-    if (escaped) {
-        for (p = (char *)string, q = escaped; *p; p++, q++) {
-            switch (*p) {
-            case '"':
-                *q++ = '\\';
-                *q = '"';
-                break;
-            case '\\':
-                *q++ = '\\';
-                *q = '\\';
-                break;
-            case '\b':
-                *q++ = '\\';
-                *q = 'b';
-                break;
-            case '\f':
-                *q++ = '\\';
-                *q = 'f';
-                break;
-            case '\n':
-                *q++ = '\\';
-                *q = 'n';
-                break;
-            case '\r':
-                *q++ = '\\';
-                *q = 'r';
-                break;
-            case '\t':
-                *q++ = '\\';
-                *q = 't';
-                break;
-            default:
-                *q = *p;
-                break;
+}
+
+/*
+ * action_update
+ *
+ * Render the _bulk action line used for each contract type on a given day.
+ * These only change when date based index names are used and the date rolls
+ * over. When writing to a data stream every action is a create.
+ *
+ * Parameters:
+ *   day  - The number of days since the epoch
+ *   date - The date in YYYY-MM-DD format
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated
+ */
+static bool action_update(int64_t day, const char *date)
+{
+    if (action_valid && (day == action_day || !index_use_date_format)) {
+        return true;
+    }
+
+    /* Data streams only accept create operations, which also avoid the
+     * version lookup needed to index a document.
+     */
+    if (data_stream) {
+        static const char create[] = "{\"create\":{}}\n";
+        for (size_t i = 0; i < CONTRACT_MAX; i++) {
+            mistral_buffer_reset(&action_line[i]);
+            if (!mistral_buffer_append(&action_line[i], create, sizeof(create) - 1)) {
+                mistral_err("Could not allocate memory for log index\n");
+                return false;
             }
         }
-        /* Memory was allocated with calloc so string is already null terminated */
-        char *small_escaped = realloc(escaped, q - escaped + 1);
-        if (small_escaped) {
-            return small_escaped;
+        action_day = day;
+        action_valid = true;
+        return true;
+    }
+
+    for (size_t i = 0; i < CONTRACT_MAX; i++) {
+        char doc_type[sizeof(",\"_type\":\"throttle\"")]; /* Max possible len */
+        bool res;
+
+        if (es_version >= 6) {
+            strcpy(doc_type, ",\"_type\":\"_doc\"");
         } else {
-            return escaped;
+            sprintf(doc_type, ",\"_type\":\"%s\"", mistral_contract_name[i]);
         }
+
+        mistral_buffer_reset(&action_line[i]);
+        if (index_use_date_format) {
+            /* Date based index naming */
+            res = mistral_buffer_printf(&action_line[i], "{\"index\":{\"_index\":\"%s-%s\"%s}}\n",
+                                        es_index, date, doc_type);
+        } else {
+            /* Write to index alias, allow rollover to sort this out */
+            res = mistral_buffer_printf(&action_line[i], "{\"index\":{\"_index\":\"%s\"%s}}\n",
+                                        es_index, doc_type);
+        }
+        if (!res) {
+            mistral_err("Could not allocate memory for log index\n");
+            action_valid = false;
+            return false;
+        }
+    }
+
+    action_day = day;
+    action_valid = true;
+    return true;
+}
+
+/*
+ * timestamp_update
+ *
+ * Render a time as an ISO-8601 UTC timestamp (%FT%T) into timestamp_text and
+ * make sure the cached action lines are for the same day. Nothing is done if
+ * the time is in the same second as the previous call.
+ *
+ * The date is calculated directly from the number of days since the epoch
+ * using the proleptic Gregorian calendar rather than calling gmtime_r.
+ *
+ * Parameters:
+ *   seconds - The time in seconds since the epoch
+ *
+ * Returns:
+ *   true on success
+ *   false otherwise
+ */
+static bool timestamp_update(time_t seconds)
+{
+    if (timestamp_valid && seconds == timestamp_second) {
+        return true;
+    }
+
+    int64_t day = seconds / SECONDS_PER_DAY;
+    int64_t secs = seconds % SECONDS_PER_DAY;
+    if (secs < 0) {
+        secs += SECONDS_PER_DAY;
+        day--;
+    }
+
+    /* Convert days since 1970-01-01 to a civil date, counting in 400 year
+     * eras that start on 0000-03-01 so leap days fall at the end of a year.
+     */
+    int64_t z = day + 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    int64_t doe = z - era * 146097;
+    int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int64_t mp = (5 * doy + 2) / 153;
+    int64_t mday = doy - (153 * mp + 2) / 5 + 1;
+    int64_t month = mp < 10 ? mp + 3 : mp - 9;
+    int64_t year = yoe + era * 400 + (month <= 2);
+
+    if (year < 0 || year > 9999) {
+        mistral_err("Unable to calculate UTC time for log message: %ld\n", (long)seconds);
+        return false;
+    }
+
+    char *t = timestamp_text;
+    put_digits(t, year, 4);
+    t[4] = '-';
+    put_digits(t + 5, month, 2);
+    t[7] = '-';
+    put_digits(t + 8, mday, 2);
+    t[10] = 'T';
+    put_digits(t + 11, secs / 3600, 2);
+    t[13] = ':';
+    put_digits(t + 14, secs / 60 % 60, 2);
+    t[16] = ':';
+    put_digits(t + 17, secs % 60, 2);
+    t[19] = '\0';
+
+    char date[sizeof("YYYY-MM-DD")];
+    memcpy(date, t, sizeof(date) - 1);
+    date[sizeof(date) - 1] = '\0';
+
+    if (!action_update(day, date)) {
+        timestamp_valid = false;
+        return false;
+    }
+
+    timestamp_second = seconds;
+    timestamp_valid = true;
+    return true;
+}
+
+/*
+ * log_serialise
+ *
+ * Append the _bulk action line and document for a single log entry to a
+ * buffer.
+ *
+ * Elasticsearch 5.3.0 appears to treat dates inserted into date fields
+ * as seconds since epoch as long ints rather than dates even with a
+ * date mapping defined. Therefore we must use a string representation
+ * for the date. Again while Elasticsearch should cope with time zones
+ * in practice it seems that every timestamp must be in the same time
+ * zone for searches to work as expected. Logstash uses zulu time format
+ * (UTC) into a field named "@timestamp" therefore we will do the same
+ * as this should maximise compatibility.
+ *
+ * Parameters:
+ *   buffer    - The buffer to append to
+ *   log_entry - The log entry to serialise
+ *
+ * Returns:
+ *   true on success
+ *   false otherwise
+ */
+static bool log_serialise(mistral_buffer *buffer, const mistral_log *log_entry)
+{
+    if (!timestamp_update(log_entry->epoch.tv_sec)) {
+        return false;
+    }
+
+    const mistral_buffer *action = &action_line[log_entry->contract_type];
+    if (!mistral_buffer_append(buffer, action->data, action->len)) {
+        mistral_err("Could not allocate memory for log index\n");
+        return false;
+    }
+
+    /* Milliseconds are rounded so can reach 1000, keep that visible as before */
+    uint32_t millis = (uint32_t)((log_entry->microseconds / 1000.0f) + 0.5f);
+    char stamp[sizeof("{\"@timestamp\": \"YYYY-MM-DDTHH:MI:SS.mmm\",")];
+    bool res;
+
+    if (millis < 1000) {
+        static const char prefix[] = "{\"@timestamp\": \"";
+        char *p = stamp;
+        memcpy(p, prefix, sizeof(prefix) - 1);
+        p += sizeof(prefix) - 1;
+        memcpy(p, timestamp_text, sizeof(timestamp_text) - 1);
+        p += sizeof(timestamp_text) - 1;
+        *p++ = '.';
+        put_digits(p, millis, 3);
+        p += 3;
+        memcpy(p, "Z\",", 3);
+        p += 3;
+        res = mistral_buffer_append(buffer, stamp, p - stamp);
     } else {
-        return NULL;
+        res = mistral_buffer_printf(buffer, "{\"@timestamp\": \"%s.%03" PRIu32 "Z\",",
+                                    timestamp_text, millis);
     }
+
+    /* The rule, job and process objects are copied from pre-rendered fragments
+     * so only the per record values need to be formatted here.
+     */
+    const mistral_cache_entry *rule = mistral_cache_get(&rule_cache, log_entry);
+    const mistral_cache_entry *job = mistral_cache_get(&job_cache, log_entry);
+    const mistral_cache_entry *process = mistral_cache_get(&process_cache, log_entry);
+
+    res = res && rule && job && process &&
+          mistral_buffer_append(buffer, rule->text, rule->text_len) &&
+          mistral_buffer_append(buffer, job->text, job->text_len) &&
+          mistral_buffer_append(buffer, process->text, process->text_len) &&
+          mistral_buffer_printf(buffer,
+                                "\"cpu-id\":%" PRIu32 ","
+                                "\"mpi-world-rank\":%" PRId32
+                                "},"
+                                "%s"
+                                "%s"
+                                "%s"
+                                "\"value\":%" PRIu64
+                                "}\n",
+                                log_entry->cpu,
+                                log_entry->mpi_rank,
+                                (custom_variables) ? "\"environment\":{" : "",
+                                (custom_variables) ? custom_variables : "",
+                                (custom_variables) ? "}," : "",
+                                log_entry->measured);
+
+    if (!res) {
+        mistral_err("Could not allocate memory for log entry\n");
+    }
+    return res;
+}
+
+/*
+ * es_block_add_record
+ *
+ * Add a log entry to a data block that will be streamed. The block takes
+ * ownership of the log entry.
+ *
+ * Parameters:
+ *   block     - The data block being built
+ *   log_entry - The log entry to add
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated
+ */
+static bool es_block_add_record(es_block *block, mistral_log *log_entry)
+{
+    if (block->docs >= block->records_size) {
+        size_t new_size = block->records_size ? block->records_size * 2 : 256;
+        mistral_log **new_records = realloc(block->records, new_size * sizeof(mistral_log *));
+        if (!new_records) {
+            return false;
+        }
+        block->records = new_records;
+        block->records_size = new_size;
+    }
+    block->records[block->docs++] = log_entry;
+    return true;
+}
+
+/*
+ * es_block_doc
+ *
+ * Find the serialised action line and document for a single document in a
+ * data block. When streaming the document is serialised again into a shared
+ * buffer which is only valid until the next call.
+ *
+ * Parameters:
+ *   block - The data block
+ *   doc   - The index of the document
+ *   len   - Pointer to where the length of the document will be stored
+ *
+ * Returns:
+ *   A pointer to the document or NULL on error
+ */
+static const char *es_block_doc(const es_block *block, size_t doc, size_t *len)
+{
+    if (block->records) {
+        mistral_buffer_reset(&doc_buffer);
+        if (!log_serialise(&doc_buffer, block->records[doc])) {
+            return NULL;
+        }
+        *len = doc_buffer.len;
+        return doc_buffer.data;
+    }
+    *len = block->offset[doc + 1] - block->offset[doc];
+    return block->body.data + block->offset[doc];
+}
+
+/*
+ * request_claim
+ *
+ * Add a document from the block being sent to a request.
+ *
+ * Parameters:
+ *   request - The request being built
+ *   doc     - The index of the document in the block
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated
+ */
+static bool request_claim(es_request *request, size_t doc)
+{
+    if (request->docs >= request->doc_size) {
+        size_t new_size = request->doc_size ? request->doc_size * 2 : 256;
+        size_t *new_doc = realloc(request->doc, new_size * sizeof(size_t));
+        if (!new_doc) {
+            mistral_err("Could not allocate memory for request\n");
+            return false;
+        }
+        request->doc = new_doc;
+        request->doc_size = new_size;
+    }
+    request->doc[request->docs++] = doc;
+    return true;
+}
+
+/*
+ * item_result
+ *
+ * Act on the outcome of a single document reported in a _bulk response. The
+ * items in the response are in the same order as the documents in the request.
+ *
+ * Documents rejected because Elasticsearch is overloaded (429) are marked to
+ * be sent again. Documents that can never be indexed as they stand, usually
+ * due to a mapping error (400 or 404), are written to the dead letter file if
+ * one was specified. Anything else is logged and counted as a failure.
+ *
+ * Parameters:
+ *   request - The request the response belongs to
+ *
+ * Returns:
+ *   void
+ */
+static void item_result(es_request *request)
+{
+    bulk_parser *parser = &request->parser;
+    es_block *block = request->block;
+
+    if (parser->items >= request->docs) {
+        return;
+    }
+    size_t doc = request->doc[parser->items++];
+
+    if (parser->status >= 200 && parser->status < 300) {
+        return;
+    }
+
+    if (parser->status == 429 ||
+        strcmp(parser->type, "es_rejected_execution_exception") == 0)
+    {
+        block->retry[doc] = true;
+        block->retries++;
+        return;
+    }
+
+    if (dead_letter && (parser->status == 400 || parser->status == 404)) {
+        size_t len;
+        const char *data = es_block_doc(block, doc, &len);
+        if (data && fwrite(data, 1, len, dead_letter) == len) {
+            block->dead++;
+            return;
+        }
+        mistral_err("Could not write to dead letter file: %s\n", strerror(errno));
+    }
+
+    mistral_err("Could not index document: %ld %s %s\n", parser->status,
+                parser->type[0] ? parser->type : "unknown", parser->reason);
+    block->failed++;
+}
+
+/*
+ * parser_append
+ *
+ * Add a character to the string or literal currently being parsed. Values
+ * longer than the parser buffer are truncated.
+ *
+ * Parameters:
+ *   parser - The response parser
+ *   c      - The character to add
+ *
+ * Returns:
+ *   void
+ */
+static void parser_append(bulk_parser *parser, char c)
+{
+    if (parser->value_len < PARSER_VALUE_LEN - 1) {
+        parser->value[parser->value_len++] = c;
+    }
+}
+
+/*
+ * parser_copy
+ *
+ * Copy the string or literal that has just been parsed, truncating it if
+ * necessary.
+ *
+ * Parameters:
+ *   dest   - Where to copy the value
+ *   size   - The size of dest
+ *   parser - The response parser
+ *
+ * Returns:
+ *   void
+ */
+static void parser_copy(char *dest, size_t size, const bulk_parser *parser)
+{
+    size_t len = (parser->value_len < size) ? parser->value_len : size - 1;
+    memcpy(dest, parser->value, len);
+    dest[len] = '\0';
+}
+
+/*
+ * parser_value
+ *
+ * Handle a complete string or literal from a _bulk response. Inside an object
+ * this is either a key, which is remembered for its level, or the value of the
+ * latest key. Only the handful of values needed to find the outcome of each
+ * item are kept.
+ *
+ * Parameters:
+ *   request - The request the response belongs to
+ *
+ * Returns:
+ *   void
+ */
+static void parser_value(es_request *request)
+{
+    bulk_parser *parser = &request->parser;
+    unsigned int depth = parser->depth;
+
+    parser->value[parser->value_len] = '\0';
+
+    if (depth > PARSER_MAX_DEPTH || parser->container[depth] != '{') {
+        return;
+    }
+
+    if (!parser->after_colon) {
+        parser_copy(parser->key[depth], PARSER_KEY_LEN, parser);
+        return;
+    }
+    parser->after_colon = false;
+
+    const char *key = parser->key[depth];
+    if (depth == 1 && strcmp(key, "errors") == 0) {
+        /* Nothing else in the response is of interest if every item worked */
+        parser->done = (strcmp(parser->value, "false") == 0);
+    } else if (parser->in_items && depth == 4 && strcmp(key, "status") == 0) {
+        parser->status = strtol(parser->value, NULL, 10);
+    } else if (parser->in_items && depth == 5 && strcmp(parser->key[4], "error") == 0) {
+        if (strcmp(key, "type") == 0) {
+            parser_copy(parser->type, PARSER_TYPE_LEN, parser);
+        } else if (strcmp(key, "reason") == 0) {
+            parser_copy(parser->reason, PARSER_VALUE_LEN, parser);
+        }
+    }
+}
+
+/*
+ * parser_char
+ *
+ * Feed a single character of a _bulk response to the incremental parser. The
+ * parser tracks just enough of the JSON structure to find the "errors" flag
+ * and the "status" and "error" of each entry in the "items" array.
+ *
+ * Parameters:
+ *   request - The request the response belongs to
+ *   c       - The next character of the response
+ *
+ * Returns:
+ *   void
+ */
+static void parser_char(es_request *request, char c)
+{
+    bulk_parser *parser = &request->parser;
+
+    if (parser->in_string) {
+        if (parser->escape) {
+            parser->escape = false;
+            parser_append(parser, c);
+        } else if (c == '\\') {
+            parser->escape = true;
+        } else if (c == '"') {
+            parser->in_string = false;
+            parser_value(request);
+        } else {
+            parser_append(parser, c);
+        }
+        return;
+    }
+
+    if (parser->in_literal) {
+        if (c != ',' && c != '}' && c != ']' && c != ' ' && c != '\t' && c != '\r' &&
+            c != '\n')
+        {
+            parser_append(parser, c);
+            return;
+        }
+        parser->in_literal = false;
+        parser_value(request);
+    }
+
+    switch (c) {
+    case '"':
+        parser->in_string = true;
+        parser->value_len = 0;
+        break;
+    case ':':
+        parser->after_colon = true;
+        break;
+    case ',':
+        parser->after_colon = false;
+        break;
+    case '{':
+    case '[':
+        parser->depth++;
+        if (parser->depth <= PARSER_MAX_DEPTH) {
+            parser->container[parser->depth] = c;
+            parser->key[parser->depth][0] = '\0';
+        }
+        parser->after_colon = false;
+        if (parser->depth == 2 && c == '[' && strcmp(parser->key[1], "items") == 0) {
+            parser->in_items = true;
+        } else if (parser->in_items && parser->depth == 3 && c == '{') {
+            parser->status = 0;
+            parser->type[0] = '\0';
+            parser->reason[0] = '\0';
+        }
+        break;
+    case '}':
+    case ']':
+        if (parser->in_items && parser->depth == 3 && c == '}') {
+            item_result(request);
+        } else if (parser->in_items && parser->depth == 2) {
+            parser->in_items = false;
+        }
+        if (parser->depth > 0) {
+            parser->depth--;
+        }
+        parser->after_colon = false;
+        break;
+    case ' ':
+    case '\t':
+    case '\r':
+    case '\n':
+        break;
+    default:
+        parser->in_literal = true;
+        parser->value_len = 0;
+        parser_append(parser, c);
+        break;
+    }
+}
+
+/*
+ * write_callback
+ *
+ * Function to be called by CURL with the response to a _bulk request. The
+ * response is parsed as it arrives rather than being saved so that the
+ * outcome of each document can be handled without holding the whole response
+ * in memory.
+ *
+ * Parameters:
+ *   data     - A pointer to the returned data
+ *   size     - Size of a data element
+ *   nmemb    - Number of elements to "write"
+ *   userdata - A pointer to the request the response belongs to
+ *
+ * Returns:
+ *   Number of bytes successfully processed
+ */
+static size_t write_callback(void *data, size_t size, size_t nmemb, void *userdata)
+{
+    size_t data_len = size * nmemb;
+    es_request *request = (es_request *)userdata;
+    const char *p = data;
+
+    for (size_t i = 0; i < data_len && !request->parser.done; i++) {
+        parser_char(request, p[i]);
+    }
+
+    return data_len;
+}
+
+/*
+ * request_fill
+ *
+ * Serialise the next unsent document of the block into the staging buffer of
+ * a streamed request, unless the request has reached the configured size or
+ * document count limits.
+ *
+ * Parameters:
+ *   request - The request being streamed
+ *
+ * Returns:
+ *   true if a document was added to the request
+ *   false if the request is complete or an error occurred, in which case
+ *         request->abort is set
+ */
+static bool request_fill(es_request *request)
+{
+    es_block *block = request->block;
+
+    request->staging_pos = 0;
+    mistral_buffer_reset(&request->staging);
+
+    /* After a rewind the documents already in the request are sent again */
+    if (request->replay < request->docs) {
+        if (!log_serialise(&request->staging, block->records[request->doc[request->replay]])) {
+            request->abort = true;
+            return false;
+        }
+        request->replay++;
+        request->bytes += request->staging.len;
+        return true;
+    }
+
+    if (block->next_doc >= block->docs || (bulk_max_docs && request->docs >= bulk_max_docs)) {
+        return false;
+    }
+
+    if (!log_serialise(&request->staging, block->records[block->next_doc])) {
+        request->abort = true;
+        return false;
+    }
+
+    /* The document is left for the next request if it would take this one over
+     * the size limit, a request always contains at least one document.
+     */
+    if (request->docs && request->bytes + request->staging.len > bulk_max_bytes) {
+        mistral_buffer_reset(&request->staging);
+        return false;
+    }
+
+    if (!request_claim(request, block->next_doc)) {
+        request->abort = true;
+        return false;
+    }
+    block->next_doc++;
+    request->replay++;
+    request->bytes += request->staging.len;
+    if (compress_level) {
+        compress_in_total += request->staging.len;
+    }
+    return true;
+}
+
+/*
+ * read_callback
+ *
+ * Function called by CURL to get the next part of a streamed _bulk request.
+ * Documents are serialised one at a time as CURL asks for more data, and
+ * compressed straight into the CURL buffer if required, so the full request
+ * is never held in memory. The request is sent with chunked transfer encoding
+ * as its size is not known in advance.
+ *
+ * Parameters:
+ *   buffer   - Where to copy the data
+ *   size     - Size of a data element
+ *   nitems   - Number of elements that will fit in the buffer
+ *   userdata - A pointer to the request being sent
+ *
+ * Returns:
+ *   Number of bytes written to the buffer, 0 at the end of the request or
+ *   CURL_READFUNC_ABORT on error
+ */
+static size_t read_callback(char *buffer, size_t size, size_t nitems, void *userdata)
+{
+    es_request *request = (es_request *)userdata;
+    size_t space = size * nitems;
+    size_t written = 0;
+
+    while (written < space && !request->finished && !request->abort) {
+        size_t pending = request->staging.len - request->staging_pos;
+
+        if (!compress_level) {
+            if (pending == 0) {
+                if (request->eof || !request_fill(request)) {
+                    request->eof = true;
+                    break;
+                }
+                continue;
+            }
+            size_t len = (pending < space - written) ? pending : space - written;
+            memcpy(buffer + written, request->staging.data + request->staging_pos, len);
+            request->staging_pos += len;
+            written += len;
+            continue;
+        }
+
+        if (pending == 0 && !request->eof) {
+            request->eof = !request_fill(request);
+            continue;
+        }
+
+        z_stream *zstream = &request->zstream;
+        zstream->next_in = (Bytef *)request->staging.data + request->staging_pos;
+        zstream->avail_in = pending;
+        zstream->next_out = (Bytef *)buffer + written;
+        zstream->avail_out = space - written;
+
+        int ret = deflate(zstream, request->eof ? Z_FINISH : Z_NO_FLUSH);
+
+        request->staging_pos += pending - zstream->avail_in;
+        written = space - zstream->avail_out;
+
+        if (ret == Z_STREAM_END) {
+            compress_out_total += zstream->total_out;
+            request->finished = true;
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            mistral_err("Could not compress request body: %s\n",
+                        zstream->msg ? zstream->msg : "unknown error");
+            request->abort = true;
+        }
+    }
+
+    return request->abort ? CURL_READFUNC_ABORT : written;
+}
+
+/*
+ * seek_callback
+ *
+ * Function called by CURL if a streamed request has to be sent again from the
+ * start, for example if a reused connection has been closed by the server.
+ *
+ * Parameters:
+ *   userdata - A pointer to the request being sent
+ *   offset   - The offset to seek to
+ *   origin   - Where the offset is measured from
+ *
+ * Returns:
+ *   CURL_SEEKFUNC_OK on success
+ *   CURL_SEEKFUNC_CANTSEEK if the seek was not back to the start
+ *   CURL_SEEKFUNC_FAIL on error
+ */
+static int seek_callback(void *userdata, curl_off_t offset, int origin)
+{
+    es_request *request = (es_request *)userdata;
+
+    if (offset != 0 || origin != SEEK_SET) {
+        return CURL_SEEKFUNC_CANTSEEK;
+    }
+
+    request->replay = 0;
+    request->bytes = 0;
+    request->staging_pos = 0;
+    mistral_buffer_reset(&request->staging);
+    request->eof = false;
+    request->finished = false;
+
+    if (compress_level && deflateReset(&request->zstream) != Z_OK) {
+        return CURL_SEEKFUNC_FAIL;
+    }
+    return CURL_SEEKFUNC_OK;
 }
 
 /*
@@ -293,6 +1422,14 @@ void mistral_startup(mistral_plugin *plugin, int argc, char *argv[])
      /* Returning without setting plug-in type will cause a clean exit */
 
    #define CERT_DIR_OPTION_CODE 1001
+   #define BULK_BYTES_OPTION_CODE 1002
+   #define BULK_DOCS_OPTION_CODE 1003
+   #define CONNECTIONS_OPTION_CODE 1004
+   #define DEAD_LETTER_OPTION_CODE 1005
+   #define RETRIES_OPTION_CODE 1006
+   #define COMPRESS_OPTION_CODE 1007
+   #define STREAM_OPTION_CODE 1008
+   #define DATA_STREAM_OPTION_CODE 1009
 
     static const struct option options[] = {
         {"index", required_argument, NULL, 'i'},
@@ -309,6 +1446,14 @@ void mistral_startup(mistral_plugin *plugin, int argc, char *argv[])
         {"date", no_argument, NULL, 'd'},
         {"cert-dir", required_argument, NULL, CERT_DIR_OPTION_CODE},
         {"cert-path", required_argument, NULL, 'c'},
+        {"bulk-bytes", required_argument, NULL, BULK_BYTES_OPTION_CODE},
+        {"bulk-docs", required_argument, NULL, BULK_DOCS_OPTION_CODE},
+        {"connections", required_argument, NULL, CONNECTIONS_OPTION_CODE},
+        {"dead-letter", required_argument, NULL, DEAD_LETTER_OPTION_CODE},
+        {"retries", required_argument, NULL, RETRIES_OPTION_CODE},
+        {"compress", optional_argument, NULL, COMPRESS_OPTION_CODE},
+        {"stream", no_argument, NULL, STREAM_OPTION_CODE},
+        {"data-stream", no_argument, NULL, DATA_STREAM_OPTION_CODE},
         {0, 0, 0, 0},
     };
 
@@ -324,6 +1469,7 @@ void mistral_startup(mistral_plugin *plugin, int argc, char *argv[])
     mode_t new_mode = 0;
     const char *cert_path = NULL;
     const char *cert_dir = NULL;
+    const char *dead_letter_file = NULL;
 
     while ((opt = getopt_long(argc, argv, "e:h:i:m:p:P:sku:v:V:dc:", options, NULL)) != -1) {
         switch (opt) {
@@ -380,35 +1526,30 @@ void mistral_startup(mistral_plugin *plugin, int argc, char *argv[])
             username = optarg;
             break;
         case 'v': {
-            char *var_val = NULL;
-            char *new_var = NULL;
+            const char *var_val = NULL;
+            mistral_buffer new_var = MISTRAL_BUFFER_INITIALIZER;
 
             if (optarg[0] != '\0' && strspn(optarg, VALID_NAME_CHARS) == strlen(optarg)) {
-                var_val = elasticsearch_escape(getenv(optarg));
+                var_val = getenv(optarg);
                 if (var_val == NULL || var_val[0] == '\0') {
-                    var_val = strdup("N/A");
-                }
-                if (var_val == NULL) {
-                    mistral_err("Could not allocate memory for environment variable value %s\n",
-                                optarg);
-                    return;
+                    var_val = "N/A";
                 }
             } else {
                 mistral_err("Invalid environment variable name %s\n", optarg);
             }
-            if (asprintf(&new_var, "%s%s\"%s\":\"%s\"",
-                         (custom_variables) ? custom_variables : "",
-                         (custom_variables) ? "," : "",
-                         optarg,
-                         var_val) < 0)
+            if (!mistral_buffer_printf(&new_var, "%s%s\"%s\":\"",
+                                       (custom_variables) ? custom_variables : "",
+                                       (custom_variables) ? "," : "",
+                                       optarg) ||
+                !mistral_json_escape(&new_var, var_val) ||
+                !mistral_buffer_append(&new_var, "\"", 1))
             {
                 mistral_err("Could not allocate memory for environment variable %s\n", optarg);
-                free(var_val);
+                mistral_buffer_free(&new_var);
                 return;
             }
-            free(var_val);
             free(custom_variables);
-            custom_variables = new_var;
+            custom_variables = mistral_buffer_release(&new_var);
             break;
         }
         case 'V': {
@@ -420,15 +1561,66 @@ void mistral_startup(mistral_plugin *plugin, int argc, char *argv[])
             }
             break;
         }
-        case 'd': {
-            index_use_date_format = true;
+        case 'd': {
+            index_use_date_format = true;
+            break;
+        }
+        case 'c':
+            cert_path = optarg;
+            break;
+        case CERT_DIR_OPTION_CODE:
+            cert_dir = optarg;
+            break;
+        case BULK_BYTES_OPTION_CODE: {
+            unsigned long long value;
+            if (!mistral_parse_count("bulk-bytes", optarg, 1, SIZE_MAX, &value)) {
+                return;
+            }
+            bulk_max_bytes = (size_t)value;
+            break;
+        }
+        case BULK_DOCS_OPTION_CODE: {
+            unsigned long long value;
+            if (!mistral_parse_count("bulk-docs", optarg, 0, SIZE_MAX, &value)) {
+                return;
+            }
+            bulk_max_docs = (size_t)value;
+            break;
+        }
+        case CONNECTIONS_OPTION_CODE: {
+            unsigned long long value;
+            if (!mistral_parse_count("connections", optarg, 1, CONNECTIONS_MAX, &value)) {
+                return;
+            }
+            connections = (unsigned long)value;
+            break;
+        }
+        case DEAD_LETTER_OPTION_CODE:
+            dead_letter_file = optarg;
+            break;
+        case RETRIES_OPTION_CODE: {
+            unsigned long long value;
+            if (!mistral_parse_count("retries", optarg, 0, RETRIES_MAX, &value)) {
+                return;
+            }
+            max_retries = (unsigned long)value;
+            break;
+        }
+        case COMPRESS_OPTION_CODE: {
+            unsigned long long value = Z_BEST_SPEED;
+            if (optarg && !mistral_parse_count("compress", optarg, Z_BEST_SPEED,
+                                               Z_BEST_COMPRESSION, &value))
+            {
+                return;
+            }
+            compress_level = (int)value;
             break;
         }
-        case 'c':
-            cert_path = optarg;
+        case STREAM_OPTION_CODE:
+            stream = true;
             break;
-        case CERT_DIR_OPTION_CODE:
-            cert_dir = optarg;
+        case DATA_STREAM_OPTION_CODE:
+            data_stream = true;
             break;
         default:
             usage(argv[0]);
@@ -436,6 +1628,11 @@ void mistral_startup(mistral_plugin *plugin, int argc, char *argv[])
         }
     }
 
+    if (data_stream && (es_version < 7 || index_use_date_format)) {
+        mistral_err("Data streams require Elasticsearch 7.9 or later and cannot be used with date based index names\n");
+        return;
+    }
+
     log_file_ptr = &(plugin->error_log);
 
     /* Error file is opened/created by the first error_msg 
@@ -476,6 +1673,15 @@ void mistral_startup(mistral_plugin *plugin, int argc, char *argv[])
         }
     }
 
+    if (dead_letter_file) {
+        dead_letter = fopen(dead_letter_file, "a");
+        if (!dead_letter) {
+            mistral_err("Could not open dead letter file %s: %s\n", dead_letter_file,
+                        strerror(errno));
+            return;
+        }
+    }
+
     if (curl_global_init(CURL_GLOBAL_ALL)) {
         mistral_err("Could not initialise curl\n");
         return;
@@ -530,6 +1736,13 @@ void mistral_startup(mistral_plugin *plugin, int argc, char *argv[])
 
     /* All our queries are going to be using JSON so save a custom header */
     headers = curl_slist_append(headers, "Content-Type: application/json");
+    if (compress_level) {
+        headers = curl_slist_append(headers, "Content-Encoding: gzip");
+    }
+    if (stream) {
+        /* Do not wait for a 100 Continue response before sending a streamed body */
+        headers = curl_slist_append(headers, "Expect:");
+    }
     if (!set_curl_option(CURLOPT_HTTPHEADER, headers)) {
         mistral_shutdown();
         return;
@@ -541,7 +1754,14 @@ void mistral_startup(mistral_plugin *plugin, int argc, char *argv[])
      * option values, therefore we use global variables for both the URL and
      * authentication strings.
      */
-    if (asprintf(&url, "%s://%s:%d/_bulk", protocol, host, port) < 0) {
+    /* A data stream is named in the URL so every action can be a bare create */
+    int url_len;
+    if (data_stream) {
+        url_len = asprintf(&url, "%s://%s:%d/%s/_bulk", protocol, host, port, es_index);
+    } else {
+        url_len = asprintf(&url, "%s://%s:%d/_bulk", protocol, host, port);
+    }
+    if (url_len < 0) {
         mistral_err("Could not allocate memory for connection URL\n");
         return;
     }
@@ -571,6 +1791,65 @@ void mistral_startup(mistral_plugin *plugin, int argc, char *argv[])
             return;
         }
     }
+    /* Each concurrent _bulk request needs its own handle, these are copies of
+     * the fully configured handle above that are driven by a single multi
+     * handle so their connections can be kept alive and reused.
+     */
+    multihandle = curl_multi_init();
+    if (!multihandle) {
+        mistral_err("Could not initialise curl multi handle\n");
+        return;
+    }
+
+    if (curl_multi_setopt(multihandle, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)connections) != CURLM_OK) {
+        mistral_err("Could not set curl connection limit\n");
+        return;
+    }
+
+    requests = calloc(connections, sizeof(es_request));
+    if (!requests) {
+        mistral_err("Could not allocate memory for curl requests\n");
+        return;
+    }
+
+    for (unsigned long i = 0; i < connections; i++) {
+        es_request *request = &requests[i];
+        request->handle = curl_easy_duphandle(easyhandle);
+        if (!request->handle) {
+            mistral_err("Could not initialise curl handle\n");
+            return;
+        }
+        if (compress_level) {
+            /* Adding 16 to the window bits selects a gzip rather than zlib wrapper */
+            if (deflateInit2(&request->zstream, compress_level, Z_DEFLATED, 15 + 16, 8,
+                             Z_DEFAULT_STRATEGY) != Z_OK)
+            {
+                mistral_err("Could not initialise compression\n");
+                return;
+            }
+            request->zstream_init = true;
+        }
+        if (curl_easy_setopt(request->handle, CURLOPT_ERRORBUFFER, request->error) != CURLE_OK ||
+            curl_easy_setopt(request->handle, CURLOPT_WRITEDATA, request) != CURLE_OK ||
+            curl_easy_setopt(request->handle, CURLOPT_PRIVATE, request) != CURLE_OK)
+        {
+            mistral_err("Could not set up curl handle\n");
+            return;
+        }
+        if (stream) {
+            /* Without a known body size CURL will use chunked transfer encoding */
+            if (curl_easy_setopt(request->handle, CURLOPT_POST, 1l) != CURLE_OK ||
+                curl_easy_setopt(request->handle, CURLOPT_READFUNCTION, read_callback) != CURLE_OK ||
+                curl_easy_setopt(request->handle, CURLOPT_READDATA, request) != CURLE_OK ||
+                curl_easy_setopt(request->handle, CURLOPT_SEEKFUNCTION, seek_callback) != CURLE_OK ||
+                curl_easy_setopt(request->handle, CURLOPT_SEEKDATA, request) != CURLE_OK)
+            {
+                mistral_err("Could not set up curl handle for streaming\n");
+                return;
+            }
+        }
+    }
+
     /* Returning after this point indicates success */
     plugin->type = OUTPUT_PLUGIN;
 }
@@ -594,6 +1873,25 @@ void mistral_exit(void)
         mistral_received_data_end(0, false);
     }
 
+    if (requests) {
+        for (unsigned long i = 0; i < connections; i++) {
+            if (requests[i].handle) {
+                curl_easy_cleanup(requests[i].handle);
+            }
+            if (requests[i].zstream_init) {
+                deflateEnd(&requests[i].zstream);
+            }
+            mistral_buffer_free(&requests[i].compressed);
+            mistral_buffer_free(&requests[i].staging);
+            free(requests[i].doc);
+        }
+        free(requests);
+    }
+
+    if (multihandle) {
+        curl_multi_cleanup(multihandle);
+    }
+
     if (easyhandle) {
         curl_easy_cleanup(easyhandle);
     }
@@ -604,6 +1902,28 @@ void mistral_exit(void)
 
     curl_global_cleanup();
 
+    if (compress_in_total) {
+        mistral_err("Compressed %" PRIu64 " bytes of bulk data to %" PRIu64
+                    " bytes, a ratio of %.1f:1\n", compress_in_total, compress_out_total,
+                    (double)compress_in_total / (compress_out_total ? compress_out_total : 1));
+    }
+
+    if (failed_total || dead_letter_total) {
+        mistral_err("%" PRIu64 " documents could not be indexed, %" PRIu64
+                    " were written to the dead letter file\n", failed_total, dead_letter_total);
+    }
+
+    if (dead_letter) {
+        fclose(dead_letter);
+    }
+
+    mistral_buffer_free(&doc_buffer);
+    mistral_cache_free(&rule_cache);
+    mistral_cache_free(&job_cache);
+    mistral_cache_free(&process_cache);
+    for (size_t i = 0; i < CONTRACT_MAX; i++) {
+        mistral_buffer_free(&action_line[i]);
+    }
     free(custom_variables);
     free(auth);
     free(url);
@@ -646,9 +1966,13 @@ void mistral_received_log(mistral_log *log_entry)
  * mistral_received_data_end
  *
  * Function called whenever an end of data block message is received. At this
- * point run through the linked list of log entries we have seen and send them
- * to Elasticsearch. Remove each log_entry from the linked list as they are
- * processed and destroy them.
+ * point run through the linked list of log entries we have seen and build the
+ * bulk request body. Remove each log_entry from the linked list as they are
+ * processed and destroy them. The body is then handed to the plug-in framework
+ * to be sent to Elasticsearch by mistral_sink_deliver.
+ *
+ * When streaming, the log entries are handed over as they are and are only
+ * serialised as they are sent.
  *
  * No special handling of data block number errors is done beyond the message
  * logged by the main plug-in framework. Instead this function will simply
@@ -670,207 +1994,437 @@ void mistral_received_data_end(uint64_t block_num, bool block_error)
     UNUSED(block_num);
     UNUSED(block_error);
 
-    char *data = NULL;
+    if (!log_list_head) {
+        return;
+    }
+
+    es_block *block = calloc(1, sizeof(es_block));
+    if (!block) {
+        mistral_err("Could not allocate memory for data block\n");
+        mistral_shutdown();
+        return;
+    }
 
     mistral_log *log_entry = log_list_head;
 
-    /* Elasticsearch 5.3.0 appears to treat dates inserted into date fields
-     * as seconds since epoch as long ints rather than dates even with a
-     * date mapping defined. Therefore we must use a string representation
-     * for the date. Again while Elasticsearch should cope with time zones
-     * in practice it seems that every timestamp must be in the same time
-     * zone for searches to work as expected. Logstash uses zulu time format
-     * (UTC) into a field named "@timestamp" therefore we will do the same
-     * as this should maximise compatibility.
-     */
-    size_t date_len = sizeof("YYYY-MM-DD"); /* strftime format = %F */
-    size_t ts_len = sizeof("YYYY-MM-DDTHH:MI:SS"); /* = %FT%T */
-    size_t type_len = sizeof(",\"_type\":\"throttle\""); /* Max possible len */
-    char strdate[date_len];
-    char strts[ts_len];
-    char doc_type[type_len];
-    struct tm utc_time;
+    while (log_entry) {
+        log_list_head = log_entry->forward;
+        remque(log_entry);
+
+        if (stream) {
+            /* Log entries are serialised as they are sent */
+            if (!es_block_add_record(block, log_entry)) {
+                mistral_err("Could not allocate memory for data block\n");
+                mistral_destroy_log_entry(log_entry);
+                es_block_destroy(block);
+                mistral_shutdown();
+                return;
+            }
+        } else {
+            if (!es_block_mark(block)) {
+                mistral_err("Could not allocate memory for data block\n");
+                mistral_destroy_log_entry(log_entry);
+                es_block_destroy(block);
+                mistral_shutdown();
+                return;
+            }
+            if (!log_serialise(&block->body, log_entry)) {
+                mistral_destroy_log_entry(log_entry);
+                es_block_destroy(block);
+                mistral_shutdown();
+                return;
+            }
+            block->docs++;
+            mistral_destroy_log_entry(log_entry);
+        }
 
-    if (es_version >= 6) {
-        strcpy(doc_type, ",\"_type\":\"_doc\"");
+        log_entry = log_list_head;
     }
+    log_list_tail = NULL;
 
-    while (log_entry) {
-        /* Calculate UTC time */
-        if (gmtime_r(&log_entry->epoch.tv_sec, &utc_time) == NULL) {
-            mistral_err("Unable to calculate UTC time for log message: %ld\n",
-                        log_entry->epoch.tv_sec);
-            free(data);
-            mistral_shutdown();
-            return;
+    if (!stream && !es_block_mark(block)) {
+        mistral_err("Could not allocate memory for data block\n");
+        es_block_destroy(block);
+        mistral_shutdown();
+        return;
+    }
+
+    if (!mistral_sink_submit(block)) {
+        es_block_destroy(block);
+        mistral_shutdown();
+    }
+}
+
+/*
+ * request_start
+ *
+ * Take the next unsent documents from a data block, as many as will fit in a
+ * single _bulk request within the configured size and document count limits,
+ * and add the request to the multi handle. A single document that exceeds the
+ * size limit is always sent in a request of its own.
+ *
+ * When streaming only the first document is serialised here, further
+ * documents are added by read_callback as the request is sent.
+ *
+ * Parameters:
+ *   request - An idle request structure to use
+ *   block   - The data block being sent
+ *
+ * Returns:
+ *   true on success
+ *   false otherwise
+ */
+static bool request_start(es_request *request, es_block *block)
+{
+    request->block = block;
+    request->docs = 0;
+    request->bytes = 0;
+    request->error[0] = '\0';
+    memset(&request->parser, 0, sizeof(bulk_parser));
+
+    if (stream) {
+        request->replay = 0;
+        request->eof = false;
+        request->finished = false;
+        request->abort = false;
+        if (compress_level && deflateReset(&request->zstream) != Z_OK) {
+            mistral_err("Could not prepare compressed request body\n");
+            return false;
+        }
+        if (!request_fill(request)) {
+            return false;
         }
+    } else {
+        size_t first_doc = block->next_doc;
+        size_t start = block->offset[first_doc];
 
-        strftime(strts, ts_len, "%FT%T", &utc_time);
+        do {
+            if (!request_claim(request, block->next_doc++)) {
+                return false;
+            }
+        } while (block->next_doc < block->docs &&
+                 block->offset[block->next_doc + 1] - start <= bulk_max_bytes &&
+                 (bulk_max_docs == 0 || request->docs < bulk_max_docs));
 
-        /* Several fields  must be JSON escaped */
-        char *command = elasticsearch_escape(log_entry->command);
-        char *file = elasticsearch_escape(log_entry->file);
-        char *path = elasticsearch_escape(log_entry->path);
-        char *fstype = elasticsearch_escape(log_entry->fstype);
-        char *fsname = elasticsearch_escape(log_entry->fsname);
-        char *fshost = elasticsearch_escape(log_entry->fshost);
-        const char *job_gid = (log_entry->job_group_id[0] == 0) ? "N/A" : log_entry->job_group_id;
-        const char *job_id = (log_entry->job_id[0] == 0) ? "N/A" : log_entry->job_id;
-        char *new_data = NULL;
+        const char *post = block->body.data + start;
+        size_t post_len = block->offset[block->next_doc] - start;
 
-        if (es_version < 6) {
-            sprintf(doc_type, ",\"_type\":\"%s\"",
-                    mistral_contract_name[log_entry->contract_type]);
+        if (compress_level) {
+            if (!mistral_compress(&request->zstream, &request->compressed, post, post_len)) {
+                return false;
+            }
+            compress_in_total += post_len;
+            compress_out_total += request->compressed.len;
+            post = request->compressed.data;
+            post_len = request->compressed.len;
         }
 
-        char *index_definition = NULL;
-        int res = 0;
-        if (index_use_date_format) {
-            /* Date based index naming */
-            strftime(strdate, date_len, "%F", &utc_time);
-            res = asprintf(&index_definition, "{\"index\":{\"_index\":\"%s-%s\"%s}}\n", es_index, strdate, doc_type);
-        } else {
-            /* Write to index alias, allow rollover to sort this out */
-            res = asprintf(&index_definition, "{\"index\":{\"_index\":\"%s\"%s}}\n", es_index, doc_type);
+        /* The body is not null terminated at the end of a chunk so the size must
+         * be set explicitly.
+         */
+        if (curl_easy_setopt(request->handle, CURLOPT_POSTFIELDS, post) != CURLE_OK ||
+            curl_easy_setopt(request->handle, CURLOPT_POSTFIELDSIZE_LARGE,
+                             (curl_off_t)post_len) != CURLE_OK)
+        {
+            mistral_err("Could not set curl option: %s\n", request->error);
+            return false;
         }
-        if (index_definition == NULL || res == -1) {
-            mistral_err("Could not allocate memory for log index\n");
-            free(data);
-            free(path);
-            free(file);
-            free(command);
-            mistral_shutdown();
-            return;
+    }
+
+    if (curl_multi_add_handle(multihandle, request->handle) != CURLM_OK) {
+        mistral_err("Could not add curl request\n");
+        return false;
+    }
+
+    request->busy = true;
+    return true;
+}
+
+/*
+ * request_finish
+ *
+ * Check the result of a completed _bulk request and make its handle available
+ * for reuse. The outcome of each document has already been handled as the
+ * response was parsed. If Elasticsearch rejected the whole request because it
+ * is overloaded every document in it is marked to be sent again.
+ *
+ * Parameters:
+ *   request - The request that has completed
+ *   result  - The result code of the transfer
+ *
+ * Returns:
+ *   true if the request was sent and a response received
+ *   false otherwise
+ */
+static bool request_finish(es_request *request, CURLcode result)
+{
+    es_block *block = request->block;
+    long http_code = 0;
+
+    curl_multi_remove_handle(multihandle, request->handle);
+    request->busy = false;
+
+    if (result == CURLE_HTTP_RETURNED_ERROR) {
+        curl_easy_getinfo(request->handle, CURLINFO_RESPONSE_CODE, &http_code);
+        if (http_code == 429) {
+            for (size_t i = 0; i < request->docs; i++) {
+                block->retry[request->doc[i]] = true;
+            }
+            block->retries += request->docs;
+            return true;
         }
+    }
 
-        if (asprintf(&new_data,
-                     "%s"
-                     "%s"
-                     "{\"@timestamp\": \"%s.%03" PRIu32 "Z\","
-                     "\"rule\":{"
-                     "\"scope\":\"%s\","
-                     "\"type\":\"%s\","
-                     "\"label\":\"%s\","
-                     "\"measurement\":\"%s\","
-                     "\"calltype\":\"%s\","
-                     "\"path\":\"%s\","
-                     "\"fstype\":\"%s\","
-                     "\"fsname\":\"%s\","
-                     "\"fshost\":\"%s\","
-                     "\"threshold\":%" PRIu64 ","
-                     "\"timeframe\":%" PRIu64 ","
-                     "\"size-min\":%" PRIu64 ","
-                     "\"size-max\":%" PRIu64
-                     "},"
-                     "\"job\":{"
-                     "\"host\":\"%s\","
-                     "\"job-group-id\":\"%s\","
-                     "\"job-id\":\"%s\""
-                     "},"
-                     "\"process\":{"
-                     "\"pid\":%" PRId64 ","
-                     "\"command\":\"%s\","
-                     "\"file\":\"%s\","
-                     "\"cpu-id\":%" PRIu32 ","
-                     "\"mpi-world-rank\":%" PRId32
-                     "},"
-                     "%s"
-                     "%s"
-                     "%s"
-                     "\"value\":%" PRIu64
-                     "}\n",
-                     (data) ? data : "",
-                     index_definition,
-                     strts,
-                     (uint32_t)((log_entry->microseconds / 1000.0f) + 0.5f),
-                     mistral_scope_name[log_entry->scope],
-                     mistral_contract_name[log_entry->contract_type],
-                     log_entry->label,
-                     mistral_measurement_name[log_entry->measurement],
-                     log_entry->call_type_names,
-                     path,
-                     fstype,
-                     fsname,
-                     fshost,
-                     log_entry->threshold,
-                     log_entry->timeframe,
-                     log_entry->size_min,
-                     log_entry->size_max,
-                     log_entry->hostname,
-                     job_gid,
-                     job_id,
-                     log_entry->pid,
-                     command,
-                     file,
-                     log_entry->cpu,
-                     log_entry->mpi_rank,
-                     (custom_variables) ? "\"environment\":{" : "",
-                     (custom_variables) ? custom_variables : "",
-                     (custom_variables) ? "}," : "",
-                     log_entry->measured) < 0)
-        {
-            mistral_err("Could not allocate memory for log entry\n");
-            free(data);
-            free(fshost);
-            free(fsname);
-            free(fstype);
-            free(path);
-            free(file);
-            free(command);
-            mistral_shutdown();
-            return;
+    if (result != CURLE_OK) {
+        /* Depending on the version of curl used during compilation
+         * the error buffer may not be populated. If this is the case, look up
+         * the less detailed error based on return code instead.
+         */
+        mistral_err("Could not run curl query: %s\n",
+                    (request->error[0] != '\0') ? request->error : curl_easy_strerror(result));
+        return false;
+    }
+
+    if (!request->parser.done && request->parser.items < request->docs) {
+        mistral_err("No result received for %zu documents\n",
+                    request->docs - request->parser.items);
+        block->failed += request->docs - request->parser.items;
+    }
+    return true;
+}
+
+/*
+ * block_send
+ *
+ * Send every document in a data block to Elasticsearch. The block is split
+ * into _bulk requests limited by --bulk-bytes and --bulk-docs which are sent
+ * over up to --connections concurrent connections. The result of every
+ * request is collected before this function returns.
+ *
+ * Parameters:
+ *   block - The data block to send
+ *
+ * Returns:
+ *   true if every request received a response, the outcome of each document
+ *        is recorded in the block
+ *   false otherwise
+ */
+static bool block_send(es_block *block)
+{
+    int running = 0;
+    bool success = true;
+
+    block->next_doc = 0;
+    block->retries = 0;
+    block->dead = 0;
+    block->failed = 0;
+    if (!block->retry) {
+        block->retry = calloc(block->docs, sizeof(bool));
+        if (!block->retry) {
+            mistral_err("Could not allocate memory for data block\n");
+            return false;
         }
-        free(data);
-        free(fshost);
-        free(fsname);
-        free(fstype);
-        free(path);
-        free(file);
-        free(command);
-        data = new_data;
+    }
 
-        log_list_head = log_entry->forward;
-        remque(log_entry);
-        mistral_destroy_log_entry(log_entry);
+    do {
+        /* Keep every connection busy while there are documents left to send */
+        for (unsigned long i = 0; i < connections && success && block->next_doc < block->docs; i++) {
+            if (!requests[i].busy && !request_start(&requests[i], block)) {
+                success = false;
+            }
+        }
 
-        log_entry = log_list_head;
+        if (curl_multi_perform(multihandle, &running) != CURLM_OK) {
+            mistral_err("Could not run curl query\n");
+            success = false;
+            break;
+        }
+
+        CURLMsg *msg;
+        int queued;
+        while ((msg = curl_multi_info_read(multihandle, &queued))) {
+            if (msg->msg == CURLMSG_DONE) {
+                es_request *request = NULL;
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&request);
+                if (request && !request_finish(request, msg->data.result)) {
+                    success = false;
+                }
+            }
+        }
+
+        if (running && curl_multi_wait(multihandle, NULL, 0, 1000, NULL) != CURLM_OK) {
+            mistral_err("Could not wait for curl query\n");
+            success = false;
+            break;
+        }
+    } while (running || (success && block->next_doc < block->docs));
+
+    /* Abandon any requests still in progress after an error */
+    for (unsigned long i = 0; i < connections; i++) {
+        if (requests[i].busy) {
+            curl_multi_remove_handle(multihandle, requests[i].handle);
+            requests[i].busy = false;
+        }
     }
-    log_list_tail = NULL;
 
-    if (data) {
-        if (!set_curl_option(CURLOPT_POSTFIELDS, data)) {
-            mistral_shutdown();
-            return;
+    if (dead_letter && block->dead && fflush(dead_letter) != 0) {
+        mistral_err("Could not write to dead letter file: %s\n", strerror(errno));
+    }
+    return success;
+}
+
+/*
+ * block_retry
+ *
+ * Create a new data block containing only the documents of an existing block
+ * that have been marked to be sent again. When streaming the log entries are
+ * moved to the new block.
+ *
+ * Parameters:
+ *   block - The data block that was sent
+ *
+ * Returns:
+ *   A pointer to the new data block or NULL on error
+ */
+static es_block *block_retry(es_block *block)
+{
+    es_block *retry = calloc(1, sizeof(es_block));
+    if (!retry) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < block->docs; i++) {
+        if (!block->retry[i]) {
+            continue;
+        }
+        if (block->records) {
+            if (!es_block_add_record(retry, block->records[i])) {
+                es_block_destroy(retry);
+                return NULL;
+            }
+            block->records[i] = NULL;
+        } else {
+            if (!es_block_mark(retry) ||
+                !mistral_buffer_append(&retry->body, block->body.data + block->offset[i],
+                                       block->offset[i + 1] - block->offset[i]))
+            {
+                es_block_destroy(retry);
+                return NULL;
+            }
+            retry->docs++;
         }
+    }
+
+    if (!block->records && !es_block_mark(retry)) {
+        es_block_destroy(retry);
+        return NULL;
+    }
+    return retry;
+}
+
+/*
+ * mistral_sink_deliver
+ *
+ * Function called by the plug-in framework with each data block built by
+ * mistral_received_data_end. This is called on the sink worker thread, if
+ * it is running, so that the next data block can be parsed while this one is
+ * sent to Elasticsearch.
+ *
+ * Documents rejected because Elasticsearch is overloaded are sent again after
+ * an increasing delay, up to --retries times. Only documents that still could
+ * not be indexed are counted as failures.
+ *
+ * If Elasticsearch cannot be reached the mistral_shutdown flag is set to true
+ * which will cause the plug-in to exit cleanly.
+ *
+ * Parameters:
+ *   block - The data block to send. Freed by this function.
+ *
+ * Returns:
+ *   void
+ */
+void mistral_sink_deliver(void *block)
+{
+    es_block *data = block;
+    unsigned long delay = RETRY_DELAY_INITIAL;
 
-        struct saved_resp full_response = {0, NULL};
-        if (!set_curl_option(CURLOPT_WRITEDATA, &full_response)) {
+    for (unsigned long attempt = 0; ; attempt++) {
+        if (!block_send(data)) {
             mistral_shutdown();
-            return;
+            break;
         }
 
-        CURLcode ret = curl_easy_perform(easyhandle);
-        if (ret != CURLE_OK) {
-            /* Depending on the version of curl used during compilation
-             * curl_error may not be populated. If this is the case, look up
-             * the less detailed error based on return code instead.
-             */
-            mistral_err("Could not run curl query: %s\n",
-                        (curl_error[0] != '\0') ? curl_error : curl_easy_strerror(ret));
-            mistral_shutdown();
+        failed_total += data->failed;
+        dead_letter_total += data->dead;
+
+        if (data->failed || data->dead) {
+            mistral_err("%zu documents could not be indexed, %zu were written to the dead letter file\n",
+                        data->failed, data->dead);
         }
 
-        if (full_response.body) {
-            char *success = strstr(full_response.body, "\"errors\":false");
-            if (!success) {
-                mistral_shutdown();
-                mistral_err("Could not index data\n");
-                mistral_err("Data sent:\n%s\n", data);
-                mistral_err("Response received:\n%s\n", full_response.body);
-            }
+        if (data->retries == 0) {
+            break;
         }
+
+        if (attempt == max_retries) {
+            mistral_err("%zu documents were still rejected after %lu retries\n",
+                        data->retries, max_retries);
+            failed_total += data->retries;
+            break;
+        }
+
+        es_block *retry = block_retry(data);
+        if (!retry) {
+            mistral_err("Could not allocate memory for data block\n");
+            mistral_shutdown();
+            break;
+        }
+        es_block_destroy(data);
+        data = retry;
+
+        struct timespec wait = {delay / 1000, (delay % 1000) * 1000000};
+        while (nanosleep(&wait, &wait) == -1 && errno == EINTR);
+        delay = (delay * 2 < RETRY_DELAY_MAX) ? delay * 2 : RETRY_DELAY_MAX;
+    }
+    es_block_destroy(data);
+}
+
+/*
+ * mistral_sink_discard
+ *
+ * Function called by the plug-in framework with each data block still queued
+ * for the sink worker thread once the plug-in is shutting down after an error.
+ *
+ * Parameters:
+ *   block - The data block to discard. Freed by this function.
+ *
+ * Returns:
+ *   void
+ */
+void mistral_sink_discard(void *block)
+{
+    es_block_destroy(block);
+}
+
+/*
+ * mistral_flush
+ *
+ * Function called by the plug-in framework part way through a data block once
+ * the configured flush interval has elapsed or enough data has been received.
+ * Send the log entries seen so far to Elasticsearch so that a large data block
+ * is not held in memory in full and data becomes visible sooner.
+ *
+ * Parameters:
+ *   block_num   - The data block number currently being received.
+ *
+ * Returns:
+ *   void
+ */
+void mistral_flush(uint64_t block_num)
+{
+    if (log_list_head) {
+        mistral_received_data_end(block_num, false);
     }
-    free(data);
 }
 
 /*
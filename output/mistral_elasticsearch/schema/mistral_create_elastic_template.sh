@@ -35,6 +35,10 @@ OPTIONS:
                     e.g. mistral-YYYY-MM-DD
                     rather than numerical
                     e.g. mistral-0000N
+  -D, --data-stream Create a data stream template and a lifecycle policy that
+                    rolls the data stream over daily, for use with the
+                    plug-in's --data-stream option. Requires Elasticsearch 7.9
+                    or later.
 EOF
     exit 1
 }
@@ -132,6 +136,9 @@ function main() {
             -d | --date)
                 format="date"
                 ;;
+            -D | --data-stream)
+                format="datastream"
+                ;;
             *)
                 usage "Invalid option ${1}"
                 ;;
@@ -165,7 +172,34 @@ function main() {
         ver=$(echo "$outval" | grep number | sed -e 's/.*number" : "\([0-9]\+\).*/\1/g')
     fi
 
-    if [[ "$format" == "date" ]]; then
+    if [[ "$format" == "datastream" ]]; then
+        if [[ ! -f "$scriptdir/mappings_datastream_$ver.x.json" ]]; then
+            >&2 echo Error, data streams are not supported by Elasticsearch version $ver
+            exit 2
+        fi
+
+        outval=$($curl_cmd -s $auth -XPUT -H "Content-Type: application/json" \
+            $protocol://$host:$port/_ilm/policy/$database -d \
+            "$(cat $scriptdir/ilm_policy_$ver.x.json)" \
+            )
+        retval=$?
+
+        if [[ "$retval" -ne 0 ]]; then
+            >&2 echo Error, curl exited with error code $retval
+            exit $retval
+        elif [[ "${outval:0:9}" = '{"error":' ]]; then
+            >&2 echo Error, ElasticSearch query failed:
+            echo "$outval" | >&2 sed -e 's/.*reason":\([^}]*\)}.*/  \1/;s/,/\n  /g'
+            exit 2
+        fi
+
+        echo Lifecycle policy \"$database\" created successfully
+
+        outval=$($curl_cmd -s $auth -XPUT -H "Content-Type: application/json" \
+            $protocol://$host:$port/_index_template/$database -d \
+            "$(sed -e "s/mistral/$database/" $scriptdir/mappings_datastream_$ver.x.json)" \
+            )
+    elif [[ "$format" == "date" ]]; then
         outval=$($curl_cmd -s $auth -XPUT -H "Content-Type: application/json" \
             $protocol://$host:$port/_template/$database -d \
             "$(sed -e "s/mistral/$database/" $scriptdir/mappings_$ver.x.json)" \
@@ -11,6 +11,8 @@
 #include <sys/types.h>          /* open, umask */
 #include <sys/time.h>           /* gettimeofday */
 
+#include "mistral_buffer.h"
+#include "mistral_json.h"
 #include "mistral_plugin.h"
 #include "mistral_fluentbit_tcp.h"
 
@@ -83,82 +85,6 @@ static void usage(const char *name)
                 "\n");
 }
 
-/*
- * fluentbit_escape
- *
- * Fluent Bit uses JSON output which uses double quotes to delimit strings.
- * There are several special characters that must be escaped using a single
- * backslash character inside these strings.
- *
- * This function allocates twice as much memory as is required to copy the
- * passed string and then copies the string character by character escaping
- * the common characters that need special treatment as they are encountered.
- * Once the copy is complete the memory is reallocated to reduce wastage.
- *
- * Parameters:
- *   string - The string whose content needs to be escaped
- *
- * Returns:
- *   A pointer to newly allocated memory containing the escaped string or
- *   NULL on error
- */
-static char *fluentbit_escape(const char *string)
-{
-    if (!string) {
-        return NULL;
-    }
-    size_t len = strlen(string);
-
-    char *escaped = calloc(1, (2 * len + 1) * sizeof(char));
-    char *p, *q;
-    if (escaped) {
-        for (p = (char *)string, q = escaped; *p; p++, q++) {
-            switch (*p) {
-            case '"':
-                *q++ = '\\';
-                *q = '"';
-                break;
-            case '\\':
-                *q++ = '\\';
-                *q = '\\';
-                break;
-            case '\b':
-                *q++ = '\\';
-                *q = 'b';
-                break;
-            case '\f':
-                *q++ = '\\';
-                *q = 'f';
-                break;
-            case '\n':
-                *q++ = '\\';
-                *q = 'n';
-                break;
-            case '\r':
-                *q++ = '\\';
-                *q = 'r';
-                break;
-            case '\t':
-                *q++ = '\\';
-                *q = 't';
-                break;
-            default:
-                *q = *p;
-                break;
-            }
-        }
-        /* Memory was allocated with calloc so string is already null terminated */
-        char *small_escaped = realloc(escaped, q - escaped + 1);
-        if (small_escaped) {
-            return small_escaped;
-        } else {
-            return escaped;
-        }
-    } else {
-        return NULL;
-    }
-}
-
 /*
  * mistral_startup
  *
@@ -244,35 +170,30 @@ void mistral_startup(mistral_plugin *plugin, int argc, char *argv[])
             break;
         }
         case 'v': {
-            char *var_val = NULL;
-            char *new_var = NULL;
+            const char *var_val = NULL;
+            mistral_buffer new_var = MISTRAL_BUFFER_INITIALIZER;
 
             if (optarg[0] != '\0' && strspn(optarg, VALID_NAME_CHARS) == strlen(optarg)) {
-                var_val = fluentbit_escape(getenv(optarg));
+                var_val = getenv(optarg);
                 if (var_val == NULL || var_val[0] == '\0') {
-                    var_val = strdup("N/A");
-                }
-                if (var_val == NULL) {
-                    mistral_err("Could not allocate memory for environment variable value %s\n",
-                                optarg);
-                    return;
+                    var_val = "N/A";
                 }
             } else {
                 mistral_err("Invalid environment variable name %s\n", optarg);
             }
-            if (asprintf(&new_var, "%s%s\"%s\":\"%s\"",
-                         (custom_variables) ? custom_variables : "",
-                         (custom_variables) ? "," : "",
-                         optarg,
-                         var_val) < 0)
+            if (!mistral_buffer_printf(&new_var, "%s%s\"%s\":\"",
+                                       (custom_variables) ? custom_variables : "",
+                                       (custom_variables) ? "," : "",
+                                       optarg) ||
+                !mistral_json_escape(&new_var, var_val) ||
+                !mistral_buffer_append(&new_var, "\"", 1))
             {
                 mistral_err("Could not allocate memory for environment variable %s\n", optarg);
-                free(var_val);
+                mistral_buffer_free(&new_var);
                 return;
             }
-            free(var_val);
             free(custom_variables);
-            custom_variables = new_var;
+            custom_variables = mistral_buffer_release(&new_var);
             break;
         }
         }
@@ -482,7 +403,7 @@ void mistral_received_data_end(uint64_t block_num, bool block_error)
     UNUSED(block_num);
     UNUSED(block_error);
 
-    char *data = NULL;
+    mistral_buffer data = MISTRAL_BUFFER_INITIALIZER;
     struct timeval time_elapsed;
     mistral_log *log_entry = log_list_head;
     uint64_t calculated_timeframe = 0;
@@ -499,7 +420,7 @@ void mistral_received_data_end(uint64_t block_num, bool block_error)
         if (localtime_r(&log_entry->epoch.tv_sec, &utc_time) == NULL) {
             mistral_err("Unable to calculate UTC time for log message: %ld\n",
                         log_entry->epoch.tv_sec);
-            free(data);
+            mistral_buffer_free(&data);
             mistral_shutdown();
             return;
         }
@@ -514,17 +435,9 @@ void mistral_received_data_end(uint64_t block_num, bool block_error)
         strftime(strdate, date_len, "%F", &utc_time);
         strftime(strts, ts_len, "%FT%T", &utc_time);
 
-        /* Command and filename must be JSON escaped */
-        char *command = fluentbit_escape(log_entry->command);
-        char *file = fluentbit_escape(log_entry->file);
-        char *path = fluentbit_escape(log_entry->path);
-        char *fstype = fluentbit_escape(log_entry->fstype);
-        char *fsname = fluentbit_escape(log_entry->fsname);
-        char *fshost = fluentbit_escape(log_entry->fshost);
         const char *job_gid = (log_entry->job_group_id[0] == 0) ? "N/A" : log_entry->job_group_id;
         const char *job_id = (log_entry->job_id[0] == 0) ? "N/A" : log_entry->job_id;
         char generic_id[MISTRAL_MAX_BUFFER_SIZE];
-        char *new_data = NULL;
 
         /* We create the content for the genereric_id. The generic_id is used for queries when the
          * there is no job id present. The requirement for the content of the generic_id came from
@@ -532,7 +445,7 @@ void mistral_received_data_end(uint64_t block_num, bool block_error)
          */
         const char *user_name = mistral_user_name();
 
-        const char *simplified_command = mistral_simplify_command(command);
+        const char *simplified_command = mistral_simplify_command(log_entry->command);
         if (!simplified_command) {
             simplified_command = "unknown";
         }
@@ -543,75 +456,67 @@ void mistral_received_data_end(uint64_t block_num, bool block_error)
             mistral_err("The generic_id has been truncated\n");
         }
 
-        if (asprintf(&new_data,
-                     "{\"timestamp\": \"%s.%03" PRIu32 "Z\","
-                     "\"rulescope\":\"%s\","
-                     "\"ruletype\":\"%s\","
-                     "\"rulelabel\":\"%s\","
-                     "\"rulemeasurement\":\"%s\","
-                     "\"rulecalltype\":\"%s\","
-                     "\"rulepath\":\"%s\","
-                     "\"fstype\":\"%s\","
-                     "\"fsname\":\"%s\","
-                     "\"fshost\":\"%s\","
-                     "\"rulethreshold\":%" PRIu64 ","
-                     "\"ruletimeframe\":%" PRIu64 ","
-                     "\"rulesizemin\":%" PRIu64 ","
-                     "\"rulesizemax\":%" PRIu64 ","
-                     "\"jobhost\":\"%s\","
-                     "\"jobgroupid\":\"%s\","
-                     "\"jobid\":\"%s\","
-                     "\"jobgenericid\":\"%s\""
-                     "%s"
-                     "%s"
-                     ","
-                     "\"value\":%" PRIu64
-                     "}\n",
-                     strts,
-                     (uint32_t)((log_entry->microseconds / 1000.0f) + 0.5f),
-                     mistral_scope_name[log_entry->scope],
-                     mistral_contract_name[log_entry->contract_type],
-                     log_entry->label,
-                     mistral_measurement_name[log_entry->measurement],
-                     log_entry->call_type_names,
-                     path,
-                     fstype,
-                     fsname,
-                     fshost,
-                     log_entry->threshold,
-                     calculated_timeframe,
-                     log_entry->size_min,
-                     log_entry->size_max,
-                     log_entry->hostname,
-                     job_gid,
-                     job_id,
-                     generic_id,
-                     (custom_variables) ? ", " : "",
-                     (custom_variables) ? custom_variables : "",
-                     log_entry->measured) < 0)
-
+        /* The path, file system fields and generic_id, which includes part of the command, are
+         * JSON escaped straight into the record */
+        mistral_buffer_reset(&data);
+        if (!mistral_buffer_printf(&data,
+                                   "{\"timestamp\": \"%s.%03" PRIu32 "Z\","
+                                   "\"rulescope\":\"%s\","
+                                   "\"ruletype\":\"%s\","
+                                   "\"rulelabel\":\"%s\","
+                                   "\"rulemeasurement\":\"%s\","
+                                   "\"rulecalltype\":\"%s\","
+                                   "\"rulepath\":\"",
+                                   strts,
+                                   (uint32_t)((log_entry->microseconds / 1000.0f) + 0.5f),
+                                   mistral_scope_name[log_entry->scope],
+                                   mistral_contract_name[log_entry->contract_type],
+                                   log_entry->label,
+                                   mistral_measurement_name[log_entry->measurement],
+                                   log_entry->call_type_names) ||
+            !mistral_json_escape(&data, log_entry->path) ||
+            !mistral_buffer_printf(&data, "\",\"fstype\":\"") ||
+            !mistral_json_escape(&data, log_entry->fstype) ||
+            !mistral_buffer_printf(&data, "\",\"fsname\":\"") ||
+            !mistral_json_escape(&data, log_entry->fsname) ||
+            !mistral_buffer_printf(&data, "\",\"fshost\":\"") ||
+            !mistral_json_escape(&data, log_entry->fshost) ||
+            !mistral_buffer_printf(&data,
+                                   "\","
+                                   "\"rulethreshold\":%" PRIu64 ","
+                                   "\"ruletimeframe\":%" PRIu64 ","
+                                   "\"rulesizemin\":%" PRIu64 ","
+                                   "\"rulesizemax\":%" PRIu64 ","
+                                   "\"jobhost\":\"%s\","
+                                   "\"jobgroupid\":\"%s\","
+                                   "\"jobid\":\"%s\","
+                                   "\"jobgenericid\":\"",
+                                   log_entry->threshold,
+                                   calculated_timeframe,
+                                   log_entry->size_min,
+                                   log_entry->size_max,
+                                   log_entry->hostname,
+                                   job_gid,
+                                   job_id) ||
+            !mistral_json_escape(&data, generic_id) ||
+            !mistral_buffer_printf(&data,
+                                   "\""
+                                   "%s"
+                                   "%s"
+                                   ","
+                                   "\"value\":%" PRIu64
+                                   "}\n",
+                                   (custom_variables) ? ", " : "",
+                                   (custom_variables) ? custom_variables : "",
+                                   log_entry->measured))
         {
             mistral_err("Could not allocate memory for log entry\n");
-            free(data);
-            free(fshost);
-            free(fsname);
-            free(fstype);
-            free(path);
-            free(file);
-            free(command);
+            mistral_buffer_free(&data);
             mistral_shutdown();
             return;
         }
-        free(data);
-        free(fshost);
-        free(fsname);
-        free(fstype);
-        free(path);
-        free(file);
-        free(command);
-        data = new_data;
 
-        mistral_fluentbit_send(&fluentbit_tcp_ctx, new_data, strlen(new_data));
+        mistral_fluentbit_send(&fluentbit_tcp_ctx, data.data, data.len);
 
         log_list_head = log_entry->forward;
         remque(log_entry);
@@ -621,7 +526,7 @@ void mistral_received_data_end(uint64_t block_num, bool block_error)
     }
     log_list_tail = NULL;
 
-    free(data);
+    mistral_buffer_free(&data);
 }
 
 /*
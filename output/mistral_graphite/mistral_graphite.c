@@ -4,112 +4,1256 @@
 #include <getopt.h>             /* getopt_long */
 #include <inttypes.h>           /* uint32_t, uint64_t */
 #include <netdb.h>              /* getaddrinfo, freeaddrinfo, gai_strerror */
-#include <search.h>             /* insque, remque */
+#include <poll.h>               /* poll */
 #include <stdbool.h>            /* bool */
 #include <stdio.h>              /* asprintf */
 #include <stdlib.h>             /* calloc, realloc, free */
 #include <string.h>             /* strerror_r */
-#include <sys/socket.h>         /* getaddrinfo, freeaddrinfo, gai_strerror, send */
+#include <sys/socket.h>         /* getaddrinfo, freeaddrinfo, gai_strerror, sendmsg */
 #include <sys/stat.h>           /* open, umask */
-#include <sys/types.h>          /* open, umask, getaddrinfo, freeaddrinfo, gai_strerror, send */
+#include <sys/types.h>          /* open, umask, getaddrinfo, freeaddrinfo, gai_strerror, sendmsg */
+#include <sys/uio.h>            /* struct iovec */
+#include <time.h>               /* clock_gettime */
 #include <unistd.h>             /* close */
 
+#include "mistral_buffer.h"     /* mistral_buffer */
+#include "mistral_cache.h"      /* mistral_cache */
 #include "mistral_plugin.h"
 
+/* When the connection to Graphite cannot be made, or is lost, a new connection
+ * is attempted after an increasing delay in milliseconds. Data is retained
+ * while the plug-in is disconnected, up to a limit set by --buffer-bytes.
+ */
+#define RECONNECT_DELAY_INITIAL 1000
+#define RECONNECT_DELAY_MAX 60000
+#define BUFFER_BYTES_DEFAULT (64 * 1024 * 1024)
+
+/* Time in milliseconds allowed for a connection to be made, for a block to be
+ * written to each destination before it is left to be sent with the next block
+ * and for any retained data to be written when the plug-in exits.
+ */
+#define CONNECT_TIMEOUT 5000
+#define SEND_TIMEOUT 1000
+#define EXIT_TIMEOUT 10000
+
+/* The number of retained blocks passed to each sendmsg call */
+#define SEND_IOV_MAX 64
+
+/* Metrics sent with the pickle protocol are grouped into length prefixed
+ * messages. Carbon refuses messages over 1MiB so a message is also ended once
+ * it passes PICKLE_MESSAGE_BYTES, well short of the limit.
+ */
+#define PICKLE_BATCH_DEFAULT 500
+#define PICKLE_BATCH_MAX 100000
+#define PICKLE_MESSAGE_BYTES (512 * 1024)
+
+/* Pickle protocol 2 opcodes used to build a list of (path, (timestamp, value))
+ * tuples
+ */
+#define PICKLE_PROTO "\x80\x02"
+#define PICKLE_EMPTY_LIST ']'
+#define PICKLE_MARK '('
+#define PICKLE_BINUNICODE 'X'
+#define PICKLE_BININT 'J'
+#define PICKLE_LONG1 '\x8a'
+#define PICKLE_TUPLE2 '\x86'
+#define PICKLE_APPENDS 'e'
+#define PICKLE_STOP '.'
+
+enum graphite_protocol {
+    PROTOCOL_PLAINTEXT,
+    PROTOCOL_PICKLE,
+    PROTOCOL_MAX
+};
+
+static const char *const protocol_name[] = {
+    [PROTOCOL_PLAINTEXT] = "plaintext",
+    [PROTOCOL_PICKLE] = "pickle",
+};
+
+/* Rendered metric path prefixes are cached. The rule cache holds everything
+ * from the instance name to the size range and the job cache holds the job IDs
+ * and host name, so only the CPU and MPI rank have to be formatted for each
+ * record. The caches are only used by the processing thread.
+ */
+#define PATH_CACHE_SLOTS 4096
+
+/* The start of each pickle message in a block and the number of metrics in it */
+typedef struct graphite_message {
+    size_t offset;
+    size_t metrics;
+} graphite_message;
+
+/* The metrics for a data block in the chosen protocol. Blocks waiting to be
+ * sent are kept in a queue in the order they were received.
+ */
+typedef struct graphite_block {
+    struct graphite_block *next;
+    mistral_buffer body;
+    size_t lines;
+    graphite_message *message;
+    size_t messages;
+    size_t message_size;
+} graphite_block;
+
+/* A carbon server metrics are sent to. Each destination has its own
+ * connection, reconnection schedule and queue of data waiting to be sent, all
+ * owned by the sink worker thread. The down flag is also read by the
+ * processing thread to route new metrics around a destination that cannot be
+ * reached.
+ */
+typedef struct graphite_destination {
+    char *host;
+    char *port;
+    char *instance;             /* NULL if not specified */
+    struct addrinfo *addrs;
+    struct addrinfo *connect_addr;  /* The address being connected to, if any */
+    uint64_t connect_deadline;
+    int fd;
+    uint64_t reconnect_at;
+    unsigned long reconnect_delay;
+    bool connect_failed;
+    bool down;
+    graphite_block *pending_head;
+    graphite_block *pending_tail;
+    size_t pending_offset;
+    size_t pending_bytes;
+    uint64_t dropped_lines;
+} graphite_destination;
+
+/* When metrics are sent to several destinations each metric path is assigned
+ * to one using the same consistent hash ring as carbon-relay's carbon_ch
+ * method, so the plug-in can send directly to a set of carbon-cache instances.
+ * Each destination is placed on the ring RING_REPLICAS times.
+ */
+#define RING_REPLICAS 100
+
+/* The result of trying to send the data queued for a destination */
+enum send_state {
+    SEND_DONE,                  /* Everything has been written */
+    SEND_WAIT,                  /* The socket must be writable, or connected, to continue */
+    SEND_BLOCKED,               /* Nothing can be done until the destination is reconnected */
+};
+
+typedef struct ring_entry {
+    uint32_t position;
+    size_t destination;
+} ring_entry;
+
 static FILE **log_file_ptr = NULL;
 
-static mistral_log *log_list_head = NULL;
-static mistral_log *log_list_tail = NULL;
-static int graphite_fd = -1;
-static char *schema = NULL;
+static mistral_record *record_list_head = NULL;
+static mistral_record *record_list_tail = NULL;
+static char *schema = NULL;
+static enum graphite_protocol protocol = PROTOCOL_PLAINTEXT;
+static size_t batch_size = PICKLE_BATCH_DEFAULT;
+static size_t buffer_bytes = BUFFER_BYTES_DEFAULT;
+
+static graphite_destination *destinations = NULL;
+static size_t destination_count = 0;
+static ring_entry *ring = NULL;
+static size_t ring_len = 0;
+static mistral_buffer metric_path = MISTRAL_BUFFER_INITIALIZER;
+
+/*
+ * usage
+ *
+ * Output a usage message via mistral_err.
+ *
+ * Parameters:
+ *   name   - A pointer to a string containing arg[0]
+ *
+ * Returns:
+ *   void
+ */
+static void usage(const char *name)
+{
+    /* This may be called before options have been processed so errors will go to stderr.
+     * While this is designed to be run with Mistral to make the messages understandable
+     * on a terminal add an explicit newline to each line.
+     */
+    mistral_err("Usage:\n"
+                "  %s [-i metric] [-h host] [-p port] [-e file] [-m octal-mode] [-4|-6]\n"
+                "     [--buffer-bytes=bytes] [--protocol=plaintext|pickle] [--batch-size=count]\n"
+                "     [--destination=host[:port[:instance]]...]\n",
+                name);
+    mistral_err("\n"
+                "  -4\n"
+                "     Use IPv4 only. This is the default behaviour.\n"
+                "\n"
+                "  -6\n"
+                "     Use IPv6 only.\n"
+                "\n"
+                "  --batch-size=count\n"
+                "     The maximum number of metrics sent in each message when using the\n"
+                "     pickle protocol. Defaults to 500.\n"
+                "\n"
+                "  --buffer-bytes=bytes\n"
+                "     The maximum amount of data retained while the plug-in is unable to\n"
+                "     send to Graphite, the oldest data is discarded once this is\n"
+                "     reached. Defaults to 67108864 (64MiB).\n"
+                "\n"
+                "  --destination=host[:port[:instance]]\n"
+                "     A carbon server to send metrics to. This option can be specified\n"
+                "     multiple times in which case each metric is sent to one destination\n"
+                "     chosen with the same consistent hashing as carbon-relay, falling\n"
+                "     back to the next destination on the hash ring if one is down. The\n"
+                "     instance names must match the carbon-relay DESTINATIONS setting.\n"
+                "     Cannot be used with --host or --port.\n"
+                "\n"
+                "  --error=file\n"
+                "  -e file\n"
+                "     Specify location for error log. If not specified all errors will\n"
+                "     be output on stderr and handled by Mistral error logging.\n"
+                "\n"
+                "  --host=hostname\n"
+                "  -h hostname\n"
+                "     The hostname of the Graphite server with which to establish a connection.\n"
+                "     If not specified the plug-in will default to \"localhost\".\n"
+                "\n"
+                "  --instance=metric\n"
+                "  -i metric\n"
+                "     Set the root metric node name the plug-in should create data under. This\n"
+                "     value can contain '.' characters to allow more precise classification\n"
+                "     of metrics.  Defaults to \"mistral\".\n"
+                "\n"
+                "  --mode=octal-mode\n"
+                "  -m octal-mode\n"
+                "     Permissions used to create the error log file specified by the -o\n"
+                "     option.\n"
+                "\n"
+                "  --port=port\n"
+                "  -p port\n"
+                "     Specifies the port to connect to on the Graphite server host.\n"
+                "     If not specified the plug-in will default to \"2003\", or \"2004\" when\n"
+                "     using the pickle protocol.\n"
+                "\n"
+                "  --protocol=plaintext|pickle\n"
+                "     The carbon protocol used to send metrics. The pickle protocol sends\n"
+                "     metrics in batches that are cheaper for carbon to receive. Defaults\n"
+                "     to \"plaintext\".\n"
+                "\n");
+}
+
+/*
+ * graphite_escape_append
+ *
+ * Graphite metrics will interpret both '.' and '/' characters as separators so
+ * if these characters occur within the data e.g. in the path or job ID they
+ * must be replaced. To be paranoid this function will replace '/' with ':' and
+ * any other non-alphanumeric, hyphen or underscore characters with hyphens.
+ *
+ * The escaped string is appended directly to the buffer.
+ *
+ * Parameters:
+ *   buffer - The buffer to append to
+ *   string - The string whose content needs to be escaped
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated
+ */
+static bool graphite_escape_append(mistral_buffer *buffer, const char *string)
+{
+    size_t len = strlen(string);
+    if (!mistral_buffer_reserve(buffer, len)) {
+        return false;
+    }
+
+    char *q = buffer->data + buffer->len;
+    for (const char *p = string; *p; p++) {
+        if (*p == '/') {
+            *q++ = ':';
+        } else if (!isalnum((unsigned char)*p) && *p != '_') {
+            *q++ = '-';
+        } else {
+            *q++ = *p;
+        }
+    }
+    *q = '\0';
+    buffer->len = q - buffer->data;
+
+    return true;
+}
+
+/*
+ * put_decimal
+ *
+ * Write a number in decimal. Formatting numbers is a large part of the cost
+ * of each metric so this is used in place of printf.
+ *
+ * Parameters:
+ *   dest  - Where to write the digits, there must be space for at least 20
+ *           characters
+ *   value - The number to write
+ *
+ * Returns:
+ *   A pointer to the character after the last digit written
+ */
+static char *put_decimal(char *dest, uint64_t value)
+{
+    char digits[20];
+    unsigned int len = 0;
+
+    do {
+        digits[sizeof(digits) - ++len] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+
+    memcpy(dest, digits + sizeof(digits) - len, len);
+    return dest + len;
+}
+
+/*
+ * decimal_append
+ *
+ * Append a number in decimal, followed by a separator, to a buffer.
+ *
+ * Parameters:
+ *   buffer    - The buffer to append to
+ *   value     - The number to write
+ *   sign      - Whether value holds a signed number
+ *   separator - The character written after the number, or '\0' for none
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated
+ */
+static bool decimal_append(mistral_buffer *buffer, uint64_t value, bool sign, char separator)
+{
+    if (!mistral_buffer_reserve(buffer, sizeof("-18446744073709551615 "))) {
+        return false;
+    }
+
+    char *q = buffer->data + buffer->len;
+    if (sign && (int64_t)value < 0) {
+        *q++ = '-';
+        value = -value;
+    }
+    q = put_decimal(q, value);
+    if (separator) {
+        *q++ = separator;
+    }
+    *q = '\0';
+    buffer->len = q - buffer->data;
+
+    return true;
+}
+
+/*
+ * now_ms
+ *
+ * Read the monotonic clock.
+ *
+ * Parameters:
+ *   void
+ *
+ * Returns:
+ *   The current time in milliseconds
+ */
+static uint64_t now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+/*
+ * graphite_connected
+ *
+ * Record that a connection to a destination has been established.
+ *
+ * Parameters:
+ *   dest - The destination that has been connected to
+ *
+ * Returns:
+ *   void
+ */
+static void graphite_connected(graphite_destination *dest)
+{
+    dest->connect_addr = NULL;
+    dest->reconnect_delay = RECONNECT_DELAY_INITIAL;
+    if (dest->connect_failed) {
+        mistral_err("Connected to %s:%s\n", dest->host, dest->port);
+        dest->connect_failed = false;
+    }
+    __atomic_store_n(&dest->down, false, __ATOMIC_RELAXED);
+}
+
+/*
+ * graphite_connect
+ *
+ * Start a non-blocking connection to a destination, trying each of its
+ * addresses in turn from the one given. A connection that does not complete
+ * immediately is left in progress to be finished by graphite_connect_check so
+ * the sink thread never waits on one destination while others have data to
+ * send. If no address is left the destination is marked as down and the next
+ * attempt is scheduled after an increasing delay.
+ *
+ * Parameters:
+ *   dest - The destination to connect to
+ *   addr - The first address to try
+ *
+ * Returns:
+ *   true if a connection was established or is in progress
+ *   false otherwise
+ */
+static bool graphite_connect(graphite_destination *dest, struct addrinfo *addr)
+{
+    for (struct addrinfo *curr = addr; curr != NULL; curr = curr->ai_next) {
+        char buf[256];
+        int fd = socket(curr->ai_family, curr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        curr->ai_protocol);
+        if (fd == -1) {
+            mistral_err("Unable to create socket: %s%s\n",
+                        strerror_r(errno, buf, sizeof buf),
+                        curr->ai_next ? " - Trying next address" : "");
+            continue;
+        }
+
+        if (connect(fd, curr->ai_addr, curr->ai_addrlen) == 0) {
+            dest->fd = fd;
+            graphite_connected(dest);
+            return true;
+        } else if (errno == EINPROGRESS) {
+            dest->fd = fd;
+            dest->connect_addr = curr;
+            dest->connect_deadline = now_ms() + CONNECT_TIMEOUT;
+            return true;
+        }
+
+        /* Do not log all failed attempts as this can be quite a common occurrence */
+        close(fd);
+    }
+
+    if (!dest->connect_failed) {
+        mistral_err("Unable to connect to: %s:%s, will retry\n", dest->host, dest->port);
+        dest->connect_failed = true;
+    }
+    __atomic_store_n(&dest->down, true, __ATOMIC_RELAXED);
+    dest->reconnect_at = now_ms() + dest->reconnect_delay;
+    dest->reconnect_delay = (dest->reconnect_delay * 2 < RECONNECT_DELAY_MAX) ?
+                            dest->reconnect_delay * 2 : RECONNECT_DELAY_MAX;
+    return false;
+}
+
+/*
+ * graphite_connect_check
+ *
+ * Check, without waiting, whether a connection in progress has completed. If
+ * it has failed, or has not completed within CONNECT_TIMEOUT milliseconds, the
+ * next address of the destination is tried.
+ *
+ * Parameters:
+ *   dest - The destination being connected to
+ *
+ * Returns:
+ *   true if the connection has been established
+ *   false if it is still in progress or could not be made
+ */
+static bool graphite_connect_check(graphite_destination *dest)
+{
+    struct pollfd pfd = {.fd = dest->fd, .events = POLLOUT};
+    int error = 0;
+    socklen_t len = sizeof(error);
+
+    if (poll(&pfd, 1, 0) <= 0) {
+        if (now_ms() < dest->connect_deadline) {
+            return false;
+        }
+        error = ETIMEDOUT;
+    } else if (getsockopt(dest->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1) {
+        error = errno;
+    }
+
+    if (!error) {
+        graphite_connected(dest);
+        return true;
+    }
+
+    struct addrinfo *next = dest->connect_addr->ai_next;
+    close(dest->fd);
+    dest->fd = -1;
+    dest->connect_addr = NULL;
+    return graphite_connect(dest, next) && !dest->connect_addr;
+}
+
+/*
+ * block_message_at
+ *
+ * Find the pickle message of a block that contains an offset.
+ *
+ * Parameters:
+ *   block  - The data block
+ *   offset - The offset into the block body
+ *
+ * Returns:
+ *   The index of the message
+ */
+static size_t block_message_at(const graphite_block *block, size_t offset)
+{
+    size_t i = 0;
+    while (i + 1 < block->messages && block->message[i + 1].offset <= offset) {
+        i++;
+    }
+    return i;
+}
+
+/*
+ * block_unsent
+ *
+ * Count the metrics in a block that have not been completely sent.
+ *
+ * Parameters:
+ *   block  - The data block
+ *   offset - The number of bytes of the block that have been sent
+ *
+ * Returns:
+ *   The number of metrics
+ */
+static size_t block_unsent(const graphite_block *block, size_t offset)
+{
+    size_t unsent = 0;
+
+    if (protocol == PROTOCOL_PICKLE) {
+        for (size_t i = (offset) ? block_message_at(block, offset) : 0; i < block->messages; i++) {
+            unsent += block->message[i].metrics;
+        }
+    } else {
+        for (const char *p = block->body.data + offset;
+             (p = memchr(p, '\n', block->body.data + block->body.len - p)); p++)
+        {
+            unsent++;
+        }
+    }
+    return unsent;
+}
+
+/*
+ * graphite_disconnect
+ *
+ * Close a connection that has failed. Carbon discards a partial line or pickle
+ * message when a connection is closed so the one that was being sent is
+ * rewound to be sent again in full over the next connection, which is
+ * attempted immediately.
+ *
+ * Parameters:
+ *   dest - The destination whose connection has failed
+ *
+ * Returns:
+ *   void
+ */
+static void graphite_disconnect(graphite_destination *dest)
+{
+    close(dest->fd);
+    dest->fd = -1;
+    dest->reconnect_at = 0;
+
+    graphite_block *head = dest->pending_head;
+    if (head && protocol == PROTOCOL_PICKLE) {
+        size_t start = head->message[block_message_at(head, dest->pending_offset)].offset;
+        dest->pending_bytes += dest->pending_offset - start;
+        dest->pending_offset = start;
+    } else if (head) {
+        const char *data = head->body.data;
+        while (dest->pending_offset > 0 && data[dest->pending_offset - 1] != '\n') {
+            dest->pending_offset--;
+            dest->pending_bytes++;
+        }
+    }
+}
+
+/*
+ * graphite_closed
+ *
+ * Check whether Graphite has closed the connection. Carbon never writes to a
+ * plaintext connection so a socket that is readable has been closed by the
+ * server, for example because carbon was restarted. Detecting this before
+ * writing avoids a block being accepted by the local socket and then lost.
+ *
+ * Parameters:
+ *   dest - The destination to check
+ *
+ * Returns:
+ *   true if the connection has been closed
+ *   false otherwise
+ */
+static bool graphite_closed(const graphite_destination *dest)
+{
+    struct pollfd pfd = {.fd = dest->fd, .events = POLLIN | POLLRDHUP};
+    return poll(&pfd, 1, 0) > 0;
+}
+
+/*
+ * graphite_block_destroy
+ *
+ * Free a data block.
+ *
+ * Parameters:
+ *   block - The data block to free
+ *
+ * Returns:
+ *   void
+ */
+static void graphite_block_destroy(graphite_block *block)
+{
+    if (block) {
+        mistral_buffer_free(&block->body);
+        free(block->message);
+        free(block);
+    }
+}
+
+/*
+ * graphite_retain
+ *
+ * Add a block to the end of the queue waiting to be sent to a destination. If
+ * this takes the amount of data waiting over the limit the oldest blocks that
+ * have not been started are discarded.
+ *
+ * Parameters:
+ *   dest  - The destination the block is for
+ *   block - The data block to add, owned by the queue from now on
+ *
+ * Returns:
+ *   void
+ */
+static void graphite_retain(graphite_destination *dest, graphite_block *block)
+{
+    block->next = NULL;
+    if (dest->pending_tail) {
+        dest->pending_tail->next = block;
+    } else {
+        dest->pending_head = block;
+    }
+    dest->pending_tail = block;
+    dest->pending_bytes += block->body.len;
+
+    /* Never discard the newest block, or a block that is part way through being sent */
+    graphite_block **oldest = (dest->pending_offset) ? &dest->pending_head->next :
+                              &dest->pending_head;
+    size_t discarded = 0;
+    while (dest->pending_bytes > buffer_bytes && *oldest && *oldest != dest->pending_tail) {
+        graphite_block *drop = *oldest;
+        *oldest = drop->next;
+        dest->pending_bytes -= drop->body.len;
+        discarded += drop->lines;
+        graphite_block_destroy(drop);
+    }
+
+    if (discarded) {
+        mistral_err("Discarded %zu metrics that could not be sent to %s:%s\n", discarded,
+                    dest->host, dest->port);
+        dest->dropped_lines += discarded;
+    }
+}
+
+/*
+ * graphite_send
+ *
+ * Write as much of the data queued for a destination as possible without
+ * waiting, connecting first if needed. Data is written with a single sendmsg
+ * call covering several blocks where possible and partial writes are continued
+ * on the next call. If the connection is lost the data stays queued and a new
+ * connection is made once the reconnection delay has passed. This is done even
+ * if no data is waiting so that metrics can be routed to the destination again.
+ *
+ * Parameters:
+ *   dest - The destination to send to
+ *
+ * Returns:
+ *   SEND_DONE if all queued data was written
+ *   SEND_WAIT if the socket must become writable, or connected, to continue
+ *   SEND_BLOCKED if nothing can be sent until the destination is reconnected
+ */
+static enum send_state graphite_send(graphite_destination *dest)
+{
+    if (dest->fd >= 0 && !dest->connect_addr && dest->pending_head && graphite_closed(dest)) {
+        mistral_err("Connection closed by %s:%s\n", dest->host, dest->port);
+        graphite_disconnect(dest);
+    }
+
+    while (true) {
+        if (dest->fd < 0 &&
+            (now_ms() < dest->reconnect_at || !graphite_connect(dest, dest->addrs)))
+        {
+            return SEND_BLOCKED;
+        }
+        if (dest->connect_addr && !graphite_connect_check(dest)) {
+            return (dest->connect_addr) ? SEND_WAIT : SEND_BLOCKED;
+        }
+        if (!dest->pending_head) {
+            return SEND_DONE;
+        }
+
+        struct iovec iov[SEND_IOV_MAX];
+        struct msghdr msg = {.msg_iov = iov};
+        size_t offset = dest->pending_offset;
+        for (graphite_block *block = dest->pending_head; block && msg.msg_iovlen < SEND_IOV_MAX;
+             block = block->next)
+        {
+            iov[msg.msg_iovlen].iov_base = block->body.data + offset;
+            iov[msg.msg_iovlen].iov_len = block->body.len - offset;
+            msg.msg_iovlen++;
+            offset = 0;
+        }
+
+        ssize_t sent = sendmsg(dest->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return SEND_WAIT;
+            }
+            char buf[256];
+            mistral_err("Could not send data to %s:%s: %s\n", dest->host, dest->port,
+                        strerror_r(errno, buf, sizeof buf));
+            graphite_disconnect(dest);
+            continue;
+        }
+
+        /* Release every block that has been completely written */
+        size_t remaining = (size_t)sent;
+        dest->pending_bytes -= remaining;
+        while (remaining) {
+            size_t left = dest->pending_head->body.len - dest->pending_offset;
+            if (remaining < left) {
+                dest->pending_offset += remaining;
+                break;
+            }
+            remaining -= left;
+            graphite_block *done = dest->pending_head;
+            dest->pending_head = done->next;
+            dest->pending_offset = 0;
+            graphite_block_destroy(done);
+        }
+        if (!dest->pending_head) {
+            dest->pending_tail = NULL;
+        }
+    }
+}
+
+/*
+ * graphite_flush
+ *
+ * Send the data queued for every destination. Destinations that are not ready
+ * are waited for together with a single poll so a destination that is slow, or
+ * whose connection attempt hangs, does not hold up the others. Each destination
+ * has its own deadline, starting when it is first waited for, after which its
+ * data is left queued for the next call. Connections in progress are only
+ * waited for if requested, otherwise they are checked again on the next call
+ * so a destination that does not answer cannot delay the next block.
+ *
+ * Parameters:
+ *   timeout  - The time in milliseconds to wait for each destination
+ *   connects - Whether to wait for connections in progress to complete
+ *
+ * Returns:
+ *   void
+ */
+static void graphite_flush(uint64_t timeout, bool connects)
+{
+    /* Nothing is configured if the plug-in failed to start */
+    if (destination_count == 0) {
+        return;
+    }
+
+    uint64_t deadline[destination_count];
+    struct pollfd pfd[destination_count];
+
+    memset(deadline, 0, sizeof(deadline));
+    while (true) {
+        uint64_t now = now_ms();
+        uint64_t wake = UINT64_MAX;
+        nfds_t nfds = 0;
+
+        for (size_t d = 0; d < destination_count; d++) {
+            graphite_destination *dest = &destinations[d];
+            if (graphite_send(dest) != SEND_WAIT ||
+                !((dest->connect_addr) ? connects : dest->pending_head != NULL))
+            {
+                continue;
+            }
+            if (!deadline[d]) {
+                deadline[d] = now + timeout;
+            }
+            if (now >= deadline[d]) {
+                continue;
+            }
+
+            /* Wake up in time to try the next address if a connection attempt times out */
+            uint64_t until = deadline[d];
+            if (dest->connect_addr && dest->connect_deadline < until) {
+                until = dest->connect_deadline;
+            }
+            wake = (until < wake) ? until : wake;
+            pfd[nfds].fd = dest->fd;
+            pfd[nfds].events = POLLOUT;
+            nfds++;
+        }
+
+        if (nfds == 0) {
+            return;
+        }
+
+        now = now_ms();
+        if (poll(pfd, nfds, (wake > now) ? (int)(wake - now) : 0) == -1 && errno != EINTR) {
+            char buf[256];
+            mistral_err("Error waiting for Graphite connections: %s\n",
+                        strerror_r(errno, buf, sizeof buf));
+            return;
+        }
+    }
+}
+
+/*
+ * md5_prefix
+ *
+ * Calculate the MD5 digest of a string, as defined by RFC 1321, and return its
+ * first 16 bits. This is the ring position carbon uses for consistent hashing.
+ *
+ * Parameters:
+ *   data - The string to hash
+ *   len  - The length of the string
+ *
+ * Returns:
+ *   The first two bytes of the digest as a big endian number
+ */
+static uint32_t md5_prefix(const char *data, size_t len)
+{
+    static const uint32_t k[64] = {
+        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613,
+        0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193,
+        0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d,
+        0x02441453, 0xd8a1e681, 0xe7d3fbc8, 0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+        0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122,
+        0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+        0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665, 0xf4292244,
+        0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+        0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb,
+        0xeb86d391,
+    };
+    static const unsigned char r[64] = {
+        7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+        5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+        4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+        6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+    };
+    uint32_t h[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+
+    /* The message is padded with 0x80, zeros and its length in bits to a
+     * multiple of 64 bytes. Each chunk is assembled as it is processed.
+     */
+    size_t chunks = (len + 8) / 64 + 1;
+    for (size_t chunk = 0; chunk < chunks; chunk++) {
+        unsigned char block[64];
+        for (size_t i = 0; i < 64; i++) {
+            size_t pos = chunk * 64 + i;
+            if (pos < len) {
+                block[i] = (unsigned char)data[pos];
+            } else if (pos == len) {
+                block[i] = 0x80;
+            } else if (chunk == chunks - 1 && i >= 56) {
+                block[i] = (unsigned char)(((uint64_t)len * 8) >> (8 * (i - 56)));
+            } else {
+                block[i] = 0;
+            }
+        }
+
+        uint32_t w[16];
+        for (size_t i = 0; i < 16; i++) {
+            w[i] = (uint32_t)block[i * 4] | (uint32_t)block[i * 4 + 1] << 8 |
+                   (uint32_t)block[i * 4 + 2] << 16 | (uint32_t)block[i * 4 + 3] << 24;
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+        for (unsigned int i = 0; i < 64; i++) {
+            uint32_t f;
+            unsigned int g;
+            if (i < 16) {
+                f = (b & c) | (~b & d);
+                g = i;
+            } else if (i < 32) {
+                f = (d & b) | (~d & c);
+                g = (5 * i + 1) % 16;
+            } else if (i < 48) {
+                f = b ^ c ^ d;
+                g = (3 * i + 5) % 16;
+            } else {
+                f = c ^ (b | ~d);
+                g = (7 * i) % 16;
+            }
+            uint32_t temp = d;
+            d = c;
+            c = b;
+            uint32_t x = a + f + k[i] + w[g];
+            b = b + ((x << r[i]) | (x >> (32 - r[i])));
+            a = temp;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+    }
+
+    return ((h[0] & 0xff) << 8) | ((h[0] >> 8) & 0xff);
+}
+
+/*
+ * ring_compare
+ *
+ * Order ring entries by position, for use with qsort.
+ *
+ * Parameters:
+ *   a - The first entry
+ *   b - The second entry
+ *
+ * Returns:
+ *   Less than, equal to or greater than zero if a is before, at or after b
+ */
+static int ring_compare(const void *a, const void *b)
+{
+    uint32_t pa = ((const ring_entry *)a)->position;
+    uint32_t pb = ((const ring_entry *)b)->position;
+    return (pa > pb) - (pa < pb);
+}
+
+/*
+ * ring_build
+ *
+ * Place each destination on the hash ring exactly as carbon's
+ * ConsistentHashRing does. The replicas of a destination are keyed on the
+ * Python representation of its (host, instance) tuple followed by the replica
+ * number and a position already taken is moved along to the next free one.
+ *
+ * Parameters:
+ *   void
+ *
+ * Returns:
+ *   true on success
+ *   false on error
+ */
+static bool ring_build(void)
+{
+    ring = calloc(destination_count * RING_REPLICAS, sizeof(ring_entry));
+    if (!ring) {
+        mistral_err("Could not allocate memory for hash ring\n");
+        return false;
+    }
+
+    mistral_buffer key = MISTRAL_BUFFER_INITIALIZER;
+    for (size_t d = 0; d < destination_count; d++) {
+        const graphite_destination *dest = &destinations[d];
+        for (unsigned int i = 0; i < RING_REPLICAS; i++) {
+            mistral_buffer_reset(&key);
+            bool res = (dest->instance) ?
+                       mistral_buffer_printf(&key, "('%s', '%s'):%u", dest->host, dest->instance,
+                                             i) :
+                       mistral_buffer_printf(&key, "('%s', None):%u", dest->host, i);
+            if (!res) {
+                mistral_err("Could not allocate memory for hash ring\n");
+                mistral_buffer_free(&key);
+                return false;
+            }
+
+            uint32_t position = md5_prefix(key.data, key.len);
+            for (size_t j = 0; j < ring_len; j++) {
+                if (ring[j].position == position) {
+                    position++;
+                    j = (size_t)-1;
+                }
+            }
+            ring[ring_len].position = position;
+            ring[ring_len].destination = d;
+            ring_len++;
+        }
+    }
+    mistral_buffer_free(&key);
+
+    qsort(ring, ring_len, sizeof(ring_entry), ring_compare);
+    return true;
+}
+
+/*
+ * ring_route
+ *
+ * Choose the destination for a metric. This is the first destination at or
+ * after the position of the metric path on the hash ring, as carbon-relay
+ * would choose, skipping any destinations that are down. If every destination
+ * is down the metric is queued for the first choice.
+ *
+ * Parameters:
+ *   path - The metric path
+ *   len  - The length of the metric path
+ *
+ * Returns:
+ *   The index of the destination
+ */
+static size_t ring_route(const char *path, size_t len)
+{
+    if (destination_count == 1) {
+        return 0;
+    }
+
+    uint32_t position = md5_prefix(path, len);
+    size_t low = 0;
+    size_t high = ring_len;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (ring[mid].position < position) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    for (size_t i = 0; i < ring_len; i++) {
+        size_t d = ring[(low + i) % ring_len].destination;
+        if (!__atomic_load_n(&destinations[d].down, __ATOMIC_RELAXED)) {
+            return d;
+        }
+    }
+    return ring[low % ring_len].destination;
+}
+
+/*
+ * destination_add
+ *
+ * Add a destination given as host[:port[:instance]]. An IPv6 address must be
+ * enclosed in square brackets.
+ *
+ * Parameters:
+ *   spec - The destination
+ *
+ * Returns:
+ *   true on success
+ *   false on error
+ */
+static bool destination_add(const char *spec)
+{
+    const char *host = spec;
+    const char *rest;
+    size_t host_len;
+
+    if (spec[0] == '[') {
+        host = spec + 1;
+        rest = strchr(host, ']');
+        if (!rest) {
+            mistral_err("Invalid destination specified %s\n", spec);
+            return false;
+        }
+        host_len = rest - host;
+        rest++;
+        if (*rest && *rest != ':') {
+            mistral_err("Invalid destination specified %s\n", spec);
+            return false;
+        }
+    } else {
+        host_len = strcspn(host, ":");
+        rest = host + host_len;
+    }
+
+    const char *port = (*rest) ? rest + 1 : "";
+    size_t port_len = strcspn(port, ":");
+    const char *instance = (port[port_len]) ? port + port_len + 1 : NULL;
+
+    if (host_len == 0 || (instance && (!*instance || strchr(instance, ':')))) {
+        mistral_err("Invalid destination specified %s\n", spec);
+        return false;
+    }
+    if (port_len) {
+        char *end = NULL;
+        unsigned long tmp_port = strtoul(port, &end, 10);
+        if (tmp_port > UINT16_MAX || end != port + port_len || port[0] == '-') {
+            mistral_err("Invalid port specified in destination %s\n", spec);
+            return false;
+        }
+    }
+
+    graphite_destination *new_destinations = realloc(destinations, (destination_count + 1) *
+                                                     sizeof(graphite_destination));
+    if (!new_destinations) {
+        mistral_err("Could not allocate memory for destination %s\n", spec);
+        return false;
+    }
+    destinations = new_destinations;
+
+    graphite_destination *dest = &destinations[destination_count];
+    memset(dest, 0, sizeof(*dest));
+    dest->fd = -1;
+    dest->reconnect_delay = RECONNECT_DELAY_INITIAL;
+    dest->host = strndup(host, host_len);
+    dest->port = (port_len) ? strndup(port, port_len) : NULL;
+    dest->instance = (instance) ? strdup(instance) : NULL;
+    destination_count++;
+
+    if (!dest->host || (port_len && !dest->port) || (instance && !dest->instance)) {
+        mistral_err("Could not allocate memory for destination %s\n", spec);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * string_identify
+ *
+ * Append a string, including its terminator, to a cache key.
+ *
+ * Parameters:
+ *   key    - The cache key being built
+ *   string - The string to append
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated
+ */
+static bool string_identify(mistral_buffer *key, const char *string)
+{
+    return mistral_buffer_append(key, string, strlen(string) + 1);
+}
+
+/*
+ * rule_identify
+ *
+ * Build the cache key for the rule part of a metric path.
+ *
+ * Parameters:
+ *   key    - The cache key being built
+ *   item   - The record
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated
+ */
+static bool rule_identify(mistral_buffer *key, const void *item)
+{
+    const mistral_record *record = item;
+    const mistral_record_strings *strings = record->strings;
+    uint32_t values[] = {record->scope, record->contract_type, record->measurement,
+                         record->call_type_mask};
+
+    return mistral_buffer_append(key, (const char *)values, sizeof(values)) &&
+           string_identify(key, strings->label) &&
+           string_identify(key, strings->path) &&
+           string_identify(key, strings->fstype) &&
+           string_identify(key, strings->fsname) &&
+           string_identify(key, strings->fshost) &&
+           string_identify(key, strings->size_range);
+}
+
+/*
+ * rule_render
+ *
+ * Render the rule part of a metric path, from the instance name to the size
+ * range, including the trailing separator.
+ *
+ * Parameters:
+ *   text   - The buffer to render into
+ *   item   - The record
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated
+ */
+static bool rule_render(mistral_buffer *text, const void *item)
+{
+    const mistral_record *record = item;
+    const mistral_record_strings *strings = record->strings;
+
+    return mistral_buffer_printf(text, "%s.%s.%s.%s.%s.", schema,
+                                 mistral_scope_name[record->scope],
+                                 mistral_contract_name[record->contract_type],
+                                 mistral_measurement_name[record->measurement],
+                                 strings->label) &&
+           graphite_escape_append(text, strings->path) &&
+           mistral_buffer_append(text, ".", 1) &&
+           graphite_escape_append(text, strings->fstype) &&
+           mistral_buffer_append(text, ".", 1) &&
+           graphite_escape_append(text, strings->fsname) &&
+           mistral_buffer_append(text, ".", 1) &&
+           graphite_escape_append(text, strings->fshost) &&
+           mistral_buffer_printf(text, ".%s.%s.", record->call_type_names, strings->size_range);
+}
 
 /*
- * usage
+ * job_identify
  *
- * Output a usage message via mistral_err.
+ * Build the cache key for the job part of a metric path.
  *
  * Parameters:
- *   name   - A pointer to a string containing arg[0]
+ *   key    - The cache key being built
+ *   item   - The record
  *
  * Returns:
- *   void
+ *   true on success
+ *   false if memory could not be allocated
  */
-static void usage(const char *name)
+static bool job_identify(mistral_buffer *key, const void *item)
 {
-    /* This may be called before options have been processed so errors will go to stderr.
-     * While this is designed to be run with Mistral to make the messages understandable
-     * on a terminal add an explicit newline to each line.
-     */
-    mistral_err("Usage:\n"
-                "  %s [-i metric] [-h host] [-p port] [-e file] [-m octal-mode] [-4|-6]\n", name);
-    mistral_err("\n"
-                "  -4\n"
-                "     Use IPv4 only. This is the default behaviour.\n"
-                "\n"
-                "  -6\n"
-                "     Use IPv6 only.\n"
-                "\n"
-                "  --error=file\n"
-                "  -e file\n"
-                "     Specify location for error log. If not specified all errors will\n"
-                "     be output on stderr and handled by Mistral error logging.\n"
-                "\n"
-                "  --host=hostname\n"
-                "  -h hostname\n"
-                "     The hostname of the Graphite server with which to establish a connection.\n"
-                "     If not specified the plug-in will default to \"localhost\".\n"
-                "\n"
-                "  --instance=metric\n"
-                "  -i metric\n"
-                "     Set the root metric node name the plug-in should create data under. This\n"
-                "     value can contain '.' characters to allow more precise classification\n"
-                "     of metrics.  Defaults to \"mistral\".\n"
-                "\n"
-                "  --mode=octal-mode\n"
-                "  -m octal-mode\n"
-                "     Permissions used to create the error log file specified by the -o\n"
-                "     option.\n"
-                "\n"
-                "  --port=port\n"
-                "  -p port\n"
-                "     Specifies the port to connect to on the Graphite server host.\n"
-                "     If not specified the plug-in will default to \"2003\".\n"
-                "\n");
+    const mistral_record *record = item;
+    const mistral_record_strings *strings = record->strings;
+
+    return string_identify(key, strings->job_group_id) &&
+           string_identify(key, strings->job_id) &&
+           string_identify(key, strings->hostname);
 }
 
 /*
- * graphite_escape
+ * job_render
  *
- * Graphite metrics will interpret both '.' and '/' characters as separators so
- * if these characters occur within the data e.g. in the path or job ID they
- * must be replaced. To be paranoid this function will replace '/' with ':' and
- * any other non-alphanumeric, hyphen or underscore characters with hyphens.
+ * Render the job part of a metric path, the job group ID, job ID and host
+ * name, including the trailing separator. Empty job IDs are written as "None".
+ *
+ * Parameters:
+ *   text   - The buffer to render into
+ *   item   - The record
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated
+ */
+static bool job_render(mistral_buffer *text, const void *item)
+{
+    const mistral_record *record = item;
+    const mistral_record_strings *strings = record->strings;
+    const char *job_gid = (strings->job_group_id[0]) ? strings->job_group_id : "None";
+    const char *job_id = (strings->job_id[0]) ? strings->job_id : "None";
+
+    return graphite_escape_append(text, job_gid) &&
+           mistral_buffer_append(text, ".", 1) &&
+           graphite_escape_append(text, job_id) &&
+           mistral_buffer_printf(text, ".%s.", strings->hostname);
+}
+
+static mistral_cache rule_cache = MISTRAL_CACHE_INITIALIZER(PATH_CACHE_SLOTS, rule_identify,
+                                                            rule_render);
+static mistral_cache job_cache = MISTRAL_CACHE_INITIALIZER(PATH_CACHE_SLOTS, job_identify,
+                                                           job_render);
+
+/*
+ * metric_path_append
  *
- * This function duplicates the passed string and then replaces each character
- * encountered.
+ * Append the Graphite metric path for a record to a buffer. The path is made
+ * of the cached rule and job prefixes followed by the CPU and MPI rank.
  *
  * Parameters:
- *   string - The string whose content needs to be escaped
+ *   buffer - The buffer to append to
+ *   record - The record to describe
  *
  * Returns:
- *   A pointer to newly allocated memory containing the escaped string or
- *   NULL on error
+ *   true on success
+ *   false if memory could not be allocated
  */
-static char *graphite_escape(const char *string)
+static bool metric_path_append(mistral_buffer *buffer, const mistral_record *record)
 {
-    char *escaped = strdup(string);
-    if (escaped) {
-        for (char *p = escaped; *p; p++) {
-            if (*p == '/') {
-                *p = ':';
-            } else if (!isalnum((unsigned char)*p) && *p != '_') {
-                *p = '-';
-            }
-        }
-        return escaped;
-    } else {
-        return NULL;
-    }
+    const mistral_cache_entry *rule = mistral_cache_get(&rule_cache, record);
+    const mistral_cache_entry *job = mistral_cache_get(&job_cache, record);
+
+    return rule && job &&
+           mistral_buffer_append(buffer, rule->text, rule->text_len) &&
+           mistral_buffer_append(buffer, job->text, job->text_len) &&
+           decimal_append(buffer, record->cpu, false, '.') &&
+           decimal_append(buffer, (uint64_t)(int64_t)record->mpi_rank, true, '\0');
 }
 
 /*
@@ -139,22 +1283,25 @@ void mistral_startup(mistral_plugin *plugin, int argc, char *argv[])
     static const struct option options[] = {
         {"4", no_argument, NULL, '4'},
         {"6", no_argument, NULL, '6'},
+        {"batch-size", required_argument, NULL, 'B'},
+        {"buffer-bytes", required_argument, NULL, 'b'},
+        {"destination", required_argument, NULL, 'D'},
         {"error", required_argument, NULL, 'e'},
         {"host", required_argument, NULL, 'h'},
         {"instance", required_argument, NULL, 'i'},
         {"mode", required_argument, NULL, 'm'},
         {"port", required_argument, NULL, 'p'},
+        {"protocol", required_argument, NULL, 'r'},
         {0, 0, 0, 0},
     };
 
     const char *error_file = NULL;
-    const char *host = "localhost";
-    const char *port = "2003";
+    const char *host = NULL;
+    const char *port = NULL;
     int family = AF_UNSPEC;
     int gai_retval;
     int opt;
     mode_t new_mode = 0;
-    struct addrinfo *addrs;
     struct addrinfo hints;
 
     while ((opt = getopt_long(argc, argv, "e:h:i:m:p:", options, NULL)) != -1) {
@@ -165,6 +1312,37 @@ void mistral_startup(mistral_plugin *plugin, int argc, char *argv[])
         case '6':
             family = AF_INET6;
             break;
+        case 'B': {
+            char *end = NULL;
+            errno = 0;
+            unsigned long tmp_size = strtoul(optarg, &end, 10);
+            if (errno || !end || *end || optarg[0] == '-' || tmp_size == 0 ||
+                tmp_size > PICKLE_BATCH_MAX)
+            {
+                mistral_err("Invalid batch size specified %s\n", optarg);
+                return;
+            }
+            batch_size = (size_t)tmp_size;
+            break;
+        }
+        case 'b': {
+            char *end = NULL;
+            errno = 0;
+            unsigned long long tmp_bytes = strtoull(optarg, &end, 10);
+            if (errno || !end || *end || optarg[0] == '-' || tmp_bytes == 0 ||
+                tmp_bytes > SIZE_MAX)
+            {
+                mistral_err("Invalid buffer size specified %s\n", optarg);
+                return;
+            }
+            buffer_bytes = (size_t)tmp_bytes;
+            break;
+        }
+        case 'D':
+            if (!destination_add(optarg)) {
+                return;
+            }
+            break;
         case 'e':
             error_file = optarg;
             break;
@@ -205,6 +1383,18 @@ void mistral_startup(mistral_plugin *plugin, int argc, char *argv[])
             port = optarg;
             break;
         }
+        case 'r': {
+            enum graphite_protocol i = 0;
+            while (i < PROTOCOL_MAX && strcmp(optarg, protocol_name[i])) {
+                i++;
+            }
+            if (i == PROTOCOL_MAX) {
+                mistral_err("Invalid protocol specified %s\n", optarg);
+                return;
+            }
+            protocol = i;
+            break;
+        }
         default:
             usage(argv[0]);
             return;
@@ -228,43 +1418,75 @@ void mistral_startup(mistral_plugin *plugin, int argc, char *argv[])
                         strerror_r(errno, buf, sizeof buf));
         }
     }
+    if (destination_count && (host || port)) {
+        mistral_err("--host and --port cannot be used with --destination\n");
+        return;
+    } else if (!destination_count) {
+        /* A single destination given by --host and --port */
+        char *spec = NULL;
+        bool bracket = (host && strchr(host, ':'));
+        if (asprintf(&spec, "%s%s%s%s%s", (bracket) ? "[" : "", (host) ? host : "localhost",
+                     (bracket) ? "]" : "", (port) ? ":" : "", (port) ? port : "") < 0)
+        {
+            mistral_err("Could not allocate memory for destination\n");
+            return;
+        }
+        bool res = destination_add(spec);
+        free(spec);
+        if (!res) {
+            return;
+        }
+    }
+
     /* Get addrinfo using the provided parameters */
     memset(&hints, 0, sizeof hints);
     hints.ai_family = family;
     hints.ai_socktype = SOCK_STREAM;
 
-    if ((gai_retval = getaddrinfo(host, port, &hints, &addrs)) != 0) {
-        mistral_err("Failed to get host info: %s\n", gai_strerror(gai_retval));
-        return;
-    }
-
-    /* getaddrinfo returns an array of matching possible addresses, try to
-     * connect to each until we succeed or run out of addresses.
+    /* Carbon identifies a destination on the hash ring by its host and
+     * instance name only so these must be unique.
      */
+    for (size_t d = 0; d < destination_count; d++) {
+        const graphite_destination *dest = &destinations[d];
+        for (size_t e = 0; e < d; e++) {
+            const graphite_destination *other = &destinations[e];
+            const char *instance = (dest->instance) ? dest->instance : "";
+            const char *other_instance = (other->instance) ? other->instance : "";
+            if (strcmp(dest->host, other->host) == 0 && strcmp(instance, other_instance) == 0) {
+                mistral_err("Destinations on the same host must have different instance names\n");
+                return;
+            }
+        }
+    }
 
-    for (struct addrinfo *curr = addrs; curr != NULL; curr = curr->ai_next) {
-        char buf[256];
-        if ((graphite_fd = socket(curr->ai_family, curr->ai_socktype, curr->ai_protocol)) == -1) {
-            mistral_err("Unable to create socket: %s%s\n",
-                        strerror_r(errno, buf, sizeof buf),
-                        curr->ai_next ? " - Trying next address" : "");
-            continue;
+    for (size_t d = 0; d < destination_count; d++) {
+        graphite_destination *dest = &destinations[d];
+        if (!dest->port) {
+            dest->port = strdup((protocol == PROTOCOL_PICKLE) ? "2004" : "2003");
+            if (!dest->port) {
+                mistral_err("Could not allocate memory for destination\n");
+                return;
+            }
         }
 
-        if (connect(graphite_fd, curr->ai_addr, curr->ai_addrlen) == -1) {
-            /* Do not log all failed attempts as this can be quite a common occurrence */
-            close(graphite_fd);
-            continue;
+        if ((gai_retval = getaddrinfo(dest->host, dest->port, &hints, &dest->addrs)) != 0) {
+            mistral_err("Failed to get host info for %s: %s\n", dest->host,
+                        gai_strerror(gai_retval));
+            return;
         }
-        break;
     }
 
-    if (graphite_fd < 0) {
-        mistral_err("Unable to connect to: %s:%s\n", host, port);
+    if (!ring_build()) {
+        return;
     }
 
-    /* We no longer need the array of addresses */
-    freeaddrinfo(addrs);
+    /* The addresses are kept so that connections can be re-established if
+     * they are lost. A failure here is not fatal, data will be retained, or
+     * sent to another destination, until a connection can be made. Wait
+     * briefly so destinations that refuse the connection are known to be down
+     * before the first metrics are routed, slower connections complete later.
+     */
+    graphite_flush(SEND_TIMEOUT, true);
 
     /* Returning after this point indicates success */
     plugin->type = OUTPUT_PLUGIN;
@@ -275,7 +1497,7 @@ void mistral_startup(mistral_plugin *plugin, int argc, char *argv[])
  *
  * Function called immediately before the plug-in exits. Check for any unhandled
  * log entries and call mistral_received_data_end to process them if any are
- * found. Clean up any open error log and the socket connection.
+ * found. Clean up any open error log and the socket connections.
  *
  * Parameters:
  *   None
@@ -285,13 +1507,65 @@ void mistral_startup(mistral_plugin *plugin, int argc, char *argv[])
  */
 void mistral_exit(void)
 {
-    if (log_list_head) {
+    if (record_list_head) {
         mistral_received_data_end(0, false);
     }
 
-    if (graphite_fd >= 0) {
-        close(graphite_fd);
+    /* Make a final attempt to send any data that has been retained. Connections
+     * to destinations with nothing left to send are abandoned.
+     */
+    for (size_t d = 0; d < destination_count; d++) {
+        graphite_destination *dest = &destinations[d];
+        if (dest->pending_head) {
+            dest->reconnect_at = 0;
+        } else {
+            dest->reconnect_at = UINT64_MAX;
+            if (dest->connect_addr) {
+                close(dest->fd);
+                dest->fd = -1;
+                dest->connect_addr = NULL;
+            }
+        }
+    }
+    graphite_flush(EXIT_TIMEOUT, true);
+
+    for (size_t d = 0; d < destination_count; d++) {
+        graphite_destination *dest = &destinations[d];
+        size_t unsent = 0;
+        while (dest->pending_head) {
+            graphite_block *block = dest->pending_head;
+            unsent += block_unsent(block, dest->pending_offset);
+            dest->pending_head = block->next;
+            dest->pending_offset = 0;
+            graphite_block_destroy(block);
+        }
+        dest->pending_tail = NULL;
+
+        if (unsent + dest->dropped_lines) {
+            mistral_err("%" PRIu64 " metrics could not be sent to %s:%s\n",
+                        (uint64_t)unsent + dest->dropped_lines, dest->host, dest->port);
+        }
+
+        if (dest->fd >= 0) {
+            close(dest->fd);
+        }
+        if (dest->addrs) {
+            freeaddrinfo(dest->addrs);
+        }
+        free(dest->host);
+        free(dest->port);
+        free(dest->instance);
     }
+    free(destinations);
+    destinations = NULL;
+    destination_count = 0;
+    free(ring);
+    ring = NULL;
+    ring_len = 0;
+    mistral_buffer_free(&metric_path);
+
+    mistral_cache_free(&rule_cache);
+    mistral_cache_free(&job_cache);
 
     if (log_file_ptr && *log_file_ptr != stderr) {
         fclose(*log_file_ptr);
@@ -300,40 +1574,227 @@ void mistral_exit(void)
 }
 
 /*
- * mistral_received_log
+ * mistral_received_record
  *
- * Function called whenever a log message is received. Simply store the log
- * entry received in a linked list until we reach the end of this data block
- * as it is more efficient to send all the entries to Graphite in a single
- * request.
+ * Function called whenever a log message is received. Simply store the record
+ * received in a linked list until we reach the end of this data block as it is
+ * more efficient to send all the entries to Graphite in a single request.
  *
  * Parameters:
- *   log_entry - A Mistral log record data structure containing the received
- *               log information.
+ *   record - A compact Mistral record data structure containing the received
+ *            log information.
  *
  * Returns:
  *   void
  */
-void mistral_received_log(mistral_log *log_entry)
+void mistral_received_record(mistral_record *record)
 {
-    if (!log_list_head) {
+    record->next = NULL;
+    if (!record_list_head) {
         /* Initialise linked list */
-        log_list_head = log_entry;
-        log_list_tail = log_entry;
-        insque(log_entry, NULL);
+        record_list_head = record;
     } else {
-        insque(log_entry, log_list_tail);
-        log_list_tail = log_entry;
+        record_list_tail->next = record;
+    }
+    record_list_tail = record;
+}
+
+/*
+ * pickle_le_append
+ *
+ * Append an unsigned integer to a buffer as little endian bytes.
+ *
+ * Parameters:
+ *   buffer - The buffer to append to
+ *   value  - The value to append
+ *   bytes  - The number of bytes to write
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated
+ */
+static bool pickle_le_append(mistral_buffer *buffer, uint64_t value, size_t bytes)
+{
+    char data[sizeof(value)];
+    for (size_t i = 0; i < bytes; i++) {
+        data[i] = (char)(value >> (8 * i));
+    }
+    return mistral_buffer_append(buffer, data, bytes);
+}
+
+/*
+ * pickle_int_append
+ *
+ * Append a pickled integer to a buffer. Values that fit in 32 bits use BININT,
+ * anything larger is written in two's complement with LONG1.
+ *
+ * Parameters:
+ *   buffer   - The buffer to append to
+ *   value    - The magnitude of the value
+ *   negative - Whether the value is negative
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated
+ */
+static bool pickle_int_append(mistral_buffer *buffer, uint64_t value, bool negative)
+{
+    uint64_t bits = (negative) ? -value : value;
+
+    if ((!negative && value <= INT32_MAX) || (negative && value <= (uint64_t)INT32_MAX + 1)) {
+        char opcode = PICKLE_BININT;
+        return mistral_buffer_append(buffer, &opcode, 1) && pickle_le_append(buffer, bits, 4);
+    }
+
+    /* A positive value with the top bit set needs an extra zero byte */
+    bool extra = (!negative && (value >> 63));
+    char header[] = {PICKLE_LONG1, (char)(sizeof(bits) + extra)};
+    return mistral_buffer_append(buffer, header, sizeof(header)) &&
+           pickle_le_append(buffer, bits, sizeof(bits)) &&
+           (!extra || mistral_buffer_append(buffer, "", 1));
+}
+
+/*
+ * pickle_message_end
+ *
+ * Finish the current pickle message of a block, if there is one, by closing
+ * the list of metrics and filling in the length prefix.
+ *
+ * Parameters:
+ *   block - The data block
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated
+ */
+static bool pickle_message_end(graphite_block *block)
+{
+    if (block->messages == 0) {
+        return true;
+    }
+
+    char footer[] = {PICKLE_APPENDS, PICKLE_STOP};
+    if (!mistral_buffer_append(&block->body, footer, sizeof(footer))) {
+        return false;
+    }
+
+    size_t offset = block->message[block->messages - 1].offset;
+    uint32_t length = (uint32_t)(block->body.len - offset - sizeof(length));
+    unsigned char *prefix = (unsigned char *)block->body.data + offset;
+    prefix[0] = (unsigned char)(length >> 24);
+    prefix[1] = (unsigned char)(length >> 16);
+    prefix[2] = (unsigned char)(length >> 8);
+    prefix[3] = (unsigned char)length;
+    return true;
+}
+
+/*
+ * pickle_message_start
+ *
+ * Start a new pickle message in a block, reserving space for the length
+ * prefix and opening an empty list of metrics.
+ *
+ * Parameters:
+ *   block - The data block
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated
+ */
+static bool pickle_message_start(graphite_block *block)
+{
+    if (block->messages == block->message_size) {
+        size_t new_size = (block->message_size) ? block->message_size * 2 : 16;
+        graphite_message *new_message = realloc(block->message,
+                                                new_size * sizeof(graphite_message));
+        if (!new_message) {
+            return false;
+        }
+        block->message = new_message;
+        block->message_size = new_size;
+    }
+
+    block->message[block->messages].offset = block->body.len;
+    block->message[block->messages].metrics = 0;
+    block->messages++;
+
+    static const char header[] = {0, 0, 0, 0, PICKLE_PROTO[0], PICKLE_PROTO[1],
+                                  PICKLE_EMPTY_LIST, PICKLE_MARK};
+    return mistral_buffer_append(&block->body, header, sizeof(header));
+}
+
+/*
+ * pickle_metric_append
+ *
+ * Append a metric to a block as a pickled (path, (timestamp, value)) tuple,
+ * starting a new message when the current one has reached the batch size.
+ *
+ * Parameters:
+ *   block  - The data block
+ *   path   - The rendered metric path
+ *   record - The record to append
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated
+ */
+static bool pickle_metric_append(graphite_block *block, const mistral_buffer *path,
+                                 const mistral_record *record)
+{
+    if (block->messages == 0 ||
+        block->message[block->messages - 1].metrics == batch_size ||
+        block->body.len - block->message[block->messages - 1].offset >= PICKLE_MESSAGE_BYTES)
+    {
+        if (!pickle_message_end(block) || !pickle_message_start(block)) {
+            return false;
+        }
+    }
+
+    char opcode = PICKLE_BINUNICODE;
+    char tuples[] = {PICKLE_TUPLE2, PICKLE_TUPLE2};
+    if (!mistral_buffer_append(&block->body, &opcode, 1) ||
+        !pickle_le_append(&block->body, path->len, 4) ||
+        !mistral_buffer_append(&block->body, path->data, path->len) ||
+        !pickle_int_append(&block->body, (record->epoch < 0) ? -(uint64_t)record->epoch :
+                           (uint64_t)record->epoch, record->epoch < 0) ||
+        !pickle_int_append(&block->body, record->measured, false) ||
+        !mistral_buffer_append(&block->body, tuples, sizeof(tuples)))
+    {
+        return false;
+    }
+
+    block->message[block->messages - 1].metrics++;
+    return true;
+}
+
+/*
+ * blocks_destroy
+ *
+ * Free the set of per-destination data blocks built for a data block.
+ *
+ * Parameters:
+ *   blocks - The array of data blocks, one per destination
+ *
+ * Returns:
+ *   void
+ */
+static void blocks_destroy(graphite_block **blocks)
+{
+    for (size_t d = 0; d < destination_count; d++) {
+        graphite_block_destroy(blocks[d]);
     }
+    free(blocks);
 }
 
 /*
  * mistral_received_data_end
  *
  * Function called whenever an end of data block message is received. At this
- * point run through the linked list of log entries we have seen and send them
- * to Graphite. Remove each log_entry from the linked list as they are
- * processed and destroy them.
+ * point run through the linked list of records we have seen and render them
+ * as plaintext protocol lines, or pickle protocol messages, in a buffer for
+ * the destination chosen for each metric. The buffers are handed to
+ * mistral_sink_deliver to be sent to Graphite. Remove each record from the
+ * linked list as they are processed and destroy them.
  *
  * No special handling of data block number errors is done beyond the message
  * logged by the main plug-in framework. Instead this function will simply
@@ -355,88 +1816,130 @@ void mistral_received_data_end(uint64_t block_num, bool block_error)
     UNUSED(block_num);
     UNUSED(block_error);
 
-    mistral_log *log_entry = log_list_head;
-
-    while (log_entry) {
-        char *data = NULL;
-
-        char *job_gid = graphite_escape(log_entry->job_group_id);
-        char *job_id = graphite_escape(log_entry->job_id);
-        char *path = graphite_escape(log_entry->path);
-        char *fstype = graphite_escape(log_entry->fstype);
-        char *fsname = graphite_escape(log_entry->fsname);
-        char *fshost = graphite_escape(log_entry->fshost);
-        if (job_gid[0] == 0) {
-            free(job_gid);
-            job_gid = strdup("None");
-        }
-        if (job_id[0] == 0) {
-            free(job_id);
-            job_id = strdup("None");
-        }
-
-        /* Graphite doesn't support sub-second precision, as explained in:
-         * http://graphite.readthedocs.io/en/latest/terminology.html#term-series
-         *
-         * timestamp
-         * A point in time in which values can be associated. Time in Graphite is represented
-         * as epoch time with a maximum resolution of 1-second.
-         */
-        if (asprintf(&data,
-                     "%s.%s.%s.%s.%s.%s.%s.%s.%s.%s.%s.%s.%s.%s.%" PRIu32 ".%" PRId32 " %" PRIu64
-                     " %ld\n",
-                     schema,
-                     mistral_scope_name[log_entry->scope],
-                     mistral_contract_name[log_entry->contract_type],
-                     mistral_measurement_name[log_entry->measurement],
-                     log_entry->label,
-                     path,
-                     fstype,
-                     fsname,
-                     fshost,
-                     log_entry->call_type_names,
-                     log_entry->size_range,
-                     job_gid,
-                     job_id,
-                     log_entry->hostname,
-                     log_entry->cpu,
-                     log_entry->mpi_rank,
-                     log_entry->measured,
-                     log_entry->epoch.tv_sec) < 0)
-        {
+    mistral_record *record = record_list_head;
+    graphite_block **blocks = calloc(destination_count, sizeof(graphite_block *));
+    bool empty = true;
+
+    if (!blocks) {
+        mistral_err("Could not allocate memory for data block\n");
+        mistral_shutdown();
+        return;
+    }
+
+    /* Graphite doesn't support sub-second precision, as explained in:
+     * http://graphite.readthedocs.io/en/latest/terminology.html#term-series
+     *
+     * timestamp
+     * A point in time in which values can be associated. Time in Graphite is represented
+     * as epoch time with a maximum resolution of 1-second.
+     */
+    while (record) {
+        mistral_buffer_reset(&metric_path);
+        bool rendered = metric_path_append(&metric_path, record);
+
+        size_t d = (rendered) ? ring_route(metric_path.data, metric_path.len) : 0;
+        if (rendered && !blocks[d]) {
+            blocks[d] = calloc(1, sizeof(graphite_block));
+            rendered = (blocks[d] != NULL);
+        }
+
+        if (rendered && protocol == PROTOCOL_PICKLE) {
+            rendered = pickle_metric_append(blocks[d], &metric_path, record);
+        } else if (rendered) {
+            mistral_buffer *body = &blocks[d]->body;
+            rendered = mistral_buffer_append(body, metric_path.data, metric_path.len) &&
+                       mistral_buffer_append(body, " ", 1) &&
+                       decimal_append(body, record->measured, false, ' ') &&
+                       decimal_append(body, (uint64_t)(int64_t)record->epoch, true, '\n');
+        }
+
+        if (!rendered) {
             mistral_err("Could not allocate memory for log entry\n");
+            blocks_destroy(blocks);
             mistral_shutdown();
-            free(fshost);
-            free(fsname);
-            free(fstype);
-            free(path);
-            free(job_id);
-            free(job_gid);
             return;
         }
-        free(fshost);
-        free(fsname);
-        free(fstype);
-        free(path);
-        free(job_id);
-        free(job_gid);
+        blocks[d]->lines++;
+        empty = false;
 
-        /* As send needs to send data atomically send each log message separately */
-        if (send(graphite_fd, data, strlen(data), 0) == -1) {
-            char buf[256];
-            mistral_err("Could not send data to Graphite %s\n",
-                        strerror_r(errno, buf, sizeof buf));
+        record_list_head = record->next;
+        mistral_destroy_record(record);
+
+        record = record_list_head;
+    }
+    record_list_tail = NULL;
+
+    if (empty) {
+        blocks_destroy(blocks);
+        return;
+    }
+
+    for (size_t d = 0; protocol == PROTOCOL_PICKLE && d < destination_count; d++) {
+        if (blocks[d] && !pickle_message_end(blocks[d])) {
+            mistral_err("Could not allocate memory for data block\n");
+            blocks_destroy(blocks);
+            mistral_shutdown();
+            return;
         }
+    }
 
-        free(data);
+    if (!mistral_sink_submit(blocks)) {
+        blocks_destroy(blocks);
+        mistral_shutdown();
+    }
+}
 
-        log_list_head = log_entry->forward;
-        remque(log_entry);
-        mistral_destroy_log_entry(log_entry);
+/*
+ * mistral_sink_deliver
+ *
+ * Function called by the plug-in framework with the blocks of metrics built by
+ * mistral_received_data_end. This is called on the sink worker thread, if it
+ * is running, so that the next data block can be parsed while this one is sent
+ * to Graphite.
+ *
+ * Each block is added to the queue of data waiting to be sent to its
+ * destination and every destination is then written to, waiting up to
+ * SEND_TIMEOUT milliseconds for each one. Anything not written in that time, or
+ * while a connection is down, is retained and sent with the next block.
+ *
+ * Parameters:
+ *   block - The array of data blocks, one per destination. Freed by this
+ *           function.
+ *
+ * Returns:
+ *   void
+ */
+void mistral_sink_deliver(void *block)
+{
+    graphite_block **blocks = block;
 
-        log_entry = log_list_head;
+    for (size_t d = 0; d < destination_count; d++) {
+        if (blocks[d]) {
+            graphite_retain(&destinations[d], blocks[d]);
+        }
     }
-    log_list_tail = NULL;
+    free(blocks);
+
+    graphite_flush(SEND_TIMEOUT, false);
+}
+
+/*
+ * mistral_sink_discard
+ *
+ * Function called by the plug-in framework with the blocks of metrics still
+ * queued for the sink worker thread once the plug-in is shutting down after an
+ * error.
+ *
+ * Parameters:
+ *   block - The array of data blocks, one per destination. Freed by this
+ *           function.
+ *
+ * Returns:
+ *   void
+ */
+void mistral_sink_discard(void *block)
+{
+    blocks_destroy(block);
 }
 
 /*
@@ -457,7 +1960,7 @@ void mistral_received_data_end(uint64_t block_num, bool block_error)
  */
 void mistral_received_shutdown(void)
 {
-    if (log_list_head) {
+    if (record_list_head) {
         mistral_received_data_end(0, false);
     }
 }
@@ -3,14 +3,24 @@
 #include <fcntl.h>              /* open */
 #include <getopt.h>             /* getopt_long */
 #include <inttypes.h>           /* uint32_t, uint64_t */
+#include <netdb.h>              /* getaddrinfo, freeaddrinfo, gai_strerror */
 #include <search.h>             /* insque, remque */
 #include <stdbool.h>            /* bool */
 #include <stdio.h>              /* asprintf */
 #include <stdlib.h>             /* calloc, realloc, free, getenv */
 #include <string.h>             /* strerror_r */
+#include <strings.h>            /* strncasecmp */
+#include <sys/socket.h>         /* socket, connect, sendmmsg */
 #include <sys/stat.h>           /* open, umask */
 #include <sys/types.h>          /* open, umask */
+#include <sys/uio.h>            /* struct iovec */
+#include <time.h>               /* nanosleep, time */
+#include <unistd.h>             /* close */
+#include <zlib.h>               /* deflate */
 
+#include "mistral_buffer.h"
+#include "mistral_cache.h"
+#include "mistral_compress.h"
 #include "mistral_plugin.h"
 
 enum debug_states {
@@ -41,7 +51,172 @@ static char *auth = NULL;
 
 static mistral_log *log_list_head = NULL;
 static mistral_log *log_list_tail = NULL;
-static char *custom_variables = NULL;
+
+/* Limits used to split a data block into separate write requests. InfluxDB
+ * recommends writing batches of around 5000 points.
+ */
+#define BATCH_POINTS_DEFAULT 5000
+#define BATCH_BYTES_DEFAULT (10 * 1024 * 1024)
+#define CONNECTIONS_DEFAULT 4
+#define CONNECTIONS_MAX 64
+
+/* Batches rejected because InfluxDB is overloaded or temporarily unavailable
+ * are resent after an increasing delay, in milliseconds, up to a maximum
+ * number of attempts. A delay requested by the server with Retry-After is
+ * honoured up to RETRY_AFTER_MAX seconds.
+ */
+#define RETRIES_DEFAULT 5
+#define RETRIES_MAX 100
+#define RETRY_DELAY_INITIAL 100
+#define RETRY_DELAY_MAX 10000
+#define RETRY_AFTER_MAX 300
+
+/* Only the start of a response is kept, enough to report why points were rejected */
+#define RESPONSE_MAX 65536
+
+static size_t batch_max_points = BATCH_POINTS_DEFAULT;
+static size_t batch_max_bytes = BATCH_BYTES_DEFAULT;
+static unsigned long connections = CONNECTIONS_DEFAULT;
+static unsigned long max_retries = RETRIES_DEFAULT;
+static uint64_t failed_total = 0;
+static int compress_level = 0;
+static uint64_t compress_in_total = 0;
+static uint64_t compress_out_total = 0;
+
+/* Timestamp precisions that can be used when writing points. The names used by
+ * the option and the v2 API are given first, followed by the v1 API name.
+ */
+enum precision {
+    PRECISION_S,
+    PRECISION_MS,
+    PRECISION_US,
+    PRECISION_NS,
+    PRECISION_MAX
+};
+
+static const char *const precision_name[] = {"s", "ms", "us", "ns", NULL};
+static const char *const precision_v1_name[] = {"s", "ms", "u", "ns", NULL};
+
+static enum precision precision = PRECISION_US;
+
+/* Each value written for a point is either a tag, which is indexed and forms
+ * part of the series key, a field or is not written at all.
+ */
+enum influxdb_role {
+    ROLE_TAG,
+    ROLE_FIELD,
+    ROLE_DROP,
+    ROLE_MAX
+};
+
+static const char *const influxdb_role_name[] = {"tag", "field", "drop", NULL};
+
+typedef struct influxdb_output influxdb_output;
+
+typedef bool (*influxdb_writer)(mistral_buffer *buffer, const influxdb_output *output,
+                                const mistral_log *log_entry);
+
+/* A value that can be written for each point. The writers append the value in
+ * the form needed for a tag or a field, a NULL writer means the value cannot
+ * be used in that role.
+ */
+typedef struct influxdb_column {
+    const char *name;
+    enum influxdb_role role;
+    influxdb_writer tag;
+    influxdb_writer field;
+    const char *(*string)(const mistral_log *log_entry);
+    uint64_t (*number)(const mistral_log *log_entry);
+} influxdb_column;
+
+/* An environment variable recorded with the --var option */
+typedef struct influxdb_variable {
+    const char *name;
+    const char *value;
+    enum influxdb_role role;
+} influxdb_variable;
+
+/* The compiled schema is an array of these, tags followed by fields. Each
+ * holds the key, including the preceding separator, and the writer chosen at
+ * start up so building a line needs no decisions about the schema. Values of
+ * environment variables do not change so are escaped once into constant.
+ * Tags also have an identify function which adds the raw value to the key
+ * used to look up the series key in the series cache.
+ */
+struct influxdb_output {
+    char *key;
+    size_t key_len;
+    influxdb_writer write;
+    influxdb_writer identify;
+    const influxdb_column *column;
+    char *constant;
+    size_t constant_len;
+};
+
+static influxdb_variable *variables = NULL;
+static size_t variable_count = 0;
+static influxdb_output *outputs = NULL;
+static size_t output_count = 0;
+static size_t tag_count = 0;
+
+/* Rendered series keys, the measurement and tag set that start each line, are
+ * cached. The cache is only used by the processing thread.
+ */
+#define SERIES_CACHE_SLOTS 4096
+
+/* Line protocol can also be sent to the UDP listener of InfluxDB or Telegraf.
+ * Consecutive lines are packed into datagrams that fit in a single packet and
+ * a batch of datagrams is passed to the kernel with each call to sendmmsg.
+ */
+#define UDP_PORT_DEFAULT 8089
+#define UDP_MTU_DEFAULT 1500
+#define UDP_MTU_MIN 576
+#define UDP_PAYLOAD_MAX 65507
+#define UDP_BATCH 64
+
+static int udp_fd = -1;
+static size_t udp_mtu = UDP_MTU_DEFAULT;
+static size_t udp_payload = 0;
+static uint64_t udp_datagrams = 0;
+static uint64_t udp_lines = 0;
+static uint64_t udp_dropped = 0;
+
+/* A serialised data block, the line protocol for every point plus the offset at
+ * which each line starts. The extra final offset marks the end of the body so
+ * the length of line n is always offset[n + 1] - offset[n]. The outcome of
+ * sending the block is recorded alongside it.
+ */
+typedef struct influxdb_block {
+    mistral_buffer body;
+    size_t *offset;
+    size_t offset_size;
+    size_t points;
+    size_t next_point;
+    bool *retry;
+    size_t retries;
+    size_t failed;
+    unsigned long retry_after;
+} influxdb_block;
+
+/* A connection used to send one batch of points at a time */
+typedef struct influxdb_request {
+    CURL *handle;
+    char error[CURL_ERROR_SIZE];
+    influxdb_block *block;
+    size_t first_point;
+    size_t points;
+    bool busy;
+    z_stream zstream;
+    bool zstream_init;
+    mistral_buffer compressed;
+    mistral_buffer response;
+    long retry_after;
+} influxdb_request;
+
+static CURLM *multihandle = NULL;
+static influxdb_request *requests = NULL;
+
+static struct curl_slist *headers = NULL;
 
 /*
  * set_curl_option
@@ -94,8 +269,27 @@ static void usage(const char *name)
     mistral_err("Usage:\n");
     mistral_err(
         "  %s [-d database] [-h host] [-P port] [-e file] [-m octal-mode] [-u user] [-p password] [-s] [-v var-name ...]\n"
-             "[-k] [-c certificate_path] [--cert-dir=certificate_directory]\n", name);
+             "[-k] [-c certificate_path] [--cert-dir=certificate_directory]\n"
+             "[--batch-bytes=bytes] [--batch-points=count] [--connections=count]\n"
+             "[--bucket=bucket] [--org=org] [--token=token] [--compress[=level]]\n"
+             "[--precision=s|ms|us|ns] [--schema=column:tag|field|drop[,...]]\n"
+             "[--udp] [--mtu=bytes] [--retries=count]\n", name);
     mistral_err("\n"
+                "  --batch-bytes=bytes\n"
+                "     The maximum size of a single write request. Larger data blocks are\n"
+                "     split into several requests. A point larger than this limit is sent\n"
+                "     in a request of its own. Defaults to 10485760 (10MiB).\n"
+                "\n"
+                "  --batch-points=count\n"
+                "     The maximum number of points sent in a single write request. If set\n"
+                "     to 0 only the --batch-bytes limit applies. Defaults to 5000.\n"
+                "\n"
+                "  --bucket=bucket\n"
+                "     Write to the named bucket using the InfluxDB 2.x /api/v2/write API,\n"
+                "     which is also supported by InfluxDB 3.x where the bucket is the\n"
+                "     database name. Cannot be used with --database, --username or\n"
+                "     --password.\n"
+                "\n"
                 "  --cert-path=certificate_path\n"
                 "  -c certificate_path\n"
                 "     The full path to a CA certificate used to sign the certificate\n"
@@ -108,6 +302,14 @@ static void usage(const char *name)
                 "     should be named after the hashed certificate subject name, see\n"
                 "     ``man openssl verify`` for details of the ``CApath`` option.\n"
                 "\n"
+                "  --compress[=level]\n"
+                "     Compress each write request with gzip. The optional level runs from\n"
+                "     1, the fastest and the default, to 9, the smallest.\n"
+                "\n"
+                "  --connections=count\n"
+                "     The maximum number of write requests that will be sent to the\n"
+                "     InfluxDB server concurrently. Defaults to 4.\n"
+                "\n"
                 "  --database=db-name\n"
                 "  -d db-name\n"
                 "     Set the InfluxDB database to be used for storing data.\n"
@@ -123,11 +325,18 @@ static void usage(const char *name)
                 "     The hostname of the InfluxDB server with which to establish a connection.\n"
                 "     If not specified the plug-in will default to \"localhost\".\n"
                 "\n"
+                "  --mtu=bytes\n"
+                "     The MTU of the network used to reach the UDP listener. Lines are\n"
+                "     packed into datagrams that fit within it. Defaults to 1500.\n"
+                "\n"
                 "  --mode=octal-mode\n"
                 "  -m octal-mode\n"
                 "     Permissions used to create the error log file specified by the -e\n"
                 "     option.\n"
                 "\n"
+                "  --org=org\n"
+                "     The organization that owns the bucket given by --bucket.\n"
+                "\n"
                 "  --password=secret\n"
                 "  -p secret\n"
                 "     The password required to access the InfluxDB server if needed.\n"
@@ -135,7 +344,29 @@ static void usage(const char *name)
                 "  --port=number\n"
                 "  -P number\n"
                 "     Specifies the port to connect to on the InfluxDB server host.\n"
-                "     If not specified the plug-in will default to \"8086\".\n"
+                "     If not specified the plug-in will default to \"8086\", or \"8089\"\n"
+                "     with --udp.\n"
+                "\n"
+                "  --precision=s|ms|us|ns\n"
+                "     The precision of the timestamps written. Mistral records times to\n"
+                "     the microsecond, a coarser precision makes each point smaller.\n"
+                "     Defaults to \"us\", or \"ns\" with --udp.\n"
+                "\n"
+                "  --retries=count\n"
+                "     The number of times a batch rejected because InfluxDB is\n"
+                "     overloaded or temporarily unavailable will be sent again, with an\n"
+                "     increasing delay, before its points are counted as failures.\n"
+                "     Defaults to 5.\n"
+                "\n"
+                "  --schema=column:tag|field|drop[,column:tag|field|drop...]\n"
+                "     Set whether each named column is written as a tag, as a field or\n"
+                "     is not written at all. Columns are calltype, jobgroup, jobid,\n"
+                "     label, path, fstype, fsname, fshost, host, command, cpu, file,\n"
+                "     logtype, mpirank, pid, scope, sizemin, sizemax, threshold,\n"
+                "     timeframe, value and any variable named by --var. Tags form the\n"
+                "     series key, so moving columns with many distinct values, such as\n"
+                "     jobid, to fields or dropping them reduces series cardinality.\n"
+                "     This option can be specified multiple times.\n"
                 "\n"
                 "  --ssl\n"
                 "  -s\n"
@@ -145,6 +376,18 @@ static void usage(const char *name)
                 "  -k\n"
                 "     Disable SSL certificate validation when connecting to InfluxDB.\n"
                 "\n"
+                "  --token=token\n"
+                "     The API token used to access the bucket given by --bucket. Use\n"
+                "     the form --token=file:<filename> to read the token from the first\n"
+                "     line of <filename>.\n"
+                "\n"
+                "  --udp\n"
+                "     Send line protocol to the UDP listener of InfluxDB or Telegraf\n"
+                "     rather than using HTTP. Points are not acknowledged so may be\n"
+                "     lost. The port defaults to 8089. The precision must match the\n"
+                "     precision setting of the listener. Cannot be used with the\n"
+                "     options for HTTP authentication, security, buckets or compression.\n"
+                "\n"
                 "  --username=user\n"
                 "  -u user\n"
                 "     The username required to access the InfluxDB server if needed.\n"
@@ -156,308 +399,1301 @@ static void usage(const char *name)
                 "\n");
 }
 
-/* influxdb_escape
- *
- * InfluxDB query strings treat commas, spaces and equals signs as delimiters,
- * if these characters occur within the data to be sent they must be escaped
- * with a single backslash character.
+/*
+ * influxdb_escape_append
  *
- * This function allocates twice as much memory as is required to copy the
- * passed string and then copies the string character by character escaping
- * spaces, commas and equals signs as they are encountered. Once the copy is
- * complete the memory is reallocated to reduce wasteage.
+ * Append a string to a buffer, escaping any of the special characters with a
+ * single backslash. InfluxDB tag values treat commas, spaces and equals signs
+ * as delimiters while string field values are double quoted and so only need
+ * double quotes to be escaped.
  *
  * Parameters:
- *   string - The string whose content needs to be escaped
+ *   buffer  - The buffer to append to
+ *   string  - The string to escape, NULL is treated as empty
+ *   special - The characters that must be escaped
  *
  * Returns:
- *   A pointer to newly allocated memory containing the escaped string or
- *   NULL on error
+ *   true on success
+ *   false if memory could not be allocated
  */
-static char *influxdb_escape(const char *string)
+static bool influxdb_escape_append(mistral_buffer *buffer, const char *string,
+                                   const char *special)
 {
-    DEBUG_OUTPUT(DBG_ENTRY, "Entering function, %s\n", string);
     if (!string) {
-        DEBUG_OUTPUT(DBG_ENTRY, "Leaving function, nothing to do\n");
-        return NULL;
+        string = "";
     }
-    size_t len = strlen(string);
 
-    char *escaped = calloc(1, (2 * len + 1) * sizeof(char));
-    char *p, *q;
-    if (escaped) {
-        for (p = (char *)string, q = escaped; *p; p++, q++) {
-            if (*p == ' ' || *p == ',' || *p == '=') {
-                *q++ = '\\';
-            }
-            *q = *p;
-        }
-        /* Memory was allocated with calloc so string is already null terminated */
-        char *small_escaped = realloc(escaped, q - escaped + 1);
-        if (small_escaped) {
-            DEBUG_OUTPUT(DBG_ENTRY, "Leaving function, success\n");
-            return small_escaped;
-        } else {
-            DEBUG_OUTPUT(DBG_ENTRY, "Leaving function, partial success\n");
-            return escaped;
+    /* Reserve enough space for every character to be escaped */
+    if (!mistral_buffer_reserve(buffer, 2 * strlen(string))) {
+        return false;
+    }
+
+    char *q = buffer->data + buffer->len;
+    for (const char *p = string; *p;) {
+        size_t run = strcspn(p, special);
+        memcpy(q, p, run);
+        q += run;
+        p += run;
+        if (*p) {
+            *q++ = '\\';
+            *q++ = *p++;
         }
-    } else {
-        DEBUG_OUTPUT(DBG_ENTRY, "Leaving function, failed\n");
-        return NULL;
     }
+    *q = '\0';
+    buffer->len = q - buffer->data;
+
+    return true;
 }
 
-/* influxdb_escape_field
- *
- * InfluxDB field strings are double quoted. We need to quote any double quotes
- * that are part of the string value.
+/*
+ * put_decimal
  *
- * This function allocates twice as much memory as is required to copy the
- * passed string and then copies the string character by character escaping
- * double quotes as they are encountered. Once the copy is complete the memory
- * is reallocated to reduce wasteage.
+ * Write a number in decimal, padded with leading zeros to a minimum width.
+ * Formatting numbers is a large part of the cost of each line so this is used
+ * in place of printf.
  *
  * Parameters:
- *   string - The field string whose content needs to be escaped
+ *   dest  - Where to write the digits, there must be space for at least 20
+ *           characters or width if that is larger
+ *   value - The number to write
+ *   width - The minimum number of digits to write
  *
  * Returns:
- *   A pointer to newly allocated memory containing the escaped string or
- *   NULL on error
+ *   A pointer to the character after the last digit written
  */
-static char *influxdb_escape_field(const char *string)
+static char *put_decimal(char *dest, uint64_t value, unsigned int width)
 {
-    DEBUG_OUTPUT(DBG_ENTRY, "Entering function, %s\n", string);
-    if (!string) {
-        DEBUG_OUTPUT(DBG_ENTRY, "Leaving function, nothing to do\n");
-        return NULL;
-    }
-    size_t len = strlen(string);
+    char digits[20];
+    unsigned int len = 0;
 
-    char *escaped = calloc(1, (2 * len + 1) * sizeof(char));
-    if (escaped) {
-        for (char *p = (char *)string, *q = escaped; *p; p++, q++) {
-            if (*p == '"') {
-                *q++ = '\\';
-            }
-            *q = *p;
-        }
-        char *small_escaped = realloc(escaped, (strlen(escaped) + 1) * sizeof(char));
-        if (small_escaped) {
-            DEBUG_OUTPUT(DBG_ENTRY, "Leaving function, success\n");
-            return small_escaped;
-        } else {
-            DEBUG_OUTPUT(DBG_ENTRY, "Leaving function, partial success\n");
-            return escaped;
-        }
-    } else {
-        DEBUG_OUTPUT(DBG_ENTRY, "Leaving function, failed\n");
-        return NULL;
+    do {
+        digits[sizeof(digits) - ++len] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+
+    while (width > len) {
+        *dest++ = '0';
+        width--;
     }
+    memcpy(dest, digits + sizeof(digits) - len, len);
+    return dest + len;
 }
 
 /*
- * mistral_startup
- *
- * Required function that initialises the type of plug-in we are running. This
- * function is called immediately on plug-in start-up.
+ * decimal_append
  *
- * In addition this plug-in needs to initialise the InfluxDB connection
- * parameters. The stream used for error messages defaults to stderr but can
- * be overridden here by setting plugin->error_log.
+ * Append a number in decimal, followed by a short suffix, to a buffer.
  *
  * Parameters:
- *   plugin - A pointer to the plug-in information structure. This function
- *            must set plugin->type before returning, if it doesn't the plug-in
- *            will immediately shut down.
- *   argc   - The number of entries in the argv array
- *   argv   - A pointer to the argument array passed to main.
+ *   buffer - The buffer to append to
+ *   value  - The number to write
+ *   sign   - Whether value holds a signed number
+ *   suffix - A string of at most one character written after the number
  *
  * Returns:
- *   void - but see note about setting plugin->type above.
+ *   true on success
+ *   false if memory could not be allocated
  */
-void mistral_startup(mistral_plugin *plugin, int argc, char *argv[])
+static bool decimal_append(mistral_buffer *buffer, uint64_t value, bool sign, const char *suffix)
 {
-    DEBUG_OUTPUT(DBG_ENTRY, "Entering function %d, %p, %p\n", argc, argv, plugin);
-    /* Returning without setting plug-in type will cause a clean exit */
+    if (!mistral_buffer_reserve(buffer, sizeof("-18446744073709551615i"))) {
+        return false;
+    }
 
-    #define CERT_DIR_OPTION_CODE 1001
+    char *q = buffer->data + buffer->len;
+    if (sign && (int64_t)value < 0) {
+        *q++ = '-';
+        value = -value;
+    }
+    q = put_decimal(q, value, 0);
+    if (suffix[0]) {
+        *q++ = suffix[0];
+    }
+    *q = '\0';
+    buffer->len = q - buffer->data;
 
-    static const struct option options[] = {
-        {"database", required_argument, NULL, 'd'},
-        {"debug", required_argument, NULL, 'D'},
-        {"error", required_argument, NULL, 'e'},
-        {"host", required_argument, NULL, 'h'},
-        {"mode", required_argument, NULL, 'm'},
-        {"password", required_argument, NULL, 'p'},
-        {"port", required_argument, NULL, 'P'},
-        {"https", no_argument, NULL, 's'},
-        {"skip-ssl-validation", no_argument, NULL, 'k'},
-        {"username", required_argument, NULL, 'u'},
-        {"var", required_argument, NULL, 'v'},
-        {"cert-dir", required_argument, NULL, CERT_DIR_OPTION_CODE},
-        {"cert-path", required_argument, NULL, 'c'},        
-        {0, 0, 0, 0},
-    };
+    return true;
+}
 
-    const char *database = "mistral";
-    const char *error_file = NULL;
-    const char *host = "localhost";
-    const char *password = NULL;
-    uint16_t port = 8086;
-    const char *username = NULL;
-    const char *protocol = "http";
-    int opt;
-    bool skip_validation = false;
-    mode_t new_mode = 0;
-    const char *cert_path = NULL;
-    const char *cert_dir = NULL;
+#define TAG_SPECIAL_CHARS " ,="
+#define FIELD_SPECIAL_CHARS "\""
 
-    while ((opt = getopt_long(argc, argv, "d:D:e:h:m:p:P:sku:v:c:", options, NULL)) != -1) {
-        switch (opt) {
-        case 'd':
-            database = optarg;
-            break;
-        case 'D': {
-            char *end = NULL;
-            unsigned long tmp_level = strtoul(optarg, &end, 10);
-            if (tmp_level == 0 || !end || *end || tmp_level > DBG_LIMIT) {
-                mistral_err("Invalid debug level '%s', using '1'\n", optarg);
-                tmp_level = 1;
-            }
-            /* For now just allow cumulative debug levels rather than selecting messages */
-            debug_level = (1 << tmp_level) - 1;
-            break;
-        }
-        case 'e':
-            error_file = optarg;
-            break;
-        case 'h':
-            host = optarg;
-            break;
-        case 'm': {
-            char *end = NULL;
-            unsigned long tmp_mode = strtoul(optarg, &end, 8);
-            if (!end || *end) {
-                tmp_mode = 0;
-            }
-            new_mode = (mode_t)tmp_mode;
+/* Functions used to read the value of each column from a log entry */
+static const char *column_call_type(const mistral_log *log_entry)
+{
+    return log_entry->call_type_names;
+}
 
-            if (new_mode <= 0 || new_mode > 0777) {
-                mistral_err("Invalid mode '%s' specified, using default\n", optarg);
-                new_mode = 0;
-            }
+static const char *column_job_group_id(const mistral_log *log_entry)
+{
+    return (log_entry->job_group_id[0] == 0) ? "N/A" : log_entry->job_group_id;
+}
 
-            if ((new_mode & (S_IWUSR | S_IWGRP | S_IWOTH)) == 0) {
-                mistral_err(
-                    "Invalid mode '%s' specified, plug-in will not be able to write to log. Using default\n",
-                    optarg);
-                new_mode = 0;
-            }
-            break;
-        }
-        case 'p':
-            password = optarg;
-            break;
-        case 'P': {
-            char *end = NULL;
-            unsigned long tmp_port = strtoul(optarg, &end, 10);
-            if (tmp_port <= 0 || tmp_port > UINT16_MAX || !end || *end) {
-                mistral_err("Invalid port specified %s\n", optarg);
-                DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
-                return;
-            }
-            port = (uint16_t)tmp_port;
-            break;
-        }
-        case 's':
-            protocol = "https";
-            break;
-        case 'k':
-            skip_validation = true;
-            break;
-        case 'u':
-            username = optarg;
-            break;
-        case 'v': {
-            char *var_val = NULL;
-            char *new_var = NULL;
+static const char *column_job_id(const mistral_log *log_entry)
+{
+    return (log_entry->job_id[0] == 0) ? "N/A" : log_entry->job_id;
+}
 
-            if (optarg[0] != '\0' && strspn(optarg, VALID_NAME_CHARS) == strlen(optarg)) {
-                var_val = influxdb_escape(getenv(optarg));
+static const char *column_label(const mistral_log *log_entry)
+{
+    return log_entry->label;
+}
 
-                if (var_val == NULL || var_val[0] == '\0') {
-                    var_val = strdup("N/A");
-                }
-                if (var_val == NULL) {
-                    mistral_err("Could not allocate memory for environment variable value %s\n",
-                                optarg);
-                    DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
-                    return;
-                }
-            } else {
-                mistral_err("Invalid environment variable name %s\n", optarg);
-            }
-            if (asprintf(&new_var, "%s,%s=%s",
-                         (custom_variables) ? custom_variables : "",
-                         optarg,
-                         var_val) < 0)
-            {
-                mistral_err("Could not allocate memory for environment variable %s\n", optarg);
-                DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
-                free(var_val);
-                return;
-            }
-            free(var_val);
-            free(custom_variables);
-            custom_variables = new_var;
-            break;
-        }
-        case 'c':
-            cert_path = optarg;
-            break;
-        case CERT_DIR_OPTION_CODE:
-            cert_dir = optarg;
-            break;
-        default:
-            usage(argv[0]);
-            DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
-            return;
-        }
-    }
+static const char *column_path(const mistral_log *log_entry)
+{
+    return log_entry->path;
+}
 
-    log_file_ptr = &(plugin->error_log);
+static const char *column_fstype(const mistral_log *log_entry)
+{
+    return log_entry->fstype;
+}
 
-    /* Error file is opened/created by the first error_msg
-     */
-    plugin->error_log = stderr;
-    plugin->error_log_name = (char *)error_file;
-    plugin->error_log_mode = new_mode;
-    plugin->flags = 0;
+static const char *column_fsname(const mistral_log *log_entry)
+{
+    return log_entry->fsname;
+}
 
-    if (curl_global_init(CURL_GLOBAL_ALL)) {
-        mistral_err("Could not initialise curl\n");
-        DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
-        return;
-    }
+static const char *column_fshost(const mistral_log *log_entry)
+{
+    return log_entry->fshost;
+}
 
-    /* Initialise curl */
-    easyhandle = curl_easy_init();
+static const char *column_host(const mistral_log *log_entry)
+{
+    return log_entry->hostname;
+}
 
-    if (!easyhandle) {
-        mistral_err("Could not initialise curl handle\n");
-        DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
-        return;
-    }
+static const char *column_command(const mistral_log *log_entry)
+{
+    return log_entry->command;
+}
 
-    if (curl_easy_setopt(easyhandle, CURLOPT_ERRORBUFFER, curl_error) != CURLE_OK) {
-        mistral_err("Could not set curl error buffer\n");
-        DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
-        return;
-    }
+static const char *column_file(const mistral_log *log_entry)
+{
+    return log_entry->file;
+}
 
-    /* Set curl to treat HTTP errors as failures */
-    if (curl_easy_setopt(easyhandle, CURLOPT_FAILONERROR, 1l) != CURLE_OK) {
-        mistral_err("Could not set curl to fail on HTTP error\n");
+static const char *column_logtype(const mistral_log *log_entry)
+{
+    return mistral_contract_name[log_entry->contract_type];
+}
+
+static const char *column_scope(const mistral_log *log_entry)
+{
+    return mistral_scope_name[log_entry->scope];
+}
+
+static uint64_t column_cpu(const mistral_log *log_entry)
+{
+    return log_entry->cpu;
+}
+
+static uint64_t column_mpi_rank(const mistral_log *log_entry)
+{
+    return (uint64_t)(int64_t)log_entry->mpi_rank;
+}
+
+static uint64_t column_pid(const mistral_log *log_entry)
+{
+    return (uint64_t)log_entry->pid;
+}
+
+static uint64_t column_size_min(const mistral_log *log_entry)
+{
+    return (uint64_t)log_entry->size_min;
+}
+
+static uint64_t column_size_max(const mistral_log *log_entry)
+{
+    return (uint64_t)log_entry->size_max;
+}
+
+static uint64_t column_threshold(const mistral_log *log_entry)
+{
+    return log_entry->threshold;
+}
+
+static uint64_t column_timeframe(const mistral_log *log_entry)
+{
+    return log_entry->timeframe;
+}
+
+static uint64_t column_value(const mistral_log *log_entry)
+{
+    return log_entry->measured;
+}
+
+/* Functions used to write a value as a tag or a field. Integer fields require
+ * an 'i' suffix, otherwise InfluxDB interprets the value as a float. For
+ * example, if the suffix is omitted with a size-max value of
+ * 9223372036854775807, InfluxDB stores it as 9.223372036854776e+18 and
+ * returns 9223372036854776000. The measured value has always been written as
+ * a float so it remains one.
+ */
+static bool write_tag_string(mistral_buffer *buffer, const influxdb_output *output,
+                             const mistral_log *log_entry)
+{
+    return influxdb_escape_append(buffer, output->column->string(log_entry), TAG_SPECIAL_CHARS);
+}
+
+static bool write_quoted_string(mistral_buffer *buffer, const influxdb_output *output,
+                                const mistral_log *log_entry)
+{
+    return mistral_buffer_append(buffer, "\"", 1) &&
+           influxdb_escape_append(buffer, output->column->string(log_entry),
+                                  FIELD_SPECIAL_CHARS) &&
+           mistral_buffer_append(buffer, "\"", 1);
+}
+
+static bool write_tag_unsigned(mistral_buffer *buffer, const influxdb_output *output,
+                               const mistral_log *log_entry)
+{
+    return decimal_append(buffer, output->column->number(log_entry), false, "");
+}
+
+static bool write_tag_signed(mistral_buffer *buffer, const influxdb_output *output,
+                             const mistral_log *log_entry)
+{
+    return decimal_append(buffer, output->column->number(log_entry), true, "");
+}
+
+static bool write_field_unsigned(mistral_buffer *buffer, const influxdb_output *output,
+                                 const mistral_log *log_entry)
+{
+    return decimal_append(buffer, output->column->number(log_entry), false, "i");
+}
+
+static bool write_field_signed(mistral_buffer *buffer, const influxdb_output *output,
+                               const mistral_log *log_entry)
+{
+    return decimal_append(buffer, output->column->number(log_entry), true, "i");
+}
+
+static bool write_field_float(mistral_buffer *buffer, const influxdb_output *output,
+                              const mistral_log *log_entry)
+{
+    return decimal_append(buffer, output->column->number(log_entry), false, "");
+}
+
+static bool write_constant(mistral_buffer *buffer, const influxdb_output *output,
+                           const mistral_log *log_entry)
+{
+    UNUSED(log_entry);
+    return mistral_buffer_append(buffer, output->constant, output->constant_len);
+}
+
+/* Functions used to add the raw value of a tag to a series cache key. The
+ * terminating null character of strings is included so that adjacent values
+ * cannot run together. Constant values do not need to be part of the key.
+ */
+static bool identify_string(mistral_buffer *buffer, const influxdb_output *output,
+                            const mistral_log *log_entry)
+{
+    const char *string = output->column->string(log_entry);
+    if (!string) {
+        return mistral_buffer_append(buffer, "\x01", 2);
+    }
+    return mistral_buffer_append(buffer, string, strlen(string) + 1);
+}
+
+static bool identify_number(mistral_buffer *buffer, const influxdb_output *output,
+                            const mistral_log *log_entry)
+{
+    uint64_t number = output->column->number(log_entry);
+    return mistral_buffer_append(buffer, (const char *)&number, sizeof(number));
+}
+
+static bool identify_constant(mistral_buffer *buffer, const influxdb_output *output,
+                              const mistral_log *log_entry)
+{
+    UNUSED(buffer);
+    UNUSED(output);
+    UNUSED(log_entry);
+    return true;
+}
+
+/* The columns written for each point, in the order they are written, with the
+ * role each has by default. The path and file system columns have always been
+ * written as quoted tags so their tag form is unchanged.
+ */
+static const influxdb_column influxdb_columns[] = {
+    {"calltype", ROLE_TAG, write_tag_string, write_quoted_string, column_call_type, NULL},
+    {"jobgroup", ROLE_TAG, write_tag_string, write_quoted_string, column_job_group_id, NULL},
+    {"jobid", ROLE_TAG, write_tag_string, write_quoted_string, column_job_id, NULL},
+    {"label", ROLE_TAG, write_tag_string, write_quoted_string, column_label, NULL},
+    {"path", ROLE_TAG, write_quoted_string, write_quoted_string, column_path, NULL},
+    {"fstype", ROLE_TAG, write_quoted_string, write_quoted_string, column_fstype, NULL},
+    {"fsname", ROLE_TAG, write_quoted_string, write_quoted_string, column_fsname, NULL},
+    {"fshost", ROLE_TAG, write_quoted_string, write_quoted_string, column_fshost, NULL},
+    {"host", ROLE_TAG, write_tag_string, write_quoted_string, column_host, NULL},
+    {"command", ROLE_FIELD, write_tag_string, write_quoted_string, column_command, NULL},
+    {"cpu", ROLE_FIELD, write_tag_unsigned, write_field_unsigned, NULL, column_cpu},
+    {"file", ROLE_FIELD, write_tag_string, write_quoted_string, column_file, NULL},
+    {"logtype", ROLE_FIELD, write_tag_string, write_quoted_string, column_logtype, NULL},
+    {"mpirank", ROLE_FIELD, write_tag_signed, write_field_signed, NULL, column_mpi_rank},
+    {"pid", ROLE_FIELD, write_tag_signed, write_field_signed, NULL, column_pid},
+    {"scope", ROLE_FIELD, write_tag_string, write_quoted_string, column_scope, NULL},
+    {"sizemin", ROLE_FIELD, write_tag_unsigned, write_field_unsigned, NULL, column_size_min},
+    {"sizemax", ROLE_FIELD, write_tag_unsigned, write_field_unsigned, NULL, column_size_max},
+    {"threshold", ROLE_FIELD, write_tag_unsigned, write_field_unsigned, NULL, column_threshold},
+    {"timeframe", ROLE_FIELD, write_tag_unsigned, write_field_unsigned, NULL, column_timeframe},
+    {"value", ROLE_FIELD, NULL, write_field_float, NULL, column_value},
+};
+
+#define COLUMN_COUNT (sizeof(influxdb_columns) / sizeof(influxdb_columns[0]))
+
+/*
+ * schema_apply
+ *
+ * Parse a schema specification, a comma separated list of column:role pairs,
+ * and record the requested role for each column or environment variable.
+ *
+ * Parameters:
+ *   spec  - The schema specification
+ *   roles - The role of each of the standard columns
+ *
+ * Returns:
+ *   true on success
+ *   false if the specification is invalid
+ */
+static bool schema_apply(const char *spec, enum influxdb_role *roles)
+{
+    char *copy = strdup(spec);
+    if (!copy) {
+        mistral_err("Could not allocate memory for schema\n");
+        return false;
+    }
+
+    char *saveptr = NULL;
+    for (char *entry = strtok_r(copy, ",", &saveptr); entry;
+         entry = strtok_r(NULL, ",", &saveptr))
+    {
+        char *role_name = strchr(entry, ':');
+        if (!role_name) {
+            mistral_err("Invalid schema entry '%s', expected column:tag|field|drop\n", entry);
+            free(copy);
+            return false;
+        }
+        *role_name++ = '\0';
+
+        int role;
+        for (role = 0; influxdb_role_name[role] && strcmp(role_name, influxdb_role_name[role]);
+             role++);
+        if (!influxdb_role_name[role]) {
+            mistral_err("Invalid role '%s' for column %s in schema\n", role_name, entry);
+            free(copy);
+            return false;
+        }
+
+        size_t i;
+        for (i = 0; i < COLUMN_COUNT && strcmp(entry, influxdb_columns[i].name); i++);
+        if (i < COLUMN_COUNT) {
+            roles[i] = (enum influxdb_role)role;
+            continue;
+        }
+
+        for (i = 0; i < variable_count && strcmp(entry, variables[i].name); i++);
+        if (i < variable_count) {
+            variables[i].role = (enum influxdb_role)role;
+            continue;
+        }
+
+        mistral_err("Unknown column '%s' in schema\n", entry);
+        free(copy);
+        return false;
+    }
+
+    free(copy);
+    return true;
+}
+
+/*
+ * schema_output_add
+ *
+ * Add a value to the compiled schema.
+ *
+ * Parameters:
+ *   name      - The tag or field key
+ *   role      - Whether the value is a tag or a field
+ *   separator - The character written before the key
+ *   writer    - The function used to write the value
+ *   column    - The column being written, NULL for an environment variable
+ *   constant  - The value of an environment variable, NULL for a column
+ *
+ * Returns:
+ *   true on success
+ *   false otherwise
+ */
+static bool schema_output_add(const char *name, enum influxdb_role role, char separator,
+                              influxdb_writer writer, const influxdb_column *column,
+                              const char *constant)
+{
+    influxdb_output *output = &outputs[output_count];
+    mistral_buffer value = MISTRAL_BUFFER_INITIALIZER;
+
+    int len = asprintf(&output->key, "%c%s=", separator, name);
+    if (len < 0) {
+        mistral_err("Could not allocate memory for schema\n");
+        return false;
+    }
+    output->key_len = (size_t)len;
+    output->write = writer;
+    output->column = column;
+    if (!column) {
+        output->identify = identify_constant;
+    } else if (column->string) {
+        output->identify = identify_string;
+    } else {
+        output->identify = identify_number;
+    }
+
+    if (constant) {
+        bool res = (role == ROLE_TAG) ?
+                   influxdb_escape_append(&value, constant, TAG_SPECIAL_CHARS) :
+                   mistral_buffer_append(&value, "\"", 1) &&
+                   influxdb_escape_append(&value, constant, FIELD_SPECIAL_CHARS) &&
+                   mistral_buffer_append(&value, "\"", 1);
+        if (!res) {
+            mistral_err("Could not allocate memory for schema\n");
+            mistral_buffer_free(&value);
+            free(output->key);
+            return false;
+        }
+        output->constant_len = value.len;
+        output->constant = mistral_buffer_release(&value);
+    }
+
+    output_count++;
+    return true;
+}
+
+/*
+ * schema_compile
+ *
+ * Build the list of tags and fields written for each point from the role of
+ * each column and environment variable.
+ *
+ * Parameters:
+ *   roles - The role of each of the standard columns
+ *
+ * Returns:
+ *   true on success
+ *   false otherwise
+ */
+static bool schema_compile(const enum influxdb_role *roles)
+{
+    outputs = calloc(COLUMN_COUNT + variable_count, sizeof(influxdb_output));
+    if (!outputs) {
+        mistral_err("Could not allocate memory for schema\n");
+        return false;
+    }
+
+    /* Tags follow the measurement and each other after a comma, the first
+     * field is separated from the tags by a space.
+     */
+    char separator = ',';
+    for (enum influxdb_role role = ROLE_TAG; role <= ROLE_FIELD; role++) {
+        if (role == ROLE_FIELD) {
+            separator = ' ';
+        }
+        for (size_t i = 0; i < COLUMN_COUNT; i++) {
+            if (roles[i] != role) {
+                continue;
+            }
+            const influxdb_column *column = &influxdb_columns[i];
+            influxdb_writer writer = (role == ROLE_TAG) ? column->tag : column->field;
+            if (!writer) {
+                mistral_err("Column %s cannot be a %s\n", column->name, influxdb_role_name[role]);
+                return false;
+            }
+            if (!schema_output_add(column->name, role, separator, writer, column, NULL)) {
+                return false;
+            }
+            separator = ',';
+        }
+        for (size_t i = 0; i < variable_count; i++) {
+            if (variables[i].role != role) {
+                continue;
+            }
+            if (!schema_output_add(variables[i].name, role, separator, write_constant, NULL,
+                                   variables[i].value))
+            {
+                return false;
+            }
+            separator = ',';
+        }
+        if (role == ROLE_TAG) {
+            tag_count = output_count;
+        }
+    }
+
+    if (separator == ' ') {
+        mistral_err("The schema must include at least one field\n");
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * influxdb_block_destroy
+ *
+ * Free a serialised data block and everything it contains.
+ *
+ * Parameters:
+ *   block - The data block to free, may be NULL
+ *
+ * Returns:
+ *   void
+ */
+static void influxdb_block_destroy(influxdb_block *block)
+{
+    if (block) {
+        mistral_buffer_free(&block->body);
+        free(block->offset);
+        free(block->retry);
+        free(block);
+    }
+}
+
+/*
+ * influxdb_block_mark
+ *
+ * Record the current end of the request body as the start of a new line, or as
+ * the end of the body once all points have been added.
+ *
+ * Parameters:
+ *   block - The data block being built
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated
+ */
+static bool influxdb_block_mark(influxdb_block *block)
+{
+    if (block->points + 1 >= block->offset_size) {
+        size_t new_size = block->offset_size ? block->offset_size * 2 : 256;
+        size_t *new_offset = realloc(block->offset, new_size * sizeof(size_t));
+        if (!new_offset) {
+            return false;
+        }
+        block->offset = new_offset;
+        block->offset_size = new_size;
+    }
+    block->offset[block->points] = block->body.len;
+    return true;
+}
+
+/*
+ * series_identify
+ *
+ * Build the series cache key for a log entry from the measurement and the raw
+ * values of the tags.
+ *
+ * Parameters:
+ *   key  - The cache key being built
+ *   item - The log entry
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated
+ */
+static bool series_identify(mistral_buffer *key, const void *item)
+{
+    const mistral_log *log_entry = item;
+    bool res = mistral_buffer_append(key, (const char *)&log_entry->measurement,
+                                     sizeof(log_entry->measurement));
+    for (size_t i = 0; res && i < tag_count; i++) {
+        res = outputs[i].identify(key, &outputs[i], log_entry);
+    }
+    return res;
+}
+
+/*
+ * series_render
+ *
+ * Render the series key for a log entry, the measurement followed by the tag
+ * set.
+ *
+ * Parameters:
+ *   text - The buffer to render into
+ *   item - The log entry
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated
+ */
+static bool series_render(mistral_buffer *text, const void *item)
+{
+    const mistral_log *log_entry = item;
+    const char *measurement = mistral_measurement_name[log_entry->measurement];
+    bool res = mistral_buffer_append(text, measurement, strlen(measurement));
+    for (size_t i = 0; res && i < tag_count; i++) {
+        const influxdb_output *output = &outputs[i];
+        res = mistral_buffer_append(text, output->key, output->key_len) &&
+              output->write(text, output, log_entry);
+    }
+    return res;
+}
+
+static mistral_cache series_cache = MISTRAL_CACHE_INITIALIZER(SERIES_CACHE_SLOTS, series_identify,
+                                                              series_render);
+
+/*
+ * timestamp_append
+ *
+ * Append the timestamp of a log entry, in the configured precision, and the
+ * end of line to a line of line protocol.
+ *
+ * Parameters:
+ *   buffer    - The buffer containing the line being built
+ *   log_entry - The log entry
+ *
+ * Returns:
+ *   true on success
+ *   false if memory could not be allocated
+ */
+static bool timestamp_append(mistral_buffer *buffer, const mistral_log *log_entry)
+{
+    if (!mistral_buffer_reserve(buffer, sizeof(" 18446744073709551615000000000\n"))) {
+        return false;
+    }
+
+    char *q = buffer->data + buffer->len;
+    *q++ = ' ';
+    q = put_decimal(q, (uint64_t)log_entry->epoch.tv_sec, 0);
+
+    switch (precision) {
+    case PRECISION_S:
+        break;
+    case PRECISION_MS:
+        q = put_decimal(q, log_entry->microseconds / 1000, 3);
+        break;
+    case PRECISION_NS:
+        q = put_decimal(q, log_entry->microseconds, 6);
+        memcpy(q, "000", 3);
+        q += 3;
+        break;
+    default:
+        q = put_decimal(q, log_entry->microseconds, 6);
+        break;
+    }
+    *q++ = '\n';
+    *q = '\0';
+    buffer->len = q - buffer->data;
+
+    return true;
+}
+
+/*
+ * udp_connect
+ *
+ * Create a UDP socket connected to the InfluxDB or Telegraf UDP listener and
+ * work out the largest payload that fits in a single packet.
+ *
+ * Parameters:
+ *   host - The host name of the listener
+ *   port - The port the listener is bound to
+ *
+ * Returns:
+ *   true on success
+ *   false otherwise
+ */
+static bool udp_connect(const char *host, uint16_t port)
+{
+    struct addrinfo hints;
+    struct addrinfo *addrs = NULL;
+    char service[sizeof("65535")];
+    int gai_retval;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    snprintf(service, sizeof service, "%" PRIu16, port);
+
+    if ((gai_retval = getaddrinfo(host, service, &hints, &addrs)) != 0) {
+        mistral_err("Failed to get host info: %s\n", gai_strerror(gai_retval));
+        return false;
+    }
+
+    for (struct addrinfo *curr = addrs; curr != NULL; curr = curr->ai_next) {
+        udp_fd = socket(curr->ai_family, curr->ai_socktype, curr->ai_protocol);
+        if (udp_fd == -1) {
+            continue;
+        }
+        if (connect(udp_fd, curr->ai_addr, curr->ai_addrlen) == -1) {
+            close(udp_fd);
+            udp_fd = -1;
+            continue;
+        }
+        /* Leave room for the IP and UDP headers */
+        udp_payload = udp_mtu - ((curr->ai_family == AF_INET6) ? 48 : 28);
+        break;
+    }
+    freeaddrinfo(addrs);
+
+    if (udp_fd == -1) {
+        char buf[256];
+        mistral_err("Unable to create UDP socket for %s:%" PRIu16 ": %s\n", host, port,
+                    strerror_r(errno, buf, sizeof buf));
+        return false;
+    }
+
+    DEBUG_OUTPUT(DBG_MED, "Sending UDP datagrams of up to %zu bytes\n", udp_payload);
+    return true;
+}
+
+/*
+ * udp_send
+ *
+ * Send every point in a data block to the UDP listener. Consecutive lines are
+ * already contiguous in the block body so each datagram is a single slice of
+ * it holding as many whole lines as fit in the payload. A line too long to
+ * share a datagram is sent on its own and relies on IP fragmentation.
+ *
+ * UDP output is loss tolerant, datagrams that cannot be sent are counted and
+ * reported rather than stopping the plug-in.
+ *
+ * Parameters:
+ *   block - The data block to send
+ *
+ * Returns:
+ *   void
+ */
+static void udp_send(const influxdb_block *block)
+{
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    size_t lines[UDP_BATCH];
+    size_t point = 0;
+    uint64_t dropped = 0;
+    int error = 0;
+
+    memset(msgs, 0, sizeof msgs);
+
+    while (point < block->points) {
+        unsigned int count = 0;
+
+        while (count < UDP_BATCH && point < block->points) {
+            size_t start = block->offset[point];
+            size_t end = block->offset[++point];
+
+            if (end - start > UDP_PAYLOAD_MAX) {
+                dropped++;
+                error = EMSGSIZE;
+                continue;
+            }
+
+            lines[count] = 1;
+            while (point < block->points && block->offset[point + 1] - start <= udp_payload) {
+                end = block->offset[++point];
+                lines[count]++;
+            }
+
+            iov[count].iov_base = block->body.data + start;
+            iov[count].iov_len = end - start;
+            msgs[count].msg_hdr.msg_iov = &iov[count];
+            msgs[count].msg_hdr.msg_iovlen = 1;
+            count++;
+        }
+
+        unsigned int sent = 0;
+        while (sent < count) {
+            int n = sendmmsg(udp_fd, msgs + sent, count - sent, 0);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                /* Skip the datagram that could not be sent and carry on */
+                error = errno;
+                dropped += lines[sent];
+                sent++;
+                continue;
+            }
+            for (int i = 0; i < n; i++) {
+                udp_lines += lines[sent + i];
+            }
+            udp_datagrams += n;
+            sent += n;
+        }
+    }
+
+    if (dropped) {
+        char buf[256];
+        mistral_err("Could not send %" PRIu64 " lines over UDP: %s\n", dropped,
+                    strerror_r(error, buf, sizeof buf));
+        udp_dropped += dropped;
+    }
+}
+
+/*
+ * write_callback
+ *
+ * Function to be called by CURL with the body of a response. The start of
+ * the body is kept so that the reason for a rejected write can be reported.
+ *
+ * Parameters:
+ *   data     - A pointer to the returned data
+ *   size     - Size of a data element
+ *   nmemb    - Number of elements to "write"
+ *   userdata - A pointer to the request the response belongs to
+ *
+ * Returns:
+ *   Number of bytes successfully processed
+ */
+static size_t write_callback(void *data, size_t size, size_t nmemb, void *userdata)
+{
+    size_t data_len = size * nmemb;
+    influxdb_request *request = (influxdb_request *)userdata;
+
+    if (request->response.len < RESPONSE_MAX) {
+        size_t keep = RESPONSE_MAX - request->response.len;
+        /* Failing to keep the body only loses detail from error messages */
+        mistral_buffer_append(&request->response, data, (data_len < keep) ? data_len : keep);
+    }
+
+    return data_len;
+}
+
+/*
+ * header_callback
+ *
+ * Function to be called by CURL with each header of a response. A Retry-After
+ * header, given either as a number of seconds or as an HTTP date, is recorded
+ * so that the request is not retried before InfluxDB is ready.
+ *
+ * Parameters:
+ *   buffer   - The header line, not null terminated
+ *   size     - Always 1
+ *   nitems   - The length of the header line
+ *   userdata - A pointer to the request the response belongs to
+ *
+ * Returns:
+ *   Number of bytes successfully processed
+ */
+static size_t header_callback(char *buffer, size_t size, size_t nitems, void *userdata)
+{
+    size_t len = size * nitems;
+    influxdb_request *request = (influxdb_request *)userdata;
+    static const char name[] = "Retry-After:";
+
+    if (len <= sizeof(name) - 1 || strncasecmp(buffer, name, sizeof(name) - 1)) {
+        return len;
+    }
+
+    char value[64];
+    const char *p = buffer + sizeof(name) - 1;
+    const char *end = buffer + len;
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    while (end > p && (end[-1] == '\r' || end[-1] == '\n' || end[-1] == ' ')) {
+        end--;
+    }
+    if (end == p || (size_t)(end - p) >= sizeof(value)) {
+        return len;
+    }
+    memcpy(value, p, end - p);
+    value[end - p] = '\0';
+
+    if (strspn(value, "0123456789") == strlen(value)) {
+        request->retry_after = strtol(value, NULL, 10);
+    } else {
+        time_t when = curl_getdate(value, NULL);
+        if (when != -1) {
+            time_t now = time(NULL);
+            request->retry_after = (when > now) ? (long)(when - now) : 0;
+        }
+    }
+    return len;
+}
+
+/*
+ * mistral_startup
+ *
+ * Required function that initialises the type of plug-in we are running. This
+ * function is called immediately on plug-in start-up.
+ *
+ * In addition this plug-in needs to initialise the InfluxDB connection
+ * parameters. The stream used for error messages defaults to stderr but can
+ * be overridden here by setting plugin->error_log.
+ *
+ * Parameters:
+ *   plugin - A pointer to the plug-in information structure. This function
+ *            must set plugin->type before returning, if it doesn't the plug-in
+ *            will immediately shut down.
+ *   argc   - The number of entries in the argv array
+ *   argv   - A pointer to the argument array passed to main.
+ *
+ * Returns:
+ *   void - but see note about setting plugin->type above.
+ */
+void mistral_startup(mistral_plugin *plugin, int argc, char *argv[])
+{
+    DEBUG_OUTPUT(DBG_ENTRY, "Entering function %d, %p, %p\n", argc, argv, plugin);
+    /* Returning without setting plug-in type will cause a clean exit */
+
+    #define CERT_DIR_OPTION_CODE 1001
+    #define BATCH_BYTES_OPTION_CODE 1002
+    #define BATCH_POINTS_OPTION_CODE 1003
+    #define CONNECTIONS_OPTION_CODE 1004
+    #define BUCKET_OPTION_CODE 1005
+    #define ORG_OPTION_CODE 1006
+    #define TOKEN_OPTION_CODE 1007
+    #define COMPRESS_OPTION_CODE 1008
+    #define PRECISION_OPTION_CODE 1009
+    #define SCHEMA_OPTION_CODE 1010
+    #define UDP_OPTION_CODE 1011
+    #define MTU_OPTION_CODE 1012
+    #define RETRIES_OPTION_CODE 1013
+
+    static const struct option options[] = {
+        {"database", required_argument, NULL, 'd'},
+        {"debug", required_argument, NULL, 'D'},
+        {"error", required_argument, NULL, 'e'},
+        {"host", required_argument, NULL, 'h'},
+        {"mode", required_argument, NULL, 'm'},
+        {"password", required_argument, NULL, 'p'},
+        {"port", required_argument, NULL, 'P'},
+        {"https", no_argument, NULL, 's'},
+        {"skip-ssl-validation", no_argument, NULL, 'k'},
+        {"username", required_argument, NULL, 'u'},
+        {"var", required_argument, NULL, 'v'},
+        {"cert-dir", required_argument, NULL, CERT_DIR_OPTION_CODE},
+        {"cert-path", required_argument, NULL, 'c'},        
+        {"batch-bytes", required_argument, NULL, BATCH_BYTES_OPTION_CODE},
+        {"batch-points", required_argument, NULL, BATCH_POINTS_OPTION_CODE},
+        {"connections", required_argument, NULL, CONNECTIONS_OPTION_CODE},
+        {"bucket", required_argument, NULL, BUCKET_OPTION_CODE},
+        {"org", required_argument, NULL, ORG_OPTION_CODE},
+        {"token", required_argument, NULL, TOKEN_OPTION_CODE},
+        {"compress", optional_argument, NULL, COMPRESS_OPTION_CODE},
+        {"precision", required_argument, NULL, PRECISION_OPTION_CODE},
+        {"schema", required_argument, NULL, SCHEMA_OPTION_CODE},
+        {"udp", no_argument, NULL, UDP_OPTION_CODE},
+        {"mtu", required_argument, NULL, MTU_OPTION_CODE},
+        {"retries", required_argument, NULL, RETRIES_OPTION_CODE},
+        {0, 0, 0, 0},
+    };
+
+    const char *database = NULL;
+    const char *error_file = NULL;
+    const char *host = "localhost";
+    const char *password = NULL;
+    uint16_t port = 0;
+    const char *username = NULL;
+    const char *protocol = "http";
+    int opt;
+    bool skip_validation = false;
+    mode_t new_mode = 0;
+    const char *cert_path = NULL;
+    const char *cert_dir = NULL;
+    const char *bucket = NULL;
+    const char *org = NULL;
+    const char *token = NULL;
+    const char **schema = NULL;
+    size_t schema_count = 0;
+    bool udp = false;
+    bool precision_set = false;
+
+    while ((opt = getopt_long(argc, argv, "d:D:e:h:m:p:P:sku:v:c:", options, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            database = optarg;
+            break;
+        case 'D': {
+            char *end = NULL;
+            unsigned long tmp_level = strtoul(optarg, &end, 10);
+            if (tmp_level == 0 || !end || *end || tmp_level > DBG_LIMIT) {
+                mistral_err("Invalid debug level '%s', using '1'\n", optarg);
+                tmp_level = 1;
+            }
+            /* For now just allow cumulative debug levels rather than selecting messages */
+            debug_level = (1 << tmp_level) - 1;
+            break;
+        }
+        case 'e':
+            error_file = optarg;
+            break;
+        case 'h':
+            host = optarg;
+            break;
+        case 'm': {
+            char *end = NULL;
+            unsigned long tmp_mode = strtoul(optarg, &end, 8);
+            if (!end || *end) {
+                tmp_mode = 0;
+            }
+            new_mode = (mode_t)tmp_mode;
+
+            if (new_mode <= 0 || new_mode > 0777) {
+                mistral_err("Invalid mode '%s' specified, using default\n", optarg);
+                new_mode = 0;
+            }
+
+            if ((new_mode & (S_IWUSR | S_IWGRP | S_IWOTH)) == 0) {
+                mistral_err(
+                    "Invalid mode '%s' specified, plug-in will not be able to write to log. Using default\n",
+                    optarg);
+                new_mode = 0;
+            }
+            break;
+        }
+        case 'p':
+            password = optarg;
+            break;
+        case 'P': {
+            char *end = NULL;
+            unsigned long tmp_port = strtoul(optarg, &end, 10);
+            if (tmp_port <= 0 || tmp_port > UINT16_MAX || !end || *end) {
+                mistral_err("Invalid port specified %s\n", optarg);
+                DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+                return;
+            }
+            port = (uint16_t)tmp_port;
+            break;
+        }
+        case 's':
+            protocol = "https";
+            break;
+        case 'k':
+            skip_validation = true;
+            break;
+        case 'u':
+            username = optarg;
+            break;
+        case 'v': {
+            if (optarg[0] == '\0' || strspn(optarg, VALID_NAME_CHARS) != strlen(optarg)) {
+                mistral_err("Invalid environment variable name %s\n", optarg);
+                break;
+            }
+
+            influxdb_variable *new_variables = realloc(variables, (variable_count + 1) *
+                                                                  sizeof(influxdb_variable));
+            if (!new_variables) {
+                mistral_err("Could not allocate memory for environment variable %s\n", optarg);
+                DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+                return;
+            }
+            variables = new_variables;
+
+            const char *var_val = getenv(optarg);
+            variables[variable_count].name = optarg;
+            variables[variable_count].value = (var_val && var_val[0]) ? var_val : "N/A";
+            variables[variable_count].role = ROLE_TAG;
+            variable_count++;
+            break;
+        }
+        case 'c':
+            cert_path = optarg;
+            break;
+        case CERT_DIR_OPTION_CODE:
+            cert_dir = optarg;
+            break;
+        case BATCH_BYTES_OPTION_CODE: {
+            unsigned long long value;
+            if (!mistral_parse_count("batch-bytes", optarg, 1, SIZE_MAX, &value)) {
+                DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+                return;
+            }
+            batch_max_bytes = (size_t)value;
+            break;
+        }
+        case BATCH_POINTS_OPTION_CODE: {
+            unsigned long long value;
+            if (!mistral_parse_count("batch-points", optarg, 0, SIZE_MAX, &value)) {
+                DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+                return;
+            }
+            batch_max_points = (size_t)value;
+            break;
+        }
+        case CONNECTIONS_OPTION_CODE: {
+            unsigned long long value;
+            if (!mistral_parse_count("connections", optarg, 1, CONNECTIONS_MAX, &value)) {
+                DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+                return;
+            }
+            connections = (unsigned long)value;
+            break;
+        }
+        case BUCKET_OPTION_CODE:
+            bucket = optarg;
+            break;
+        case ORG_OPTION_CODE:
+            org = optarg;
+            break;
+        case TOKEN_OPTION_CODE:
+            token = optarg;
+            break;
+        case COMPRESS_OPTION_CODE: {
+            unsigned long long value = Z_BEST_SPEED;
+            if (optarg && !mistral_parse_count("compress", optarg, Z_BEST_SPEED,
+                                               Z_BEST_COMPRESSION, &value))
+            {
+                DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+                return;
+            }
+            compress_level = (int)value;
+            break;
+        }
+        case PRECISION_OPTION_CODE: {
+            int i;
+            for (i = 0; precision_name[i] && strcmp(optarg, precision_name[i]); i++);
+            if (!precision_name[i]) {
+                mistral_err("Invalid precision specified %s\n", optarg);
+                DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+                return;
+            }
+            precision = (enum precision)i;
+            precision_set = true;
+            break;
+        }
+        case UDP_OPTION_CODE:
+            udp = true;
+            break;
+        case MTU_OPTION_CODE: {
+            unsigned long long value;
+            if (!mistral_parse_count("mtu", optarg, UDP_MTU_MIN, UINT16_MAX, &value)) {
+                DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+                return;
+            }
+            udp_mtu = (size_t)value;
+            break;
+        }
+        case RETRIES_OPTION_CODE: {
+            unsigned long long value;
+            if (!mistral_parse_count("retries", optarg, 0, RETRIES_MAX, &value)) {
+                DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+                return;
+            }
+            max_retries = (unsigned long)value;
+            break;
+        }
+        case SCHEMA_OPTION_CODE: {
+            /* Schema entries may name variables given later so are applied
+             * once all the options have been read.
+             */
+            const char **new_schema = realloc(schema, (schema_count + 1) * sizeof(char *));
+            if (!new_schema) {
+                mistral_err("Could not allocate memory for schema\n");
+                free(schema);
+                DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+                return;
+            }
+            schema = new_schema;
+            schema[schema_count++] = optarg;
+            break;
+        }
+        default:
+            usage(argv[0]);
+            DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+            return;
+        }
+    }
+
+    if (udp && (database || username || password || bucket || org || token || compress_level ||
+                strcmp(protocol, "http") || skip_validation || cert_path || cert_dir))
+    {
+        mistral_err("The --udp option cannot be used with options that only apply to HTTP\n");
+        DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+        return;
+    }
+
+    if (port == 0) {
+        port = (udp) ? UDP_PORT_DEFAULT : 8086;
+    }
+
+    /* A UDP listener cannot be told the precision of each write, InfluxDB 1.x
+     * and Telegraf read timestamps as nanoseconds unless configured otherwise.
+     */
+    if (udp && !precision_set) {
+        precision = PRECISION_NS;
+    }
+
+    if (bucket && (database || username || password)) {
+        mistral_err("The --database, --username and --password options cannot be used with --bucket\n");
+        DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+        return;
+    }
+
+    if (!bucket && (org || token)) {
+        mistral_err("The --org and --token options require --bucket\n");
+        DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+        return;
+    }
+
+    if (!database) {
+        database = "mistral";
+    }
+
+    enum influxdb_role roles[COLUMN_COUNT];
+    for (size_t i = 0; i < COLUMN_COUNT; i++) {
+        roles[i] = influxdb_columns[i].role;
+    }
+
+    for (size_t i = 0; i < schema_count; i++) {
+        if (!schema_apply(schema[i], roles)) {
+            free(schema);
+            DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+            return;
+        }
+    }
+    free(schema);
+
+    if (!schema_compile(roles)) {
+        DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+        return;
+    }
+
+    log_file_ptr = &(plugin->error_log);
+
+    /* Error file is opened/created by the first error_msg
+     */
+    plugin->error_log = stderr;
+    plugin->error_log_name = (char *)error_file;
+    plugin->error_log_mode = new_mode;
+    plugin->flags = 0;
+
+    if (udp) {
+        if (!udp_connect(host, port)) {
+            DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+            return;
+        }
+        /* Returning after this point indicates success */
+        plugin->type = OUTPUT_PLUGIN;
+        return;
+    }
+
+    if (curl_global_init(CURL_GLOBAL_ALL)) {
+        mistral_err("Could not initialise curl\n");
+        DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+        return;
+    }
+
+    /* Initialise curl */
+    easyhandle = curl_easy_init();
+
+    if (!easyhandle) {
+        mistral_err("Could not initialise curl handle\n");
+        DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+        return;
+    }
+
+    if (curl_easy_setopt(easyhandle, CURLOPT_ERRORBUFFER, curl_error) != CURLE_OK) {
+        mistral_err("Could not set curl error buffer\n");
+        DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+        return;
+    }
+
+    /* The status and body of every response are checked so that batches can
+     * be retried, they must not be written to stdout.
+     */
+    if (curl_easy_setopt(easyhandle, CURLOPT_WRITEFUNCTION, write_callback) != CURLE_OK ||
+        curl_easy_setopt(easyhandle, CURLOPT_HEADERFUNCTION, header_callback) != CURLE_OK)
+    {
+        mistral_err("Could not set curl response callbacks\n");
         DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
         return;
     }
@@ -484,42 +1720,162 @@ void mistral_startup(mistral_plugin *plugin, int argc, char *argv[])
         }
     }    
 
-    /* Set InfluxDB connection options and set precision to microseconds as this
-     * is what we see in logs
-     *
-     * Some versions of libcurl appear to use pointers to the original data for
-     * option values, therefore we use global variables for both the URL and
-     * authentication strings.
+    /* Set InfluxDB connection options. Either the v1 /write API, authenticated
+     * with a username and password, or the v2 /api/v2/write API, authenticated
+     * with a token, is used.
+     *
+     * Some versions of libcurl appear to use pointers to the original data for
+     * option values, therefore we use global variables for both the URL and
+     * authentication strings.
+     */
+    if (bucket) {
+        char *bucket_escaped = curl_easy_escape(easyhandle, bucket, 0);
+        char *org_escaped = org ? curl_easy_escape(easyhandle, org, 0) : NULL;
+
+        if (!bucket_escaped || (org && !org_escaped) ||
+            asprintf(&url, "%s://%s:%d/api/v2/write?bucket=%s&precision=%s%s%s", protocol, host,
+                     port, bucket_escaped, precision_name[precision], (org) ? "&org=" : "",
+                     (org) ? org_escaped : "") < 0)
+        {
+            mistral_err("Could not allocate memory for connection URL\n");
+            curl_free(org_escaped);
+            curl_free(bucket_escaped);
+            DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+            return;
+        }
+        curl_free(org_escaped);
+        curl_free(bucket_escaped);
+    } else if (asprintf(&url, "%s://%s:%d/write?db=%s&precision=%s", protocol, host,
+                        port, database, precision_v1_name[precision]) < 0)
+    {
+        mistral_err("Could not allocate memory for connection URL\n");
+        DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+        return;
+    }
+    DEBUG_OUTPUT(DBG_MED, "InfluxDB connection URL: %s\n", url);
+
+    if (!set_curl_option(CURLOPT_URL, url)) {
+        DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+        free(url);
+        return;
+    }
+
+    /* Set up authentication */
+    if (bucket) {
+        char *line = NULL;
+        if (token && strncmp(token, "file:", 5) == 0) {
+            FILE *token_file = fopen(token + 5, "r");
+            if (token_file == NULL) {
+                mistral_err("Could not open authentication token file %s: %s\n",
+                            token + 5, strerror(errno));
+                DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+                return;
+            }
+            size_t n = 0;
+            ssize_t ret = getline(&line, &n, token_file);
+            fclose(token_file);
+            if (ret == -1) {
+                mistral_err("Could not read authentication token file %s: %s\n",
+                            token + 5, strerror(errno));
+                free(line);
+                DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+                return;
+            }
+            if (ret > 0 && line[ret - 1] == '\n') {
+                line[ret - 1] = '\0';
+            }
+            token = line;
+        }
+
+        if (token) {
+            if (asprintf(&auth, "Authorization: Token %s", token) < 0) {
+                mistral_err("Could not allocate memory for authentication\n");
+                free(line);
+                DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+                return;
+            }
+            headers = curl_slist_append(headers, auth);
+        }
+        free(line);
+    } else {
+        if (asprintf(&auth, "%s:%s", (username) ? username : "",
+                     (password) ? password : "") < 0)
+        {
+            mistral_err("Could not allocate memory for authentication\n");
+            DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+            return;
+        }
+
+        if (strcmp(auth, ":")) {
+            if (curl_easy_setopt(easyhandle, CURLOPT_USERPWD, auth) != CURLE_OK) {
+                mistral_err("Could not set up authentication\n");
+                DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+                free(auth);
+                return;
+            }
+        }
+    }
+
+    headers = curl_slist_append(headers, "Content-Type: text/plain; charset=utf-8");
+    if (compress_level) {
+        headers = curl_slist_append(headers, "Content-Encoding: gzip");
+    }
+    if (!headers || !set_curl_option(CURLOPT_HTTPHEADER, headers)) {
+        mistral_err("Could not set up HTTP headers\n");
+        DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+        return;
+    }
+
+    /* Each concurrent write request needs its own handle, these are copies of
+     * the fully configured handle above that are driven by a single multi
+     * handle so their connections can be kept alive and reused.
      */
-    if (asprintf(&url, "%s://%s:%d/write?db=%s&precision=u", protocol, host,
-                 port, database) < 0)
-    {
-        mistral_err("Could not allocate memory for connection URL\n");
+    multihandle = curl_multi_init();
+    if (!multihandle) {
+        mistral_err("Could not initialise curl multi handle\n");
         DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
         return;
     }
-    DEBUG_OUTPUT(DBG_MED, "InfluxDB connection URL: %s\n", url);
 
-    if (!set_curl_option(CURLOPT_URL, url)) {
+    if (curl_multi_setopt(multihandle, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)connections) != CURLM_OK) {
+        mistral_err("Could not set curl connection limit\n");
         DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
-        free(url);
         return;
     }
 
-    /* Set up authentication */
-    if (asprintf(&auth, "%s:%s", (username) ? username : "",
-                 (password) ? password : "") < 0)
-    {
-        mistral_err("Could not allocate memory for authentication\n");
+    requests = calloc(connections, sizeof(influxdb_request));
+    if (!requests) {
+        mistral_err("Could not allocate memory for curl requests\n");
         DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
         return;
     }
 
-    if (strcmp(auth, ":")) {
-        if (curl_easy_setopt(easyhandle, CURLOPT_USERPWD, auth) != CURLE_OK) {
-            mistral_err("Could not set up authentication\n");
+    for (unsigned long i = 0; i < connections; i++) {
+        influxdb_request *request = &requests[i];
+        request->handle = curl_easy_duphandle(easyhandle);
+        if (!request->handle) {
+            mistral_err("Could not initialise curl handle\n");
+            DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+            return;
+        }
+        if (compress_level) {
+            /* Adding 16 to the window bits selects a gzip rather than zlib wrapper */
+            if (deflateInit2(&request->zstream, compress_level, Z_DEFLATED, 15 + 16, 8,
+                             Z_DEFAULT_STRATEGY) != Z_OK)
+            {
+                mistral_err("Could not initialise compression\n");
+                DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
+                return;
+            }
+            request->zstream_init = true;
+        }
+        if (curl_easy_setopt(request->handle, CURLOPT_ERRORBUFFER, request->error) != CURLE_OK ||
+            curl_easy_setopt(request->handle, CURLOPT_PRIVATE, request) != CURLE_OK ||
+            curl_easy_setopt(request->handle, CURLOPT_WRITEDATA, request) != CURLE_OK ||
+            curl_easy_setopt(request->handle, CURLOPT_HEADERDATA, request) != CURLE_OK)
+        {
+            mistral_err("Could not set up curl handle\n");
             DEBUG_OUTPUT(DBG_HIGH, "Leaving function, failed\n");
-            free(auth);
             return;
         }
     }
@@ -549,13 +1905,57 @@ void mistral_exit(void)
         mistral_received_data_end(0, false);
     }
 
+    if (requests) {
+        for (unsigned long i = 0; i < connections; i++) {
+            if (requests[i].handle) {
+                curl_easy_cleanup(requests[i].handle);
+            }
+            if (requests[i].zstream_init) {
+                deflateEnd(&requests[i].zstream);
+            }
+            mistral_buffer_free(&requests[i].compressed);
+            mistral_buffer_free(&requests[i].response);
+        }
+        free(requests);
+    }
+
+    if (multihandle) {
+        curl_multi_cleanup(multihandle);
+    }
+
     if (easyhandle) {
         curl_easy_cleanup(easyhandle);
     }
 
+    if (headers) {
+        curl_slist_free_all(headers);
+    }
+
     curl_global_cleanup();
 
-    free(custom_variables);
+    if (udp_fd >= 0) {
+        close(udp_fd);
+        mistral_err("Sent %" PRIu64 " lines in %" PRIu64 " UDP datagrams, %" PRIu64
+                    " lines could not be sent\n", udp_lines, udp_datagrams, udp_dropped);
+    }
+
+    if (failed_total) {
+        mistral_err("%" PRIu64 " points could not be written\n", failed_total);
+    }
+
+    if (compress_in_total) {
+        mistral_err("Compressed %" PRIu64 " bytes of line protocol to %" PRIu64
+                    " bytes, a ratio of %.1f:1\n", compress_in_total, compress_out_total,
+                    (double)compress_in_total / (compress_out_total ? compress_out_total : 1));
+    }
+
+    for (size_t i = 0; i < output_count; i++) {
+        free(outputs[i].key);
+        free(outputs[i].constant);
+    }
+    free(outputs);
+    free(variables);
+    mistral_cache_free(&series_cache);
     free(auth);
     free(url);
 
@@ -600,9 +2000,10 @@ void mistral_received_log(mistral_log *log_entry)
  * mistral_received_data_end
  *
  * Function called whenever an end of data block message is received. At this
- * point run through the linked list of log entries we have seen and send them
- * to InfluxDB. Remove each log_entry from the linked list as they are
- * processed and destroy them.
+ * point run through the linked list of log entries we have seen and build the
+ * request body. Remove each log_entry from the linked list as they are
+ * processed and destroy them. The body is then handed to the plug-in framework
+ * to be sent to InfluxDB by mistral_sink_deliver.
  *
  * No special handling of data block number errors is done beyond the message
  * logged by the main plug-in framework. Instead this function will simply
@@ -625,87 +2026,47 @@ void mistral_received_data_end(uint64_t block_num, bool block_error)
     UNUSED(block_num);
     UNUSED(block_error);
 
-    char *data = NULL;
+    influxdb_block *block = calloc(1, sizeof(influxdb_block));
+    if (!block) {
+        mistral_err("Could not allocate memory for data block\n");
+        mistral_shutdown();
+        DEBUG_OUTPUT(DBG_ENTRY, "Leaving function, failed\n");
+        return;
+    }
 
     mistral_log *log_entry = log_list_head;
 
     while (log_entry) {
-        /* Double quotes must must be escaped in the field strings. */
-        char *command = influxdb_escape_field(log_entry->command);
-        char *file = influxdb_escape_field(log_entry->file);
-        char *path = influxdb_escape_field(log_entry->path);
-        char *fstype = influxdb_escape_field(log_entry->fstype);
-        char *fsname = influxdb_escape_field(log_entry->fsname);
-        char *fshost = influxdb_escape_field(log_entry->fshost);
-        const char *job_gid = (log_entry->job_group_id[0] == 0) ? "N/A" : log_entry->job_group_id;
-        const char *job_id = (log_entry->job_id[0] == 0) ? "N/A" : log_entry->job_id;
-        char *new_data = NULL;
-
-        /* InfluxDB tags are always strings. They are indexed and stored in memory. Our current
-         * tags are measurement type, call type, job group ID, job ID, label and hostname. None
-         * of these tags should contain commas, spaces or equals signs, so we don't need to worry
-         * about escaping these characters.
+        /* InfluxDB tags are always strings. They are indexed and stored in memory
+         * while fields are not indexed and hence should not be used as query
+         * filters. Which values are tags and which are fields is decided by the
+         * schema compiled at start up, each line is then the measurement followed
+         * by every tag and field in turn.
          *
-         * InfluxDB fields are not indexed and hence should not be used as query filters. They
-         * use different data types, like strings and integers. Strings are double-quoted, so we
-         * have to escape double quotes in command and file path. Integers require 'i' suffix,
-         * otherwise InfluxDB interprets the value as a float. For example, if you omit 'i' with
-         * size-max value 9223372036854775807, InfluxDB stores it as 9.223372036854776e+18 and
-         * returns 9223372036854776000.
+         * The measurement and tags, the series key, are the same for every
+         * record from a rule, job and host so are copied from the series cache.
+         *
+         * Each line is appended to the block so building the body takes linear time.
          */
-        if (asprintf(&new_data,
-                     "%s%s%s,calltype=%s,jobgroup=%s,jobid=%s,label=%s,path=\"%s\","
-                     "fstype=\"%s\",fsname=\"%s\",fshost=\"%s\",host=%s%s"
-                     " command=\"%s\",cpu=%" PRIu32 "i,file=\"%s\",logtype=\"%s\""
-                     ",mpirank=%" PRId32 "i,pid=%" PRId64 "i,scope=\"%s\""
-                     ",sizemin=%" PRIu64 "i,sizemax=%" PRIu64 "i,threshold=%" PRIu64
-                     "i,timeframe=%" PRIu64 "i,value=%"
-                     PRIu64 " %ld%06" PRIu32,
-                     (data) ? data : "", (data) ? "\n" : "",
-                     mistral_measurement_name[log_entry->measurement],
-                     log_entry->call_type_names,
-                     job_gid,
-                     job_id,
-                     log_entry->label,
-                     path,
-                     fstype,
-                     fsname,
-                     fshost,
-                     log_entry->hostname,
-                     (custom_variables) ? custom_variables : "",
-                     command,
-                     log_entry->cpu,
-                     file,
-                     mistral_contract_name[log_entry->contract_type],
-                     log_entry->mpi_rank,
-                     log_entry->pid,
-                     mistral_scope_name[log_entry->scope],
-                     log_entry->size_min,
-                     log_entry->size_max,
-                     log_entry->threshold,
-                     log_entry->timeframe,
-                     log_entry->measured,
-                     log_entry->epoch.tv_sec,
-                     log_entry->microseconds) < 0)
-        {
+        const mistral_cache_entry *series = mistral_cache_get(&series_cache, log_entry);
+        bool res = series && influxdb_block_mark(block) &&
+                   mistral_buffer_append(&block->body, series->text, series->text_len);
+
+        for (size_t i = tag_count; res && i < output_count; i++) {
+            const influxdb_output *output = &outputs[i];
+            res = mistral_buffer_append(&block->body, output->key, output->key_len) &&
+                  output->write(&block->body, output, log_entry);
+        }
+        res = res && timestamp_append(&block->body, log_entry);
+
+        if (!res) {
             mistral_err("Could not allocate memory for log entry\n");
-            free(data);
-            free(fshost);
-            free(fsname);
-            free(fstype);
-            free(file);
-            free(command);
+            influxdb_block_destroy(block);
             mistral_shutdown();
             DEBUG_OUTPUT(DBG_ENTRY, "Leaving function, failed\n");
             return;
         }
-        free(data);
-        free(fshost);
-        free(fsname);
-        free(fstype);
-        free(file);
-        free(command);
-        data = new_data;
+        block->points++;
 
         log_list_head = log_entry->forward;
         remque(log_entry);
@@ -715,27 +2076,464 @@ void mistral_received_data_end(uint64_t block_num, bool block_error)
     }
     log_list_tail = NULL;
 
-    if (data) {
-        if (!set_curl_option(CURLOPT_POSTFIELDS, data)) {
-            mistral_shutdown();
+    if (block->points == 0) {
+        influxdb_block_destroy(block);
+        DEBUG_OUTPUT(DBG_ENTRY, "Leaving function, nothing to send\n");
+        return;
+    }
+
+    if (!influxdb_block_mark(block)) {
+        mistral_err("Could not allocate memory for data block\n");
+        influxdb_block_destroy(block);
+        mistral_shutdown();
+        DEBUG_OUTPUT(DBG_ENTRY, "Leaving function, failed\n");
+        return;
+    }
+
+    if (!mistral_sink_submit(block)) {
+        influxdb_block_destroy(block);
+        mistral_shutdown();
+        DEBUG_OUTPUT(DBG_ENTRY, "Leaving function, failed\n");
+        return;
+    }
+    DEBUG_OUTPUT(DBG_ENTRY, "Leaving function, success\n");
+}
+
+/*
+ * request_start
+ *
+ * Start sending the next batch of points from a data block on an idle
+ * connection. Points are added to the batch until either the --batch-points or
+ * --batch-bytes limit would be exceeded. The batch is sent straight from the
+ * block's buffer without being copied.
+ *
+ * Parameters:
+ *   request - The idle request to use
+ *   block   - The data block being sent
+ *
+ * Returns:
+ *   true on success
+ *   false otherwise
+ */
+static bool request_start(influxdb_request *request, influxdb_block *block)
+{
+    DEBUG_OUTPUT(DBG_ENTRY, "Entering function, %p, %p\n", (void *)request, (void *)block);
+
+    size_t start = block->offset[block->next_point];
+
+    request->block = block;
+    request->first_point = block->next_point;
+    request->points = 0;
+    request->error[0] = '\0';
+    request->retry_after = -1;
+    mistral_buffer_reset(&request->response);
+
+    do {
+        block->next_point++;
+        request->points++;
+    } while (block->next_point < block->points &&
+             block->offset[block->next_point + 1] - start <= batch_max_bytes &&
+             (batch_max_points == 0 || request->points < batch_max_points));
+
+    const char *post = block->body.data + start;
+    size_t post_len = block->offset[block->next_point] - start;
+
+    if (compress_level) {
+        if (!mistral_compress(&request->zstream, &request->compressed, post, post_len)) {
             DEBUG_OUTPUT(DBG_ENTRY, "Leaving function, failed\n");
-            return;
+            return false;
         }
+        compress_in_total += post_len;
+        compress_out_total += request->compressed.len;
+        post = request->compressed.data;
+        post_len = request->compressed.len;
+    }
 
-        CURLcode ret = curl_easy_perform(easyhandle);
-        if (ret != CURLE_OK) {
-            /* Depending on the version of curl used during compilation
-             * curl_error may not be populated. If this is the case, look up
-             * the less detailed error based on return code instead.
-             */
-            mistral_err("Could not run curl query: %s\n",
-                        (*curl_error != '\0') ? curl_error : curl_easy_strerror(ret));
-            mistral_shutdown();
+    /* The body is not null terminated at the end of a batch so the size must be
+     * set explicitly.
+     */
+    if (curl_easy_setopt(request->handle, CURLOPT_POSTFIELDS, post) != CURLE_OK ||
+        curl_easy_setopt(request->handle, CURLOPT_POSTFIELDSIZE_LARGE,
+                         (curl_off_t)post_len) != CURLE_OK)
+    {
+        mistral_err("Could not set curl option: %s\n", request->error);
+        DEBUG_OUTPUT(DBG_ENTRY, "Leaving function, failed\n");
+        return false;
+    }
+
+    if (curl_multi_add_handle(multihandle, request->handle) != CURLM_OK) {
+        mistral_err("Could not add curl request\n");
+        DEBUG_OUTPUT(DBG_ENTRY, "Leaving function, failed\n");
+        return false;
+    }
+
+    request->busy = true;
+    DEBUG_OUTPUT(DBG_MED, "Sending %zu points from point %zu in %zu bytes\n", request->points,
+                 request->first_point, post_len);
+    DEBUG_OUTPUT(DBG_ENTRY, "Leaving function, success\n");
+    return true;
+}
+
+/*
+ * response_rejected
+ *
+ * Work out how many points of a batch were rejected from the body of a 400
+ * response. InfluxDB 1.x reports the number dropped, 2.x the number written
+ * and 3.x lists each rejected line. If none of these are found every point in
+ * the batch is assumed to have been rejected.
+ *
+ * Parameters:
+ *   request - The completed request
+ *
+ * Returns:
+ *   The number of points rejected
+ */
+static size_t response_rejected(const influxdb_request *request)
+{
+    const char *body = (request->response.data) ? request->response.data : "";
+    const char *p;
+    unsigned long count;
+
+    if ((p = strstr(body, "dropped=")) && sscanf(p, "dropped=%lu", &count) == 1) {
+        return (count < request->points) ? count : request->points;
+    }
+
+    if ((p = strstr(body, "partial write error (")) &&
+        sscanf(p, "partial write error (%lu written)", &count) == 1)
+    {
+        return (count < request->points) ? request->points - count : 0;
+    }
+
+    count = 0;
+    for (p = body; (p = strstr(p, "\"line_number\"")); p++) {
+        count++;
+    }
+    if (count) {
+        return (count < request->points) ? count : request->points;
+    }
+
+    return request->points;
+}
+
+/*
+ * request_finish
+ *
+ * Check the result of a completed write request and make its handle available
+ * for reuse.
+ *
+ * Batches rejected because InfluxDB is overloaded (429) or temporarily
+ * unavailable (500, 502, 503 and 504) are marked to be sent again, honouring
+ * any Retry-After delay. A 400 response means some or all of the points could
+ * never be written as they stand, for example due to a field type conflict,
+ * but any other points in the batch were written. Resending the batch cannot
+ * help so the rejected points are counted as failures. Any other status, such
+ * as an authentication failure or a missing database, is fatal.
+ *
+ * Parameters:
+ *   request - The request that has completed
+ *   result  - The result code of the transfer
+ *
+ * Returns:
+ *   true if a response was received that allows sending to continue
+ *   false otherwise
+ */
+static bool request_finish(influxdb_request *request, CURLcode result)
+{
+    DEBUG_OUTPUT(DBG_ENTRY, "Entering function, %p, %d\n", (void *)request, (int)result);
+
+    influxdb_block *block = request->block;
+    long http_code = 0;
+
+    curl_multi_remove_handle(multihandle, request->handle);
+    request->busy = false;
+
+    if (result != CURLE_OK) {
+        /* Depending on the version of curl used during compilation
+         * the error buffer may not be populated. If this is the case, look up
+         * the less detailed error based on return code instead.
+         */
+        mistral_err("Could not run curl query: %s\n",
+                    (request->error[0] != '\0') ? request->error : curl_easy_strerror(result));
+        DEBUG_OUTPUT(DBG_ENTRY, "Leaving function, failed\n");
+        return false;
+    }
+
+    curl_easy_getinfo(request->handle, CURLINFO_RESPONSE_CODE, &http_code);
+    const char *body = (request->response.data) ? request->response.data : "";
+
+    if (http_code >= 200 && http_code < 300) {
+        DEBUG_OUTPUT(DBG_ENTRY, "Leaving function, success\n");
+        return true;
+    }
+
+    if (http_code == 429 || (http_code >= 500 && http_code <= 504 && http_code != 501)) {
+        for (size_t i = 0; i < request->points; i++) {
+            block->retry[request->first_point + i] = true;
+        }
+        block->retries += request->points;
+
+        if (request->retry_after >= 0) {
+            unsigned long delay = (request->retry_after < RETRY_AFTER_MAX) ?
+                                  (unsigned long)request->retry_after * 1000 :
+                                  RETRY_AFTER_MAX * 1000;
+            if (delay > block->retry_after) {
+                block->retry_after = delay;
+            }
+        }
+        DEBUG_OUTPUT(DBG_MED, "Batch of %zu points will be retried, HTTP status %ld\n",
+                     request->points, http_code);
+        DEBUG_OUTPUT(DBG_ENTRY, "Leaving function, retry\n");
+        return true;
+    }
+
+    if (http_code == 400) {
+        size_t rejected = response_rejected(request);
+        block->failed += rejected;
+        mistral_err("InfluxDB rejected %zu of %zu points: %.512s\n", rejected, request->points,
+                    body);
+        DEBUG_OUTPUT(DBG_ENTRY, "Leaving function, rejected\n");
+        return true;
+    }
+
+    mistral_err("InfluxDB write failed with HTTP status %ld: %.512s\n", http_code, body);
+    DEBUG_OUTPUT(DBG_ENTRY, "Leaving function, failed\n");
+    return false;
+}
+
+/*
+ * block_send
+ *
+ * Send every point in a data block to InfluxDB. The block is split into
+ * batches limited by --batch-points and --batch-bytes which are sent over up to
+ * --connections concurrent connections. The result of every request is
+ * collected before this function returns.
+ *
+ * Parameters:
+ *   block - The data block to send
+ *
+ * Returns:
+ *   true if every request received a response, the outcome of each point is
+ *        recorded in the block
+ *   false otherwise
+ */
+static bool block_send(influxdb_block *block)
+{
+    DEBUG_OUTPUT(DBG_ENTRY, "Entering function, %p\n", (void *)block);
+
+    int running = 0;
+    bool success = true;
+
+    block->next_point = 0;
+    block->retries = 0;
+    block->failed = 0;
+    block->retry_after = 0;
+    if (!block->retry) {
+        block->retry = calloc(block->points, sizeof(bool));
+        if (!block->retry) {
+            mistral_err("Could not allocate memory for data block\n");
             DEBUG_OUTPUT(DBG_ENTRY, "Leaving function, failed\n");
+            return false;
         }
     }
-    free(data);
-    DEBUG_OUTPUT(DBG_ENTRY, "Leaving function, success\n");
+
+    do {
+        /* Keep every connection busy while there are points left to send */
+        for (unsigned long i = 0; i < connections && success && block->next_point < block->points; i++) {
+            if (!requests[i].busy && !request_start(&requests[i], block)) {
+                success = false;
+            }
+        }
+
+        if (curl_multi_perform(multihandle, &running) != CURLM_OK) {
+            mistral_err("Could not run curl query\n");
+            success = false;
+            break;
+        }
+
+        CURLMsg *msg;
+        int queued;
+        while ((msg = curl_multi_info_read(multihandle, &queued))) {
+            if (msg->msg == CURLMSG_DONE) {
+                influxdb_request *request = NULL;
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&request);
+                if (request && !request_finish(request, msg->data.result)) {
+                    success = false;
+                }
+            }
+        }
+
+        if (running && curl_multi_wait(multihandle, NULL, 0, 1000, NULL) != CURLM_OK) {
+            mistral_err("Could not wait for curl query\n");
+            success = false;
+            break;
+        }
+    } while (running || (success && block->next_point < block->points));
+
+    /* Abandon any requests still in progress after an error */
+    for (unsigned long i = 0; i < connections; i++) {
+        if (requests[i].busy) {
+            curl_multi_remove_handle(multihandle, requests[i].handle);
+            requests[i].busy = false;
+        }
+    }
+
+    DEBUG_OUTPUT(DBG_ENTRY, "Leaving function, %s\n", success ? "success" : "failed");
+    return success;
+}
+
+/*
+ * block_retry
+ *
+ * Create a new data block containing only the points of an existing block
+ * that have been marked to be sent again.
+ *
+ * Parameters:
+ *   block - The data block that was sent
+ *
+ * Returns:
+ *   A pointer to the new data block or NULL on error
+ */
+static influxdb_block *block_retry(const influxdb_block *block)
+{
+    influxdb_block *retry = calloc(1, sizeof(influxdb_block));
+    if (!retry) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < block->points; i++) {
+        if (!block->retry[i]) {
+            continue;
+        }
+        if (!influxdb_block_mark(retry) ||
+            !mistral_buffer_append(&retry->body, block->body.data + block->offset[i],
+                                   block->offset[i + 1] - block->offset[i]))
+        {
+            influxdb_block_destroy(retry);
+            return NULL;
+        }
+        retry->points++;
+    }
+
+    if (!influxdb_block_mark(retry)) {
+        influxdb_block_destroy(retry);
+        return NULL;
+    }
+    return retry;
+}
+
+/*
+ * mistral_sink_deliver
+ *
+ * Function called by the plug-in framework with each block of points built by
+ * mistral_received_data_end. This is called on the sink worker thread, if it
+ * is running, so that the next data block can be parsed while this one is sent
+ * to InfluxDB.
+ *
+ * Batches rejected because InfluxDB is overloaded or temporarily unavailable
+ * are kept in memory and sent again after an increasing delay, or the delay
+ * requested by InfluxDB if that is longer, up to --retries times. Only points
+ * that still could not be written are counted as failures.
+ *
+ * If InfluxDB cannot be reached or refuses every write the mistral_shutdown
+ * flag is set to true which will cause the plug-in to exit cleanly.
+ *
+ * Parameters:
+ *   block - The data block to send. Freed by this function.
+ *
+ * Returns:
+ *   void
+ */
+void mistral_sink_deliver(void *block)
+{
+    DEBUG_OUTPUT(DBG_ENTRY, "Entering function, %p\n", block);
+
+    influxdb_block *data = block;
+    unsigned long delay = RETRY_DELAY_INITIAL;
+
+    if (udp_fd >= 0) {
+        udp_send(data);
+        influxdb_block_destroy(data);
+        DEBUG_OUTPUT(DBG_ENTRY, "Leaving function\n");
+        return;
+    }
+
+    for (unsigned long attempt = 0; ; attempt++) {
+        if (!block_send(data)) {
+            mistral_shutdown();
+            break;
+        }
+
+        failed_total += data->failed;
+
+        if (data->retries == 0) {
+            break;
+        }
+
+        if (attempt == max_retries) {
+            mistral_err("%zu points were still rejected after %lu retries\n",
+                        data->retries, max_retries);
+            failed_total += data->retries;
+            break;
+        }
+
+        unsigned long wait_ms = (data->retry_after > delay) ? data->retry_after : delay;
+        DEBUG_OUTPUT(DBG_MED, "Retrying %zu points in %lums\n", data->retries, wait_ms);
+
+        influxdb_block *retry = block_retry(data);
+        if (!retry) {
+            mistral_err("Could not allocate memory for data block\n");
+            mistral_shutdown();
+            break;
+        }
+        influxdb_block_destroy(data);
+        data = retry;
+
+        struct timespec wait = {wait_ms / 1000, (wait_ms % 1000) * 1000000};
+        while (nanosleep(&wait, &wait) == -1 && errno == EINTR);
+        delay = (delay * 2 < RETRY_DELAY_MAX) ? delay * 2 : RETRY_DELAY_MAX;
+    }
+    influxdb_block_destroy(data);
+    DEBUG_OUTPUT(DBG_ENTRY, "Leaving function\n");
+}
+
+/*
+ * mistral_sink_discard
+ *
+ * Function called by the plug-in framework with each data block still queued
+ * for the sink worker thread once the plug-in is shutting down after an error.
+ *
+ * Parameters:
+ *   block - The data block to discard. Freed by this function.
+ *
+ * Returns:
+ *   void
+ */
+void mistral_sink_discard(void *block)
+{
+    influxdb_block_destroy(block);
+}
+
+/*
+ * mistral_flush
+ *
+ * Function called by the plug-in framework part way through a data block once
+ * the configured flush interval has elapsed or enough data has been received.
+ * Send the log entries seen so far to InfluxDB so that a large data block
+ * is not held in memory in full and data becomes visible sooner.
+ *
+ * Parameters:
+ *   block_num   - The data block number currently being received.
+ *
+ * Returns:
+ *   void
+ */
+void mistral_flush(uint64_t block_num)
+{
+    DEBUG_OUTPUT(DBG_ENTRY, "Entering function, %" PRIu64 "\n", block_num);
+    if (log_list_head) {
+        DEBUG_OUTPUT(DBG_LOW, "Flushing log entries part way through data block\n");
+        mistral_received_data_end(block_num, false);
+    }
 }
 
 /*
@@ -11,6 +11,8 @@
 #include <sys/stat.h>           /* open, umask */
 #include <sys/types.h>          /* open, umask */
 
+#include "mistral_buffer.h"
+#include "mistral_json.h"
 #include "mistral_plugin.h"
 
 #define VALID_NAME_CHARS "1234567890abcdefghijklmnopqrstvuwxyzABCDEFGHIJKLMNOPQRSTVUWXYZ-_"
@@ -176,82 +178,6 @@ static void usage(const char *name)
                 "\n");
 }
 
-/*
- * splunk_escape
- *
- * Splunk uses JSON output which uses double quotes to delimit strings.
- * There are several special characters that must be escaped using a single
- * backslash character inside these strings.
- *
- * This function allocates twice as much memory as is required to copy the
- * passed string and then copies the string character by character escaping
- * the common characters that need special treatment as they are encountered.
- * Once the copy is complete the memory is reallocated to reduce wastage.
- *
- * Parameters:
- *   string - The string whose content needs to be escaped
- *
- * Returns:
- *   A pointer to newly allocated memory containing the escaped string or
- *   NULL on error
- */
-static char *splunk_escape(const char *string)
-{
-    if (!string) {
-        return NULL;
-    }
-    size_t len = strlen(string);
-
-    char *escaped = calloc(1, (2 * len + 1) * sizeof(char));
-    char *p, *q;
-    if (escaped) {
-        for (p = (char *)string, q = escaped; *p; p++, q++) {
-            switch (*p) {
-            case '"':
-                *q++ = '\\';
-                *q = '"';
-                break;
-            case '\\':
-                *q++ = '\\';
-                *q = '\\';
-                break;
-            case '\b':
-                *q++ = '\\';
-                *q = 'b';
-                break;
-            case '\f':
-                *q++ = '\\';
-                *q = 'f';
-                break;
-            case '\n':
-                *q++ = '\\';
-                *q = 'n';
-                break;
-            case '\r':
-                *q++ = '\\';
-                *q = 'r';
-                break;
-            case '\t':
-                *q++ = '\\';
-                *q = 't';
-                break;
-            default:
-                *q = *p;
-                break;
-            }
-        }
-        /* Memory was allocated with calloc so string is already null terminated */
-        char *small_escaped = realloc(escaped, q - escaped + 1);
-        if (small_escaped) {
-            return small_escaped;
-        } else {
-            return escaped;
-        }
-    } else {
-        return NULL;
-    }
-}
-
 /*
  * mistral_startup
  *
@@ -361,35 +287,30 @@ void mistral_startup(mistral_plugin *plugin, int argc, char *argv[])
             }
             break;
         case 'v': {
-            char *var_val = NULL;
-            char *new_var = NULL;
+            const char *var_val = NULL;
+            mistral_buffer new_var = MISTRAL_BUFFER_INITIALIZER;
 
             if (optarg[0] != '\0' && strspn(optarg, VALID_NAME_CHARS) == strlen(optarg)) {
-                var_val = splunk_escape(getenv(optarg));
+                var_val = getenv(optarg);
                 if (var_val == NULL || var_val[0] == '\0') {
-                    var_val = strdup("N/A");
-                }
-                if (var_val == NULL) {
-                    mistral_err("Could not allocate memory for environment variable value %s\n",
-                                optarg);
-                    return;
+                    var_val = "N/A";
                 }
             } else {
                 mistral_err("Invalid environment variable name %s\n", optarg);
             }
-            if (asprintf(&new_var, "%s%s\"%s\":\"%s\"",
-                         (custom_variables) ? custom_variables : "",
-                         (custom_variables) ? "," : "",
-                         optarg,
-                         var_val) < 0)
+            if (!mistral_buffer_printf(&new_var, "%s%s\"%s\":\"",
+                                       (custom_variables) ? custom_variables : "",
+                                       (custom_variables) ? "," : "",
+                                       optarg) ||
+                !mistral_json_escape(&new_var, var_val) ||
+                !mistral_buffer_append(&new_var, "\"", 1))
             {
                 mistral_err("Could not allocate memory for environment variable %s\n", optarg);
-                free(var_val);
+                mistral_buffer_free(&new_var);
                 return;
             }
-            free(var_val);
             free(custom_variables);
-            custom_variables = new_var;
+            custom_variables = mistral_buffer_release(&new_var);
             break;
         }
         case 'c':
@@ -601,9 +522,10 @@ void mistral_received_log(mistral_log *log_entry)
  * mistral_received_data_end
  *
  * Function called whenever an end of data block message is received. At this
- * point run through the linked list of log entries we have seen and send them
- * to Splunk. Remove each log_entry from the linked list as they are
- * processed and destroy them.
+ * point run through the linked list of log entries we have seen and build the
+ * request body. Remove each log_entry from the linked list as they are
+ * processed and destroy them. The body is then handed to the plug-in framework
+ * to be sent to Splunk by mistral_sink_deliver.
  *
  * No special handling of data block number errors is done beyond the message
  * logged by the main plug-in framework. Instead this function will simply
@@ -625,112 +547,94 @@ void mistral_received_data_end(uint64_t block_num, bool block_error)
     UNUSED(block_num);
     UNUSED(block_error);
 
-    char *data = NULL;
+    mistral_buffer data = MISTRAL_BUFFER_INITIALIZER;
 
     mistral_log *log_entry = log_list_head;
 
     while (log_entry) {
-        /* Path, Command and filename must be JSON escaped */
-        char *command = splunk_escape(log_entry->command);
-        char *file = splunk_escape(log_entry->file);
-        char *path = splunk_escape(log_entry->path);
-        char *fstype = splunk_escape(log_entry->fstype);
-        char *fsname = splunk_escape(log_entry->fsname);
-        char *fshost = splunk_escape(log_entry->fshost);
         const char *job_gid = (log_entry->job_group_id[0] == 0) ? "N/A" : log_entry->job_group_id;
         const char *job_id = (log_entry->job_id[0] == 0) ? "N/A" : log_entry->job_id;
-        char *new_data = NULL;
-
-        if (asprintf(&new_data,
-                     "%s"
-                     "{\"sourcetype\": \"_json\","
-                     "\"source\": \"mistral_splunk\","
-                     "\"index\":\"%s\","
-                     "\"time\": \"%ld.%03" PRIu32 "\","
-                     "\"host\":\"%s\","
-                     "\"event\": {"
-                     "\"rule\":{"
-                     "\"scope\":\"%s\","
-                     "\"type\":\"%s\","
-                     "\"label\":\"%s\","
-                     "\"measurement\":\"%s\","
-                     "\"calltype\":\"%s\","
-                     "\"path\":\"%s\","
-                     "\"fstype\":\"%s\","
-                     "\"fsname\":\"%s\","
-                     "\"fshost\":\"%s\","
-                     "\"threshold\":%" PRIu64 ","
-                     "\"timeframe\":%" PRIu64 ","
-                     "\"size-min\":%" PRIu64 ","
-                     "\"size-max\":%" PRIu64
-                     "},"
-                     "\"job\":{"
-                     "\"host\":\"%s\","
-                     "\"job-group-id\":\"%s\","
-                     "\"job-id\":\"%s\""
-                     "},"
-                     "\"process\":{"
-                     "\"pid\":%" PRId64 ","
-                     "\"command\":\"%s\","
-                     "\"file\":\"%s\","
-                     "\"cpu-id\":%" PRIu32 ","
-                     "\"mpi-world-rank\":%" PRId32
-                     "},"
-                     "%s"
-                     "%s"
-                     "%s"
-                     "\"value\":%" PRIu64
-                     "}}\n",
-                     (data) ? data : "",
-                     splunk_index,
-                     log_entry->epoch.tv_sec,
-                     (uint32_t)((log_entry->microseconds / 1000.0f) + 0.5f),
-                     log_entry->hostname,
-                     mistral_scope_name[log_entry->scope],
-                     mistral_contract_name[log_entry->contract_type],
-                     log_entry->label,
-                     mistral_measurement_name[log_entry->measurement],
-                     log_entry->call_type_names,
-                     path,
-                     fstype,
-                     fsname,
-                     fshost,
-                     log_entry->threshold,
-                     log_entry->timeframe,
-                     log_entry->size_min,
-                     log_entry->size_max,
-                     log_entry->hostname,
-                     job_gid,
-                     job_id,
-                     log_entry->pid,
-                     command,
-                     file,
-                     log_entry->cpu,
-                     log_entry->mpi_rank,
-                     (custom_variables) ? "\"environment\":{" : "",
-                     (custom_variables) ? custom_variables : "",
-                     (custom_variables) ? "}," : "",
-                     log_entry->measured) < 0)
+
+        /* Path, command, filename and file system fields are JSON escaped straight into the
+         * request body */
+        if (!mistral_buffer_printf(&data,
+                                   "{\"sourcetype\": \"_json\","
+                                   "\"source\": \"mistral_splunk\","
+                                   "\"index\":\"%s\","
+                                   "\"time\": \"%ld.%03" PRIu32 "\","
+                                   "\"host\":\"%s\","
+                                   "\"event\": {"
+                                   "\"rule\":{"
+                                   "\"scope\":\"%s\","
+                                   "\"type\":\"%s\","
+                                   "\"label\":\"%s\","
+                                   "\"measurement\":\"%s\","
+                                   "\"calltype\":\"%s\","
+                                   "\"path\":\"",
+                                   splunk_index,
+                                   log_entry->epoch.tv_sec,
+                                   (uint32_t)((log_entry->microseconds / 1000.0f) + 0.5f),
+                                   log_entry->hostname,
+                                   mistral_scope_name[log_entry->scope],
+                                   mistral_contract_name[log_entry->contract_type],
+                                   log_entry->label,
+                                   mistral_measurement_name[log_entry->measurement],
+                                   log_entry->call_type_names) ||
+            !mistral_json_escape(&data, log_entry->path) ||
+            !mistral_buffer_printf(&data, "\",\"fstype\":\"") ||
+            !mistral_json_escape(&data, log_entry->fstype) ||
+            !mistral_buffer_printf(&data, "\",\"fsname\":\"") ||
+            !mistral_json_escape(&data, log_entry->fsname) ||
+            !mistral_buffer_printf(&data, "\",\"fshost\":\"") ||
+            !mistral_json_escape(&data, log_entry->fshost) ||
+            !mistral_buffer_printf(&data,
+                                   "\","
+                                   "\"threshold\":%" PRIu64 ","
+                                   "\"timeframe\":%" PRIu64 ","
+                                   "\"size-min\":%" PRIu64 ","
+                                   "\"size-max\":%" PRIu64
+                                   "},"
+                                   "\"job\":{"
+                                   "\"host\":\"%s\","
+                                   "\"job-group-id\":\"%s\","
+                                   "\"job-id\":\"%s\""
+                                   "},"
+                                   "\"process\":{"
+                                   "\"pid\":%" PRId64 ","
+                                   "\"command\":\"",
+                                   log_entry->threshold,
+                                   log_entry->timeframe,
+                                   log_entry->size_min,
+                                   log_entry->size_max,
+                                   log_entry->hostname,
+                                   job_gid,
+                                   job_id,
+                                   log_entry->pid) ||
+            !mistral_json_escape(&data, log_entry->command) ||
+            !mistral_buffer_printf(&data, "\",\"file\":\"") ||
+            !mistral_json_escape(&data, log_entry->file) ||
+            !mistral_buffer_printf(&data,
+                                   "\","
+                                   "\"cpu-id\":%" PRIu32 ","
+                                   "\"mpi-world-rank\":%" PRId32
+                                   "},"
+                                   "%s"
+                                   "%s"
+                                   "%s"
+                                   "\"value\":%" PRIu64
+                                   "}}\n",
+                                   log_entry->cpu,
+                                   log_entry->mpi_rank,
+                                   (custom_variables) ? "\"environment\":{" : "",
+                                   (custom_variables) ? custom_variables : "",
+                                   (custom_variables) ? "}," : "",
+                                   log_entry->measured))
         {
             mistral_err("Could not allocate memory for log entry\n");
-            free(data);
-            free(fshost);
-            free(fsname);
-            free(fstype);
-            free(path);
-            free(file);
-            free(command);
+            mistral_buffer_free(&data);
             mistral_shutdown();
             return;
         }
-        free(data);
-        free(fshost);
-        free(fsname);
-        free(fstype);
-        free(path);
-        free(file);
-        free(command);
-        data = new_data;
 
         log_list_head = log_entry->forward;
         remque(log_entry);
@@ -740,36 +644,104 @@ void mistral_received_data_end(uint64_t block_num, bool block_error)
     }
     log_list_tail = NULL;
 
-    if (data) {
-        if (!set_curl_option(CURLOPT_POSTFIELDS, data)) {
-            mistral_shutdown();
-            return;
-        }
+    char *body = mistral_buffer_release(&data);
+    if (body && !mistral_sink_submit(body)) {
+        free(body);
+        mistral_shutdown();
+    }
+}
 
-        struct saved_resp full_response = {0, NULL};
-        if (!set_curl_option(CURLOPT_WRITEDATA, &full_response)) {
-            mistral_shutdown();
-            return;
-        }
+/*
+ * mistral_sink_deliver
+ *
+ * Function called by the plug-in framework with each block of events built by
+ * mistral_received_data_end. This is called on the sink worker thread, if it
+ * is running, so that the next data block can be parsed while this one is sent
+ * to Splunk.
+ *
+ * On error the mistral_shutdown flag is set to true which will cause the
+ * plug-in to exit cleanly.
+ *
+ * Parameters:
+ *   block - The request body to send. Freed by this function.
+ *
+ * Returns:
+ *   void
+ */
+void mistral_sink_deliver(void *block)
+{
+    char *data = block;
 
-        CURLcode ret = curl_easy_perform(easyhandle);
-        if (ret != CURLE_OK) {
-            mistral_shutdown();
-            /* Depending on the version of curl used during compilation
-             * curl_error may not be populated. If this is the case, look up
-             * the less detailed error based on return code instead.
-             */
-            mistral_err("Could not run curl query: %s\n",
-                        (curl_error[0] != '\0') ? curl_error : curl_easy_strerror(ret));
-            if (full_response.body) {
-                mistral_err("Data sent:\n%s\n", data);
-                mistral_err("Response received:\n%s\n", full_response.body);
-            }
+    if (!set_curl_option(CURLOPT_POSTFIELDS, data)) {
+        free(data);
+        mistral_shutdown();
+        return;
+    }
+
+    struct saved_resp full_response = {0, NULL};
+    if (!set_curl_option(CURLOPT_WRITEDATA, &full_response)) {
+        free(data);
+        mistral_shutdown();
+        return;
+    }
+
+    CURLcode ret = curl_easy_perform(easyhandle);
+    if (ret != CURLE_OK) {
+        mistral_shutdown();
+        /* Depending on the version of curl used during compilation
+         * curl_error may not be populated. If this is the case, look up
+         * the less detailed error based on return code instead.
+         */
+        mistral_err("Could not run curl query: %s\n",
+                    (curl_error[0] != '\0') ? curl_error : curl_easy_strerror(ret));
+        if (full_response.body) {
+            mistral_err("Data sent:\n%s\n", data);
+            mistral_err("Response received:\n%s\n", full_response.body);
         }
     }
+    free(full_response.body);
     free(data);
 }
 
+/*
+ * mistral_sink_discard
+ *
+ * Function called by the plug-in framework with each block of events still
+ * queued for the sink worker thread once the plug-in is shutting down after an
+ * error.
+ *
+ * Parameters:
+ *   block - The request body to discard. Freed by this function.
+ *
+ * Returns:
+ *   void
+ */
+void mistral_sink_discard(void *block)
+{
+    free(block);
+}
+
+/*
+ * mistral_flush
+ *
+ * Function called by the plug-in framework part way through a data block once
+ * the configured flush interval has elapsed or enough data has been received.
+ * Send the log entries seen so far to Splunk so that a large data block
+ * is not held in memory in full and data becomes visible sooner.
+ *
+ * Parameters:
+ *   block_num   - The data block number currently being received.
+ *
+ * Returns:
+ *   void
+ */
+void mistral_flush(uint64_t block_num)
+{
+    if (log_list_head) {
+        mistral_received_data_end(block_num, false);
+    }
+}
+
 /*
  * mistral_received_shutdown
  *
@@ -0,0 +1,94 @@
+#!/bin/bash
+
+# Measure how the time taken to process a data block scales with the number of
+# records in the block. The plug-in sends its bulk requests to a local mock of
+# the _bulk API, mock_es.py, so no Elasticsearch instance is needed.
+#
+# The block sizes used can be overridden by setting bench_sizes, e.g.
+#   bench_sizes="1000 10000 100000" ./bench.sh
+#
+# The CPU time (user + system) used by the plug-in is measured rather than the
+# elapsed time so the framework's one second idle poll does not distort the
+# results. Each size is run bench_runs times and the fastest run is reported.
+
+. ../../plugin_test_utilities.sh
+
+bench_sizes=${bench_sizes:-1000 5000 10000 25000 50000}
+bench_runs=${bench_runs:-3}
+bench_port=${bench_port:-19200}
+
+TIMEFORMAT="%U %S"
+
+python_cmd=$(which python3 2>/dev/null)
+if [ -z "$python_cmd" ]; then
+    logerr "python3 not found"
+    exit 1
+fi
+
+# Send the bulk requests to the mock Elasticsearch server, which also records
+# what it received. Latency and 429 rejections can be injected by passing mock
+# server options in bench_mock_opts, e.g.
+#   bench_mock_opts="--latency 20 --item-429 0.05" ./bench.sh
+$python_cmd "$script_dir/mock_es.py" -P "$bench_port" -S "$results_dir/mock_stats.json" \
+    $bench_mock_opts &
+server_pid=$!
+trap 'kill $server_pid 2>/dev/null' EXIT
+sleep 1
+
+# Report the cost of each additional record relative to the previous block
+# size as well as the overall average as fixed start up costs dominate the
+# average for small blocks. For a linear builder the marginal cost stays
+# roughly constant as blocks grow.
+prev_records=0
+prev_ns=0
+printf "%10s %12s %14s %14s\n" "records" "cpu seconds" "us/record" "marginal" \
+    | tee -a "$summary_file"
+for records in $bench_sizes; do
+    make_mock_input "$results_dir/bench_$records.dat" 1 "$records"
+
+    best_ns=
+    for ((run = 0; run < bench_runs; run++)); do
+        cpu=$( { time $plugin_path -h 127.0.0.1 -P "$bench_port" \
+                     -e "$results_dir/bench_$records.err" \
+                     < "$results_dir/bench_$records.dat" \
+                     > "$results_dir/bench_$records.out"; } 2>&1 )
+        ns=$(awk -v cpu="$cpu" 'BEGIN { split(cpu, t, " "); printf "%.0f", (t[1] + t[2]) * 1e9 }')
+        if [ -z "$best_ns" ] || [ "$ns" -lt "$best_ns" ]; then
+            best_ns=$ns
+        fi
+    done
+
+    if [ -s "$results_dir/bench_$records.err" ]; then
+        logerr "Plug-in reported errors for $records records, see $results_dir/bench_$records.err"
+    fi
+
+    awk -v records="$records" -v ns="$best_ns" -v prev_records="$prev_records" \
+        -v prev_ns="$prev_ns" 'BEGIN {
+        if (prev_records > 0 && records > prev_records) {
+            marginal = sprintf("%.3f", (ns - prev_ns) / 1e3 / (records - prev_records))
+        } else {
+            marginal = "-"
+        }
+        printf "%10d %12.3f %14.3f %14s\n", records, ns / 1e9, ns / 1e3 / records, marginal
+    }' | tee -a "$summary_file"
+    prev_records=$records
+    prev_ns=$best_ns
+done
+
+# Stop the mock server and report the traffic it received over all the runs
+kill $server_pid
+wait $server_pid
+if [ -r "$results_dir/mock_stats.json" ]; then
+    cat "$results_dir/mock_stats.json" | tee -a "$summary_file"
+else
+    logerr "Mock server did not report statistics"
+fi
+
+if [ $(grep -c ERROR: "$summary_file") -ne 0 ]; then
+    echo "FAILURE: see '$summary_file' for details"
+    exit 1
+fi
+
+if [ -z "$KEEP_TEST_OUTPUT" ]; then
+    rm -rf "$results_dir"
+fi
@@ -0,0 +1,412 @@
+#!/usr/bin/env python3
+
+# A minimal stand-in for the Elasticsearch _bulk API so the plug-in can be
+# tested and benchmarked without a cluster.
+#
+# Each _bulk request is decoded (chunked and/or gzip encoded bodies are
+# supported) and every action/document pair is checked. Action lines must be a
+# single index or create operation. Documents must be valid JSON, any field
+# declared in the index template must have the mapped type and every other
+# field must be one the plug-in is expected to produce. Documents that fail
+# validation are rejected with a per-item 400 mapper_parsing_exception just as
+# Elasticsearch would reject them.
+#
+# Requests can be delayed and whole requests or individual items can be
+# rejected with 429 to exercise the plug-in's retry handling. Statistics on the
+# traffic received are written as JSON when the server is stopped by SIGINT or
+# SIGTERM.
+
+import argparse
+import datetime
+import gzip
+import http.server
+import json
+import os
+import random
+import signal
+import sys
+import threading
+import time
+
+# Fields produced by the plug-in that are left to dynamic mapping by the index
+# templates. Custom environment variables are free-form and only checked to be
+# strings.
+DOCUMENT_FIELDS = {
+    "@timestamp": str,
+    "rule": {
+        "scope": str,
+        "type": str,
+        "label": str,
+        "measurement": str,
+        "calltype": str,
+        "path": str,
+        "fstype": str,
+        "fsname": str,
+        "fshost": str,
+        "threshold": int,
+        "timeframe": int,
+        "size-min": int,
+        "size-max": int,
+    },
+    "job": {
+        "host": str,
+        "job-group-id": str,
+        "job-id": str,
+    },
+    "process": {
+        "pid": int,
+        "command": str,
+        "file": str,
+        "cpu-id": int,
+        "mpi-world-rank": int,
+        "sequence": int,
+    },
+    "environment": None,
+    "value": int,
+}
+
+ACTIONS = ("index", "create")
+
+
+def load_mapping(path):
+    """Return the properties declared in an index template file."""
+    with open(path) as template:
+        mappings = json.load(template).get("mappings", {})
+    if "properties" not in mappings and len(mappings) == 1:
+        # Elasticsearch 6.x and earlier nest the properties under a type name
+        mappings = next(iter(mappings.values()))
+    return mappings.get("properties", {})
+
+
+def check_date(value, mapping):
+    """Check a value against a date mapping, returning an error or None."""
+    for fmt in mapping.get("format", "strict_date_optional_time").split("||"):
+        if fmt in ("epoch_millis", "epoch_second"):
+            if isinstance(value, int) or (isinstance(value, str) and value.isdigit()):
+                return None
+        elif isinstance(value, str):
+            try:
+                datetime.datetime.fromisoformat(value.replace("Z", "+00:00"))
+                return None
+            except ValueError:
+                pass
+    return "failed to parse date field [%s]" % value
+
+
+def check_long(value, name):
+    """Check a value against a long mapping, returning an error or None."""
+    if isinstance(value, int) and not isinstance(value, bool):
+        return None
+    if isinstance(value, str) and value.lstrip("-").isdigit():
+        return None
+    return "failed to parse field [%s] of type [long]" % name
+
+
+def check_document(doc, mapped, expected, prefix=""):
+    """Validate a document, returning a description of the first problem."""
+    if not isinstance(doc, dict):
+        return "object mapping for [%s] tried to parse a value" % prefix.rstrip(".")
+    for key, value in doc.items():
+        name = prefix + key
+        mapping = mapped.get(key)
+        if mapping is not None:
+            if mapping.get("type") == "date":
+                error = check_date(value, mapping)
+                if error:
+                    return error
+            elif mapping.get("type") in ("long", "integer"):
+                error = check_long(value, name)
+                if error:
+                    return error
+            elif "properties" in mapping:
+                error = check_document(value, mapping["properties"],
+                                       expected.get(key) or {}, name + ".")
+                if error:
+                    return error
+            continue
+        if key not in expected:
+            return "unexpected field [%s]" % name
+        kind = expected[key]
+        if kind is None:
+            if not isinstance(value, dict) or \
+                    not all(isinstance(v, str) for v in value.values()):
+                return "field [%s] must contain string values" % name
+        elif isinstance(kind, dict):
+            error = check_document(value, {}, kind, name + ".")
+            if error:
+                return error
+        elif not isinstance(value, kind) or isinstance(value, bool):
+            return "failed to parse field [%s] of type [%s]" % (name, kind.__name__)
+    for key, mapping in mapped.items():
+        if mapping.get("type") == "date" and key not in doc:
+            return "missing mapped field [%s%s]" % (prefix, key)
+    return None
+
+
+class Stats:
+    """Counters shared by all request handler threads."""
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.started = time.time()
+        self.requests = 0
+        self.rejected_requests = 0
+        self.wire_bytes = 0
+        self.body_bytes = 0
+        self.docs = 0
+        self.rejected_docs = 0
+        self.invalid_docs = 0
+        self.paths = set()
+        self.create_actions = 0
+        self.bare_actions = 0
+        self.timings = []
+        self.errors = {}
+
+    def report(self):
+        with self.lock:
+            timings = sorted(self.timings)
+            elapsed = time.time() - self.started
+
+            def percentile(p):
+                if not timings:
+                    return 0.0
+                return round(timings[min(len(timings) - 1, int(p * len(timings)))] * 1e3, 3)
+
+            return {
+                "elapsed_seconds": round(elapsed, 3),
+                "requests": self.requests,
+                "rejected_requests": self.rejected_requests,
+                "wire_bytes": self.wire_bytes,
+                "body_bytes": self.body_bytes,
+                "docs": self.docs,
+                "rejected_docs": self.rejected_docs,
+                "invalid_docs": self.invalid_docs,
+                "paths": ",".join(sorted(self.paths)),
+                "create_actions": self.create_actions,
+                "bare_actions": self.bare_actions,
+                "docs_per_second": round(self.docs / elapsed, 1) if elapsed else 0.0,
+                "request_ms": {
+                    "min": percentile(0),
+                    "p50": percentile(0.5),
+                    "p99": percentile(0.99),
+                    "max": percentile(1),
+                },
+                "errors": self.errors,
+            }
+
+
+class BulkHandler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def read_body(self):
+        """Read the request body, undoing any transfer and content encoding."""
+        if self.headers.get("Transfer-Encoding", "").lower() == "chunked":
+            parts = []
+            wire = 0
+            while True:
+                line = self.rfile.readline()
+                wire += len(line)
+                size = int(line.split(b";")[0], 16)
+                if size == 0:
+                    wire += len(self.rfile.readline())
+                    break
+                parts.append(self.rfile.read(size))
+                wire += size + len(self.rfile.readline())
+            body = b"".join(parts)
+        else:
+            body = self.rfile.read(int(self.headers.get("Content-Length", 0)))
+            wire = len(body)
+        if self.headers.get("Content-Encoding", "").lower() == "gzip":
+            body = gzip.decompress(body)
+        return wire, body
+
+    def reply(self, status, body):
+        data = json.dumps(body, separators=(",", ":")).encode()
+        self.send_response(status)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+
+    def do_HEAD(self):
+        self.send_response(200)
+        self.send_header("Content-Length", "0")
+        self.end_headers()
+
+    def do_GET(self):
+        self.reply(200, {"version": {"number": self.server.es_version}})
+
+    def do_PUT(self):
+        self.read_body()
+        self.reply(200, {"acknowledged": True})
+
+    def do_POST(self):
+        start = time.perf_counter()
+        server = self.server
+        stats = server.stats
+        wire, body = self.read_body()
+
+        if not self.path.split("?")[0].endswith("/_bulk"):
+            self.reply(404, {"error": {"type": "invalid_index_name_exception"},
+                             "status": 404})
+            return
+
+        if server.latency:
+            time.sleep(max(0, server.latency + random.uniform(-1, 1) * server.jitter) / 1e3)
+
+        with stats.lock:
+            stats.requests += 1
+            stats.paths.add(self.path)
+            stats.wire_bytes += wire
+            stats.body_bytes += len(body)
+            reject = server.request_429 and random.random() < server.request_429
+            if reject:
+                stats.rejected_requests += 1
+
+        if reject:
+            self.reply(429, {"error": {"type": "es_rejected_execution_exception",
+                                       "reason": "injected request rejection"},
+                             "status": 429})
+            with stats.lock:
+                stats.timings.append(time.perf_counter() - start)
+            return
+
+        lines = body.split(b"\n")
+        if lines and lines[-1] == b"":
+            lines.pop()
+        else:
+            self.reply(400, {"error": {"type": "illegal_argument_exception",
+                                       "reason": "The bulk request must be "
+                                       "terminated by a newline [\\n]"},
+                             "status": 400})
+            return
+
+        items = []
+        accepted = []
+        errors = False
+        docs = rejected = invalid = creates = bare = 0
+        for n in range(0, len(lines), 2):
+            try:
+                action = json.loads(lines[n])
+                if not isinstance(action, dict) or len(action) != 1 or \
+                        next(iter(action)) not in ACTIONS:
+                    raise ValueError("unsupported action [%s]" % lines[n].decode())
+                op = next(iter(action))
+            except ValueError as e:
+                self.reply(400, {"error": {"type": "illegal_argument_exception",
+                                           "reason": str(e)}, "status": 400})
+                return
+            if n + 1 >= len(lines):
+                self.reply(400, {"error": {"type": "action_request_validation_exception",
+                                           "reason": "no document for action"},
+                                 "status": 400})
+                return
+
+            meta = action[op] or {}
+            creates += op == "create"
+            bare += not meta
+            index = meta.get("_index") or self.path.split("/")[1] or "mistral"
+            try:
+                error = check_document(json.loads(lines[n + 1]), server.mapping,
+                                       DOCUMENT_FIELDS)
+            except ValueError as e:
+                error = "failed to parse document: %s" % e
+
+            if error:
+                invalid += 1
+                errors = True
+                items.append({op: {"_index": index, "status": 400,
+                                   "error": {"type": "mapper_parsing_exception",
+                                             "reason": error}}})
+                with stats.lock:
+                    stats.errors[error] = stats.errors.get(error, 0) + 1
+            elif server.item_429 and random.random() < server.item_429:
+                rejected += 1
+                errors = True
+                items.append({op: {"_index": index, "status": 429,
+                                   "error": {"type": "es_rejected_execution_exception",
+                                             "reason": "injected item rejection"}}})
+            else:
+                docs += 1
+                items.append({op: {"_index": index, "result": "created", "status": 201}})
+                accepted.append(lines[n + 1])
+
+        if server.output and accepted:
+            with server.output_lock:
+                server.output.write(b"\n".join(accepted) + b"\n")
+                server.output.flush()
+
+        self.reply(200, {"took": int((time.perf_counter() - start) * 1e3),
+                         "errors": errors, "items": items})
+
+        with stats.lock:
+            stats.docs += docs
+            stats.rejected_docs += rejected
+            stats.invalid_docs += invalid
+            stats.create_actions += creates
+            stats.bare_actions += bare
+            stats.timings.append(time.perf_counter() - start)
+
+    def log_message(self, *args):
+        pass
+
+
+def main():
+    schema_dir = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "..", "..",
+                              "output", "mistral_elasticsearch", "schema")
+
+    parser = argparse.ArgumentParser(description="Mock Elasticsearch _bulk endpoint")
+    parser.add_argument("-P", "--port", type=int, default=9200)
+    parser.add_argument("-m", "--mappings", default=os.path.join(schema_dir, "mappings_7.x.json"),
+                        help="index template used to validate documents")
+    parser.add_argument("-V", "--es-version", default="7.10.2",
+                        help="version number reported by GET /")
+    parser.add_argument("-l", "--latency", type=float, default=0,
+                        help="delay added to each _bulk request in milliseconds")
+    parser.add_argument("-j", "--jitter", type=float, default=0,
+                        help="random variation applied to the latency in milliseconds")
+    parser.add_argument("--request-429", type=float, default=0, metavar="RATE",
+                        help="fraction of _bulk requests rejected with 429")
+    parser.add_argument("--item-429", type=float, default=0, metavar="RATE",
+                        help="fraction of documents rejected with a per-item 429")
+    parser.add_argument("-s", "--seed", type=int, help="seed for the rejection decisions")
+    parser.add_argument("-o", "--output", help="append accepted documents to this file")
+    parser.add_argument("-S", "--stats", help="write statistics as JSON to this file on exit")
+    args = parser.parse_args()
+
+    if args.seed is not None:
+        random.seed(args.seed)
+
+    server = http.server.ThreadingHTTPServer(("127.0.0.1", args.port), BulkHandler)
+    server.daemon_threads = True
+    server.mapping = load_mapping(args.mappings)
+    server.es_version = args.es_version
+    server.latency = args.latency
+    server.jitter = args.jitter
+    server.request_429 = args.request_429
+    server.item_429 = args.item_429
+    server.output = open(args.output, "ab") if args.output else None
+    server.output_lock = threading.Lock()
+    server.stats = Stats()
+
+    def stop(signum, frame):
+        threading.Thread(target=server.shutdown).start()
+
+    signal.signal(signal.SIGINT, stop)
+    signal.signal(signal.SIGTERM, stop)
+
+    server.serve_forever()
+    server.server_close()
+
+    report = json.dumps(server.stats.report(), indent=2)
+    if args.stats:
+        with open(args.stats, "w") as stats_file:
+            stats_file.write(report + "\n")
+    else:
+        print(report, file=sys.stderr)
+    if server.output:
+        server.output.close()
+
+
+if __name__ == "__main__":
+    main()
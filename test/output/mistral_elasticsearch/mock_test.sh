@@ -0,0 +1,129 @@
+#!/bin/bash
+
+# Run generated plug-in input against a local mock of the Elasticsearch _bulk
+# API (mock_es.py) so the plug-in can be tested without a cluster. The
+# documents received are validated against the index template and the run is
+# repeated with 429 rejections injected and with compressed and streamed
+# requests to check every document still arrives exactly once. A run writing to
+# a data stream checks the URL and actions used, and invalid data stream
+# options must stop the plug-in at start up. Finally an index template that
+# rejects some documents checks they are written to the dead letter file, or
+# counted as failures without one.
+#
+# The mock server port can be overridden by setting mock_port.
+
+. ../../plugin_test_utilities.sh
+
+mock_port=${mock_port:-19201}
+
+python_cmd=$(which python3 2>/dev/null)
+if [ -z "$python_cmd" ]; then
+    logerr "python3 not found"
+    exit 1
+fi
+
+mock_blocks=3
+mock_records=200
+expected_docs=$((mock_blocks * mock_records))
+make_mock_input "$results_dir/input.dat" "$mock_blocks" "$mock_records"
+
+mock_server=mock_es.py
+mock_ext=json
+mock_plugin_opts=(-h 127.0.0.1 -P "$mock_port" -v _test_var)
+mock_stats="docs invalid_docs rejected_docs rejected_requests"
+mock_expected_err='^Compressed '
+
+function check_mock_stats() {
+    local name=$1
+
+    if [ "$invalid_docs" -ne "${expected_invalid:-0}" ]; then
+        logerr "$name: $invalid_docs documents failed validation, expected ${expected_invalid:-0}," \
+               "see $results_dir/$name.stats"
+    fi
+    if [ "$docs" -ne "$((expected_docs - ${expected_invalid:-0}))" ]; then
+        logerr "$name: $docs documents received, expected $((expected_docs - ${expected_invalid:-0}))"
+    fi
+}
+
+# Set a custom value to be included in the output
+export _test_var=MISTRAL
+
+run_mock plain --
+run_mock rejected --request-429 0.1 --item-429 0.2 --seed 1 -- --bulk-docs 50 --retries 20
+if [ "$((rejected_docs + rejected_requests))" -eq 0 ]; then
+    logerr "rejected: no rejections were injected"
+fi
+run_mock compressed -- --compress --bulk-docs 50
+run_mock streamed -l 20 -- --stream --bulk-docs 50 --connections 2
+
+# Every run must deliver the same set of documents
+for name in rejected compressed streamed; do
+    if ! diff -q <(sort "$results_dir/plain.json") <(sort "$results_dir/$name.json") >/dev/null; then
+        logerr "$name: documents received differ from the plain run"
+    fi
+done
+
+# Writing to a data stream must name the stream in the URL and send every
+# document with a bare create action
+mock_stats="$mock_stats paths create_actions bare_actions" \
+    run_mock data_stream -- --data-stream -i mistral-ds
+if [ "$paths" != "/mistral-ds/_bulk" ]; then
+    logerr "data_stream: requests were sent to '$paths', expected '/mistral-ds/_bulk'"
+fi
+if [ "$create_actions" -ne "$expected_docs" ] || [ "$bare_actions" -ne "$expected_docs" ]; then
+    logerr "data_stream: $create_actions create and $bare_actions bare actions, expected $expected_docs of each"
+fi
+if ! diff -q <(sort "$results_dir/plain.json") <(sort "$results_dir/data_stream.json") >/dev/null; then
+    logerr "data_stream: documents received differ from the plain run"
+fi
+
+data_stream_err="Data streams require Elasticsearch 7.9 or later and cannot be used with date based index names"
+check_startup_error data_stream_date "$data_stream_err" --data-stream -d
+check_startup_error data_stream_version "$data_stream_err" --data-stream -V 6
+
+# A template mapping job IDs as numbers rejects the documents of records with
+# no job ID, written with the job ID "N/A", with a per-item 400. Every other job
+# ID is made numeric.
+cat > "$results_dir/mappings_job_id.json" <<EOF
+{"mappings": {"properties": {
+    "@timestamp": {"type": "date", "format": "strict_date_optional_time||epoch_millis||epoch_second"},
+    "job": {"properties": {"job-id": {"type": "long"}}}}}}
+EOF
+sed -E 's/,job\.([0-9]+),/,\1,/' "$results_dir/input.dat" > "$results_dir/job_id.dat"
+no_job_id=$((expected_docs / 4))
+
+mock_input=$results_dir/job_id.dat expected_invalid=$no_job_id \
+mock_expected_err='^[0-9]+ documents could not be indexed, [0-9]+ were written to the dead letter file$' \
+    run_mock dead_letter -m "$results_dir/mappings_job_id.json" -- \
+    --dead-letter "$results_dir/dead_letter.ndjson"
+if ! grep -qx "0 documents could not be indexed, $no_job_id were written to the dead letter file" \
+        "$results_dir/dead_letter.err"; then
+    logerr "dead_letter: rejected documents were not reported, see $results_dir/dead_letter.err"
+fi
+if ! awk -v expected="$no_job_id" '
+        NR % 2 == 1 && !/^\{"(index|create)":/ { print "Bad action on line " NR; exit 1 }
+        NR % 2 == 0 && !/"job-id":"N\/A"/ { print "Unexpected document on line " NR; exit 1 }
+        END { if (NR != 2 * expected) { print NR " lines, expected " 2 * expected; exit 1 } }' \
+        "$results_dir/dead_letter.ndjson" > "$results_dir/dead_letter.check"; then
+    logerr "dead_letter: the dead letter file is not the rejected documents," \
+           "see $results_dir/dead_letter.check"
+fi
+
+mock_input=$results_dir/job_id.dat expected_invalid=$no_job_id \
+mock_expected_err='^Could not index document: 400 mapper_parsing_exception failed to parse field \[job\.job-id\] of type \[long\]$|^[0-9]+ documents could not be indexed, 0 were written to the dead letter file$' \
+    run_mock mapping_error -m "$results_dir/mappings_job_id.json" --
+if ! grep -qx "$no_job_id documents could not be indexed, 0 were written to the dead letter file" \
+        "$results_dir/mapping_error.err"; then
+    logerr "mapping_error: rejected documents were not counted as failures," \
+           "see $results_dir/mapping_error.err"
+fi
+
+if [ $(grep -c ERROR: "$summary_file") -ne 0 ]; then
+    echo "FAILURE: see '$summary_file' for details"
+    exit 1
+elif [ -n "$KEEP_TEST_OUTPUT" ]; then
+    echo "SUCCESS: See '$summary_file' for details"
+else
+    rm -rf "$results_dir"
+    echo "SUCCESS"
+fi
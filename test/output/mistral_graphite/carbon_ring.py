@@ -0,0 +1,87 @@
+#!/usr/bin/env python3
+
+# Check that metrics sent to several mock carbon receivers were placed the way
+# carbon-relay would place them. The hash ring is a copy of carbon's
+# ConsistentHashRing using the default carbon_ch hash, nodes are given in the
+# order they were passed to the plug-in as HOST:INSTANCE=FILE where FILE holds
+# the plaintext lines received by that node. A node given without a file was
+# down for the whole run and its metrics must have gone to the next node on the
+# ring instead.
+
+import argparse
+import bisect
+import hashlib
+import sys
+
+
+class ConsistentHashRing:
+
+    def __init__(self, nodes, replica_count=100):
+        self.ring = []
+        self.nodes = set()
+        for node in nodes:
+            self.add_node(node)
+
+    @staticmethod
+    def compute_ring_position(key):
+        return int(hashlib.md5(key.encode("utf-8")).hexdigest()[:4], 16)
+
+    def add_node(self, key, replica_count=100):
+        self.nodes.add(key)
+        for i in range(replica_count):
+            position = self.compute_ring_position("%s:%d" % (key, i))
+            while position in [r[0] for r in self.ring]:
+                position = position + 1
+            bisect.insort(self.ring, (position, key))
+
+    def get_nodes(self, key):
+        """Yield the nodes for a key in the order carbon-relay would try them."""
+        if len(self.nodes) == 1:
+            yield next(iter(self.nodes))
+            return
+        position = self.compute_ring_position(key)
+        index = bisect.bisect_left(self.ring, (position, ())) % len(self.ring)
+        seen = set()
+        for offset in range(len(self.ring)):
+            node = self.ring[(index + offset) % len(self.ring)][1]
+            if node not in seen:
+                seen.add(node)
+                yield node
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Check consistent hashing placement")
+    parser.add_argument("nodes", nargs="+", metavar="HOST:INSTANCE[=FILE]")
+    args = parser.parse_args()
+
+    nodes = []
+    files = {}
+    for spec in args.nodes:
+        name, _, path = spec.partition("=")
+        host, _, instance = name.partition(":")
+        node = (host, instance or None)
+        nodes.append(node)
+        if path:
+            files[node] = path
+
+    ring = ConsistentHashRing(nodes)
+    checked = 0
+    misplaced = 0
+    for node, path in files.items():
+        with open(path) as metrics:
+            for line in metrics:
+                metric = line.split()[0]
+                expected = next(n for n in ring.get_nodes(metric) if n in files)
+                if expected != node:
+                    if misplaced < 10:
+                        print("%s sent to %r, expected %r" % (metric, node, expected),
+                              file=sys.stderr)
+                    misplaced += 1
+                checked += 1
+
+    print("%d metrics checked, %d misplaced" % (checked, misplaced))
+    return 1 if misplaced else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,262 @@
+#!/usr/bin/env python3
+
+# A minimal stand-in for a carbon receiver so the plug-in can be tested without
+# a Graphite server.
+#
+# In plaintext mode every "path value timestamp" line received is checked and
+# written to the output file. In pickle mode each length prefixed message is
+# decoded with a minimal unpickler that only understands the opcodes needed to
+# build a list of (path, (timestamp, value)) tuples, just as carbon only accepts
+# these simple types. Each metric is written to the output file as a plaintext
+# line so the two protocols can be compared directly. Statistics on the traffic
+# received are written as JSON when the server is stopped by SIGINT or SIGTERM,
+# once every open connection, including any still waiting to be accepted, has
+# been closed or has been idle for a moment so data already sent by the plug-in
+# is not lost.
+
+import argparse
+import json
+import pickle
+import signal
+import socketserver
+import struct
+import sys
+import threading
+import time
+
+# Carbon refuses pickle messages larger than this
+MAX_LENGTH = 2 ** 20
+
+# Time in seconds an open connection must be idle before the server exits
+DRAIN_IDLE = 0.5
+
+
+class UnpicklingError(Exception):
+    pass
+
+
+def unpickle(data):
+    """Decode a pickled list of (path, (timestamp, value)) tuples."""
+    stack = []
+    marks = []
+    pos = 0
+
+    def take(count):
+        nonlocal pos
+        if pos + count > len(data):
+            raise UnpicklingError("truncated pickle")
+        chunk = data[pos:pos + count]
+        pos += count
+        return chunk
+
+    while True:
+        op = take(1)
+        if op == b"\x80":
+            if take(1)[0] > 2:
+                raise UnpicklingError("unsupported pickle protocol")
+        elif op == b"]":
+            stack.append([])
+        elif op == b"(":
+            marks.append(len(stack))
+        elif op == b"X":
+            (length,) = struct.unpack("<I", take(4))
+            stack.append(take(length).decode("utf-8"))
+        elif op == b"J":
+            stack.append(struct.unpack("<i", take(4))[0])
+        elif op == b"\x8a":
+            stack.append(int.from_bytes(take(take(1)[0]), "little", signed=True))
+        elif op == b"\x86":
+            if len(stack) < 2:
+                raise UnpicklingError("stack underflow")
+            stack[-2:] = [(stack[-2], stack[-1])]
+        elif op == b"e":
+            if not marks:
+                raise UnpicklingError("APPENDS without MARK")
+            mark = marks.pop()
+            if mark < 1 or not isinstance(stack[mark - 1], list):
+                raise UnpicklingError("APPENDS to a non-list")
+            stack[mark - 1].extend(stack[mark:])
+            del stack[mark:]
+        elif op == b".":
+            if len(stack) != 1 or marks or pos != len(data):
+                raise UnpicklingError("unexpected data at STOP")
+            return stack[0]
+        else:
+            raise UnpicklingError("unsupported opcode %r at %d" % (op, pos - 1))
+
+
+def check_metrics(metrics):
+    """Check the decoded message has the shape carbon expects."""
+    if not isinstance(metrics, list):
+        raise UnpicklingError("message is not a list")
+    for metric in metrics:
+        if not (isinstance(metric, tuple) and len(metric) == 2 and
+                isinstance(metric[0], str) and isinstance(metric[1], tuple) and
+                len(metric[1]) == 2 and all(isinstance(v, int) for v in metric[1])):
+            raise UnpicklingError("malformed metric %r" % (metric,))
+
+
+class Stats:
+    """Counters shared by all connection handler threads."""
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.active = 0
+        self.last_read = time.monotonic()
+        self.connections = 0
+        self.messages = 0
+        self.metrics = 0
+        self.invalid = 0
+        self.max_message_metrics = 0
+        self.max_message_bytes = 0
+        self.errors = {}
+
+    def error(self, reason):
+        with self.lock:
+            self.invalid += 1
+            self.errors[reason] = self.errors.get(reason, 0) + 1
+
+    def report(self):
+        with self.lock:
+            return {key: value for key, value in vars(self).items()
+                    if key not in ("lock", "active", "last_read")}
+
+
+class CarbonHandler(socketserver.StreamRequestHandler):
+
+    def write(self, lines):
+        if self.server.output and lines:
+            with self.server.output_lock:
+                self.server.output.write("".join(lines))
+                self.server.output.flush()
+
+    def handle_plaintext(self):
+        stats = self.server.stats
+        for raw in self.rfile:
+            stats.last_read = time.monotonic()
+            if not raw.endswith(b"\n"):
+                stats.error("incomplete line")
+                break
+            fields = raw.decode("utf-8").split()
+            try:
+                if len(fields) != 3:
+                    raise ValueError
+                int(fields[1])
+                int(fields[2])
+            except ValueError:
+                stats.error("malformed line")
+                continue
+            with stats.lock:
+                stats.metrics += 1
+            self.write(["%s %s %s\n" % tuple(fields)])
+
+    def handle_pickle(self):
+        stats = self.server.stats
+        while True:
+            prefix = self.rfile.read(4)
+            if not prefix:
+                break
+            (length,) = struct.unpack(">I", prefix.rjust(4, b"\0"))
+            data = self.rfile.read(length)
+            stats.last_read = time.monotonic()
+            if len(prefix) != 4 or len(data) != length:
+                stats.error("incomplete message")
+                break
+            if length > MAX_LENGTH:
+                stats.error("message too large")
+                break
+            try:
+                metrics = unpickle(data)
+                check_metrics(metrics)
+                if metrics != pickle.loads(data):
+                    raise UnpicklingError("decoded message differs from pickle.loads")
+            except (UnpicklingError, UnicodeDecodeError, struct.error) as e:
+                stats.error(str(e))
+                continue
+            with stats.lock:
+                stats.messages += 1
+                stats.metrics += len(metrics)
+                stats.max_message_metrics = max(stats.max_message_metrics, len(metrics))
+                stats.max_message_bytes = max(stats.max_message_bytes, length)
+            self.write(["%s %d %d\n" % (path, value, timestamp)
+                        for path, (timestamp, value) in metrics])
+
+    def handle(self):
+        stats = self.server.stats
+        try:
+            if self.server.pickle:
+                self.handle_pickle()
+            else:
+                self.handle_plaintext()
+        finally:
+            with stats.lock:
+                stats.active -= 1
+
+
+class CarbonServer(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+    def verify_request(self, request, client_address):
+        # Count the connection before its handler thread starts so the drain on
+        # exit waits for it
+        with self.stats.lock:
+            self.stats.connections += 1
+            self.stats.active += 1
+            self.stats.last_read = time.monotonic()
+        return True
+
+    def accept_backlog(self):
+        """Handle connections made before the server was stopped but not yet accepted."""
+        self.socket.setblocking(False)
+        while True:
+            try:
+                request, client_address = self.socket.accept()
+            except OSError:
+                return
+            request.setblocking(True)
+            if self.verify_request(request, client_address):
+                self.process_request(request, client_address)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Mock carbon receiver")
+    parser.add_argument("-P", "--port", type=int, default=2003)
+    parser.add_argument("-p", "--pickle", action="store_true",
+                        help="expect the pickle protocol rather than plaintext")
+    parser.add_argument("-o", "--output", help="append received metrics to this file")
+    parser.add_argument("-S", "--stats", help="write statistics as JSON to this file on exit")
+    args = parser.parse_args()
+
+    server = CarbonServer(("127.0.0.1", args.port), CarbonHandler)
+    server.pickle = args.pickle
+    server.output = open(args.output, "a") if args.output else None
+    server.output_lock = threading.Lock()
+    server.stats = Stats()
+
+    def stop(signum, frame):
+        threading.Thread(target=server.shutdown).start()
+
+    signal.signal(signal.SIGINT, stop)
+    signal.signal(signal.SIGTERM, stop)
+
+    server.serve_forever()
+    server.accept_backlog()
+    server.server_close()
+
+    # Read what is still arriving on open connections before reporting
+    while server.stats.active and time.monotonic() - server.stats.last_read < DRAIN_IDLE:
+        time.sleep(0.05)
+
+    report = json.dumps(server.stats.report(), indent=2)
+    if args.stats:
+        with open(args.stats, "w") as stats_file:
+            stats_file.write(report + "\n")
+    else:
+        print(report, file=sys.stderr)
+    if server.output:
+        server.output.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,260 @@
+#!/bin/bash
+
+# Run generated plug-in input against a local mock carbon receiver
+# (mock_carbon.py) so the plug-in can be tested without a Graphite server. The
+# input is sent once with the plaintext protocol and then with the pickle
+# protocol using small batches. Every pickle message must decode, respect the
+# batch size and the metrics received must match the plaintext run exactly.
+# Record filters are then checked to select exactly the expected records, and
+# invalid filters, or batch sizes, to stop the plug-in at start up. Finally the
+# input is sent to three mock servers, with and without one of them down, and
+# carbon_ring.py checks each metric went to the destination carbon-relay's
+# consistent hashing would choose. Carbon is then restarted between data
+# blocks, after which every metric must still arrive exactly once, and left
+# down with a tiny buffer, when the metrics discarded must be counted.
+#
+# The mock server ports start at mock_port which can be overridden.
+
+. ../../plugin_test_utilities.sh
+
+mock_port=${mock_port:-12003}
+mock_batch=7
+
+python_cmd=$(which python3 2>/dev/null)
+if [ -z "$python_cmd" ]; then
+    logerr "python3 not found"
+    exit 1
+fi
+
+mock_blocks=3
+mock_records=200
+make_mock_input "$results_dir/input.dat" "$mock_blocks" "$mock_records"
+
+mock_server=mock_carbon.py
+mock_ext=txt
+mock_plugin_opts=(-h 127.0.0.1 -p "$mock_port" -i mistral.mock)
+mock_stats="metrics invalid messages max_message_metrics"
+
+function check_mock_stats() {
+    local name=$1
+
+    if [ "$invalid" -ne 0 ]; then
+        logerr "$name: $invalid invalid lines or messages, see $results_dir/$name.stats"
+    fi
+    if [ "$metrics" -ne "${expected_metrics:-$((mock_blocks * mock_records))}" ]; then
+        logerr "$name: $metrics metrics received," \
+               "expected ${expected_metrics:-$((mock_blocks * mock_records))}"
+    fi
+}
+
+run_mock plaintext --
+
+run_mock pickle -p -- --protocol=pickle --batch-size=$mock_batch
+if [ "$max_message_metrics" -gt "$mock_batch" ]; then
+    logerr "pickle: $max_message_metrics metrics in one message, batch size is $mock_batch"
+fi
+if [ "$messages" -lt $((mock_blocks * mock_records / mock_batch)) ]; then
+    logerr "pickle: metrics were not split into batches, $messages messages received"
+fi
+
+# Both protocols must deliver the same metrics
+if ! diff -q <(sort "$results_dir/plaintext.txt") <(sort "$results_dir/pickle.txt") >/dev/null; then
+    logerr "pickle: metrics received differ from the plaintext run"
+fi
+
+# Run the plug-in with the record filter given as the second parameter in
+# MISTRAL_PLUGIN_FILTER. The first parameter is a name for the run and the third
+# an awk condition on the record number n that selects the records the filter
+# should accept. Each record is timestamped n seconds into the hour so the
+# metrics received must be exactly the plaintext metrics of those records.
+function run_filter() {
+    local name=$1
+    local filter=$2
+    local condition=$3
+
+    awk "{ n = \$3 % 3600 } $condition" "$results_dir/plaintext.txt" \
+        > "$results_dir/$name.expected"
+    MISTRAL_PLUGIN_FILTER=$filter expected_metrics=$(wc -l < "$results_dir/$name.expected") \
+        run_mock "$name" --
+    if ! diff -q <(sort "$results_dir/$name.expected") <(sort "$results_dir/$name.txt") >/dev/null; then
+        logerr "$name: metrics received differ from the plaintext metrics the filter should accept"
+    fi
+}
+
+# && binds more tightly than || unless overridden by parentheses
+run_filter filter_precedence 'contract=throttle || scope=global && measurement=count' \
+    'n % 2 || (n % 3 == 0 && n % 7 == 0)'
+run_filter filter_parentheses '(contract=throttle || scope=global) && measurement=count' \
+    '(n % 2 || n % 3 == 0) && n % 7 == 0'
+run_filter filter_negation '!(label=label_1 || label=label_2) && contract!=monitor' \
+    'n % 10 != 1 && n % 10 != 2 && n % 2'
+run_filter filter_wildcard 'label="label_[3-5]" && host=host1? && scope=gl*' \
+    'n % 10 >= 3 && n % 10 <= 5 && n % 16 >= 10 && n % 3 == 0'
+# Every call type listed must be present, in any order
+run_filter filter_call_type 'calltype=write+read || calltype!=read' 'n % 5'
+# Hosts match by short or full name
+run_filter filter_host 'host=host3 || host=host4.example.com || host=host5.example' \
+    'n % 16 == 3 || n % 16 == 4'
+run_filter filter_job 'jobid="" || jobid=job.1* || jobgroup="group/7"' \
+    'n % 4 == 0 || n % 64 == 1 || (n % 64 >= 10 && n % 64 < 20) || n % 8 == 7'
+
+# Invalid filters must stop the plug-in at start up
+MISTRAL_PLUGIN_FILTER='label=' check_startup_error filter_missing_value \
+    "Missing value in record filter at offset 6: label=" "${mock_plugin_opts[@]}"
+MISTRAL_PLUGIN_FILTER='(label=label_1 || label=label_2' check_startup_error filter_parenthesis \
+    "Expected ')' in record filter at offset 31: (label=label_1 || label=label_2" \
+    "${mock_plugin_opts[@]}"
+MISTRAL_PLUGIN_FILTER='scope=local && lable=label_1' check_startup_error filter_unknown_field \
+    "Unknown field in record filter at offset 15: scope=local && lable=label_1" \
+    "${mock_plugin_opts[@]}"
+MISTRAL_PLUGIN_FILTER='calltype=read+bogus' check_startup_error filter_call_type_name \
+    "Invalid call type 'bogus' in record filter: calltype=read+bogus" "${mock_plugin_opts[@]}"
+
+# A plug-in that fails to start has no destinations to flush at exit, which
+# must not be reported as anything else
+check_startup_error batch_size_zero "Invalid batch size specified 0" --batch-size=0
+if [ "$(wc -l < "$results_dir/batch_size_zero.err")" -ne 1 ]; then
+    logerr "batch_size_zero: unexpected errors at exit, see $results_dir/batch_size_zero.err"
+fi
+
+# Run the plug-in against several mock servers, one for each instance name
+# given. A mock server is not started for instances listed in $ring_down so the
+# plug-in has to fail over to the next destination on the hash ring. Every
+# metric must arrive exactly once at the destination carbon-relay would choose.
+function run_ring() {
+    local name=$1
+    shift
+    local port=$mock_port
+    local dest_opts=()
+    local ring_nodes=()
+    local instance
+
+    for instance in "$@"; do
+        dest_opts+=("--destination=127.0.0.1:$port:$instance")
+        if [[ " $ring_down " == *" $instance "* ]]; then
+            ring_nodes+=("127.0.0.1:$instance")
+        else
+            start_mock "$name.$instance" "$port"
+            ring_nodes+=("127.0.0.1:$instance=$results_dir/$name.$instance.txt")
+        fi
+        port=$((port + 1))
+    done
+    sleep 1
+
+    $plugin_path -i mistral.mock "${dest_opts[@]}" \
+        < "$results_dir/input.dat" > "$results_dir/$name.out" 2> "$results_dir/$name.err"
+
+    stop_mocks
+    mock_expected_err='Unable to connect to: .*, will retry' check_mock_run "$name"
+
+    if ! diff -q <(sort "$results_dir/plaintext.txt") <(cat "$results_dir/$name".*.txt | sort) >/dev/null; then
+        logerr "$name: metrics received differ from the plaintext run"
+    fi
+    if ! $python_cmd "$script_dir/carbon_ring.py" "${ring_nodes[@]}" > "$results_dir/$name.ring" 2>&1; then
+        logerr "$name: metrics were not sent to the expected destinations, see $results_dir/$name.ring"
+    fi
+    for instance in "$@"; do
+        if [[ " $ring_down " != *" $instance "* ]] && [ ! -s "$results_dir/$name.$instance.txt" ]; then
+            logerr "$name: no metrics were sent to instance $instance"
+        fi
+    done
+}
+
+ring_down= run_ring ring a b c
+ring_down=b run_ring failover a b c
+
+# Start the plug-in in the background reading its input from a pipe, so mock
+# servers can be stopped and started between data blocks. The parameters are a
+# name for the run and the plug-in options.
+function start_piped() {
+    local name=$1
+    shift
+
+    rm -f "$results_dir/$name.fifo"
+    mkfifo "$results_dir/$name.fifo"
+    $plugin_path "${mock_plugin_opts[@]}" "$@" < "$results_dir/$name.fifo" \
+        > "$results_dir/$name.out" 2> "$results_dir/$name.err" &
+    plugin_pid=$!
+    exec 3> "$results_dir/$name.fifo"
+    head -n 1 "$results_dir/input.dat" >&3
+}
+
+# Send the data blocks numbered from $1 to $2 to the plug-in started by
+# start_piped and give it time to deliver them
+function send_blocks() {
+    sed -n "/^:PGNDATASRT:$1:/,/^:PGNDATAEND:$2:/p" "$results_dir/input.dat" >&3
+    sleep 2
+}
+
+# Shut down the plug-in started by start_piped and wait for it to exit
+function stop_piped() {
+    echo ":PGNSHUTDWN:" >&3
+    exec 3>&-
+    wait "$plugin_pid"
+}
+
+# Restart carbon between data blocks. The closed connection must be noticed
+# before the next block is written and every metric must arrive exactly once,
+# each block at the server running when it was sent.
+start_mock restart.1 "$mock_port"
+sleep 1
+start_piped restart
+send_blocks 1 1
+for block in 2 3; do
+    stop_mocks
+    start_mock "restart.$block" "$mock_port"
+    sleep 1
+    send_blocks "$block" "$block"
+done
+stop_piped
+stop_mocks
+mock_expected_err='^Connection closed by 127\.0\.0\.1:[0-9]+$' check_mock_run restart
+
+for block in 1 2 3; do
+    if read_mock_stats "restart.$block" metrics invalid &&
+        [ "$((metrics + invalid))" -ne "$mock_records" ]; then
+        logerr "restart: $metrics metrics and $invalid invalid lines received by server $block," \
+               "expected $mock_records"
+    fi
+done
+if ! diff -q <(sort "$results_dir/plaintext.txt") <(cat "$results_dir"/restart.*.txt | sort) >/dev/null; then
+    logerr "restart: metrics received differ from the plaintext run"
+fi
+
+# With carbon down and a tiny buffer only the newest block is retained. Every
+# older metric must be reported as discarded and the newest block delivered
+# once carbon is started.
+start_piped buffer --buffer-bytes=1
+send_blocks 1 "$mock_blocks"
+start_mock buffer "$mock_port"
+sleep 1
+stop_piped
+stop_mocks
+mock_expected_err='^Unable to connect to: 127\.0\.0\.1:[0-9]+, will retry$|^Connected to |^Discarded [0-9]+ metrics that could not be sent to |^[0-9]+ metrics could not be sent to ' \
+    check_mock_run buffer
+
+discarded=$(sed -n 's/^Discarded \([0-9]*\) metrics .*/\1/p' "$results_dir/buffer.err" |
+            awk '{ total += $1 } END { print total + 0 }')
+if [ "$discarded" -ne $(((mock_blocks - 1) * mock_records)) ]; then
+    logerr "buffer: $discarded metrics reported discarded, expected all but the newest block"
+fi
+if ! grep -qx "$discarded metrics could not be sent to 127.0.0.1:$mock_port" "$results_dir/buffer.err"; then
+    logerr "buffer: discarded metrics were not reported at exit, see $results_dir/buffer.err"
+fi
+if read_mock_stats buffer metrics invalid && [ "$((metrics + discarded))" -ne $((mock_blocks * mock_records)) ]; then
+    logerr "buffer: $metrics metrics received and $discarded discarded," \
+           "expected $((mock_blocks * mock_records))"
+fi
+if [ -n "$(comm -13 <(sort "$results_dir/plaintext.txt") <(sort "$results_dir/buffer.txt"))" ]; then
+    logerr "buffer: metrics received differ from the plaintext run"
+fi
+
+if [ $(grep -c ERROR: "$summary_file") -ne 0 ]; then
+    echo "FAILURE: see '$summary_file' for details"
+    exit 1
+elif [ -n "$KEEP_TEST_OUTPUT" ]; then
+    echo "SUCCESS: See '$summary_file' for details"
+else
+    rm -rf "$results_dir"
+    echo "SUCCESS"
+fi
@@ -0,0 +1,456 @@
+#!/usr/bin/env python3
+
+# A minimal stand-in for the InfluxDB write APIs so the plug-in can be tested
+# without a server.
+#
+# Either the 1.x /write API or the 2.x /api/v2/write API is served. The
+# request URL, the precision and the authentication header are checked against
+# the expected database, bucket, organization and credentials and any mismatch
+# is refused as InfluxDB would refuse it. Request bodies may be gzip encoded.
+# Every line must be valid line protocol with a timestamp in the precision
+# requested. The size of each request and the tag and field keys seen are
+# recorded so that batching and the schema can be checked.
+#
+# Whole requests can be rejected with 429 or 503 and a Retry-After header to
+# exercise the plug-in's retry handling, points rejected this way must not be
+# sent again before the delay has passed. Requests can also be answered with a
+# 400 partial write that drops some of their points, as happens on a field type
+# conflict, these points must never be sent again.
+#
+# With --udp the server instead listens for datagrams as the InfluxDB 1.x UDP
+# listener or Telegraf would and checks that every datagram holding more than
+# one line fits within the payload of a single packet.
+#
+# Statistics on the traffic received are written as JSON when the server is
+# stopped by SIGINT or SIGTERM.
+
+import argparse
+import base64
+import gzip
+import http.server
+import json
+import random
+import signal
+import socket
+import sys
+import threading
+import time
+import urllib.parse
+
+# Timestamps are checked to lie between 2001 and 2096, the scale needed to
+# bring them into that range must match the precision of the request
+PRECISION_SCALE = {
+    "v1": {"s": 1, "ms": 10**3, "u": 10**6, "ns": 10**9, "n": 10**9},
+    "v2": {"s": 1, "ms": 10**3, "us": 10**6, "ns": 10**9},
+}
+TIMESTAMP_MIN = 10**9
+TIMESTAMP_MAX = 4 * 10**9
+
+# Rejections are issued a little early by the clock of the server compared to
+# when the plug-in sees them, allow for this when checking retry delays
+RETRY_SLACK = 0.05
+
+
+def split_unescaped(text, separators, quotes=False):
+    """Split text at unescaped separators, optionally ignoring quoted strings."""
+    parts = []
+    start = 0
+    quoted = False
+    i = 0
+    while i < len(text):
+        char = text[i]
+        if char == "\\" and i + 1 < len(text):
+            i += 2
+            continue
+        if quotes and char == '"':
+            quoted = not quoted
+        elif not quoted and char in separators:
+            parts.append(text[start:i])
+            start = i + 1
+        i += 1
+    if quoted:
+        raise ValueError("unterminated string")
+    parts.append(text[start:])
+    return parts
+
+
+def check_line(line, scale):
+    """Validate a line of line protocol, returning a description of the first problem."""
+    try:
+        sections = split_unescaped(line, " ", quotes=True)
+    except ValueError as e:
+        return str(e)
+    if len(sections) != 3:
+        return "expected measurement, fields and timestamp"
+
+    series, fields, timestamp = sections
+    tags = split_unescaped(series, ",")
+    if not tags[0]:
+        return "missing measurement"
+    for tag in tags[1:]:
+        key, _, value = tag.partition("=")
+        if not key or not value or len(split_unescaped(tag, "=")) != 2:
+            return "invalid tag [%s]" % tag
+
+    for field in split_unescaped(fields, ",", quotes=True):
+        key, _, value = field.partition("=")
+        if not key or not value:
+            return "invalid field [%s]" % field
+        if value.startswith('"'):
+            if not value.endswith('"') or len(value) < 2:
+                return "invalid string field [%s]" % key
+        elif value[-1] in "iu":
+            if not value[:-1].lstrip("-").isdigit():
+                return "invalid integer field [%s]" % key
+        elif value not in ("t", "f", "true", "false"):
+            try:
+                float(value)
+            except ValueError:
+                return "invalid field [%s]" % key
+
+    if not timestamp.lstrip("-").isdigit():
+        return "invalid timestamp [%s]" % timestamp
+    if not TIMESTAMP_MIN <= int(timestamp) // scale < TIMESTAMP_MAX:
+        return "timestamp [%s] does not match the precision" % timestamp
+    return None
+
+
+def line_keys(line):
+    """Return the tag keys and the field keys of a valid line of line protocol."""
+    series, fields, _ = split_unescaped(line, " ", quotes=True)
+    tags = [tag.partition("=")[0] for tag in split_unescaped(series, ",")[1:]]
+    return tags, [field.partition("=")[0] for field in split_unescaped(fields, ",", quotes=True)]
+
+
+class Stats:
+    """Counters shared by all request handler threads."""
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.started = time.time()
+        self.requests = 0
+        self.bad_requests = 0
+        self.max_request_points = 0
+        self.max_request_bytes = 0
+        self.rejected_requests = 0
+        self.rejected_points = 0
+        self.early_retries = 0
+        self.partial_requests = 0
+        self.dropped_points = 0
+        self.resent_dropped = 0
+        self.datagrams = 0
+        self.max_datagram = 0
+        self.oversize_datagrams = 0
+        self.wire_bytes = 0
+        self.body_bytes = 0
+        self.points = 0
+        self.duplicate_points = 0
+        self.invalid_points = 0
+        self.errors = {}
+        self.tag_keys = set()
+        self.field_keys = set()
+
+        # Points accepted or dropped so far and when each rejected point may
+        # be sent again
+        self.accepted = set()
+        self.dropped = set()
+        self.retry_at = {}
+
+    def error(self, message):
+        self.errors[message] = self.errors.get(message, 0) + 1
+
+    def report(self):
+        with self.lock:
+            elapsed = time.time() - self.started
+            return {
+                "elapsed_seconds": round(elapsed, 3),
+                "requests": self.requests,
+                "bad_requests": self.bad_requests,
+                "max_request_points": self.max_request_points,
+                "max_request_bytes": self.max_request_bytes,
+                "rejected_requests": self.rejected_requests,
+                "rejected_points": self.rejected_points,
+                "early_retries": self.early_retries,
+                "partial_requests": self.partial_requests,
+                "dropped_points": self.dropped_points,
+                "resent_dropped": self.resent_dropped,
+                "datagrams": self.datagrams,
+                "max_datagram": self.max_datagram,
+                "oversize_datagrams": self.oversize_datagrams,
+                "wire_bytes": self.wire_bytes,
+                "body_bytes": self.body_bytes,
+                "points": self.points,
+                "duplicate_points": self.duplicate_points,
+                "invalid_points": self.invalid_points,
+                "points_per_second": round(self.points / elapsed, 1) if elapsed else 0.0,
+                "tag_keys": ",".join(sorted(self.tag_keys)),
+                "field_keys": ",".join(sorted(self.field_keys)),
+                "errors": self.errors,
+            }
+
+
+def receive_points(server, lines, scale):
+    """Validate and record points that have been accepted.
+
+    Must be called with the statistics lock held.
+    """
+    stats = server.stats
+    accepted = []
+    for line in lines:
+        if line in stats.dropped:
+            stats.resent_dropped += 1
+            continue
+        text = line.decode(errors="replace")
+        error = check_line(text, scale)
+        if error:
+            stats.invalid_points += 1
+            stats.error(error)
+            continue
+        tags, fields = line_keys(text)
+        stats.tag_keys.update(tags)
+        stats.field_keys.update(fields)
+        if line in stats.accepted:
+            stats.duplicate_points += 1
+            continue
+        stats.accepted.add(line)
+        stats.points += 1
+        accepted.append(line)
+
+    if server.output and accepted:
+        server.output.write(b"\n".join(accepted) + b"\n")
+        server.output.flush()
+
+
+class WriteHandler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def reply(self, status, body, headers=()):
+        data = json.dumps(body, separators=(",", ":")).encode() if body else b""
+        self.send_response(status)
+        for name, value in headers:
+            self.send_header(name, value)
+        if data:
+            self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+
+    def refuse(self, status, message):
+        with self.server.stats.lock:
+            self.server.stats.bad_requests += 1
+            self.server.stats.error(message)
+        if self.server.api == "v2":
+            self.reply(status, {"code": "invalid", "message": message})
+        else:
+            self.reply(status, {"error": message})
+
+    def check_request(self):
+        """Check the URL and headers of a write request, returning an error or None."""
+        server = self.server
+        url = urllib.parse.urlsplit(self.path)
+        query = dict(urllib.parse.parse_qsl(url.query))
+        auth = self.headers.get("Authorization")
+
+        if server.api == "v2":
+            if url.path != "/api/v2/write":
+                return 404, "path not found [%s]" % url.path
+            if query.get("bucket") != server.bucket:
+                return 404, "bucket \"%s\" not found" % query.get("bucket")
+            if query.get("org") != server.org:
+                return 404, "organization \"%s\" not found" % query.get("org")
+            if server.token and auth != "Token " + server.token:
+                return 401, "unauthorized access"
+        else:
+            if url.path != "/write":
+                return 404, "path not found [%s]" % url.path
+            if query.get("db") != server.database:
+                return 404, "database not found: \"%s\"" % query.get("db")
+            expected = "Basic " + base64.b64encode(server.auth.encode()).decode() \
+                if server.auth else None
+            if auth != expected:
+                return 401, "authorization failed"
+
+        precision = query.get("precision")
+        if precision not in PRECISION_SCALE[server.api]:
+            return 400, "invalid precision [%s]" % precision
+        if server.precision and precision != server.precision:
+            return 400, "precision [%s] sent, expected [%s]" % (precision, server.precision)
+        if not self.headers.get("Content-Type", "").startswith("text/plain"):
+            return 400, "unexpected content type [%s]" % self.headers.get("Content-Type")
+        return None
+
+    def do_POST(self):
+        server = self.server
+        stats = server.stats
+        wire = self.rfile.read(int(self.headers.get("Content-Length", 0)))
+        body = wire
+        if self.headers.get("Content-Encoding", "").lower() == "gzip":
+            body = gzip.decompress(body)
+
+        with stats.lock:
+            stats.requests += 1
+            stats.wire_bytes += len(wire)
+            stats.body_bytes += len(body)
+
+        problem = self.check_request()
+        if problem:
+            self.refuse(*problem)
+            return
+
+        precision = dict(urllib.parse.parse_qsl(urllib.parse.urlsplit(self.path).query))["precision"]
+        scale = PRECISION_SCALE[server.api][precision]
+        lines = [line for line in body.split(b"\n") if line]
+        now = time.time()
+
+        with stats.lock:
+            stats.max_request_points = max(stats.max_request_points, len(lines))
+            stats.max_request_bytes = max(stats.max_request_bytes, len(body))
+            for line in lines:
+                if now + RETRY_SLACK < stats.retry_at.pop(line, 0):
+                    stats.early_retries += 1
+
+            decision = random.random()
+            if decision < server.retry_rate:
+                stats.rejected_requests += 1
+                stats.rejected_points += len(lines)
+                for line in lines:
+                    stats.retry_at[line] = now + max(server.retry_after, 0)
+            elif decision < server.retry_rate + server.partial_rate:
+                drop = min(server.partial_drop, len(lines))
+                stats.partial_requests += 1
+                stats.dropped_points += drop
+                stats.dropped.update(lines[:drop])
+                receive_points(server, lines[drop:], scale)
+            else:
+                drop = 0
+                receive_points(server, lines, scale)
+
+        if decision < server.retry_rate:
+            headers = [("Retry-After", str(server.retry_after))] if server.retry_after >= 0 else []
+            self.reply(server.retry_status, {"error": "injected rejection"}, headers)
+        elif not drop:
+            self.reply(204, None)
+        elif server.api == "v2":
+            self.reply(400, {"code": "invalid",
+                             "message": "partial write error (%d written): field type "
+                                        "conflict" % (len(lines) - drop)})
+        else:
+            self.reply(400, {"error": "partial write: field type conflict: input field "
+                                      "\"value\" on measurement \"bandwidth\" is type float, "
+                                      "already exists as type integer dropped=%d" % drop})
+
+    def log_message(self, *args):
+        pass
+
+
+def serve_udp(server, stop):
+    """Receive datagrams until stop is set and no more are waiting."""
+    stats = server.stats
+    scale = PRECISION_SCALE["v2"][server.precision or "ns"]
+    while True:
+        try:
+            datagram = server.socket.recv(65536)
+        except socket.timeout:
+            if stop.is_set():
+                return
+            continue
+        lines = [line for line in datagram.split(b"\n") if line]
+        with stats.lock:
+            stats.datagrams += 1
+            stats.wire_bytes += len(datagram)
+            stats.body_bytes += len(datagram)
+            stats.max_datagram = max(stats.max_datagram, len(datagram))
+            # A line too long to share a packet may be sent alone and fragmented
+            if len(datagram) > server.payload and len(lines) > 1:
+                stats.oversize_datagrams += 1
+            receive_points(server, lines, scale)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Mock InfluxDB write endpoint")
+    parser.add_argument("-P", "--port", type=int, default=8086)
+    parser.add_argument("--api", choices=("v1", "v2"), default="v1",
+                        help="serve the 1.x /write or the 2.x /api/v2/write API")
+    parser.add_argument("-d", "--database", default="mistral",
+                        help="database expected by the 1.x API")
+    parser.add_argument("-a", "--auth", help="USER:PASSWORD expected by the 1.x API")
+    parser.add_argument("-b", "--bucket", help="bucket expected by the 2.x API")
+    parser.add_argument("--org", help="organization expected by the 2.x API")
+    parser.add_argument("-t", "--token", help="token expected by the 2.x API")
+    parser.add_argument("-p", "--precision", help="precision the requests must use")
+    parser.add_argument("--retry-rate", type=float, default=0, metavar="RATE",
+                        help="fraction of requests rejected as overloaded")
+    parser.add_argument("--retry-status", type=int, default=429, choices=(429, 503),
+                        help="status of requests rejected as overloaded")
+    parser.add_argument("--retry-after", type=int, default=-1, metavar="SECONDS",
+                        help="Retry-After delay sent with rejected requests")
+    parser.add_argument("--partial-rate", type=float, default=0, metavar="RATE",
+                        help="fraction of requests answered with a partial write")
+    parser.add_argument("--partial-drop", type=int, default=1, metavar="COUNT",
+                        help="number of points dropped by each partial write")
+    parser.add_argument("-u", "--udp", action="store_true",
+                        help="listen for line protocol datagrams instead of HTTP")
+    parser.add_argument("--mtu", type=int, default=1500,
+                        help="MTU of the network the datagrams are sent over")
+    parser.add_argument("-s", "--seed", type=int, help="seed for the rejection decisions")
+    parser.add_argument("-o", "--output", help="append accepted points to this file")
+    parser.add_argument("-S", "--stats", help="write statistics as JSON to this file on exit")
+    args = parser.parse_args()
+
+    if args.seed is not None:
+        random.seed(args.seed)
+
+    stop = threading.Event()
+    if args.udp:
+        server = argparse.Namespace()
+        server.socket = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        server.socket.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4 * 1024 * 1024)
+        server.socket.bind(("127.0.0.1", args.port))
+        server.socket.settimeout(0.1)
+        # Leave room for the IPv4 and UDP headers
+        server.payload = args.mtu - 28
+    else:
+        server = http.server.ThreadingHTTPServer(("127.0.0.1", args.port), WriteHandler)
+        server.daemon_threads = True
+        server.api = args.api
+        server.database = args.database
+        server.auth = args.auth
+        server.bucket = args.bucket
+        server.org = args.org
+        server.token = args.token
+        server.retry_rate = args.retry_rate
+        server.retry_status = args.retry_status
+        server.retry_after = args.retry_after
+        server.partial_rate = args.partial_rate
+        server.partial_drop = args.partial_drop
+    server.precision = args.precision
+    server.output = open(args.output, "ab") if args.output else None
+    server.stats = Stats()
+
+    def handle_signal(signum, frame):
+        stop.set()
+        if not args.udp:
+            threading.Thread(target=server.shutdown).start()
+
+    signal.signal(signal.SIGINT, handle_signal)
+    signal.signal(signal.SIGTERM, handle_signal)
+
+    if args.udp:
+        serve_udp(server, stop)
+        server.socket.close()
+    else:
+        server.serve_forever()
+        server.server_close()
+
+    report = json.dumps(server.stats.report(), indent=2)
+    if args.stats:
+        with open(args.stats, "w") as stats_file:
+            stats_file.write(report + "\n")
+    else:
+        print(report, file=sys.stderr)
+    if server.output:
+        server.output.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,275 @@
+#!/bin/bash
+
+# Run generated plug-in input against a local mock of the InfluxDB write APIs
+# (mock_influx.py) so the plug-in can be tested without a server. The input is
+# written with the 1.x and 2.x APIs, checking the URL and authentication of
+# each, with and without compression and with different batch limits and
+# timestamp precisions, flushed part way through each block and with the
+# framework threads placed on a CPU with a lower priority. Every batch must
+# respect the limits and every point must arrive exactly once. The tags and
+# fields written are checked with the default and a custom schema, and invalid
+# schemas must be refused. A run with more series than the series key cache
+# holds checks every point is still written with its own tags. Requests are
+# rejected as overloaded (429) or unavailable (503) with a Retry-After delay,
+# which must be honoured before the points arrive exactly once, and partial
+# writes that drop points must be counted as failures without the batch being
+# sent again. A refused write must stop the plug-in before any further blocks
+# are sent. Finally the input is sent over UDP and every datagram must fit in a
+# single packet.
+#
+# The mock server port can be overridden by setting mock_port.
+
+. ../../plugin_test_utilities.sh
+
+mock_port=${mock_port:-18086}
+
+python_cmd=$(which python3 2>/dev/null)
+if [ -z "$python_cmd" ]; then
+    logerr "python3 not found"
+    exit 1
+fi
+
+mock_blocks=3
+mock_records=200
+expected_points=$((mock_blocks * mock_records))
+make_mock_input "$results_dir/input.dat" "$mock_blocks" "$mock_records"
+
+mock_server=mock_influx.py
+mock_ext=txt
+mock_plugin_opts=(-h 127.0.0.1 -P "$mock_port")
+mock_stats="points invalid_points duplicate_points bad_requests requests max_request_points
+            max_request_bytes wire_bytes body_bytes tag_keys field_keys datagrams
+            oversize_datagrams rejected_requests early_retries dropped_points resent_dropped"
+
+function check_mock_stats() {
+    local name=$1
+
+    if [ "$invalid_points" -ne 0 ]; then
+        logerr "$name: $invalid_points points failed validation, see $results_dir/$name.stats"
+    fi
+    if [ "$bad_requests" -ne 0 ]; then
+        logerr "$name: $bad_requests requests were refused, see $results_dir/$name.stats"
+    fi
+    if [ "$duplicate_points" -ne 0 ]; then
+        logerr "$name: $duplicate_points points were written more than once"
+    fi
+    if [ "$early_retries" -ne 0 ]; then
+        logerr "$name: $early_retries points were sent again before the Retry-After delay"
+    fi
+    if [ "$resent_dropped" -ne 0 ]; then
+        logerr "$name: $resent_dropped points dropped by a partial write were sent again"
+    fi
+    if [ "$((points + dropped_points))" -ne "$expected_points" ]; then
+        logerr "$name: $points points received and $dropped_points dropped, expected $expected_points"
+    fi
+}
+
+# Check a run rejected some requests as overloaded
+function check_rejected() {
+    local name=$1
+
+    if [ "$rejected_requests" -eq 0 ]; then
+        logerr "$name: no rejections were injected"
+    fi
+}
+
+# Check every point dropped by a partial write was reported as a failure
+function check_dropped() {
+    local name=$1
+
+    if [ "$dropped_points" -eq 0 ]; then
+        logerr "$name: no partial writes were injected"
+    elif ! grep -qx "$dropped_points points could not be written" "$results_dir/$name.err"; then
+        logerr "$name: $dropped_points dropped points were not reported, see $results_dir/$name.err"
+    fi
+}
+
+# Check the tag and field keys written in a run
+function check_keys() {
+    local name=$1
+    local expected_tags=$2
+    local expected_fields=$3
+
+    if [ "$tag_keys" != "$expected_tags" ]; then
+        logerr "$name: tags written were $tag_keys, expected $expected_tags"
+    fi
+    if [ "$field_keys" != "$expected_fields" ]; then
+        logerr "$name: fields written were $field_keys, expected $expected_fields"
+    fi
+}
+
+# Each data block fits in a single request by default
+run_mock v1 -d mock_db -a mistral:secret -p u -- -d mock_db -u mistral -p secret
+if [ "$requests" -ne "$mock_blocks" ]; then
+    logerr "v1: $requests requests received, expected one for each of $mock_blocks blocks"
+fi
+check_keys v1 calltype,fshost,fsname,fstype,host,jobgroup,jobid,label,path \
+    command,cpu,file,logtype,mpirank,pid,scope,sizemax,sizemin,threshold,timeframe,value
+
+run_mock batch_points -- --batch-points 50
+if [ "$max_request_points" -gt 50 ]; then
+    logerr "batch_points: $max_request_points points in one request, the limit is 50"
+fi
+if [ "$requests" -ne "$((expected_points / 50))" ]; then
+    logerr "batch_points: $requests requests received, expected $((expected_points / 50))"
+fi
+
+run_mock batch_bytes -- --batch-bytes 4096
+if [ "$max_request_bytes" -gt 4096 ]; then
+    logerr "batch_bytes: $max_request_bytes bytes in one request, the limit is 4096"
+fi
+if [ "$requests" -le "$mock_blocks" ]; then
+    logerr "batch_bytes: data blocks were not split, $requests requests received"
+fi
+
+# The framework flushes part way through each block once enough records have
+# been received, so every block is sent in several requests
+flush_records=30
+MISTRAL_PLUGIN_FLUSH_RECORDS=$flush_records run_mock flush_records --
+if [ "$max_request_points" -gt "$flush_records" ]; then
+    logerr "flush_records: $max_request_points points in one request, flushing every $flush_records records"
+fi
+if [ "$requests" -ne "$((mock_blocks * ((mock_records + flush_records - 1) / flush_records)))" ]; then
+    logerr "flush_records: $requests requests received," \
+           "expected $((mock_blocks * ((mock_records + flush_records - 1) / flush_records)))"
+fi
+MISTRAL_PLUGIN_FLUSH_RECORDS=-1 check_startup_error flush_records_invalid \
+    "Invalid value '-1' specified in MISTRAL_PLUGIN_FLUSH_RECORDS"
+
+# Each framework thread must report running with the placement requested
+placement_cpu=$(sed -n 's/^Cpus_allowed_list:[[:space:]]*\([0-9]*\).*/\1/p' /proc/self/status)
+placement_err="^Plug-in (communication|processing|sink worker) thread \\[[0-9]+\\] placement: "
+placement_err+="CPUs $placement_cpu, scheduling policy batch, nice 5$"
+MISTRAL_PLUGIN_CPUS=$placement_cpu MISTRAL_PLUGIN_SCHED=batch MISTRAL_PLUGIN_NICE=5 \
+mock_expected_err=$placement_err run_mock placement --
+for thread in communication processing "sink worker"; do
+    if ! grep -qE "^Plug-in $thread thread .*placement: " "$results_dir/placement.err"; then
+        logerr "placement: placement of the $thread thread not reported, see $results_dir/placement.err"
+    fi
+done
+MISTRAL_PLUGIN_CPUS=0-bogus check_startup_error placement_cpus \
+    "Invalid CPU list '0-bogus' specified in MISTRAL_PLUGIN_CPUS"
+MISTRAL_PLUGIN_SCHED=fifo check_startup_error placement_sched \
+    "Invalid scheduling policy 'fifo' specified in MISTRAL_PLUGIN_SCHED"
+MISTRAL_PLUGIN_NICE=20 check_startup_error placement_nice \
+    "Invalid nice level '20' specified in MISTRAL_PLUGIN_NICE"
+
+echo mock_token > "$results_dir/token"
+mock_expected_err='^Compressed ' \
+    run_mock v2 --api v2 -b mock_bucket --org mock_org -t mock_token -p us -- \
+    --bucket mock_bucket --org mock_org --token "file:$results_dir/token" --compress --batch-points 50
+if [ "$wire_bytes" -ge "$body_bytes" ]; then
+    logerr "v2: requests were not compressed, $wire_bytes bytes sent for $body_bytes of line protocol"
+fi
+
+# The 1.x API names microseconds "u", the 2.x API "us"
+run_mock precision_s -p s -- --precision s
+run_mock precision_ns --api v2 -b mock_bucket -p ns -- --bucket mock_bucket --precision ns
+
+# Move the per-job tags to fields, drop a field and tag a variable
+export _test_var=MISTRAL
+run_mock schema -- --schema=jobid:field,jobgroup:field --schema=cpu:drop,label:field -v _test_var
+check_keys schema _test_var,calltype,fshost,fsname,fstype,host,path \
+    command,file,jobgroup,jobid,label,logtype,mpirank,pid,scope,sizemax,sizemin,threshold,timeframe,value
+
+check_startup_error schema_value_tag "Column value cannot be a tag" --schema=value:tag
+check_startup_error schema_column "Unknown column 'bogus' in schema" --schema=bogus:tag
+check_startup_error schema_role "Invalid role 'index' for column pid in schema" --schema=pid:index
+check_startup_error schema_no_fields "The schema must include at least one field" \
+    --schema=command:drop,cpu:drop,file:drop,logtype:drop,mpirank:drop,pid:drop,scope:drop \
+    --schema=sizemin:drop,sizemax:drop,threshold:drop,timeframe:drop,value:drop
+
+# Tagging each point with its pid makes every series distinct, more than the
+# 3072 the series key cache holds before it is cleared. The pid tag, label and
+# host of each point must still match the record number in its file name.
+series_records=2500
+make_mock_input "$results_dir/series.dat" 2 "$series_records"
+mock_input=$results_dir/series.dat expected_points=$((2 * series_records)) \
+    run_mock series -- --schema=pid:tag
+if ! awk '{
+        match($0, /,file="\/tmp\/mock,[0-9]+"/)
+        n = substr($0, RSTART + 17, RLENGTH - 18)
+        if (index($1, ",label=label_" n % 10 ",") == 0 || index($1, ",host=host" n % 16 ",") == 0 ||
+            index($1 ",", ",pid=" 1000 + n ",") == 0) {
+            print "Wrong series for record " n ": " $1
+            exit 1
+        }
+    }' "$results_dir/series.txt" > "$results_dir/series.check"; then
+    logerr "series: points were written with the wrong tags, see $results_dir/series.check"
+fi
+
+run_mock overloaded --retry-rate 0.2 --retry-status 429 --retry-after 1 --seed 1 -- \
+    --batch-points 20 --retries 20
+check_rejected overloaded
+run_mock unavailable --retry-rate 0.2 --retry-status 503 --retry-after 1 --seed 2 -- \
+    --batch-points 20 --retries 20
+check_rejected unavailable
+
+partial_err='^InfluxDB rejected [0-9]+ of [0-9]+ points: |^[0-9]+ points could not be written$'
+mock_expected_err=$partial_err run_mock partial --partial-rate 0.2 --partial-drop 2 --seed 3 -- \
+    --batch-points 20
+check_dropped partial
+mock_expected_err=$partial_err \
+    run_mock partial_v2 --api v2 -b mock_bucket --partial-rate 0.2 --partial-drop 2 --seed 4 -- \
+    --bucket mock_bucket --batch-points 20
+check_dropped partial_v2
+
+# A write refused by InfluxDB stops the plug-in, even when the refusal is seen
+# on the sink worker thread while further blocks are waiting to be sent
+start_mock unauthorized "$mock_port" -a mistral:secret
+sleep 1
+$plugin_path "${mock_plugin_opts[@]}" -u mistral -p wrong < "$results_dir/input.dat" \
+    > "$results_dir/unauthorized.out" 2> "$results_dir/unauthorized.err"
+stop_mocks
+if read_mock_stats unauthorized requests && [ "$requests" -ne 1 ]; then
+    logerr "unauthorized: $requests requests received after the first was refused"
+fi
+if ! grep -qxF "Error while delivering data on the sink worker thread" "$results_dir/unauthorized.err"; then
+    logerr "unauthorized: sink worker failure not reported, see $results_dir/unauthorized.err"
+fi
+
+# The UDP listener reads nanosecond timestamps unless configured otherwise
+mock_expected_err='^Sent [0-9]+ lines in [0-9]+ UDP datagrams, 0 lines could not be sent$' \
+    run_mock udp --udp --mtu 1400 -p ns -- --udp --mtu 1400
+if [ "$oversize_datagrams" -ne 0 ]; then
+    logerr "udp: $oversize_datagrams datagrams of several lines did not fit in a packet"
+fi
+if [ "$datagrams" -ge "$points" ]; then
+    logerr "udp: lines were not packed into datagrams, $datagrams datagrams received"
+fi
+if ! grep -q "^Sent $points lines in $datagrams UDP datagrams" "$results_dir/udp.err"; then
+    logerr "udp: datagrams received differ from those reported sent, see $results_dir/udp.err"
+fi
+
+# Every run must deliver the same points
+for name in batch_points batch_bytes flush_records placement v2 overloaded unavailable; do
+    if ! diff -q <(sort "$results_dir/v1.txt") <(sort "$results_dir/$name.txt") >/dev/null; then
+        logerr "$name: points received differ from the v1 run"
+    fi
+done
+for name in partial partial_v2; do
+    if [ -n "$(comm -13 <(sort "$results_dir/v1.txt") <(sort "$results_dir/$name.txt"))" ]; then
+        logerr "$name: points received differ from the v1 run"
+    fi
+done
+if ! diff -q <(sed 's/[0-9]\{6\}$//' "$results_dir/v1.txt" | sort) \
+        <(sort "$results_dir/precision_s.txt") >/dev/null; then
+    logerr "precision_s: points received differ from the v1 run"
+fi
+if ! diff -q <(sed 's/$/000/' "$results_dir/v1.txt" | sort) \
+        <(sort "$results_dir/precision_ns.txt") >/dev/null; then
+    logerr "precision_ns: points received differ from the v1 run"
+fi
+if ! diff -q <(sort "$results_dir/precision_ns.txt") <(sort "$results_dir/udp.txt") >/dev/null; then
+    logerr "udp: points received differ from the precision_ns run"
+fi
+
+if [ $(grep -c ERROR: "$summary_file") -ne 0 ]; then
+    echo "FAILURE: see '$summary_file' for details"
+    exit 1
+elif [ -n "$KEEP_TEST_OUTPUT" ]; then
+    echo "SUCCESS: See '$summary_file' for details"
+else
+    rm -rf "$results_dir"
+    echo "SUCCESS"
+fi
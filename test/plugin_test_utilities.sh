@@ -98,3 +98,131 @@ function check_results() {
         fi
     fi
 }
+
+# Write a plug-in input stream of generated records for tests that send data to
+# a mock server rather than a real database. The parameters are the file to
+# write, the number of data blocks and the number of records in each block.
+# Every record is different. Labels, paths, commands, file names and job IDs
+# include characters that plug-ins must escape, some job IDs are empty and some
+# values are too large for a 32 bit integer.
+function make_mock_input() {
+    awk -v blocks="$2" -v records="$3" 'BEGIN {
+        print ":PGNSUPVRSN:6:6:"
+        for (b = 1; b <= blocks; b++) {
+            print ":PGNDATASRT:" b ":"
+            for (i = 1; i <= records; i++) {
+                n = (b - 1) * records + i
+                printf "%s#%s#2021-06-07T%02d:%02d:%02d.%06d,label_%d,/tmp/mock.%d/file,nfs,fs%d,fshost,%s,all,%s,%d%s/1s,1MB/1s,host%d.example.com,%d,%d,/usr/bin/dd if=\"/tmp/mock\\\\%d\",/tmp/mock\\,%d,%s,%s,%d,%d\n",
+                       (n % 3) ? "local" : "global", (n % 2) ? "throttle" : "monitor",
+                       b % 24, (n / 60) % 60, n % 60, n % 1000000, n % 10, n % 13, n % 4,
+                       (n % 5) ? "read+write" : "read", (n % 7) ? "bandwidth" : "count",
+                       2 + n % 50, (n % 9) ? "MB" : "GB", n % 16, 1000 + n, n % 32, n, n,
+                       (n % 4) ? "group/" n % 8 : "", (n % 4) ? "job." n % 64 : "", n % 128, n
+            }
+            print ":PGNDATAEND:" b ":"
+        }
+        print ":PGNSHUTDWN:"
+    }' > "$1"
+}
+
+# Start the mock server script $mock_server in the background. The parameters
+# are a name for the run, the port to listen on and any further options for the
+# mock server. What the server receives is written to $results_dir/<name>.
+# $mock_ext and its statistics to $results_dir/<name>.stats when it is stopped
+# by stop_mocks.
+function start_mock() {
+    local name=$1
+    local port=$2
+    shift 2
+
+    rm -f "$results_dir/$name.$mock_ext" "$results_dir/$name.stats"
+    $python_cmd "$script_dir/$mock_server" -P "$port" -o "$results_dir/$name.$mock_ext" \
+        -S "$results_dir/$name.stats" "$@" 2>"$results_dir/$name.mock.err" &
+    mock_pids+=($!)
+}
+
+# Stop every mock server started by start_mock and wait for their statistics
+function stop_mocks() {
+    kill "${mock_pids[@]}"
+    wait "${mock_pids[@]}"
+    mock_pids=()
+}
+
+# Check the output of a plug-in run. Lines in the error output matching the
+# extended regular expression $mock_expected_err are not treated as errors.
+function check_mock_run() {
+    local name=$1
+
+    if [ "$(cat "$results_dir/$name.out")" != ":PGNVERSION:6:" ]; then
+        logerr "$name: unexpected plug-in output, see $results_dir/$name.out"
+    fi
+    if grep -qvE "${mock_expected_err:-^$}" "$results_dir/$name.err"; then
+        logerr "$name: plug-in reported errors, see $results_dir/$name.err"
+    fi
+}
+
+# Read statistics reported by a mock server into shell variables of the same
+# names. The parameters are the name of the run and the statistics to read.
+function read_mock_stats() {
+    local name=$1
+    shift
+
+    if [ ! -r "$results_dir/$name.stats" ]; then
+        logerr "$name: mock server did not report statistics, see $results_dir/$name.mock.err"
+        return 1
+    fi
+
+    local stat
+    for stat in "$@"; do
+        eval "${stat}=$($python_cmd -c 'import json, sys; print(json.load(open(sys.argv[1]))[sys.argv[2]])' \
+                        "$results_dir/$name.stats" "$stat")"
+    done
+}
+
+# Run the plug-in against a fresh mock server on $mock_port with the generated
+# input in $mock_input, $results_dir/input.dat by default. The first parameter is a name for the run,
+# followed by the mock server options, "--" and then the plug-in options, which
+# are added to those in the $mock_plugin_opts array. The statistics named in
+# $mock_stats are read and, if the test script defines it, check_mock_stats is
+# called with the name of the run to check them.
+function run_mock() {
+    local name=$1
+    shift
+    local mock_opts=()
+    while [ $# -gt 0 ] && [ "$1" != "--" ]; do
+        mock_opts+=("$1")
+        shift
+    done
+    shift
+
+    start_mock "$name" "$mock_port" "${mock_opts[@]}"
+    sleep 1
+
+    $plugin_path "${mock_plugin_opts[@]}" "$@" \
+        < "${mock_input:-$results_dir/input.dat}" > "$results_dir/$name.out" 2> "$results_dir/$name.err"
+
+    stop_mocks
+    check_mock_run "$name"
+
+    if read_mock_stats "$name" $mock_stats && declare -F check_mock_stats >/dev/null; then
+        check_mock_stats "$name"
+    fi
+}
+
+# Check the plug-in refuses a set of options when it starts. The parameters are
+# a name for the run, the error message expected and then the plug-in options.
+function check_startup_error() {
+    local name=$1
+    local expected=$2
+    shift 2
+
+    echo ":PGNSUPVRSN:6:6:" | $plugin_path "$@" \
+        > "$results_dir/$name.out" 2> "$results_dir/$name.err"
+
+    if [ "$(cat "$results_dir/$name.out")" != ":PGNSHUTDWN:" ]; then
+        logerr "$name: plug-in did not stop at start up, see $results_dir/$name.out"
+    fi
+    if ! grep -qxF "$expected" "$results_dir/$name.err"; then
+        logerr "$name: expected error '$expected', see $results_dir/$name.err"
+    fi
+}